@@ -25,6 +25,12 @@
 
 #define DEBUG_CURL 0
 
+struct _stream_data
+{
+  http_data_fn cb;
+  gpointer user_data;
+};
+
 struct _http
 {
   CURL* curl;
@@ -33,13 +39,128 @@ struct _http
   http_progress_fn progress_cb;
   gpointer progress_data;
   time_t last_progress;
+
+  // transfer running on http_multi
+  http_multi* multi;
+  struct curl_slist* request_headers;
+  struct _stream_data stream;
+  GString* response;
+  http_done_fn done_cb;
+  gpointer done_data;
+  goffset progress_total;
+  goffset progress_now;
 };
 
+// {{{ handle pool
+
+// Curl handles are not destroyed by http_free, but kept for reuse along with
+// their open connections, so that consecutive transfers don't have to go
+// through DNS, TCP and TLS handshakes again. DNS cache and TLS sessions are
+// also shared by all handles (connections can't be, handles are used from
+// multiple threads at once by parallel transfers).
+
+#define HTTP_POOL_SIZE 16
+
+G_LOCK_DEFINE_STATIC(http_pool);
+static GSList* http_pool;
+static guint http_pool_len;
+static CURLSH* http_share;
+static GMutex http_share_locks[CURL_LOCK_DATA_LAST];
+
+static void http_share_lock(CURL* curl, curl_lock_data data, curl_lock_access access, void* user_data)
+{
+  g_mutex_lock(&http_share_locks[data]);
+}
+
+static void http_share_unlock(CURL* curl, curl_lock_data data, void* user_data)
+{
+  g_mutex_unlock(&http_share_locks[data]);
+}
+
+static CURLSH* http_share_new(void)
+{
+  CURLSH* share = curl_share_init();
+  if (!share)
+    return NULL;
+
+  curl_share_setopt(share, CURLSHOPT_LOCKFUNC, http_share_lock);
+  curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, http_share_unlock);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+  return share;
+}
+
+// get idle handle from the pool or a new one
+static CURL* http_pool_get(void)
+{
+  CURL* curl = NULL;
+
+  G_LOCK(http_pool);
+
+  if (!http_share)
+    http_share = http_share_new();
+
+  if (http_pool)
+  {
+    curl = http_pool->data;
+    http_pool = g_slist_delete_link(http_pool, http_pool);
+    http_pool_len--;
+  }
+
+  G_UNLOCK(http_pool);
+
+  // options are reset, but connections and caches are kept
+  if (curl)
+    curl_easy_reset(curl);
+  else
+    curl = curl_easy_init();
+
+  if (curl && http_share)
+    curl_easy_setopt(curl, CURLOPT_SHARE, http_share);
+
+  return curl;
+}
+
+static void http_pool_put(CURL* curl)
+{
+  G_LOCK(http_pool);
+
+  if (http_pool_len < HTTP_POOL_SIZE)
+  {
+    http_pool = g_slist_prepend(http_pool, curl);
+    http_pool_len++;
+    curl = NULL;
+  }
+
+  G_UNLOCK(http_pool);
+
+  if (curl)
+    curl_easy_cleanup(curl);
+}
+
+void http_cleanup(void)
+{
+  G_LOCK(http_pool);
+
+  g_slist_free_full(http_pool, (GDestroyNotify)curl_easy_cleanup);
+  http_pool = NULL;
+  http_pool_len = 0;
+
+  if (http_share)
+    curl_share_cleanup(http_share);
+  http_share = NULL;
+
+  G_UNLOCK(http_pool);
+}
+
+// }}}
+
 http* http_new(void)
 {
   http* h = g_new0(http, 1);
 
-  h->curl = curl_easy_init();
+  h->curl = http_pool_get();
   if (!h->curl)
   {
     g_free(h);
@@ -58,8 +179,9 @@ http* http_new(void)
   curl_easy_setopt(h->curl, CURLOPT_SSL_VERIFYHOST, 0L);
 #endif
 
-  //XXX: don't use alarm signal to time out dns queries
-  //curl_easy_setopt(h->curl, CURLOPT_NOSIGNAL, 1L);
+  // handles are used from several threads by parallel transfers, alarm
+  // signal based DNS timeouts are not thread safe
+  curl_easy_setopt(h->curl, CURLOPT_NOSIGNAL, 1L);
 
   curl_easy_setopt(h->curl, CURLOPT_FOLLOWLOCATION, 1L);
 
@@ -110,6 +232,9 @@ void http_set_user_agent(http* h, const gchar* ua)
 
 static int curl_progress(http* h, double dltotal, double dlnow, double ultotal, double ulnow)
 {
+  h->progress_total = dltotal + ultotal;
+  h->progress_now = dlnow + ulnow;
+
   if (h->progress_cb 
 #ifdef G_OS_WIN32
     && (!h->last_progress || h->last_progress + 1 < time(NULL))
@@ -140,7 +265,12 @@ void http_set_progress_callback(http* h, http_progress_fn cb, gpointer data)
   }
   else
   {
-    curl_easy_setopt(h->curl, CURLOPT_NOPROGRESS, 1L);
+    h->progress_cb = NULL;
+    h->progress_data = NULL;
+
+    // progress of transfers on http_multi is always tracked
+    if (!h->multi)
+      curl_easy_setopt(h->curl, CURLOPT_NOPROGRESS, 1L);
   }
 }
 
@@ -238,12 +368,6 @@ out:
   return NULL;
 }
 
-struct _stream_data
-{
-  http_data_fn cb;
-  gpointer user_data;
-};
-
 static size_t curl_read(void *buffer, size_t size, size_t nmemb, struct _stream_data* data)
 {
   return data->cb(buffer, size * nmemb, data->user_data);
@@ -417,13 +541,247 @@ out:
 }
 
 
+// {{{ http_multi
+
+// Runs many transfers concurrently on a single thread. Transfers are
+// started with http_multi_add_* and driven by http_multi_perform, which
+// calls their done callbacks as they finish. Done callbacks may add more
+// transfers.
+
+struct _http_multi
+{
+  CURLM* multi;
+  GSList* transfers;
+  guint running;
+
+  http_progress_fn progress_cb;
+  gpointer progress_data;
+
+  // sizes of finished transfers
+  goffset finished_total;
+  goffset finished_now;
+};
+
+http_multi* http_multi_new(void)
+{
+  http_multi* m = g_new0(http_multi, 1);
+
+  m->multi = curl_multi_init();
+  if (!m->multi)
+  {
+    g_free(m);
+    return NULL;
+  }
+
+  return m;
+}
+
+void http_multi_set_progress_callback(http_multi* m, http_progress_fn cb, gpointer data)
+{
+  g_return_if_fail(m != NULL);
+
+  m->progress_cb = cb;
+  m->progress_data = data;
+}
+
+static gboolean http_multi_add(http_multi* m, http* h, const gchar* url, http_done_fn done_cb, gpointer done_data)
+{
+  h->multi = m;
+  h->done_cb = done_cb;
+  h->done_data = done_data;
+  h->progress_total = 0;
+  h->progress_now = 0;
+
+  curl_easy_setopt(h->curl, CURLOPT_POST, 1L);
+  curl_easy_setopt(h->curl, CURLOPT_URL, url);
+
+  g_hash_table_foreach(h->headers, (GHFunc)add_header, &h->request_headers);
+  curl_easy_setopt(h->curl, CURLOPT_HTTPHEADER, h->request_headers);
+
+  // aggregate progress is summed from all transfers
+  curl_easy_setopt(h->curl, CURLOPT_NOPROGRESS, 0L);
+  curl_easy_setopt(h->curl, CURLOPT_PROGRESSFUNCTION, (curl_progress_callback)curl_progress);
+  curl_easy_setopt(h->curl, CURLOPT_PROGRESSDATA, h);
+  curl_easy_setopt(h->curl, CURLOPT_PRIVATE, h);
+
+  if (curl_multi_add_handle(m->multi, h->curl) != CURLM_OK)
+  {
+    curl_easy_setopt(h->curl, CURLOPT_HTTPHEADER, NULL);
+    curl_slist_free_all(h->request_headers);
+    h->request_headers = NULL;
+    h->multi = NULL;
+    return FALSE;
+  }
+
+  m->transfers = g_slist_prepend(m->transfers, h);
+  m->running++;
+  return TRUE;
+}
+
+gboolean http_multi_add_upload(http_multi* m, http* h, const gchar* url, goffset len, http_data_fn read_cb, gpointer user_data, http_done_fn done_cb, gpointer done_data)
+{
+  g_return_val_if_fail(m != NULL, FALSE);
+  g_return_val_if_fail(h != NULL && h->multi == NULL, FALSE);
+  g_return_val_if_fail(url != NULL, FALSE);
+
+  http_no_expect(h);
+  http_set_content_length(h, len);
+  curl_easy_setopt(h->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)len);
+
+  h->stream.cb = read_cb;
+  h->stream.user_data = user_data;
+  curl_easy_setopt(h->curl, CURLOPT_READFUNCTION, (curl_read_callback)curl_read);
+  curl_easy_setopt(h->curl, CURLOPT_READDATA, &h->stream);
+
+  h->response = g_string_sized_new(512);
+  curl_easy_setopt(h->curl, CURLOPT_WRITEFUNCTION, (curl_write_callback)append_gstring);
+  curl_easy_setopt(h->curl, CURLOPT_WRITEDATA, h->response);
+
+  return http_multi_add(m, h, url, done_cb, done_data);
+}
+
+gboolean http_multi_add_download(http_multi* m, http* h, const gchar* url, http_data_fn write_cb, gpointer user_data, http_done_fn done_cb, gpointer done_data)
+{
+  g_return_val_if_fail(m != NULL, FALSE);
+  g_return_val_if_fail(h != NULL && h->multi == NULL, FALSE);
+  g_return_val_if_fail(url != NULL, FALSE);
+
+  http_no_expect(h);
+  curl_easy_setopt(h->curl, CURLOPT_POSTFIELDSIZE, 0L);
+
+  h->stream.cb = write_cb;
+  h->stream.user_data = user_data;
+  curl_easy_setopt(h->curl, CURLOPT_WRITEFUNCTION, (curl_write_callback)curl_write);
+  curl_easy_setopt(h->curl, CURLOPT_WRITEDATA, &h->stream);
+
+  return http_multi_add(m, h, url, done_cb, done_data);
+}
+
+guint http_multi_get_running(http_multi* m)
+{
+  g_return_val_if_fail(m != NULL, 0);
+
+  return m->running;
+}
+
+static void http_multi_finish(http_multi* m, http* h, CURLcode res)
+{
+  GError* local_err = NULL;
+  glong http_status = 0;
+
+  curl_multi_remove_handle(m->multi, h->curl);
+  m->transfers = g_slist_remove(m->transfers, h);
+  m->running--;
+
+  m->finished_total += h->progress_total;
+  m->finished_now += h->progress_now;
+
+  curl_easy_setopt(h->curl, CURLOPT_HTTPHEADER, NULL);
+  curl_slist_free_all(h->request_headers);
+  h->request_headers = NULL;
+  h->multi = NULL;
+
+  if (res == CURLE_OK)
+  {
+    if (curl_easy_getinfo(h->curl, CURLINFO_RESPONSE_CODE, &http_status) != CURLE_OK)
+      g_set_error(&local_err, HTTP_ERROR, HTTP_ERROR_OTHER, "Can't get http status code");
+    else if (http_status != 200)
+      g_set_error(&local_err, HTTP_ERROR, HTTP_ERROR_OTHER, "Server returned %ld", http_status);
+  }
+  else if (res == CURLE_GOT_NOTHING)
+    g_set_error(&local_err, HTTP_ERROR, HTTP_ERROR_NO_RESPONSE, "CURL error: %s", curl_easy_strerror(res));
+  else
+    g_set_error(&local_err, HTTP_ERROR, HTTP_ERROR_OTHER, "CURL error: %s", curl_easy_strerror(res));
+
+  GString* response = h->response;
+  h->response = NULL;
+
+  // done callback may free the handle
+  if (h->done_cb)
+    h->done_cb(h, local_err ? NULL : response, local_err, h->done_data);
+
+  if (response)
+    g_string_free(response, TRUE);
+  g_clear_error(&local_err);
+}
+
+gboolean http_multi_perform(http_multi* m, gint timeout_ms, GError** err)
+{
+  CURLMsg* msg;
+  CURLMcode mres;
+  gint still_running, msgs_left;
+  GSList* i;
+
+  g_return_val_if_fail(m != NULL, FALSE);
+  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+  if (m->running == 0)
+    return TRUE;
+
+  mres = curl_multi_wait(m->multi, NULL, 0, timeout_ms, NULL);
+  if (mres == CURLM_OK)
+    mres = curl_multi_perform(m->multi, &still_running);
+
+  if (mres != CURLM_OK)
+  {
+    g_set_error(err, HTTP_ERROR, HTTP_ERROR_OTHER, "CURL error: %s", curl_multi_strerror(mres));
+    return FALSE;
+  }
+
+  if (m->progress_cb)
+  {
+    goffset total = m->finished_total, now = m->finished_now;
+
+    for (i = m->transfers; i; i = i->next)
+    {
+      http* h = i->data;
+
+      total += h->progress_total;
+      now += h->progress_now;
+    }
+
+    m->progress_cb(total, now, m->progress_data);
+  }
+
+  while ((msg = curl_multi_info_read(m->multi, &msgs_left)))
+  {
+    http* h = NULL;
+
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&h);
+    if (h)
+      http_multi_finish(m, h, msg->data.result);
+  }
+
+  return TRUE;
+}
+
+void http_multi_free(http_multi* m)
+{
+  if (!m)
+    return;
+
+  // abort transfers that are still running
+  while (m->transfers)
+    http_multi_finish(m, m->transfers->data, CURLE_ABORTED_BY_CALLBACK);
+
+  curl_multi_cleanup(m->multi);
+  g_free(m);
+}
+
+// }}}
+
 void http_free(http* h)
 {
   if (!h)
     return;
 
+  g_return_if_fail(h->multi == NULL);
+
   g_hash_table_destroy(h->headers);
-  curl_easy_cleanup(h->curl);
+  http_pool_put(h->curl);
 
   memset(h, 0, sizeof(http));
   g_free(h);
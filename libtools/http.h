@@ -31,9 +31,12 @@ enum
 };
 
 typedef struct _http http;
+typedef struct _http_multi http_multi;
 
 typedef gsize (*http_data_fn)(gpointer buf, gsize len, gpointer user_data);
 typedef gboolean (*http_progress_fn)(goffset total, goffset now, gpointer user_data);
+// response is only set for successful uploads
+typedef void (*http_done_fn)(http* h, GString* response, GError* error, gpointer user_data);
 
 // functions
 
@@ -53,6 +56,26 @@ gboolean http_post_stream_download(http* h, const gchar* url, http_data_fn write
 
 void http_free(http* h);
 
+// concurrent transfers
+
+http_multi* http_multi_new(void);
+
+// aggregate progress of all transfers, handles may have their own
+void http_multi_set_progress_callback(http_multi* m, http_progress_fn cb, gpointer data);
+
+gboolean http_multi_add_upload(http_multi* m, http* h, const gchar* url, goffset len, http_data_fn read_cb, gpointer user_data, http_done_fn done_cb, gpointer done_data);
+gboolean http_multi_add_download(http_multi* m, http* h, const gchar* url, http_data_fn write_cb, gpointer user_data, http_done_fn done_cb, gpointer done_data);
+guint http_multi_get_running(http_multi* m);
+
+// wait for activity at most timeout_ms, then advance transfers and call
+// done callbacks of those that finished
+gboolean http_multi_perform(http_multi* m, gint timeout_ms, GError** err);
+
+void http_multi_free(http_multi* m);
+
+// free idle connections kept for reuse, call before curl_global_cleanup
+void http_cleanup(void);
+
 GQuark http_error_quark(void);
 
 #endif
@@ -29,10 +29,19 @@
 #include <string.h>
 #include <time.h>
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 #include <openssl/bn.h>
 #include <openssl/rsa.h>
 #include <openssl/rand.h>
 #include <openssl/err.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef G_OS_WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 DEFINE_CLEANUP_FUNCTION(http*, http_free)
 #define gc_http_free CLEANUP(http_free)
@@ -43,7 +52,18 @@ DEFINE_CLEANUP_FUNCTION_NULL(BN_CTX*, BN_CTX_free)
 DEFINE_CLEANUP_FUNCTION_NULL(BIGNUM*, BN_free)
 #define gc_bn_free CLEANUP(BN_free)
 
-#define CACHE_FORMAT_VERSION 3
+DEFINE_CLEANUP_FUNCTION_NULL(EVP_CIPHER_CTX*, EVP_CIPHER_CTX_free)
+#define gc_evp_cipher_ctx_free CLEANUP(EVP_CIPHER_CTX_free)
+
+DEFINE_CLEANUP_FUNCTION_NULL(SJsonTape*, s_json_tape_free)
+#define gc_s_json_tape_free CLEANUP(s_json_tape_free)
+
+#define CACHE_FORMAT_VERSION 4
+
+// parallel transfers are split into ranges of roughly this size (rounded up
+// to the chunk boundary)
+#define TRANSFER_RANGE_SIZE (4 * 1024 * 1024)
+#define TRANSFER_CONNECTIONS 4
 
 gint mega_debug = 0;
 
@@ -97,172 +117,172 @@ struct _rsa_key {
 };
 
 // }}}
-// {{{ mega_session
-
-struct _mega_sesssion 
-{
-  MegaHttpClient* http;
-
-  gint id;
-  gchar* sid;
-  gchar* sid_param_name;
-  gchar* rid;
-
-  guchar* password_key;
-  guchar* master_key;
-  rsa_key rsa_key;
-
-  gchar* user_handle;
-  gchar* user_name;
-  gchar* user_email;
-
-  GHashTable* share_keys;
+// {{{ node_store
 
-  GSList* fs_nodes;
+// Nodes are allocated from fixed size blocks and their strings and keys are
+// kept in a string pool, so that large accounts don't need a few small
+// allocations per node. Everything is released at once with the store.
 
-  // progress reporting
-  mega_status_callback status_callback;
-  mega_status_data status_data;
-  gpointer status_userdata;
+#define NODE_BLOCK_SIZE 4096
 
-  gint64 last_refresh;
-  gboolean create_preview;
-};
+typedef struct
+{
+  GPtrArray* blocks;
+  guint block_used;
+  mega_node* free_nodes;
+  GStringChunk* strings;
+} node_store;
 
-// }}}
+static node_store* node_store_new(void)
+{
+  node_store* st = g_new0(node_store, 1);
 
-// JSON helpers
+  st->blocks = g_ptr_array_new_with_free_func(g_free);
+  st->block_used = NODE_BLOCK_SIZE;
+  st->strings = g_string_chunk_new(64 * 1024);
 
-// {{{ print_node
+  return st;
+}
 
-static void print_node(const gchar* n, const gchar* prefix)
+static void node_store_free(node_store* st)
 {
-  gc_free gchar* pretty = s_json_pretty(n);
-
-  g_printerr("%s%s\n", prefix, pretty);
+  if (st)
+  {
+    g_ptr_array_unref(st->blocks);
+    g_string_chunk_free(st->strings);
+    g_free(st);
+  }
 }
 
-// }}}
-// {{{ s_json_get_bytes
-
-static guchar* s_json_get_bytes(const gchar* node, gsize* out_len)
+static mega_node* node_store_alloc(node_store* st)
 {
-  g_return_val_if_fail(node != NULL, NULL);
-  g_return_val_if_fail(out_len != NULL, NULL);
+  mega_node* n;
 
-  gc_free gchar* data = s_json_get_string(node);
+  // reuse released nodes first, they are chained through the parent pointer
+  if (st->free_nodes)
+  {
+    n = st->free_nodes;
+    st->free_nodes = n->parent;
+    memset(n, 0, sizeof(mega_node));
+    return n;
+  }
 
-  if (data)
+  if (st->block_used == NODE_BLOCK_SIZE)
   {
-    gchar* b64 = g_base64_decode(data, out_len);
-    return b64;
+    g_ptr_array_add(st->blocks, g_new0(mega_node, NODE_BLOCK_SIZE));
+    st->block_used = 0;
   }
 
-  return NULL;
+  n = g_ptr_array_index(st->blocks, st->blocks->len - 1);
+  return n + st->block_used++;
 }
 
-// }}}
-// {{{ s_json_get_member_bytes
+// strings of the released node stay in the pool until the store is freed
+static void node_store_release(node_store* st, mega_node* n)
+{
+  memset(n, 0, sizeof(mega_node));
+  n->parent = st->free_nodes;
+  st->free_nodes = n;
+}
 
-static guchar* s_json_get_member_bytes(const gchar* node, const gchar* name, gsize* out_len)
+// handles repeat a lot (parent and owner handles), so they are deduplicated
+static gchar* node_store_intern(node_store* st, const gchar* str)
 {
-  g_return_val_if_fail(node != NULL, NULL);
-  g_return_val_if_fail(name != NULL, NULL);
-  g_return_val_if_fail(out_len != NULL, NULL);
+  return str ? g_string_chunk_insert_const(st->strings, str) : NULL;
+}
 
-  const gchar* v = s_json_get_member(node, name);
-  if (v) 
-	  return s_json_get_bytes(v, out_len);
+static gchar* node_store_strdup(node_store* st, const gchar* str)
+{
+  return str ? g_string_chunk_insert(st->strings, str) : NULL;
+}
 
-  return NULL;
+static guchar* node_store_memdup(node_store* st, const guchar* data, gsize len)
+{
+  return data ? (guchar*)g_string_chunk_insert_len(st->strings, (const gchar*)data, len) : NULL;
 }
 
 // }}}
-// {{{ s_json_get_member_bn
+// {{{ mega_session
 
-static BIGNUM* s_json_get_member_bn(const gchar* node, const gchar* name)
+struct _mega_sesssion 
 {
-  g_return_val_if_fail(node != NULL, NULL);
-  g_return_val_if_fail(name != NULL, NULL);
+  MegaHttpClient* http;
 
-  gc_free gchar* data = s_json_get_member_string(node, name);
-  if (data)
-  {
-    BIGNUM* n = NULL;
-    if (BN_dec2bn(&n, data))
-      return n;
-  }
+  gint id;
+  gchar* sid;
+  gchar* sid_param_name;
+  gchar* rid;
 
-  return NULL;
-}
+  guchar* password_key;
+  guchar* master_key;
+  rsa_key rsa_key;
 
-void s_json_get_member_rsa_key(const gchar* node, const gchar* name, rsa_key* key)
-{
-  g_return_if_fail(node != NULL);
-  g_return_if_fail(name != NULL);
-  g_return_if_fail(key != NULL);
+  gchar* user_handle;
+  gchar* user_name;
+  gchar* user_email;
 
-  const gchar* member = s_json_get_member(node, name);
-  if (!member || s_json_get_type(member) != S_JSON_TYPE_OBJECT)
-    return;
+  GHashTable* share_keys;
 
-#define READ_COMPONENT(c) \
-  key->c = s_json_get_member_bn(member, #c)
+  // fs_nodes are allocated from this store, the array is walked instead of
+  // the store, because nodes can be removed without freeing their slots
+  node_store* nodes;
+  GPtrArray* fs_nodes;
 
-  READ_COMPONENT(p);
-  READ_COMPONENT(q);
-  READ_COMPONENT(d);
-  READ_COMPONENT(u);
-  READ_COMPONENT(m);
-  READ_COMPONENT(e);
+  // "<parent handle>/<name>" -> node, for resolving paths one component at
+  // a time
+  GHashTable* path_index;
 
-#undef READ_COMPONENT
-}
+  // parent node -> GPtrArray of its children, toplevel nodes are stored
+  // under NULL
+  GHashTable* children_index;
 
-// }}}
-// {{{ s_json_gen_member_bytes
+  // progress reporting
+  mega_status_callback status_callback;
+  mega_status_data status_data;
+  gpointer status_userdata;
 
-static void s_json_gen_member_bytes(SJsonGen* gen, const gchar* name, guchar* data, gsize len)
-{
-  if (data)
-  {
-    gc_free gchar* tmp = g_base64_encode(data, len);
-    s_json_gen_member_string(gen, name, tmp);
-  }
-  else
-  {
-    s_json_gen_member_null(gen, name);
-  }
-}
+  gint64 last_refresh;
+  gboolean create_preview;
 
-// }}}
-// {{{ s_json_gen_member_rsa_key
+  // sequence number of the last seen server-client action packet
+  gchar* sn;
 
-static void s_json_gen_member_bn(SJsonGen* gen, const gchar* name, BIGNUM* n)
-{
-  gchar* tmp = BN_bn2dec(n);
-  s_json_gen_member_string(gen, name, tmp);
-  OPENSSL_free(tmp);
-}
+  // session cache state, see mega_session_save
+  gboolean cache_dirty;
+  GByteArray* cache_log;
+  guchar cache_nonce[8];
+  guchar cache_log_nonce[8];
+  gsize cache_snapshot_len;
+  gsize cache_log_len;
 
-static void s_json_gen_member_rsa_key(SJsonGen* gen, const gchar* name, rsa_key* key)
-{
-  s_json_gen_member_object(gen, name);
+  // number of parallel connections used for file transfers
+  gint transfer_connections;
 
-#define ADD_COMPONENT(name) \
-  if (key->name) \
-    s_json_gen_member_bn(gen, #name, key->name);
+  // keep partially downloaded files along with their resume state
+  gboolean resume_transfers;
 
-  ADD_COMPONENT(p)
-  ADD_COMPONENT(q)
-  ADD_COMPONENT(d)
-  ADD_COMPONENT(u)
-  ADD_COMPONENT(m)
-  ADD_COMPONENT(e)
+  // remember password key derived from the password, see key_cache_lookup
+  gboolean cache_password_key;
 
-#undef ADD_COMPONENT
+  // adaptive API rate limiting
+  gint64 api_interval;
+  gint64 api_next_request;
+  gdouble api_throttle_rate;
+  guint64 api_requests;
+  guint64 api_throttled;
+};
 
-  s_json_gen_end_object(gen);
+// }}}
+
+// JSON helpers
+
+// {{{ print_node
+
+static void print_node(const gchar* n, const gchar* prefix)
+{
+  gc_free gchar* pretty = s_json_pretty(n);
+
+  g_printerr("%s%s\n", prefix, pretty);
 }
 
 // }}}
@@ -834,27 +854,38 @@ static guchar* make_random_key(void)
 static guchar* make_password_key(const gchar* password)
 {
   guchar pkey[16] = {0x93, 0xC4, 0x67, 0xE3, 0x7D, 0xB0, 0xC7, 0xA4, 0xD1, 0xBE, 0x3F, 0x81, 0x01, 0x52, 0xCB, 0x56};
-  gint i, r;
+  gint i, r, n_keys;
   gint len;
 
   g_return_val_if_fail(password != NULL, NULL);
 
   len = strlen(password);
+  n_keys = (len + 15) / 16;
+
+  // key schedules are the same in every round, so prepare them just once
+  AES_KEY* keys = g_new0(AES_KEY, MAX(n_keys, 1));
+  for (i = 0; i < n_keys; i++)
+  {
+    guchar key[16] = {0};
+    strncpy(key, password + i * 16, 16);
+
+    AES_set_encrypt_key(key, 128, keys + i);
+  }
 
   for (r = 65536; r--; )
   {
-    for (i = 0; i < len; i += 16)
+    for (i = 0; i < n_keys; i++)
     {
-      AES_KEY k;
-      guchar key[16] = {0}, pkey_tmp[16];
-      strncpy(key, password + i, 16);
+      guchar pkey_tmp[16];
 
-      AES_set_encrypt_key(key, 128, &k);
-      AES_encrypt(pkey, pkey_tmp, &k);  
+      AES_encrypt(pkey, pkey_tmp, keys + i);
       memcpy(pkey, pkey_tmp, 16);
     }
   }
 
+  memset(keys, 0, sizeof(AES_KEY) * MAX(n_keys, 1));
+  g_free(keys);
+
   return g_memdup(pkey, 16);
 }
 
@@ -923,17 +954,79 @@ static gsize get_chunk_off(gint idx)
 }
 */
 
+static EVP_CIPHER_CTX* cbc_mac_ctx_new(const guchar key[16])
+{
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+
+  EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, NULL);
+  EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+  return ctx;
+}
+
+// CBC-MAC whole 16 byte blocks in bulk using EVP's (possibly hardware
+// accelerated) CBC mode, mac is used as IV and updated in place. The key is
+// expanded once in cbc_mac_ctx_new(), only the IV is reset here.
+static void cbc_mac_blocks(EVP_CIPHER_CTX* ctx, guchar mac[16], const guchar* data, gsize len)
+{
+  guchar out[16 * 1024];
+  gint out_len;
+
+  g_return_if_fail((len % 16) == 0);
+
+  if (len == 0)
+    return;
+
+  EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, mac);
+
+  while (len > 0)
+  {
+    gsize n = MIN(len, sizeof(out));
+
+    EVP_EncryptUpdate(ctx, out, &out_len, data, n);
+    data += n;
+    len -= n;
+  }
+
+  memcpy(mac, out + out_len - 16, 16);
+}
+
 typedef struct 
 {
   AES_KEY k;
+  guchar key[16];
+  // created on first use and kept until finish
+  EVP_CIPHER_CTX* cbc;
   gsize chunk_idx;
   guint64 next_boundary;
   guint64 position;
   guchar chunk_mac_iv[16];
   guchar chunk_mac[16];
   guchar meta_mac[16];
+  // if set, chunk MACs are stored here (16 bytes per chunk, starting at
+  // first_chunk_idx) instead of being folded into meta_mac
+  guchar* chunk_macs;
+  gsize first_chunk_idx;
+
+  // worker pool mode: whole chunks are collected in chunk_buf and their MACs
+  // are calculated on the pool, jobs are kept in chunk order
+  GThreadPool* pool;
+  GPtrArray* jobs;
+  GByteArray* chunk_buf;
+  GMutex lock;
+  GCond cond;
+  guint pending;
+  guint max_pending;
+  // idle CBC contexts of workers, a worker takes one or creates a new one
+  GAsyncQueue* worker_cbc;
 } chunked_cbc_mac;
 
+typedef struct
+{
+  GByteArray* data;
+  guchar mac[16];
+} chunk_mac_job;
+
 static void chunked_cbc_mac_init(chunked_cbc_mac* mac, guchar key[16], guchar iv[16])
 {
   g_return_if_fail(mac != NULL);
@@ -942,6 +1035,7 @@ static void chunked_cbc_mac_init(chunked_cbc_mac* mac, guchar key[16], guchar iv
   memset(mac, 0, sizeof(*mac));
   memcpy(mac->chunk_mac_iv, iv, 16);
   memcpy(mac->chunk_mac, mac->chunk_mac_iv, 16);
+  memcpy(mac->key, key, 16);
   AES_set_encrypt_key(key, 128, &mac->k);
   mac->next_boundary = get_chunk_size(mac->chunk_idx);
 }
@@ -957,21 +1051,136 @@ static void chunked_cbc_mac_init8(chunked_cbc_mac* mac, guchar key[16], guchar i
   chunked_cbc_mac_init(mac, key, mac_iv);
 }
 
+// start calculating chunk MACs at the chunk starting at position, chunk MACs
+// are stored into chunk_macs array (starting with the MAC of that chunk)
+// instead of being folded into the meta-MAC
+static void chunked_cbc_mac_init_at(chunked_cbc_mac* mac, guchar key[16], guchar iv[8], guint64 position, guchar* chunk_macs)
+{
+  g_return_if_fail(chunk_macs != NULL);
+
+  chunked_cbc_mac_init8(mac, key, iv);
+  mac->chunk_macs = chunk_macs;
+
+  while (mac->next_boundary <= position)
+    mac->next_boundary += get_chunk_size(++mac->chunk_idx);
+
+  mac->first_chunk_idx = mac->chunk_idx;
+
+  g_return_if_fail(mac->next_boundary - get_chunk_size(mac->chunk_idx) == position);
+
+  mac->position = position;
+}
+
 static void chunked_cbc_mac_close_chunk(chunked_cbc_mac* mac)
 {
   gint i;
   guchar tmp[16];
 
-  for (i = 0; i < 16; i++)
-    mac->meta_mac[i] ^= mac->chunk_mac[i];
+  if (mac->chunk_macs)
+  {
+    memcpy(mac->chunk_macs + (mac->chunk_idx - mac->first_chunk_idx) * 16, mac->chunk_mac, 16);
+  }
+  else
+  {
+    for (i = 0; i < 16; i++)
+      mac->meta_mac[i] ^= mac->chunk_mac[i];
 
-  AES_encrypt(mac->meta_mac, tmp, &mac->k);
-  memcpy(mac->meta_mac, tmp, 16);
+    AES_encrypt(mac->meta_mac, tmp, &mac->k);
+    memcpy(mac->meta_mac, tmp, 16);
+  }
 
   memcpy(mac->chunk_mac, mac->chunk_mac_iv, 16);
   mac->next_boundary += get_chunk_size(++mac->chunk_idx);
 }
 
+// CBC-MAC of a single chunk, last partial block is zero padded
+static void chunk_mac_calc(const AES_KEY* k, EVP_CIPHER_CTX* cbc, const guchar iv[16], const guchar* data, gsize len, guchar mac_out[16])
+{
+  guchar mac[16], tmp[16];
+  gsize blocks_len = len & ~(gsize)15, i;
+
+  memcpy(mac, iv, 16);
+
+  cbc_mac_blocks(cbc, mac, data, blocks_len);
+
+  if (len > blocks_len)
+  {
+    for (i = 0; i < len - blocks_len; i++)
+      mac[i] ^= data[blocks_len + i];
+
+    AES_encrypt(mac, tmp, k);
+    memcpy(mac, tmp, 16);
+  }
+
+  memcpy(mac_out, mac, 16);
+}
+
+static void chunk_mac_job_run(chunk_mac_job* job, chunked_cbc_mac* mac)
+{
+  EVP_CIPHER_CTX* cbc = g_async_queue_try_pop(mac->worker_cbc);
+
+  if (!cbc)
+    cbc = cbc_mac_ctx_new(mac->key);
+
+  chunk_mac_calc(&mac->k, cbc, mac->chunk_mac_iv, job->data->data, job->data->len, job->mac);
+  g_async_queue_push(mac->worker_cbc, cbc);
+
+  g_byte_array_unref(job->data);
+  job->data = NULL;
+
+  g_mutex_lock(&mac->lock);
+  mac->pending--;
+  g_cond_signal(&mac->cond);
+  g_mutex_unlock(&mac->lock);
+}
+
+// number of threads for CPU bound work (MACs, node decryption)
+static gint get_worker_threads(void)
+{
+#if GLIB_CHECK_VERSION(2, 36, 0)
+  return MIN(g_get_num_processors(), 8);
+#else
+  return 2;
+#endif
+}
+
+// calculate chunk MACs on a pool of threads, must be called right after init
+static void chunked_cbc_mac_enable_threads(chunked_cbc_mac* mac, gint threads)
+{
+  g_return_if_fail(mac != NULL);
+  g_return_if_fail(mac->position == 0 && mac->chunk_macs == NULL);
+
+  if (threads < 2)
+    return;
+
+  mac->pool = g_thread_pool_new((GFunc)chunk_mac_job_run, mac, threads, FALSE, NULL);
+  mac->jobs = g_ptr_array_new_with_free_func(g_free);
+  mac->chunk_buf = g_byte_array_new();
+  mac->max_pending = threads * 2;
+  mac->worker_cbc = g_async_queue_new_full((GDestroyNotify)EVP_CIPHER_CTX_free);
+  g_mutex_init(&mac->lock);
+  g_cond_init(&mac->cond);
+}
+
+static void chunked_cbc_mac_submit_chunk(chunked_cbc_mac* mac)
+{
+  chunk_mac_job* job = g_new0(chunk_mac_job, 1);
+
+  job->data = mac->chunk_buf;
+  mac->chunk_buf = g_byte_array_new();
+  g_ptr_array_add(mac->jobs, job);
+
+  // limit memory used by chunks that wait for processing
+  g_mutex_lock(&mac->lock);
+  while (mac->pending >= mac->max_pending)
+    g_cond_wait(&mac->cond, &mac->lock);
+  mac->pending++;
+  g_mutex_unlock(&mac->lock);
+
+  g_thread_pool_push(mac->pool, job, NULL);
+  mac->next_boundary += get_chunk_size(++mac->chunk_idx);
+}
+
 static void chunked_cbc_mac_update(chunked_cbc_mac* mac, const guchar* data, gsize len)
 {
   gsize i;
@@ -979,16 +1188,52 @@ static void chunked_cbc_mac_update(chunked_cbc_mac* mac, const guchar* data, gsi
   g_return_if_fail(mac != NULL);
   g_return_if_fail(data != NULL);
 
-  for (i = 0; i < len; i++)
+  if (mac->pool)
   {
-    mac->chunk_mac[mac->position % 16] ^= data[i];
-    mac->position++;
+    while (len > 0)
+    {
+      gsize n = MIN(len, mac->next_boundary - mac->position);
+
+      g_byte_array_append(mac->chunk_buf, data, n);
+      mac->position += n;
+      data += n;
+      len -= n;
+
+      if (mac->position == mac->next_boundary)
+        chunked_cbc_mac_submit_chunk(mac);
+    }
+
+    return;
+  }
+
+  i = 0;
+  while (i < len)
+  {
+    // process whole blocks up to the chunk boundary in bulk, chunk boundaries
+    // are always block aligned
+    if ((mac->position % 16) == 0 && len - i >= 16)
+    {
+      gsize n = MIN(len - i, mac->next_boundary - mac->position) & ~(gsize)15;
 
-    if (G_UNLIKELY((mac->position % 16) == 0))
+      if (!mac->cbc)
+        mac->cbc = cbc_mac_ctx_new(mac->key);
+
+      cbc_mac_blocks(mac->cbc, mac->chunk_mac, data + i, n);
+      mac->position += n;
+      i += n;
+    }
+    else
     {
-      guchar tmp[16];
-      AES_encrypt(mac->chunk_mac, tmp, &mac->k);
-      memcpy(mac->chunk_mac, tmp, 16);
+      mac->chunk_mac[mac->position % 16] ^= data[i];
+      mac->position++;
+      i++;
+
+      if (G_UNLIKELY((mac->position % 16) == 0))
+      {
+        guchar tmp[16];
+        AES_encrypt(mac->chunk_mac, tmp, &mac->k);
+        memcpy(mac->chunk_mac, tmp, 16);
+      }
     }
 
     // add chunk mac to the chunk macs list if we are at the chunk boundary
@@ -997,10 +1242,51 @@ static void chunked_cbc_mac_update(chunked_cbc_mac* mac, const guchar* data, gsi
   }
 }
 
+static void chunked_cbc_mac_finish_threads(chunked_cbc_mac* mac)
+{
+  guint i;
+  gint j;
+  guchar tmp[16];
+
+  if (mac->chunk_buf->len > 0)
+    chunked_cbc_mac_submit_chunk(mac);
+
+  // wait for all jobs to finish
+  g_thread_pool_free(mac->pool, FALSE, TRUE);
+
+  for (i = 0; i < mac->jobs->len; i++)
+  {
+    chunk_mac_job* job = mac->jobs->pdata[i];
+
+    for (j = 0; j < 16; j++)
+      mac->meta_mac[j] ^= job->mac[j];
+
+    AES_encrypt(mac->meta_mac, tmp, &mac->k);
+    memcpy(mac->meta_mac, tmp, 16);
+  }
+
+  g_ptr_array_free(mac->jobs, TRUE);
+  g_byte_array_unref(mac->chunk_buf);
+  g_async_queue_unref(mac->worker_cbc);
+  g_mutex_clear(&mac->lock);
+  g_cond_clear(&mac->cond);
+}
+
 static void chunked_cbc_mac_finish(chunked_cbc_mac* mac, guchar mac_out[16])
 {
   g_return_if_fail(mac != NULL);
 
+  if (mac->pool)
+  {
+    chunked_cbc_mac_finish_threads(mac);
+
+    if (mac_out)
+      memcpy(mac_out, mac->meta_mac, 16);
+
+    memset(mac, 0, sizeof(*mac));
+    return;
+  }
+
   // finish buffer if necessary
   if (mac->position % 16)
   {
@@ -1022,38 +1308,146 @@ static void chunked_cbc_mac_finish(chunked_cbc_mac* mac, guchar mac_out[16])
   if (mac_out)
     memcpy(mac_out, mac->meta_mac, 16);
 
+  if (mac->cbc)
+    EVP_CIPHER_CTX_free(mac->cbc);
+
   memset(mac, 0, sizeof(*mac));
 }
 
+static void condense_meta_mac(const guchar meta_mac[16], guchar mac_out[8])
+{
+  gint i;
+
+  for (i = 0; i < 4; i++)
+    mac_out[i] = meta_mac[i] ^ meta_mac[i + 4];
+  for (i = 0; i < 4; i++)
+    mac_out[i + 4] = meta_mac[i + 8] ^ meta_mac[i + 12];
+}
+
 static void chunked_cbc_mac_finish8(chunked_cbc_mac* mac, guchar mac_out[8])
 {
   guchar buf[16];
-  gint i;
 
   g_return_if_fail(mac_out != NULL);
 
   chunked_cbc_mac_finish(mac, buf);
-
-  for (i = 0; i < 4; i++)
-    mac_out[i] = buf[i] ^ buf[i + 4];
-  for (i = 0; i < 4; i++)
-    mac_out[i + 4] = buf[i + 8] ^ buf[i + 12];
+  condense_meta_mac(buf, mac_out);
 }
 
-// }}}
-// {{{ unpack_node_key
-
-static void unpack_node_key(guchar node_key[32], guchar aes_key[16], guchar nonce[8], guchar meta_mac_xor[8])
+// fold chunk MACs calculated out of order into the meta-MAC
+static void chunked_cbc_mac_fold(const guchar key[16], const guchar* chunk_macs, gsize n_chunks, guchar mac_out[16])
 {
-  if (aes_key)
+  AES_KEY k;
+  guchar meta_mac[16] = {0};
+  guchar tmp[16];
+  gsize i;
+  gint j;
+
+  AES_set_encrypt_key(key, 128, &k);
+
+  for (i = 0; i < n_chunks; i++)
   {
-    DW(aes_key, 0) = DW(node_key, 0) ^ DW(node_key, 4);
-    DW(aes_key, 1) = DW(node_key, 1) ^ DW(node_key, 5);
-    DW(aes_key, 2) = DW(node_key, 2) ^ DW(node_key, 6);
-    DW(aes_key, 3) = DW(node_key, 3) ^ DW(node_key, 7);
+    for (j = 0; j < 16; j++)
+      meta_mac[j] ^= chunk_macs[i * 16 + j];
+
+    AES_encrypt(meta_mac, tmp, &k);
+    memcpy(meta_mac, tmp, 16);
   }
 
-  if (nonce)
+  memcpy(mac_out, meta_mac, 16);
+}
+
+static gsize get_chunk_count(guint64 size)
+{
+  guint64 off = 0;
+  gsize idx = 0;
+
+  while (off < size)
+    off += get_chunk_size(idx++);
+
+  return idx;
+}
+
+// }}}
+// {{{ AES-CTR
+
+// Data path encryption goes through EVP, so that hardware accelerated
+// (AES-NI) CTR implementation is used where available. Encryption and
+// decryption are the same operation and can be done in place (in == out).
+
+static EVP_CIPHER_CTX* aes_ctr_new(const guchar key[16])
+{
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+
+  EVP_EncryptInit_ex(ctx, EVP_aes_128_ctr(), NULL, key, NULL);
+
+  return ctx;
+}
+
+// position the keystream at byte offset of the file
+static void aes_ctr_seek(EVP_CIPHER_CTX* ctx, const guchar nonce[8], guint64 offset)
+{
+  guchar iv[16], skip[16] = {0};
+  guint64 counter = GUINT64_TO_BE(offset / 16);
+  gint out_len;
+
+  memcpy(iv, nonce, 8);
+  memcpy(iv + 8, &counter, 8);
+  EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv);
+
+  if (offset % 16)
+    EVP_EncryptUpdate(ctx, skip, &out_len, skip, offset % 16);
+}
+
+static void aes_ctr_crypt(EVP_CIPHER_CTX* ctx, const guchar* in, guchar* out, gsize len)
+{
+  gint out_len;
+
+  while (len > 0)
+  {
+    gsize n = MIN(len, 1 << 30);
+
+    EVP_EncryptUpdate(ctx, out, &out_len, in, n);
+    in += n;
+    out += n;
+    len -= n;
+  }
+}
+
+// Decrypt downloaded data in place and MAC it in a single pass: curl hands
+// us up to CURL_MAX_WRITE_SIZE (16 KiB) at a time, so each small tile is
+// MACed while it's still in L1, instead of walking the buffer twice. The
+// MAC must not be in pool mode, that would copy each tile for later.
+
+#define CTR_MAC_TILE_SIZE (4 * 1024)
+
+static void aes_ctr_decrypt_mac(EVP_CIPHER_CTX* ctx, chunked_cbc_mac* mac, guchar* buf, gsize len)
+{
+  while (len > 0)
+  {
+    gsize n = MIN(len, CTR_MAC_TILE_SIZE);
+
+    aes_ctr_crypt(ctx, buf, buf, n);
+    chunked_cbc_mac_update(mac, buf, n);
+    buf += n;
+    len -= n;
+  }
+}
+
+// }}}
+// {{{ unpack_node_key
+
+static void unpack_node_key(guchar node_key[32], guchar aes_key[16], guchar nonce[8], guchar meta_mac_xor[8])
+{
+  if (aes_key)
+  {
+    DW(aes_key, 0) = DW(node_key, 0) ^ DW(node_key, 4);
+    DW(aes_key, 1) = DW(node_key, 1) ^ DW(node_key, 5);
+    DW(aes_key, 2) = DW(node_key, 2) ^ DW(node_key, 6);
+    DW(aes_key, 3) = DW(node_key, 3) ^ DW(node_key, 7);
+  }
+
+  if (nonce)
   {
     DW(nonce, 0) = DW(node_key, 4);
     DW(nonce, 1) = DW(node_key, 5);
@@ -1187,10 +1581,98 @@ static const gchar* srv_error_to_string(gint code)
 
 // {{{ api_request_unsafe
 
-static gchar* api_request_unsafe(mega_session* s, const gchar* req_node, GError** err)
+// Elements of the array at path in the response are passed to the callback
+// as they arrive, so that huge responses don't have to be kept in memory.
+// Returned response has the streamed array emptied.
+
+typedef struct
+{
+  const gchar* path;
+  SJsonStreamFunc callback;
+  gpointer user_data;
+  guint64 count;
+} api_stream_data;
+
+static gchar* api_url(mega_session* s)
+{
+  s->id++;
+  if (s->sid)
+    return g_strdup_printf("https://eu.api.mega.co.nz/cs?id=%u&%s=%s", s->id, s->sid_param_name ? s->sid_param_name : "sid", s->sid);
+
+  return g_strdup_printf("https://eu.api.mega.co.nz/cs?id=%u", s->id);
+}
+
+// simulate SRV_EAGAIN response if server drops connection, so that the
+// request is repeated, unless it can't be (part of the response was already
+// consumed)
+static gchar* api_http_error(GError* local_err, gboolean can_retry, GError** err)
+{
+  if (can_retry && local_err->domain == MEGA_HTTP_CLIENT_ERROR && (local_err->code == MEGA_HTTP_CLIENT_ERROR_CONNECTION_BROKEN || local_err->code == MEGA_HTTP_CLIENT_ERROR_SERVER_BUSY))
+  {
+    g_error_free(local_err);
+    return g_strdup_printf("%d", SRV_EAGAIN);
+  }
+
+  g_propagate_prefixed_error(err, local_err, "HTTP POST failed: ");
+  return NULL;
+}
+
+static gboolean api_stream_element(const gchar* element, api_stream_data* data)
+{
+  data->count++;
+  return data->callback(element, data->user_data);
+}
+
+static gchar* api_request_stream_unsafe(mega_session* s, const gchar* url, const gchar* req_node, api_stream_data* data, GError** err)
+{
+  GError* local_err = NULL;
+  guchar buf[64 * 1024];
+  gssize len;
+  gsize req_len = strlen(req_node);
+
+  gc_object_unref MegaHttpIOStream* io = mega_http_client_post(s->http, url, req_len, &local_err);
+  if (io)
+  {
+    GOutputStream* os = g_io_stream_get_output_stream(G_IO_STREAM(io));
+
+    if (g_output_stream_write_all(os, req_node, req_len, NULL, NULL, &local_err))
+      mega_http_client_get_response_length(s->http, NULL, &local_err);
+  }
+
+  SJsonStream* stream = s_json_stream_new(data->path, (SJsonStreamFunc)api_stream_element, data);
+
+  if (!local_err)
+  {
+    GInputStream* is = g_io_stream_get_input_stream(G_IO_STREAM(io));
+
+    while ((len = g_input_stream_read(is, buf, sizeof(buf), NULL, &local_err)) > 0)
+    {
+      if (!s_json_stream_feed(stream, (const gchar*)buf, len))
+      {
+        s_json_stream_free(stream);
+        g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response JSON");
+        return NULL;
+      }
+    }
+  }
+
+  gchar* res_node = s_json_stream_finish(stream);
+  s_json_stream_free(stream);
+
+  if (local_err)
+  {
+    g_free(res_node);
+    return api_http_error(local_err, data->count == 0, err);
+  }
+
+  return res_node;
+}
+
+static gchar* api_request_unsafe(mega_session* s, const gchar* req_node, api_stream_data* stream, GError** err)
 {
   GError* local_err = NULL;
   gc_free gchar* url = NULL;
+  gchar* res_node;
 
   g_return_val_if_fail(s != NULL, NULL);
   g_return_val_if_fail(req_node != NULL, NULL);
@@ -1199,80 +1681,137 @@ static gchar* api_request_unsafe(mega_session* s, const gchar* req_node, GError*
   if (mega_debug & MEGA_DEBUG_API)
     print_node(req_node, "-> ");
 
-  // prepare URL
-  s->id++;
-  if (s->sid)
-    url = g_strdup_printf("https://eu.api.mega.co.nz/cs?id=%u&%s=%s", s->id, s->sid_param_name ? s->sid_param_name : "sid", s->sid);
-  else
-    url = g_strdup_printf("https://eu.api.mega.co.nz/cs?id=%u", s->id);
-
-  GString* res_str = mega_http_client_post_simple(s->http, url, req_node, -1, &local_err);
+  url = api_url(s);
 
-  // handle http errors
-  if (!res_str)
+  if (stream)
   {
-    if (local_err->domain == MEGA_HTTP_CLIENT_ERROR && (local_err->code == MEGA_HTTP_CLIENT_ERROR_CONNECTION_BROKEN || local_err->code == MEGA_HTTP_CLIENT_ERROR_SERVER_BUSY))
-    {
-      // simulate SRV_EAGAIN response if server drops connection
-      return g_strdup_printf("%d", SRV_EAGAIN);
-    }
-    else
-    {
-      g_propagate_prefixed_error(err, local_err, "HTTP POST failed: ");
+    res_node = api_request_stream_unsafe(s, url, req_node, stream, err);
+    if (!res_node)
       return NULL;
-    }
+  }
+  else
+  {
+    GString* res_str = mega_http_client_post_simple(s->http, url, req_node, -1, &local_err);
+
+    // handle http errors
+    if (!res_str)
+      return api_http_error(local_err, TRUE, err);
+
+    res_node = g_string_free(res_str, FALSE);
   }
 
   // decode JSON
-  if (!s_json_is_valid(res_str->str))
+  if (!s_json_is_valid(res_node))
   {
     g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response JSON");
-    g_string_free(res_str, TRUE);
+    g_free(res_node);
     return NULL;
   }
 
-  gchar* res_node = g_string_free(res_str, FALSE);
-
-  if (mega_debug & MEGA_DEBUG_API && res_node)
+  if (mega_debug & MEGA_DEBUG_API)
     print_node(res_node, "<- ");
 
   return res_node;
 }
 
+// }}}
+// {{{ api rate limiting
+
+// API requests are spaced by an interval shared by the whole session. It's
+// doubled whenever the server asks us to slow down and decreased gradually
+// on success, so that there's no delay at all under light load.
+
+#define API_BACKOFF_INTERVAL (250 * 1000)
+#define API_MAX_INTERVAL (16 * 1000 * 1000)
+#define API_MAX_RETRIES 10
+
+static void init_status(mega_session* s, gint type);
+static gboolean send_status(mega_session* s);
+
+static gboolean api_is_throttled(gint code)
+{
+  return code == SRV_EAGAIN || code == SRV_ERATELIMIT || code == SRV_ETOOMANYCONNECTIONS;
+}
+
+static void api_rate_wait(mega_session* s)
+{
+  gint64 now = g_get_monotonic_time();
+
+  if (s->api_next_request > now)
+    g_usleep(s->api_next_request - now);
+}
+
+static void api_rate_update(mega_session* s, gboolean throttled)
+{
+  gint64 old_interval = s->api_interval;
+
+  s->api_requests++;
+  s->api_throttle_rate *= 0.9;
+
+  if (throttled)
+  {
+    s->api_throttled++;
+    s->api_throttle_rate += 0.1;
+    s->api_interval = CLAMP(s->api_interval * 2, API_BACKOFF_INTERVAL, API_MAX_INTERVAL);
+  }
+  else
+  {
+    s->api_interval = s->api_interval * 3 / 4;
+    if (s->api_interval < 1000)
+      s->api_interval = 0;
+  }
+
+  s->api_next_request = g_get_monotonic_time() + s->api_interval;
+
+  // let the application know when the limiter kicks in or is idle again,
+  // gradual decay of the interval is not reported
+  if (s->api_interval > old_interval || (s->api_interval == 0 && old_interval > 0))
+  {
+    init_status(s, MEGA_STATUS_RATELIMIT);
+    s->status_data.ratelimit.interval = s->api_interval;
+    s->status_data.ratelimit.throttle_rate = s->api_throttle_rate;
+    s->status_data.ratelimit.requests = s->api_requests;
+    s->status_data.ratelimit.throttled = s->api_throttled;
+    send_status(s);
+  }
+}
+
 // }}}
 // {{{ api_request
 
-static gchar* api_request(mega_session* s, const gchar* req_node, GError** err)
+static gchar* api_request_full(mega_session* s, const gchar* req_node, api_stream_data* stream, GError** err)
 {
   GError* local_err = NULL;
   gchar* response;
-  gint delay = 250000; // repeat after 250ms 500ms 1s ...
+  gint retries = 0;
 
   g_return_val_if_fail(s != NULL, NULL);
   g_return_val_if_fail(req_node != NULL, NULL);
   g_return_val_if_fail(err == NULL || *err == NULL, NULL);
 
-  // some default rate limiting
-  g_usleep(20000);
-
 again:
-  response = api_request_unsafe(s, req_node, &local_err);
+  api_rate_wait(s);
+
+  response = api_request_unsafe(s, req_node, stream, &local_err);
   if (!response) 
   {
     g_propagate_error(err, local_err);
     return NULL;
   }
 
-  // if we are asked to repeat the call, do it with exponential backoff
-  if (s_json_get_type(response) == S_JSON_TYPE_NUMBER && s_json_get_int(response, SRV_EINTERNAL) == SRV_EAGAIN)
+  // if we are asked to slow down, repeat the call after the increased
+  // interval (nothing was streamed in that case)
+  gboolean throttled = s_json_get_type(response) == S_JSON_TYPE_NUMBER && api_is_throttled(s_json_get_int(response, SRV_EINTERNAL));
+
+  api_rate_update(s, throttled);
+
+  if (throttled)
   {
     g_free(response);
-    g_usleep(delay);
-    delay = delay * 2;
 
-    if (delay > 64 * 1000 * 1000)
+    if (++retries > API_MAX_RETRIES)
     {
-      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Server keeps asking us for EAGAIN, giving up");
+      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Server keeps asking us to slow down, giving up");
       return NULL;
     }
 
@@ -1282,9 +1821,71 @@ again:
   return response;
 }
 
+static gchar* api_request(mega_session* s, const gchar* req_node, GError** err)
+{
+  return api_request_full(s, req_node, NULL, err);
+}
+
 // }}}
 // {{{ api_response_check
 
+// check that response value has expected type (or is an error code)
+static const gchar* api_response_check_element(const gchar* node, gchar expects, gint* error_code, GError** err)
+{
+  SJsonType node_type = s_json_get_type(node);
+
+  if (error_code)
+    *error_code = 0;
+
+  // we got object
+  if (node_type == S_JSON_TYPE_OBJECT)
+  {
+    if (expects == 'o')
+      return node;
+  }
+  else if (node_type == S_JSON_TYPE_ARRAY)
+  {
+    if (expects == 'a')
+      return node;
+  }
+  else if (node_type == S_JSON_TYPE_NUMBER)
+  {
+    // we got int number
+    gint v = s_json_get_int(node, 0);
+
+    // if it's negative, it's error status
+    if (v < 0)
+    {
+      if (error_code)
+        *error_code = v;
+
+      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Server returned error %s", srv_error_to_string(v));
+      return NULL;
+    }
+
+    if (expects == 'i')
+      return node;
+  }
+  else if (node_type == S_JSON_TYPE_BOOL)
+  {
+    if (expects == 'b')
+      return node;
+  }
+  else if (node_type == S_JSON_TYPE_STRING)
+  {
+    if (expects == 's')
+      return node;
+  }
+  else if (node_type == S_JSON_TYPE_NULL)
+  {
+    if (expects == 'n')
+      return node;
+  }
+
+  g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Unexpected response");
+  return NULL;
+}
+
 // check that we have and array with a response value (object or error code)
 static const gchar* api_response_check(const gchar* response, gchar expects, gint* error_code, GError** err)
 {
@@ -1324,54 +1925,7 @@ static const gchar* api_response_check(const gchar* response, gchar expects, gin
   {
     const gchar* node = s_json_get_element(response, 0);
     if (node)
-    {
-      SJsonType node_type = s_json_get_type(node);
-
-      // we got object
-      if (node_type == S_JSON_TYPE_OBJECT)
-      {
-        if (expects == 'o')
-          return node;
-      }
-      else if (node_type == S_JSON_TYPE_ARRAY)
-      {
-        if (expects == 'a')
-          return node;
-      }
-      else if (node_type == S_JSON_TYPE_NUMBER)
-      {
-        // we got int number
-        gint v = s_json_get_int(node, 0);
-
-        // if it's negative, it's error status
-        if (v < 0)
-        {
-          if (error_code)
-            *error_code = v;
-
-          g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Server returned error %s", srv_error_to_string(v));
-          return NULL;
-        }
-        
-        if (expects == 'i')
-          return node;
-      }
-      else if (node_type == S_JSON_TYPE_BOOL)
-      {
-        if (expects == 'b')
-          return node;
-      }
-      else if (node_type == S_JSON_TYPE_STRING)
-      {
-        if (expects == 's')
-          return node;
-      }
-      else if (node_type == S_JSON_TYPE_NULL)
-      {
-        if (expects == 'n')
-          return node;
-      }
-    }
+      return api_response_check_element(node, expects, error_code, err);
   }
 
   g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Unexpected response");
@@ -1381,25 +1935,21 @@ static const gchar* api_response_check(const gchar* response, gchar expects, gin
 // }}}
 // {{{ api_call
 
-static gchar* api_call(mega_session* s, gchar expects, gint* error_code, GError** err, const gchar* format, ...)
+static gchar* api_callv(mega_session* s, gchar expects, api_stream_data* stream, gint* error_code, GError** err, const gchar* format, va_list args)
 {
   const gchar* node;
-  va_list args;
 
   g_return_val_if_fail(err != NULL && *err == NULL, NULL);
   g_return_val_if_fail(format != NULL, NULL);
 
-  va_start(args, format);
   gc_free gchar* request = s_json_buildv(format, args);
-  va_end(args);
-
   if (request == NULL)
   {
     g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid request format: %s", format);
     return NULL;
   }
 
-  gc_free gchar* response = api_request(s, request, err);
+  gc_free gchar* response = api_request_full(s, request, stream, err);
 
   node = api_response_check(response, expects, error_code, err);
   if (*err)
@@ -1421,84 +1971,384 @@ static gchar* api_call(mega_session* s, gchar expects, gint* error_code, GError*
   return s_json_get(node);
 }
 
-// }}}
+static gchar* api_call(mega_session* s, gchar expects, gint* error_code, GError** err, const gchar* format, ...)
+{
+  gchar* result;
+  va_list args;
 
-// Remote filesystem helpers
+  va_start(args, format);
+  result = api_callv(s, expects, NULL, error_code, err, format, args);
+  va_end(args);
 
-// {{{ update_pathmap
+  return result;
+}
+
+// }}}
+// {{{ api_call_stream
 
-static void mega_node_free(mega_node* n);
+// Like api_call, but elements of the array at path in the response are
+// passed to the callback as they arrive. Returned value has the streamed
+// array emptied.
 
-static void update_pathmap(mega_session* s)
+static gchar* api_call_stream(mega_session* s, gchar expects, const gchar* path, SJsonStreamFunc callback, gpointer user_data, gint* error_code, GError** err, const gchar* format, ...)
 {
-  GSList *i, *prev, *next;
-  g_return_if_fail(s != NULL);
+  api_stream_data data = { path, callback, user_data, 0 };
+  gchar* result;
+  va_list args;
 
-  // node handles are assumed to be unique
-  GHashTable* handle_map = g_hash_table_new(g_str_hash, g_str_equal);
-  for (i = s->fs_nodes; i; i = i->next)
-  {
-    mega_node* n = i->data;
+  va_start(args, format);
+  result = api_callv(s, expects, &data, error_code, err, format, args);
+  va_end(args);
 
-#if GLIB_CHECK_VERSION(2, 40, 0)
-    if (!g_hash_table_insert(handle_map, n->handle, n))
-      g_printerr("WARNING: Dup node handle detected %s\n", n->handle);
-#else
-    if (g_hash_table_lookup(handle_map, n->handle))
-      g_printerr("WARNING: Dup node handle detected %s\n", n->handle);
-    else
-      g_hash_table_insert(handle_map, n->handle, n);
-#endif
-  }
-  
-  prev = NULL;
-  for (i = s->fs_nodes; i;)
-  {
-    mega_node* n = i->data;
-    next = i->next;
+  return result;
+}
 
-    if (n->type == MEGA_NODE_CONTACT) 
-    {
-      if (n->su_handle)
-        n->parent = g_hash_table_lookup(handle_map, n->su_handle);
-    }
-    else
-    {
-      if (n->parent_handle)
-        n->parent = g_hash_table_lookup(handle_map, n->parent_handle);
-    }
+// }}}
+// {{{ api_batch
 
-    /*
-    // remove parentless non-root nodes from the list
-    if (!n->parent && (n->type == MEGA_NODE_FILE || n->type == MEGA_NODE_FOLDER || n->type == MEGA_NODE_CONTACT))
-    {
-      // remove current node
-      if (prev) 
-        prev->next = next;
-      else 
-        s->fs_nodes = next;
-
-      g_slist_free_1(i);
-      mega_node_free(n);
-    }
-    else
-      prev = i;
-      */
+// Batch of API commands that are sent together in as few requests as
+// possible. Result (or error) of each command is passed to its callback
+// when the batch is flushed.
 
-    i = next;
-  }
+#define API_BATCH_SIZE 1000
 
-  g_hash_table_unref(handle_map);
-}
+typedef void (*api_batch_fn)(mega_session* s, const gchar* result, GError* error, gpointer user_data);
 
-// }}}
-// {{{ path manipulation utils
+typedef struct
+{
+  gchar* request;
+  gchar expects;
+  api_batch_fn callback;
+  gpointer user_data;
+  gint retries;
+} api_batch_cmd;
+
+typedef struct
+{
+  mega_session* s;
+  GPtrArray* cmds;
+} api_batch;
 
-static gchar* path_sanitize_slashes(const gchar* path)
+static void api_batch_cmd_free(api_batch_cmd* cmd)
 {
-  g_return_val_if_fail(path != NULL, NULL);
+  if (!cmd)
+    return;
 
-  gchar* sanepath = g_malloc(strlen(path) + 1);
+  g_free(cmd->request);
+  g_free(cmd);
+}
+
+static api_batch* api_batch_new(mega_session* s)
+{
+  api_batch* b = g_new0(api_batch, 1);
+
+  b->s = s;
+  b->cmds = g_ptr_array_new_with_free_func((GDestroyNotify)api_batch_cmd_free);
+
+  return b;
+}
+
+static void api_batch_free(api_batch* b)
+{
+  if (!b)
+    return;
+
+  g_ptr_array_unref(b->cmds);
+  g_free(b);
+}
+
+DEFINE_CLEANUP_FUNCTION_NULL(api_batch*, api_batch_free)
+#define gc_api_batch_free CLEANUP(api_batch_free)
+
+// queue a single command, format describes the command object: {a:d, n:%s}
+static void api_batch_add(api_batch* b, gchar expects, api_batch_fn callback, gpointer user_data, const gchar* format, ...)
+{
+  api_batch_cmd* cmd;
+  gchar* request;
+  va_list args;
+
+  g_return_if_fail(b != NULL);
+  g_return_if_fail(format != NULL);
+
+  va_start(args, format);
+  request = s_json_buildv(format, args);
+  va_end(args);
+
+  g_return_if_fail(request != NULL);
+
+  cmd = g_new0(api_batch_cmd, 1);
+  cmd->request = request;
+  cmd->expects = expects;
+  cmd->callback = callback;
+  cmd->user_data = user_data;
+  g_ptr_array_add(b->cmds, cmd);
+}
+
+static void api_batch_dispatch(api_batch* b, api_batch_cmd* cmd, const gchar* result, GError* error)
+{
+  if (cmd->callback)
+    cmd->callback(b->s, result, error, cmd->user_data);
+}
+
+// send all queued commands, returns FALSE if a whole request failed (in that
+// case callbacks of all the remaining commands get the error too)
+static gboolean api_batch_flush(api_batch* b, GError** err)
+{
+  GError* local_err = NULL;
+  guint i;
+
+  g_return_val_if_fail(b != NULL, FALSE);
+  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+  while (b->cmds->len > 0)
+  {
+    guint n = MIN(b->cmds->len, API_BATCH_SIZE);
+    gc_string_free GString* request = g_string_new("[");
+
+    for (i = 0; i < n; i++)
+    {
+      api_batch_cmd* cmd = g_ptr_array_index(b->cmds, i);
+
+      if (i > 0)
+        g_string_append_c(request, ',');
+      g_string_append(request, cmd->request);
+    }
+    g_string_append_c(request, ']');
+
+    gc_free gchar* response = api_request(b->s, request->str, &local_err);
+    if (response && s_json_get_type(response) != S_JSON_TYPE_ARRAY)
+    {
+      gint v = s_json_get_type(response) == S_JSON_TYPE_NUMBER ? s_json_get_int(response, 0) : 0;
+
+      if (v < 0)
+        g_set_error(&local_err, MEGA_ERROR, MEGA_ERROR_OTHER, "Server returned error %s", srv_error_to_string(v));
+      else
+        g_set_error(&local_err, MEGA_ERROR, MEGA_ERROR_OTHER, "Unexpected response");
+    }
+
+    if (local_err)
+    {
+      for (i = 0; i < b->cmds->len; i++)
+        api_batch_dispatch(b, g_ptr_array_index(b->cmds, i), NULL, local_err);
+
+      g_ptr_array_set_size(b->cmds, 0);
+      g_propagate_prefixed_error(err, local_err, "API batch failed: ");
+      return FALSE;
+    }
+
+    gc_free gchar** results = s_json_get_elements(response);
+    guint n_results = g_strv_length(results);
+    guint kept = 0;
+
+    for (i = 0; i < n; i++)
+    {
+      api_batch_cmd* cmd = g_ptr_array_index(b->cmds, i);
+      const gchar* result = NULL;
+      gc_error_free GError* cmd_err = NULL;
+      gint code = 0;
+
+      if (i < n_results)
+        result = api_response_check_element(results[i], cmd->expects, &code, &cmd_err);
+      else
+        g_set_error(&cmd_err, MEGA_ERROR, MEGA_ERROR_OTHER, "Missing response");
+
+      // commands the server asked us to slow down with are sent again in
+      // the next request, in the same order
+      if (api_is_throttled(code))
+      {
+        if (++cmd->retries <= API_MAX_RETRIES)
+        {
+          b->cmds->pdata[kept++] = cmd;
+          continue;
+        }
+
+        g_clear_error(&cmd_err);
+        g_set_error(&cmd_err, MEGA_ERROR, MEGA_ERROR_OTHER, "Server keeps asking us to slow down, giving up");
+      }
+
+      api_batch_dispatch(b, cmd, result, cmd_err);
+      api_batch_cmd_free(cmd);
+    }
+
+    // slots of the dispatched commands were freed or reused above
+    for (i = kept; i < n; i++)
+      b->cmds->pdata[i] = NULL;
+    g_ptr_array_remove_range(b->cmds, kept, n - kept);
+
+    if (kept > 0)
+      api_rate_update(b->s, TRUE);
+  }
+
+  return TRUE;
+}
+
+// }}}
+
+// Remote filesystem helpers
+
+// {{{ update_pathmap
+
+static void mega_node_free(mega_session* s, mega_node* n);
+static void cache_invalidate(mega_session* s);
+static void cache_log_node(mega_session* s, mega_node* n);
+static void cache_log_remove(mega_session* s, mega_node* n);
+static void cache_log_share_key(mega_session* s, const gchar* handle, const guchar* key);
+static void cache_log_state(mega_session* s);
+
+// binary form of a base64 encoded node or user handle
+static guint64 handle_to_id(const gchar* handle)
+{
+  guchar buf[8] = {0};
+  guint acc = 0, bits = 0, len = 0;
+  guint64 id;
+  const gchar* p;
+
+  if (!handle)
+    return 0;
+
+  for (p = handle; *p && len < sizeof(buf); p++)
+  {
+    gint v;
+
+    if (*p >= 'A' && *p <= 'Z')
+      v = *p - 'A';
+    else if (*p >= 'a' && *p <= 'z')
+      v = *p - 'a' + 26;
+    else if (*p >= '0' && *p <= '9')
+      v = *p - '0' + 52;
+    else if (*p == '-')
+      v = 62;
+    else if (*p == '_')
+      v = 63;
+    else
+      return 0;
+
+    acc = (acc << 6) | v;
+    bits += 6;
+    if (bits >= 8)
+    {
+      bits -= 8;
+      buf[len++] = acc >> bits;
+      acc &= (1 << bits) - 1;
+    }
+  }
+
+  memcpy(&id, buf, sizeof(id));
+  return id;
+}
+
+static void mega_node_update_ids(mega_node* n)
+{
+  n->handle_id = handle_to_id(n->handle);
+  n->parent_id = handle_to_id(n->parent_handle);
+}
+
+static gchar* path_index_key(mega_node* parent, const gchar* name)
+{
+  return g_strconcat(parent ? parent->handle : "", "/", name, NULL);
+}
+
+// first node with a given name wins, same as with a linear search
+static void path_index_add(mega_session* s, mega_node* n)
+{
+  if (!n->name)
+    return;
+
+  gchar* key = path_index_key(n->parent, n->name);
+
+  if (g_hash_table_lookup(s->path_index, key))
+    g_free(key);
+  else
+    g_hash_table_insert(s->path_index, key, n);
+}
+
+static void children_index_add(mega_session* s, mega_node* n)
+{
+  GPtrArray* children = g_hash_table_lookup(s->children_index, n->parent);
+
+  if (!children)
+  {
+    children = g_ptr_array_new();
+    g_hash_table_insert(s->children_index, n->parent, children);
+  }
+
+  g_ptr_array_add(children, n);
+}
+
+static void update_pathmap(mega_session* s)
+{
+  guint i;
+  g_return_if_fail(s != NULL);
+
+  // node handles are assumed to be unique
+  GHashTable* handle_map = g_hash_table_new(g_int64_hash, g_int64_equal);
+  for (i = 0; i < s->fs_nodes->len; i++)
+  {
+    mega_node* n = s->fs_nodes->pdata[i];
+
+    mega_node_update_ids(n);
+
+#if GLIB_CHECK_VERSION(2, 40, 0)
+    if (!g_hash_table_insert(handle_map, &n->handle_id, n))
+      g_printerr("WARNING: Dup node handle detected %s\n", n->handle);
+#else
+    if (g_hash_table_lookup(handle_map, &n->handle_id))
+      g_printerr("WARNING: Dup node handle detected %s\n", n->handle);
+    else
+      g_hash_table_insert(handle_map, &n->handle_id, n);
+#endif
+  }
+  
+  for (i = 0; i < s->fs_nodes->len; i++)
+  {
+    mega_node* n = s->fs_nodes->pdata[i];
+
+    if (n->type == MEGA_NODE_CONTACT) 
+    {
+      if (n->su_handle)
+      {
+        guint64 su_id = handle_to_id(n->su_handle);
+
+        n->parent = g_hash_table_lookup(handle_map, &su_id);
+      }
+    }
+    else
+    {
+      if (n->parent_handle)
+        n->parent = g_hash_table_lookup(handle_map, &n->parent_id);
+    }
+  }
+
+  g_hash_table_unref(handle_map);
+
+  g_hash_table_remove_all(s->path_index);
+  g_hash_table_remove_all(s->children_index);
+  for (i = 0; i < s->fs_nodes->len; i++)
+  {
+    path_index_add(s, s->fs_nodes->pdata[i]);
+    children_index_add(s, s->fs_nodes->pdata[i]);
+  }
+}
+
+// add a single new node without rebuilding the whole map
+static void pathmap_add_node(mega_session* s, mega_node* n, mega_node* parent)
+{
+  g_ptr_array_add(s->fs_nodes, n);
+  n->parent = parent;
+  mega_node_update_ids(n);
+  path_index_add(s, n);
+  children_index_add(s, n);
+  cache_log_node(s, n);
+}
+
+// }}}
+// {{{ path manipulation utils
+
+static gchar* path_sanitize_slashes(const gchar* path)
+{
+  g_return_val_if_fail(path != NULL, NULL);
+
+  gchar* sanepath = g_malloc(strlen(path) + 1);
   gchar* tmp = sanepath;
   gboolean previous_was_slash = 0;
 
@@ -1615,80 +2465,121 @@ void add_share_key(mega_session* s, const gchar* handle, const guchar* key)
   g_return_if_fail(key != NULL);
 
   g_hash_table_insert(s->share_keys, g_strdup(handle), g_memdup(key, 16));
+  cache_log_share_key(s, handle, key);
+}
+
+// }}}
+// {{{ mega_node_new
+
+static mega_node* mega_node_new(mega_session* s)
+{
+  mega_node* n = node_store_alloc(s->nodes);
+
+  n->s = s;
+
+  return n;
 }
 
 // }}}
 // {{{ mega_node_parse
 
-static mega_node* mega_node_parse(mega_session* s, const gchar* node)
+// Parsing of a node is split into stages, so that the expensive part
+// (mega_node_data_decrypt) can run in worker threads. Only the decrypt stage
+// is thread safe, the others touch the session.
+
+typedef struct
+{
+  gchar* handle;
+  gchar* parent_handle;
+  gchar* user_handle;
+  gchar* su_handle;
+  gchar* attrs;
+  gint type;
+  gint64 timestamp;
+  gint64 size;
+
+  // node key encrypted by share_key, NULL for special nodes
+  gchar* encrypted_key;
+  guchar share_key[16];
+
+  // set by mega_node_data_decrypt
+  gchar* name;
+  guchar* key;
+  gsize key_len;
+} mega_node_data;
+
+static void mega_node_data_clear(mega_node_data* d)
+{
+  g_free(d->handle);
+  g_free(d->parent_handle);
+  g_free(d->user_handle);
+  g_free(d->su_handle);
+  g_free(d->attrs);
+  g_free(d->encrypted_key);
+  g_free(d->name);
+  g_free(d->key);
+  memset(d, 0, sizeof(*d));
+}
+
+// node is an object on the tape, members are looked up without scanning the
+// JSON again; finds the key to decrypt the node with
+static gboolean mega_node_data_load(mega_session* s, SJsonTape* tape, gint node, mega_node_data* d)
 {
-  gchar* tmp;
-  gc_free gchar* node_h = s_json_get_member_string(node, "h");
-  gc_free gchar* node_p = s_json_get_member_string(node, "p");
-  gc_free gchar* node_u = s_json_get_member_string(node, "u");
-  gc_free gchar* node_k = s_json_get_member_string(node, "k");
-  gc_free gchar* node_a = s_json_get_member_string(node, "a");
-  gc_free gchar* node_sk = s_json_get_member_string(node, "sk");
-  gc_free gchar* node_su = s_json_get_member_string(node, "su");
-  gint node_t = s_json_get_member_int(node, "t", -1);
-  gint64 node_ts = s_json_get_member_int(node, "ts", 0);
-  gint64 node_s = s_json_get_member_int(node, "s", 0);
+  gc_free gchar* node_k = s_json_tape_get_member_string(tape, node, "k");
+  gc_free gchar* node_sk = s_json_tape_get_member_string(tape, node, "sk");
+
+  d->handle = s_json_tape_get_member_string(tape, node, "h");
+  d->parent_handle = s_json_tape_get_member_string(tape, node, "p");
+  d->user_handle = s_json_tape_get_member_string(tape, node, "u");
+  d->su_handle = s_json_tape_get_member_string(tape, node, "su");
+  d->attrs = s_json_tape_get_member_string(tape, node, "a");
+  d->type = s_json_tape_get_member_int(tape, node, "t", -1);
+  d->timestamp = s_json_tape_get_member_int(tape, node, "ts", 0);
+  d->size = s_json_tape_get_member_int(tape, node, "s", 0);
 
   // sanity check parsed values
-  if (!node_h || strlen(node_h) == 0)
+  if (!d->handle || strlen(d->handle) == 0)
   {
     g_printerr("WARNING: Skipping FS node without handle\n");
-    return NULL;
+    return FALSE;
   }
 
   // return special nodes
-  if (node_t == MEGA_NODE_ROOT)
+  if (d->type == MEGA_NODE_ROOT)
   {
-    mega_node* n = g_new0(mega_node, 1);
-    n->name = g_strdup("Root");
-    n->handle = g_strdup(node_h);
-    n->timestamp = node_ts;
-    n->type = node_t;
-    return n;
+    d->name = g_strdup("Root");
+    return TRUE;
   }
-  else if (node_t == MEGA_NODE_INBOX)
+  else if (d->type == MEGA_NODE_INBOX)
   {
-    mega_node* n = g_new0(mega_node, 1);
-    n->name = g_strdup("Inbox");
-    n->handle = g_strdup(node_h);
-    n->timestamp = node_ts;
-    n->type = node_t;
-    return n;
+    d->name = g_strdup("Inbox");
+    return TRUE;
   }
-  else if (node_t == MEGA_NODE_TRASH)
+  else if (d->type == MEGA_NODE_TRASH)
   {
-    mega_node* n = g_new0(mega_node, 1);
-    n->name = g_strdup("Trash");
-    n->handle = g_strdup(node_h);
-    n->timestamp = node_ts;
-    n->type = node_t;
-    return n;
+    d->name = g_strdup("Trash");
+    return TRUE;
   }
 
   // allow only file and dir nodes
-  if (node_t != MEGA_NODE_FOLDER && node_t != MEGA_NODE_FILE)
+  if (d->type != MEGA_NODE_FOLDER && d->type != MEGA_NODE_FILE)
   {
-    g_printerr("WARNING: Skipping FS node %s with unknown type %d\n", node_h, node_t);
-    return NULL;
+    g_printerr("WARNING: Skipping FS node %s with unknown type %d\n", d->handle, d->type);
+    return FALSE;
   }
 
   // node has to have attributes
-  if (!node_a || strlen(node_a) == 0)
+  if (!d->attrs || strlen(d->attrs) == 0)
   {
-    g_printerr("WARNING: Skipping FS node %s without attributes\n", node_h);
-    return NULL;
+    g_printerr("WARNING: Skipping FS node %s without attributes\n", d->handle);
+    return FALSE;
   }
 
   // node has to have a key
   if (!node_k || strlen(node_k) == 0)
   {
-    g_printerr("WARNING: Skipping FS node %s because of missing node key\n", node_h);
-    return NULL;
+    g_printerr("WARNING: Skipping FS node %s because of missing node key\n", d->handle);
+    return FALSE;
   }
 
   // process sk if available
@@ -1701,18 +2592,16 @@ static mega_node* mega_node_parse(mega_session* s, const gchar* node)
     {
       share_key = b64_rsa_decrypt(node_sk, &s->rsa_key, &share_key_len);
       if (share_key && share_key_len >= 16)
-        add_share_key(s, node_h, share_key);
+        add_share_key(s, d->handle, share_key);
     }
     else
     {
       share_key = b64_aes128_decrypt(node_sk, s->master_key, &share_key_len);
       if (share_key && share_key_len == 16)
-        add_share_key(s, node_h, share_key);
+        add_share_key(s, d->handle, share_key);
     }
   }
 
-  gchar* node_share_key = NULL;
-  gc_free gchar* encrypted_node_key = NULL;
   gc_strfreev gchar** parts = g_strsplit(node_k, "/", 0);
   gint i;
 
@@ -1728,164 +2617,228 @@ static mega_node* mega_node_parse(mega_session* s, const gchar* node)
       if (s->user_handle && !strcmp(s->user_handle, key_handle))
       {
         // we found a key encrypted by me
-        encrypted_node_key = g_strdup(key_value);
-        node_share_key = s->master_key;
+        g_free(d->encrypted_key);
+        d->encrypted_key = g_strdup(key_value);
+        memcpy(d->share_key, s->master_key, 16);
         break;
       }
 
-      node_share_key = g_hash_table_lookup(s->share_keys, key_handle);
+      guchar* node_share_key = g_hash_table_lookup(s->share_keys, key_handle);
       if (node_share_key)
       {
-        encrypted_node_key = g_strdup(key_value);
+        g_free(d->encrypted_key);
+        d->encrypted_key = g_strdup(key_value);
+        memcpy(d->share_key, node_share_key, 16);
       }
     }
   }
 
-  if (!encrypted_node_key)
+  if (!d->encrypted_key)
   {
-    g_printerr("WARNING: Skipping FS node %s because node key wasn't found\n", node_h);
-    return NULL;
+    g_printerr("WARNING: Skipping FS node %s because node key wasn't found\n", d->handle);
+    return FALSE;
   }
 
+  return TRUE;
+}
+
+// decrypt node key and attributes, doesn't touch the session
+static gboolean mega_node_data_decrypt(mega_node_data* d)
+{
+  // special nodes are not encrypted
+  if (!d->encrypted_key)
+    return TRUE;
+
   // keys longer than 45 chars are RSA keys
-  if (strlen(encrypted_node_key) >= 46)
+  if (strlen(d->encrypted_key) >= 46)
   {
-    g_printerr("WARNING: Skipping FS node %s because it has RSA key\n", node_h);
-    return NULL;
+    g_printerr("WARNING: Skipping FS node %s because it has RSA key\n", d->handle);
+    return FALSE;
   }
 
   // decrypt node key
-  gsize node_key_len = 0;
-  gc_free guchar* node_key = b64_aes128_decrypt(encrypted_node_key, node_share_key, &node_key_len);
-  if (!node_key)
+  d->key = b64_aes128_decrypt(d->encrypted_key, d->share_key, &d->key_len);
+  if (!d->key)
   {
-    g_printerr("WARNING: Skipping FS node %s because key can't be decrypted %s\n", node_h, encrypted_node_key);
-    return NULL;
+    g_printerr("WARNING: Skipping FS node %s because key can't be decrypted %s\n", d->handle, d->encrypted_key);
+    return FALSE;
   }
 
-  if (node_t == MEGA_NODE_FILE && node_key_len != 32)
+  if (d->type == MEGA_NODE_FILE && d->key_len != 32)
   {
-    g_printerr("WARNING: Skipping FS node %s because file key doesn't have 32 bytes\n", node_h);
-    return NULL;
+    g_printerr("WARNING: Skipping FS node %s because file key doesn't have 32 bytes\n", d->handle);
+    return FALSE;
   }
 
-  if (node_t == MEGA_NODE_FOLDER && node_key_len != 16)
+  if (d->type == MEGA_NODE_FOLDER && d->key_len != 16)
   {
-    g_printerr("WARNING: Skipping FS node %s because folder key doesn't have 16 bytes\n", node_h);
-    return NULL;
+    g_printerr("WARNING: Skipping FS node %s because folder key doesn't have 16 bytes\n", d->handle);
+    return FALSE;
   }
 
   // decrypt attributes with node key
   guchar aes_key[16];
-  if (node_t == MEGA_NODE_FILE)
-    unpack_node_key(node_key, aes_key, NULL, NULL);
+  if (d->type == MEGA_NODE_FILE)
+    unpack_node_key(d->key, aes_key, NULL, NULL);
   else
-    memcpy(aes_key, node_key, 16);
+    memcpy(aes_key, d->key, 16);
 
-  gc_free gchar* node_name = NULL;
-  if (!decrypt_node_attrs(node_a, aes_key, &node_name))
+  if (!decrypt_node_attrs(d->attrs, aes_key, &d->name))
   {
-    g_printerr("WARNING: Skipping FS node %s because it has malformed attributes\n", node_h);
-    return NULL;
+    g_printerr("WARNING: Skipping FS node %s because it has malformed attributes\n", d->handle);
+    return FALSE;
   }
 
-  if (!node_name)
+  if (!d->name)
   {
-    g_printerr("WARNING: Skipping FS node %s because it is missing name\n", node_h);
-    return NULL;
+    g_printerr("WARNING: Skipping FS node %s because it is missing name\n", d->handle);
+    return FALSE;
   }
 
   // check for invalid characters in the name
 #ifdef G_OS_WIN32
-  if (strpbrk(node_name, "/\\<>:\"|?*") || !strcmp(node_name, ".") || !strcmp(node_name, ".."))
+  if (strpbrk(d->name, "/\\<>:\"|?*") || !strcmp(d->name, ".") || !strcmp(d->name, ".."))
 #else
-  if (strpbrk(node_name, "/") || !strcmp(node_name, ".") || !strcmp(node_name, "..")) 
+  if (strpbrk(d->name, "/") || !strcmp(d->name, ".") || !strcmp(d->name, "..")) 
 #endif
   {
-    g_printerr("WARNING: Skipping FS node %s because it's name is invalid '%s'\n", node_h, node_name);
-    return NULL;
+    g_printerr("WARNING: Skipping FS node %s because it's name is invalid '%s'\n", d->handle, d->name);
+    return FALSE;
   }
 
-#define TAKE(n) (tmp = n, n = NULL, tmp)
-
-  mega_node* n = g_new0(mega_node, 1);
-
-  n->s = s;
-  n->name = TAKE(node_name);
-  n->handle = TAKE(node_h);
-  n->parent_handle = TAKE(node_p);
-  n->user_handle = TAKE(node_u);
-  n->su_handle = TAKE(node_su);
-  n->key_len = node_key_len;
-  n->key = TAKE(node_key);
-  n->size = node_s;
-  n->timestamp = node_ts;
-  n->type = node_t;
-
-  return n;
+  return TRUE;
 }
 
-// }}}
-// {{{ mega_node_parse_user
-
-static mega_node* mega_node_parse_user(mega_session* s, const gchar* node)
+// move parsed node to the session's node store
+static mega_node* mega_node_data_store(mega_session* s, mega_node_data* d)
 {
-  gc_free gchar* node_u = s_json_get_member_string(node, "u");
-  gc_free gchar* node_m = s_json_get_member_string(node, "m");
-  gint64 node_ts = s_json_get_member_int(node, "ts", 0);
-
-  // sanity check parsed values
-  if (!node_u || strlen(node_u) == 0)
-    return NULL;
+  mega_node* n = mega_node_new(s);
 
-  if (!node_m || strlen(node_m) == 0)
-    return NULL;
+  n->handle = node_store_intern(s->nodes, d->handle);
+  n->timestamp = d->timestamp;
+  n->type = d->type;
 
-  mega_node* n = g_new0(mega_node, 1);
-  n->s = s;
-  n->name = node_m;
-  n->handle = node_u;
-  n->parent_handle = g_strdup("NETWORK");
-  n->user_handle = g_strdup(node_u);
-  n->timestamp = node_ts;
-  n->type = MEGA_NODE_CONTACT;
+  // special nodes have fixed names, no parent and no key
+  if (!d->encrypted_key)
+  {
+    n->name = node_store_intern(s->nodes, d->name);
+    return n;
+  }
 
-  node_u = node_m = NULL;
+  n->name = node_store_strdup(s->nodes, d->name);
+  n->parent_handle = node_store_intern(s->nodes, d->parent_handle);
+  n->user_handle = node_store_intern(s->nodes, d->user_handle);
+  n->su_handle = node_store_intern(s->nodes, d->su_handle);
+  n->key_len = d->key_len;
+  n->key = node_store_memdup(s->nodes, d->key, d->key_len);
+  n->size = d->size;
 
   return n;
 }
 
-// }}}
-// {{{ mega_node_is_writable
-
-gboolean mega_node_is_writable(mega_session* s, mega_node* n)
+static mega_node* mega_node_parse_tape(mega_session* s, SJsonTape* tape, gint node)
 {
-  g_return_val_if_fail(n != NULL, FALSE);
+  mega_node_data d = { NULL };
+  mega_node* n = NULL;
 
-  return n->type == MEGA_NODE_CONTACT 
-    || ((n->type == MEGA_NODE_FILE || n->type == MEGA_NODE_FOLDER) && !strcmp(s->user_handle, n->user_handle))
-    || n->type == MEGA_NODE_ROOT
-    || n->type == MEGA_NODE_NETWORK
-    || n->type == MEGA_NODE_TRASH;
-}
+  if (mega_node_data_load(s, tape, node, &d) && mega_node_data_decrypt(&d))
+    n = mega_node_data_store(s, &d);
 
-// }}}
-// {{{ mega_node_free
+  mega_node_data_clear(&d);
+  return n;
+}
 
-static void mega_node_free(mega_node* n)
+static mega_node* mega_node_parse(mega_session* s, const gchar* node)
 {
-  if (n)
+  gc_s_json_tape_free SJsonTape* tape = s_json_tape_new(node);
+  if (!tape || s_json_tape_get_type(tape, 0) != S_JSON_TYPE_OBJECT)
   {
-    g_free(n->name);
-    g_free(n->handle);
-    g_free(n->parent_handle);
-    g_free(n->user_handle);
-    g_free(n->su_handle);
-    g_free(n->key);
-    g_free(n->link);
-    memset(n, 0, sizeof(mega_node));
-    g_free(n);
+    g_printerr("WARNING: Skipping invalid FS node\n");
+    return NULL;
   }
+
+  return mega_node_parse_tape(s, tape, 0);
+}
+
+// check whether mega_node_parse_tape would find a key for the node with
+// share keys known so far
+static gboolean mega_node_key_known(mega_session* s, SJsonTape* tape, gint node)
+{
+  gint node_t = s_json_tape_get_member_int(tape, node, "t", -1);
+  gc_free gchar* node_k = s_json_tape_get_member_string(tape, node, "k");
+  gc_free gchar* node_sk = s_json_tape_get_member_string(tape, node, "sk");
+  gint i;
+
+  if (node_t != MEGA_NODE_FOLDER && node_t != MEGA_NODE_FILE)
+    return TRUE;
+
+  if (!node_k || (node_sk && strlen(node_sk) > 0))
+    return TRUE;
+
+  gc_strfreev gchar** parts = g_strsplit(node_k, "/", 0);
+  for (i = 0; parts[i]; i++)
+  {
+    gchar* key_value = strchr(parts[i], ':');
+    if (!key_value)
+      continue;
+
+    *key_value = '\0';
+
+    if ((s->user_handle && !strcmp(s->user_handle, parts[i])) || g_hash_table_lookup(s->share_keys, parts[i]))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+// }}}
+// {{{ mega_node_parse_user
+
+static mega_node* mega_node_parse_user(mega_session* s, SJsonTape* tape, gint node)
+{
+  gc_free gchar* node_u = s_json_tape_get_member_string(tape, node, "u");
+  gc_free gchar* node_m = s_json_tape_get_member_string(tape, node, "m");
+  gint64 node_ts = s_json_tape_get_member_int(tape, node, "ts", 0);
+
+  // sanity check parsed values
+  if (!node_u || strlen(node_u) == 0)
+    return NULL;
+
+  if (!node_m || strlen(node_m) == 0)
+    return NULL;
+
+  mega_node* n = mega_node_new(s);
+  n->name = node_store_strdup(s->nodes, node_m);
+  n->handle = node_store_intern(s->nodes, node_u);
+  n->parent_handle = node_store_intern(s->nodes, "NETWORK");
+  n->user_handle = n->handle;
+  n->timestamp = node_ts;
+  n->type = MEGA_NODE_CONTACT;
+
+  return n;
+}
+
+// }}}
+// {{{ mega_node_is_writable
+
+gboolean mega_node_is_writable(mega_session* s, mega_node* n)
+{
+  g_return_val_if_fail(n != NULL, FALSE);
+
+  return n->type == MEGA_NODE_CONTACT 
+    || ((n->type == MEGA_NODE_FILE || n->type == MEGA_NODE_FOLDER) && !strcmp(s->user_handle, n->user_handle))
+    || n->type == MEGA_NODE_ROOT
+    || n->type == MEGA_NODE_NETWORK
+    || n->type == MEGA_NODE_TRASH;
+}
+
+// }}}
+// {{{ mega_node_free
+
+static void mega_node_free(mega_session* s, mega_node* n)
+{
+  if (n)
+    node_store_release(s->nodes, n);
 }
 
 // }}}
@@ -1914,6 +2867,13 @@ mega_session* mega_session_new(void)
   s->rid = make_request_id();
 
   s->share_keys = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  s->nodes = node_store_new();
+  s->fs_nodes = g_ptr_array_new();
+  s->cache_dirty = TRUE;
+  s->cache_log = g_byte_array_new();
+  s->path_index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  s->children_index = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_ptr_array_unref);
+  s->transfer_connections = TRANSFER_CONNECTIONS;
 
   return s;
 }
@@ -1926,8 +2886,13 @@ void mega_session_free(mega_session* s)
   if (s)
   {
     g_object_unref(s->http);
-    g_slist_free_full(s->fs_nodes, (GDestroyNotify)mega_node_free);
+    g_ptr_array_unref(s->fs_nodes);
+    node_store_free(s->nodes);
+    g_byte_array_unref(s->cache_log);
     g_hash_table_destroy(s->share_keys);
+    g_hash_table_destroy(s->path_index);
+    g_hash_table_destroy(s->children_index);
+    g_free(s->sn);
     g_free(s->sid);
     g_free(s->rid);
     g_free(s->password_key);
@@ -1963,14 +2928,152 @@ void mega_session_enable_previews(mega_session* s, gboolean enable)
 }
 
 // }}}
+// {{{ mega_session_set_connections
+
+void mega_session_set_connections(mega_session* s, gint connections)
+{
+  g_return_if_fail(s != NULL);
+
+  s->transfer_connections = CLAMP(connections, 1, 16);
+}
+
+// }}}
+// {{{ mega_session_enable_resume
+
+void mega_session_enable_resume(mega_session* s, gboolean enable)
+{
+  g_return_if_fail(s != NULL);
+
+  s->resume_transfers = enable;
+}
+
+// }}}
+// {{{ mega_session_enable_key_cache
+
+void mega_session_enable_key_cache(mega_session* s, gboolean enable)
+{
+  g_return_if_fail(s != NULL);
+
+  s->cache_password_key = enable;
+}
+
+// }}}
+// {{{ file_set_contents_private
+
+// like g_file_set_contents, but the file is created private to the user
+// before anything is written to it
+static gboolean file_set_contents_private(const gchar* path, const gchar* contents, gsize len, GError** err)
+{
+  gc_object_unref GFile* file = g_file_new_for_path(path);
+  gc_object_unref GFileOutputStream* stream = g_file_replace(file, NULL, FALSE, G_FILE_CREATE_PRIVATE | G_FILE_CREATE_REPLACE_DESTINATION, NULL, err);
+  if (!stream)
+    return FALSE;
+
+  if (!g_output_stream_write_all(G_OUTPUT_STREAM(stream), contents, len, NULL, NULL, err) || !g_output_stream_close(G_OUTPUT_STREAM(stream), NULL, err))
+  {
+    g_file_delete(file, NULL, NULL);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// }}}
+
+// {{{ password key cache
+
+// Password key derivation is slow on purpose. When enabled, derived key is
+// kept in the user's runtime directory (it's private to the user and removed
+// on logout), so that tools started in quick succession don't have to
+// derive it again. Nothing derived from the password is stored with the key,
+// that would allow fast offline password guessing. Cached key is dropped if
+// it doesn't work anymore.
+
+static gchar* get_key_cache_path(const gchar* un)
+{
+  const gchar* runtime_dir = g_getenv("XDG_RUNTIME_DIR");
+
+  // g_get_user_runtime_dir falls back to a directory that is not cleaned on
+  // logout, don't store the key there
+  if (!runtime_dir || !*runtime_dir)
+    return NULL;
+
+  gc_free gchar* un_lower = g_ascii_strdown(un, -1);
+  gc_checksum_free GChecksum* cs = g_checksum_new(G_CHECKSUM_SHA1);
+  g_checksum_update(cs, un_lower, -1);
+  gc_free gchar* filename = g_strconcat(g_checksum_get_string(cs), ".megatools.key", NULL);
+
+  return g_build_filename(runtime_dir, filename, NULL);
+}
+
+static guchar* key_cache_lookup(mega_session* s, const gchar* un)
+{
+  gchar* data = NULL;
+  gsize len = 0;
+
+  if (!s->cache_password_key)
+    return NULL;
+
+  gc_free gchar* path = get_key_cache_path(un);
+  if (!path || !g_file_get_contents(path, &data, &len, NULL))
+    return NULL;
+
+  if (len != 16)
+  {
+    g_free(data);
+    return NULL;
+  }
+
+  return (guchar*)data;
+}
+
+// call only after the key was verified to be correct
+static void key_cache_store(mega_session* s, const gchar* un, const guchar* key)
+{
+  if (!s->cache_password_key)
+    return;
+
+  gc_free gchar* path = get_key_cache_path(un);
+  if (path)
+    file_set_contents_private(path, (const gchar*)key, 16, NULL);
+}
+
+static void key_cache_remove(mega_session* s, const gchar* un)
+{
+  gc_free gchar* path = get_key_cache_path(un);
+
+  if (path)
+    g_unlink(path);
+}
+
+// password is not needed to open the session if this returns TRUE, unless
+// the remembered key turns out to be outdated
+gboolean mega_session_has_remembered_key(mega_session* s, const gchar* un)
+{
+  g_return_val_if_fail(s != NULL, FALSE);
+  g_return_val_if_fail(un != NULL, FALSE);
+
+  gc_free guchar* key = key_cache_lookup(s, un);
+
+  return key != NULL;
+}
 
+static gboolean key_cache_need_password(const gchar* pw, GError** err)
+{
+  if (pw)
+    return TRUE;
+
+  g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Remembered key can't be used, password is needed");
+  return FALSE;
+}
+
+// }}}
 // {{{ mega_session_open_exp_folder
 
 gboolean mega_session_open_exp_folder(mega_session* s, const gchar* n, const gchar* key, GError** err)
 {
   GError* local_err = NULL;
   gsize len, i, l;
-  GSList* list = NULL;
 
   g_return_val_if_fail(s != NULL, FALSE);
   g_return_val_if_fail(n != NULL, FALSE);
@@ -2018,17 +3121,15 @@ gboolean mega_session_open_exp_folder(mega_session* s, const gchar* n, const gch
         {
           if (i == 1)
           {
-            g_free(n->parent_handle);
             n->parent_handle = NULL;
           }
 
-          list = g_slist_prepend(list, n);
+          g_ptr_array_add(s->fs_nodes, n);
         }
       }
     }
   }
 
-  s->fs_nodes = g_slist_reverse(list);
   update_pathmap(s);
 
   return TRUE;
@@ -2037,23 +3138,16 @@ gboolean mega_session_open_exp_folder(mega_session* s, const gchar* n, const gch
 // }}}
 // {{{ mega_session_open
 
-gboolean mega_session_open(mega_session* s, const gchar* un, const gchar* pw, const gchar* sid, GError** err)
+// password_key is taken over by the session
+static gboolean session_open_with_key(mega_session* s, const gchar* un, guchar* password_key, const gchar* sid, GError** err)
 {
   GError* local_err = NULL;
   gboolean is_loggedin = FALSE;
 
-  g_return_val_if_fail(s != NULL, FALSE);
-  g_return_val_if_fail(un != NULL, FALSE);
-  g_return_val_if_fail(pw != NULL, FALSE);
-  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
-
   mega_session_close(s);
 
-  //g_print("%s %s %s\n", un, pw, sid);
-
-  // make password key
   g_free(s->password_key);
-  s->password_key = make_password_key(pw);
+  s->password_key = password_key;
 
   // if we have existing session id, just check with the server if session is
   // active, and download keys and user info
@@ -2126,6 +3220,39 @@ gboolean mega_session_open(mega_session* s, const gchar* un, const gchar* pw, co
   return TRUE;
 }
 
+gboolean mega_session_open(mega_session* s, const gchar* un, const gchar* pw, const gchar* sid, GError** err)
+{
+  GError* local_err = NULL;
+
+  g_return_val_if_fail(s != NULL, FALSE);
+  g_return_val_if_fail(un != NULL, FALSE);
+  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+  // try remembered password key first, it may be outdated
+  guchar* cached_key = key_cache_lookup(s, un);
+  if (cached_key)
+  {
+    if (session_open_with_key(s, un, cached_key, sid, NULL))
+      return TRUE;
+
+    key_cache_remove(s, un);
+  }
+
+  if (!key_cache_need_password(pw, err))
+    return FALSE;
+
+  if (!session_open_with_key(s, un, make_password_key(pw), sid, &local_err))
+  {
+    g_propagate_error(err, local_err);
+    return FALSE;
+  }
+
+  // password key is good
+  key_cache_store(s, un, s->password_key);
+
+  return TRUE;
+}
+
 // }}}
 // {{{ mega_session_close
 
@@ -2140,10 +3267,16 @@ void mega_session_close(mega_session* s)
   g_free(s->user_handle);
   g_free(s->user_name);
   g_free(s->user_email);
+  g_free(s->sn);
 
-  g_slist_free_full(s->fs_nodes, (GDestroyNotify)mega_node_free);
+  g_ptr_array_set_size(s->fs_nodes, 0);
+  node_store_free(s->nodes);
+  s->nodes = node_store_new();
+  cache_invalidate(s);
 
   g_hash_table_remove_all(s->share_keys);
+  g_hash_table_remove_all(s->path_index);
+  g_hash_table_remove_all(s->children_index);
 
   s->password_key = NULL;
   s->master_key = NULL;
@@ -2151,7 +3284,7 @@ void mega_session_close(mega_session* s)
   s->user_handle = NULL;
   s->user_email = NULL;
   s->user_name = NULL;
-  s->fs_nodes = NULL;
+  s->sn = NULL;
   s->last_refresh = 0;
 
   s->status_callback = NULL;
@@ -2178,6 +3311,8 @@ gboolean mega_session_get_user(mega_session* s, GError** err)
   g_return_val_if_fail(s->sid != NULL, FALSE);
   g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
 
+  cache_invalidate(s);
+
   // prepare request
   gc_free gchar* user_node = api_call(s, 'o', NULL, &local_err, "[{a:ug}]");
   if (!user_node)
@@ -2238,19 +3373,175 @@ gboolean mega_session_get_user(mega_session* s, GError** err)
 // }}}
 // {{{ mega_session_refresh
 
+// Filesystem nodes are parsed as they arrive, the response for big accounts
+// can be hundreds of megabytes. Share keys from 'ok' come after 'f' in the
+// response, so nodes that need them are put aside until the end.
+//
+// Keys are looked up on the main thread in the response order (nodes may add
+// share keys for their subtree), decryption of node keys and attributes
+// runs on a pool of threads and results are stored in batches, again in the
+// response order.
+
+#define REFRESH_BATCH_SIZE 4096
+
+typedef struct
+{
+  mega_session* s;
+  GPtrArray* nodes;
+  GPtrArray* deferred;
+
+  GThreadPool* pool;
+  GPtrArray* jobs;
+  GMutex lock;
+  GCond cond;
+  guint pending;
+} refresh_data;
+
+typedef struct
+{
+  mega_node_data data;
+  gboolean ok;
+} refresh_job;
+
+static void refresh_job_free(refresh_job* job)
+{
+  mega_node_data_clear(&job->data);
+  g_free(job);
+}
+
+static void refresh_job_run(refresh_job* job, refresh_data* data)
+{
+  job->ok = mega_node_data_decrypt(&job->data);
+
+  g_mutex_lock(&data->lock);
+  data->pending--;
+  g_cond_signal(&data->cond);
+  g_mutex_unlock(&data->lock);
+}
+
+static void refresh_data_init(refresh_data* data, mega_session* s)
+{
+  gint threads = get_worker_threads();
+
+  memset(data, 0, sizeof(*data));
+  data->s = s;
+  data->nodes = g_ptr_array_new();
+  data->deferred = g_ptr_array_new_with_free_func(g_free);
+  data->jobs = g_ptr_array_new_with_free_func((GDestroyNotify)refresh_job_free);
+  g_mutex_init(&data->lock);
+  g_cond_init(&data->cond);
+
+  if (threads > 1)
+    data->pool = g_thread_pool_new((GFunc)refresh_job_run, data, threads, FALSE, NULL);
+}
+
+// wait for the decryption of queued nodes and put them to the node store
+static void refresh_data_flush(refresh_data* data)
+{
+  guint i;
+
+  g_mutex_lock(&data->lock);
+  while (data->pending > 0)
+    g_cond_wait(&data->cond, &data->lock);
+  g_mutex_unlock(&data->lock);
+
+  for (i = 0; i < data->jobs->len; i++)
+  {
+    refresh_job* job = data->jobs->pdata[i];
+
+    if (job->ok)
+      g_ptr_array_add(data->nodes, mega_node_data_store(data->s, &job->data));
+  }
+
+  g_ptr_array_set_size(data->jobs, 0);
+}
+
+static void refresh_data_clear(refresh_data* data)
+{
+  refresh_data_flush(data);
+
+  if (data->pool)
+    g_thread_pool_free(data->pool, FALSE, TRUE);
+
+  g_ptr_array_unref(data->jobs);
+  g_ptr_array_unref(data->deferred);
+  g_mutex_clear(&data->lock);
+  g_cond_clear(&data->cond);
+}
+
+static gboolean refresh_add_node(const gchar* f, refresh_data* data)
+{
+  mega_session* s = data->s;
+
+  if (mega_debug & MEGA_DEBUG_FS)
+    print_node(f, "FS: ");
+
+  gc_s_json_tape_free SJsonTape* tape = s_json_tape_new(f);
+  if (!tape || s_json_tape_get_type(tape, 0) != S_JSON_TYPE_OBJECT)
+    return TRUE;
+
+  if (!mega_node_key_known(s, tape, 0))
+  {
+    g_ptr_array_add(data->deferred, g_strdup(f));
+    return TRUE;
+  }
+
+  refresh_job* job = g_new0(refresh_job, 1);
+  if (!mega_node_data_load(s, tape, 0, &job->data))
+  {
+    refresh_job_free(job);
+    return TRUE;
+  }
+
+  g_ptr_array_add(data->jobs, job);
+
+  if (data->pool)
+  {
+    g_mutex_lock(&data->lock);
+    data->pending++;
+    g_mutex_unlock(&data->lock);
+
+    g_thread_pool_push(data->pool, job, NULL);
+  }
+  else
+    job->ok = mega_node_data_decrypt(&job->data);
+
+  if (data->jobs->len >= REFRESH_BATCH_SIZE)
+    refresh_data_flush(data);
+
+  return TRUE;
+}
+
 gboolean mega_session_refresh(mega_session* s, GError** err)
 {
   GError* local_err = NULL;
-  GSList* list = NULL;
-  gint i, l;
+  GPtrArray* nodes;
+  guint i;
 
   g_return_val_if_fail(s != NULL, FALSE);
   g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
 
+  cache_invalidate(s);
+
+  // new nodes go to a fresh store, old one is dropped as a whole
+  node_store* old_nodes = s->nodes;
+  s->nodes = node_store_new();
+
+  refresh_data data;
+  refresh_data_init(&data, s);
+
   // prepare request
-  gc_free gchar* f_node = api_call(s, 'o', NULL, &local_err, "[{a:f, c:1}]");
+  gc_free gchar* f_node = api_call_stream(s, 'o', "$[0].f", (SJsonStreamFunc)refresh_add_node, &data, NULL, &local_err, "[{a:f, c:1}]");
+
+  refresh_data_flush(&data);
+  nodes = data.nodes;
+
   if (!f_node)
   {
+    refresh_data_clear(&data);
+    g_ptr_array_unref(nodes);
+    node_store_free(s->nodes);
+    s->nodes = old_nodes;
     g_propagate_error(err, local_err);
     return FALSE;
   }
@@ -2258,21 +3549,32 @@ gboolean mega_session_refresh(mega_session* s, GError** err)
   if (mega_debug & MEGA_DEBUG_FS)
     print_node(f_node, "FS: ");
 
+  // index the rest of the response once, it is walked several times below
+  gc_s_json_tape_free SJsonTape* tape = s_json_tape_new(f_node);
+  if (!tape || s_json_tape_get_type(tape, 0) != S_JSON_TYPE_OBJECT || s_json_tape_get_type(tape, s_json_tape_get_member(tape, 0, "f")) != S_JSON_TYPE_ARRAY)
+  {
+    refresh_data_clear(&data);
+    g_ptr_array_unref(nodes);
+    node_store_free(s->nodes);
+    s->nodes = old_nodes;
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Remote filesystem 'f' node is invalid");
+    return FALSE;
+  }
+
   // process 'ok' array
-  const gchar* ok_node = s_json_get_member(f_node, "ok");
-  if (ok_node && s_json_get_type(ok_node) == S_JSON_TYPE_ARRAY)
+  gint ok_node = s_json_tape_get_member(tape, 0, "ok");
+  if (s_json_tape_get_type(tape, ok_node) == S_JSON_TYPE_ARRAY)
   {
-    gc_free gchar** oks = s_json_get_elements(ok_node);
+    gint ok;
 
-    for (i = 0, l = g_strv_length(oks); i < l; i++)
+    for (ok = s_json_tape_get_first(tape, ok_node); ok >= 0; ok = s_json_tape_get_next(tape, ok))
     {
-      const gchar* ok = oks[i];
-      if (s_json_get_type(ok) != S_JSON_TYPE_OBJECT)
+      if (s_json_tape_get_type(tape, ok) != S_JSON_TYPE_OBJECT)
         continue;
 
-      gc_free gchar* ok_h = s_json_get_member_string(ok, "h");    // h.8 
-      gc_free gchar* ok_ha = s_json_get_member_string(ok, "ha");  // b64(aes(h.8 h.8, master_key))
-      gc_free gchar* ok_k = s_json_get_member_string(ok, "k");    // b64(aes(share_key_for_h, master_key))
+      gc_free gchar* ok_h = s_json_tape_get_member_string(tape, ok, "h");    // h.8 
+      gc_free gchar* ok_ha = s_json_tape_get_member_string(tape, ok, "ha");  // b64(aes(h.8 h.8, master_key))
+      gc_free gchar* ok_k = s_json_tape_get_member_string(tape, ok, "k");    // b64(aes(share_key_for_h, master_key))
 
       if (!ok_h || !ok_ha ||!ok_k)
       {
@@ -2294,135 +3596,417 @@ gboolean mega_session_refresh(mega_session* s, GError** err)
     }
   }
 
-  // process 'f' array
-  const gchar* ff_node = s_json_get_member(f_node, "f");
-  if (!ff_node || s_json_get_type(ff_node) != S_JSON_TYPE_ARRAY)
-  {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Remote filesystem 'f' node is invalid");
-    return FALSE;
-  }
-
-  gc_free gchar** ff_arr = s_json_get_elements(ff_node);
-  for (i = 0, l = g_strv_length(ff_arr); i < l; i++)
+  // nodes whose keys weren't known when they arrived
+  for (i = 0; i < data.deferred->len; i++)
   {
-    const gchar* f = ff_arr[i];
-    if (s_json_get_type(f) != S_JSON_TYPE_OBJECT)
-      continue;
-
-    mega_node* n = mega_node_parse(s, f);
+    mega_node* n = mega_node_parse(s, data.deferred->pdata[i]);
     if (n)
-      list = g_slist_prepend(list, n);
+      g_ptr_array_add(nodes, n);
   }
 
+  refresh_data_clear(&data);
+
   // import special root node for contacts
-  mega_node* n = g_new0(mega_node, 1);
-  n->s = s;
-  n->name = g_strdup("Contacts");
-  n->handle = g_strdup("NETWORK");
+  mega_node* n = mega_node_new(s);
+  n->name = node_store_intern(s->nodes, "Contacts");
+  n->handle = node_store_intern(s->nodes, "NETWORK");
   n->type = MEGA_NODE_NETWORK;
-  list = g_slist_prepend(list, n);
+  g_ptr_array_add(nodes, n);
 
   // process 'u' array
-  const gchar* u_node = s_json_get_member(f_node, "u");
-  if (u_node && s_json_get_type(u_node) == S_JSON_TYPE_ARRAY)
+  gint u_node = s_json_tape_get_member(tape, 0, "u");
+  if (s_json_tape_get_type(tape, u_node) == S_JSON_TYPE_ARRAY)
   {
-    gc_free gchar** u_arr = s_json_get_elements(u_node);
-    for (i = 0, l = g_strv_length(u_arr); i < l; i++)
+    gint u;
+
+    for (u = s_json_tape_get_first(tape, u_node); u >= 0; u = s_json_tape_get_next(tape, u))
     {
-      const gchar* u = u_arr[i];
-      if (s_json_get_type(u) != S_JSON_TYPE_OBJECT)
+      if (s_json_tape_get_type(tape, u) != S_JSON_TYPE_OBJECT)
         continue;
 
-      gint64 u_c = s_json_get_member_int(u, "c", 0);
+      gint64 u_c = s_json_tape_get_member_int(tape, u, "c", 0);
 
       // skip self and removed
       if (u_c != 1)
         continue;
 
-      mega_node* n = mega_node_parse_user(s, u);
+      mega_node* n = mega_node_parse_user(s, tape, u);
       if (n) 
-        list = g_slist_prepend(list, n);
+        g_ptr_array_add(nodes, n);
     }
   }
 
   // replace existing nodes
-  g_slist_free_full(s->fs_nodes, (GDestroyNotify)mega_node_free);
-  s->fs_nodes = g_slist_reverse(list);
+  g_ptr_array_unref(s->fs_nodes);
+  node_store_free(old_nodes);
+  s->fs_nodes = nodes;
 
   update_pathmap(s);
 
+  // remember where to continue with incremental updates
+  g_free(s->sn);
+  s->sn = s_json_tape_get_member_string(tape, 0, "sn");
+
   s->last_refresh = time(NULL);
 
   return TRUE;
 }
 
 // }}}
-// {{{ mega_session_addlinks
+// {{{ mega_session_sync
 
-gboolean mega_session_addlinks(mega_session* s, GSList* nodes, GError** err)
+// Incremental update of the filesystem using server-client action packets.
+// Packets since s->sn are fetched from the sc channel and applied to the
+// loaded nodes. Anything we can't apply results in a full refresh.
+
+struct _sync_data
 {
-  GError* local_err = NULL;
-  GSList* i;
-  gc_ptr_array_unref GPtrArray* rnodes = NULL;
+  GHashTable* handles;
+  GHashTable* deleted;
+  gboolean need_refresh;
+};
 
-  g_return_val_if_fail(s != NULL, FALSE);
-  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+// replace contents of an existing node, so that pointers to it stay valid
+static void sync_replace_node(mega_session* s, mega_node* old_node, mega_node* new_node)
+{
+  mega_node tmp = *old_node;
 
-  if (g_slist_length(nodes) == 0)
-    return TRUE;
+  *old_node = *new_node;
+  *new_node = tmp;
+
+  if (!old_node->link)
+  {
+    old_node->link = new_node->link;
+    new_node->link = NULL;
+  }
 
-  rnodes = g_ptr_array_sized_new(g_slist_length(nodes));
+  mega_node_free(s, new_node);
+}
 
-  // prepare request
-  SJsonGen *gen = s_json_gen_new();
-  s_json_gen_start_array(gen);
-  for (i = nodes; i; i = i->next)
+static void sync_add_node(mega_session* s, struct _sync_data* data, mega_node* n)
+{
+  mega_node* existing = g_hash_table_lookup(data->handles, n->handle);
+
+  // node was moved or deleted and recreated
+  g_hash_table_remove(data->deleted, n->handle);
+
+  if (existing)
   {
-    mega_node* n = i->data;
+    g_hash_table_remove(data->handles, existing->handle);
+    sync_replace_node(s, existing, n);
+    g_hash_table_insert(data->handles, existing->handle, existing);
+    cache_log_node(s, existing);
+  }
+  else
+  {
+    g_ptr_array_add(s->fs_nodes, n);
+    g_hash_table_insert(data->handles, n->handle, n);
+    cache_log_node(s, n);
+  }
+}
 
-    if (n->type == MEGA_NODE_FILE)
-    {
-      s_json_gen_start_object(gen);
-      s_json_gen_member_string(gen, "a", "l");
-      s_json_gen_member_string(gen, "n", n->handle);
-      s_json_gen_end_object(gen);
+static void sync_update_node(mega_session* s, struct _sync_data* data, const gchar* packet)
+{
+  gc_free gchar* handle = s_json_get_member_string(packet, "n");
+  gc_free gchar* at = s_json_get_member_string(packet, "at");
+  gint64 ts = s_json_get_member_int(packet, "ts", 0);
+  mega_node* n;
+
+  n = handle ? g_hash_table_lookup(data->handles, handle) : NULL;
+  if (!n)
+    return;
 
-      g_ptr_array_add(rnodes, n);
+  if (ts > 0)
+    n->timestamp = ts;
+
+  if (at && n->key)
+  {
+    guchar aes_key[16];
+    gchar* name = NULL;
+
+    if (n->type == MEGA_NODE_FILE && n->key_len == 32)
+      unpack_node_key(n->key, aes_key, NULL, NULL);
+    else if (n->key_len == 16)
+      memcpy(aes_key, n->key, 16);
+    else
+    {
+      data->need_refresh = TRUE;
+      return;
     }
+
+    if (decrypt_node_attrs(at, aes_key, &name) && name)
+      n->name = node_store_strdup(s->nodes, name);
+    else
+      data->need_refresh = TRUE;
+
+    g_free(name);
   }
-  s_json_gen_end_array(gen);
-  gc_free gchar *request = s_json_gen_done(gen);
 
-  // perform request
-  gc_free gchar* response = api_request(s, request, &local_err);
+  cache_log_node(s, n);
+}
 
-  // process response
-  if (!response)
+static void sync_apply_packet(mega_session* s, struct _sync_data* data, const gchar* packet)
+{
+  gc_free gchar* a = s_json_get_member_string(packet, "a");
+
+  if (!a)
+    return;
+
+  if (!strcmp(a, "t"))
   {
-    g_propagate_prefixed_error(err, local_err, "API call 'l' failed: ");
-    return FALSE;
+    // new or moved nodes
+    const gchar* f_arr = s_json_path(packet, "$.t.f!array");
+    if (!f_arr)
+      return;
+
+    S_JSON_FOREACH_ELEMENT(f_arr, f)
+      if (s_json_get_type(f) != S_JSON_TYPE_OBJECT)
+        continue;
+
+      mega_node* n = mega_node_parse(s, f);
+      if (n)
+        sync_add_node(s, data, n);
+      else
+        data->need_refresh = TRUE;
+    S_JSON_FOREACH_END()
   }
-  
-  if (s_json_get_type(response) == S_JSON_TYPE_ARRAY)
+  else if (!strcmp(a, "d"))
+  {
+    gchar* handle = s_json_get_member_string(packet, "n");
+    if (handle)
+      g_hash_table_add(data->deleted, handle);
+  }
+  else if (!strcmp(a, "u"))
+  {
+    sync_update_node(s, data, packet);
+  }
+  else if (!strcmp(a, "s") || !strcmp(a, "s2") || !strcmp(a, "c") || !strcmp(a, "k"))
+  {
+    // shares, contacts and keys changed, these need a full refresh
+    data->need_refresh = TRUE;
+  }
+
+  // other packets (file attributes, user attributes, ...) don't affect the
+  // filesystem tree
+}
+
+static gboolean sync_is_deleted(mega_node* n, GHashTable* deleted)
+{
+  for (; n; n = n->parent)
+    if (g_hash_table_contains(deleted, n->handle))
+      return TRUE;
+
+  return FALSE;
+}
+
+// remove deleted nodes along with their subtrees
+static void sync_remove_deleted(mega_session* s, GHashTable* deleted)
+{
+  guint i, j;
+
+  if (g_hash_table_size(deleted) == 0)
+    return;
+
+  update_pathmap(s);
+
+  // nodes are freed only after all of them were checked, the check looks at
+  // their parents
+  gc_ptr_array_unref GPtrArray* removed = g_ptr_array_new();
+
+  for (i = 0, j = 0; i < s->fs_nodes->len; i++)
+  {
+    mega_node* n = s->fs_nodes->pdata[i];
+
+    if (sync_is_deleted(n, deleted))
+      g_ptr_array_add(removed, n);
+    else
+      s->fs_nodes->pdata[j++] = n;
+  }
+
+  g_ptr_array_set_size(s->fs_nodes, j);
+
+  for (i = 0; i < removed->len; i++)
+  {
+    cache_log_remove(s, removed->pdata[i]);
+    mega_node_free(s, removed->pdata[i]);
+  }
+}
+
+static gchar* sc_request(mega_session* s, GError** err)
+{
+  GError* local_err = NULL;
+  gc_free gchar* url = g_strdup_printf("https://eu.api.mega.co.nz/sc?sn=%s&%s=%s", s->sn, s->sid_param_name ? s->sid_param_name : "sid", s->sid);
+
+  api_rate_wait(s);
+
+  gc_string_free GString* res_str = mega_http_client_post_simple(s->http, url, "", 0, &local_err);
+  if (!res_str)
+  {
+    g_propagate_prefixed_error(err, local_err, "HTTP POST failed: ");
+    return NULL;
+  }
+
+  if (!s_json_is_valid(res_str->str))
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response JSON");
+    return NULL;
+  }
+
+  if (mega_debug & MEGA_DEBUG_API)
+    print_node(res_str->str, "<- SC: ");
+
+  return g_strdup(res_str->str);
+}
+
+gboolean mega_session_sync(mega_session* s, GError** err)
+{
+  GError* local_err = NULL;
+  struct _sync_data data;
+  gint retries = 0;
+  guint i;
+
+  g_return_val_if_fail(s != NULL, FALSE);
+  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+  if (!s->sn || !s->sid)
+    return mega_session_refresh(s, err);
+
+  memset(&data, 0, sizeof(data));
+  data.handles = g_hash_table_new(g_str_hash, g_str_equal);
+  data.deleted = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+  for (i = 0; i < s->fs_nodes->len; i++)
+  {
+    mega_node* n = s->fs_nodes->pdata[i];
+
+    g_hash_table_insert(data.handles, n->handle, n);
+  }
+
+  // fetch packets until the server tells us to wait for new ones
+  while (!data.need_refresh)
   {
-    gc_free gchar** nodes_arr = s_json_get_elements(response);
-    gint i, l = g_strv_length(nodes_arr);
+    gc_free gchar* response = sc_request(s, &local_err);
+    if (!response)
+      break;
 
-    if (l != rnodes->len)
+    // error code, ETOOMANY means that the sequence number is too old
+    if (s_json_get_type(response) == S_JSON_TYPE_NUMBER)
     {
-      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "API call 'l' results mismatch");
-      return FALSE;
+      gint v = s_json_get_int(response, 0);
+
+      api_rate_update(s, api_is_throttled(v));
+
+      // if the server keeps asking us to slow down, give up on packets and
+      // let the refresh below deal with it
+      if (api_is_throttled(v) && ++retries <= API_MAX_RETRIES)
+        continue;
+
+      data.need_refresh = TRUE;
+      break;
     }
 
-    for (i = 0; i < l; i++)
+    if (s_json_get_type(response) != S_JSON_TYPE_OBJECT)
     {
-      gchar* link = s_json_get_string(nodes_arr[i]);
+      g_set_error(&local_err, MEGA_ERROR, MEGA_ERROR_OTHER, "Unexpected response");
+      break;
+    }
 
-      mega_node* n = g_ptr_array_index(rnodes, i);
+    api_rate_update(s, FALSE);
+    retries = 0;
+
+    const gchar* packets = s_json_get_member(response, "a");
+    if (packets && s_json_get_type(packets) == S_JSON_TYPE_ARRAY)
+    {
+      S_JSON_FOREACH_ELEMENT(packets, packet)
+        if (s_json_get_type(packet) == S_JSON_TYPE_OBJECT)
+          sync_apply_packet(s, &data, packet);
+      S_JSON_FOREACH_END()
+    }
 
-      g_free(n->link);
-      n->link = link;
+    gchar* sn = s_json_get_member_string(response, "sn");
+    if (sn)
+    {
+      g_free(s->sn);
+      s->sn = sn;
     }
+
+    // we are up to date
+    if (s_json_get_member(response, "w") || !packets)
+      break;
+  }
+
+  g_hash_table_unref(data.handles);
+
+  if (local_err)
+  {
+    // keep already applied changes consistent
+    sync_remove_deleted(s, data.deleted);
+    g_hash_table_unref(data.deleted);
+    update_pathmap(s);
+    g_propagate_prefixed_error(err, local_err, "Can't fetch filesystem changes: ");
+    return FALSE;
+  }
+
+  sync_remove_deleted(s, data.deleted);
+  g_hash_table_unref(data.deleted);
+
+  if (data.need_refresh)
+    return mega_session_refresh(s, err);
+
+  update_pathmap(s);
+  s->last_refresh = time(NULL);
+  cache_log_state(s);
+
+  return TRUE;
+}
+
+// }}}
+// {{{ mega_session_is_stale
+
+gboolean mega_session_is_stale(mega_session* s, gint max_age)
+{
+  g_return_val_if_fail(s != NULL, TRUE);
+
+  return !s->last_refresh || s->last_refresh + max_age < time(NULL);
+}
+
+// }}}
+// {{{ mega_session_addlinks
+
+static void addlinks_done(mega_session* s, const gchar* result, GError* error, mega_node* n)
+{
+  // nodes that can't be exported are left without a link
+  if (error)
+    return;
+
+  gc_free gchar* link = s_json_get_string(result);
+  n->link = node_store_strdup(s->nodes, link);
+  cache_log_node(s, n);
+}
+
+gboolean mega_session_addlinks(mega_session* s, GSList* nodes, GError** err)
+{
+  GError* local_err = NULL;
+  GSList* i;
+  gc_api_batch_free api_batch* batch = NULL;
+
+  g_return_val_if_fail(s != NULL, FALSE);
+  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+  batch = api_batch_new(s);
+
+  for (i = nodes; i; i = i->next)
+  {
+    mega_node* n = i->data;
+
+    if (n->type == MEGA_NODE_FILE)
+      api_batch_add(batch, 's', (api_batch_fn)addlinks_done, n, "{a:l, n:%s}", n->handle);
+  }
+
+  if (!api_batch_flush(batch, &local_err))
+  {
+    g_propagate_prefixed_error(err, local_err, "API call 'l' failed: ");
+    return FALSE;
   }
 
   return TRUE;
@@ -2462,53 +4046,59 @@ mega_user_quota* mega_session_user_quota(mega_session* s, GError** err)
 GSList* mega_session_ls_all(mega_session* s)
 {
   GSList* list = NULL;
+  guint i;
 
   g_return_val_if_fail(s != NULL, NULL);
 
-  return g_slist_copy(s->fs_nodes);
+  for (i = s->fs_nodes->len; i > 0; i--)
+    list = g_slist_prepend(list, s->fs_nodes->pdata[i - 1]);
+
+  return list;
 }
 
 // }}}
 // {{{ mega_session_ls
 
-struct _ls_data
+static void ls_add_children(mega_session* s, mega_node* dir, gboolean recursive, GSList** list)
 {
-  GSList* list;
-  gchar* path;
-  gboolean recursive;
-};
+  GPtrArray* children = g_hash_table_lookup(s->children_index, dir);
+  guint i;
 
-static void _ls(mega_node* n, struct _ls_data* data)
-{
-  gchar path[4096];
-  if (mega_node_get_path(n, path, sizeof(path)))
+  if (!children)
+    return;
+
+  for (i = 0; i < children->len; i++)
   {
-    if (g_str_has_prefix(path, data->path) && (data->recursive || !strchr(path + strlen(data->path), '/')))
-      data->list = g_slist_prepend(data->list, n);
+    mega_node* n = children->pdata[i];
+
+    *list = g_slist_prepend(*list, n);
+
+    if (recursive)
+      ls_add_children(s, n, TRUE, list);
   }
 }
 
 // free gslist, not the data
 GSList* mega_session_ls(mega_session* s, const gchar* path, gboolean recursive)
 {
-  struct _ls_data data;
+  GSList* list = NULL;
+  mega_node* dir = NULL;
 
   g_return_val_if_fail(s != NULL, NULL);
   g_return_val_if_fail(path != NULL, NULL);
 
   gc_free gchar* tmp = path_simplify(path);
 
-  if (!strcmp(tmp, "/"))
-    data.path = g_strdup("/");
-  else
-    data.path = g_strdup_printf("%s/", tmp);
-  data.recursive = recursive;
-  data.list = NULL;
+  if (strcmp(tmp, "/"))
+  {
+    dir = mega_session_stat(s, tmp);
+    if (!dir)
+      return NULL;
+  }
 
-  g_slist_foreach(s->fs_nodes, (GFunc)_ls, &data);
+  ls_add_children(s, dir, recursive, &list);
 
-  g_free(data.path);
-  return data.list;
+  return list;
 }
 
 // }}}
@@ -2520,21 +4110,24 @@ mega_node* mega_session_stat(mega_session* s, const gchar* path)
   g_return_val_if_fail(path != NULL, NULL);
 
   gc_free gchar* tmp = path_simplify(path);
+  if (tmp[0] != '/')
+    return NULL;
+
+  gc_strfreev gchar** names = g_strsplit(tmp + 1, "/", 0);
+  gchar** name;
+  mega_node* n = NULL;
 
-  GSList* iter;
-  gchar n_path[4096];
-  for (iter = s->fs_nodes; iter; iter = iter->next)
+  // resolve path one component at a time
+  for (name = names; *name; name++)
   {
-    mega_node* n = iter->data;
+    gc_free gchar* key = path_index_key(n, *name);
 
-    if (mega_node_get_path(n, n_path, sizeof(n_path)))
-    {
-      if (!strcmp(n_path, tmp))
-        return n;
-    }
+    n = g_hash_table_lookup(s->path_index, key);
+    if (!n)
+      return NULL;
   }
 
-  return NULL;
+  return n;
 }
 
 // }}}
@@ -2542,21 +4135,22 @@ mega_node* mega_session_stat(mega_session* s, const gchar* path)
 
 GSList* mega_session_get_node_chilren(mega_session* s, mega_node* node)
 {
-  GSList *list = NULL, *i;
+  GSList* list = NULL;
+  GPtrArray* children;
+  guint i;
 
   g_return_val_if_fail(s != NULL, NULL);
   g_return_val_if_fail(node != NULL, NULL);
   g_return_val_if_fail(node->handle != NULL, NULL);
 
-  for (i = s->fs_nodes; i; i = i->next)
-  {
-    mega_node* child = i->data;
+  children = g_hash_table_lookup(s->children_index, node);
+  if (!children)
+    return NULL;
 
-    if (child->parent_handle && !strcmp(child->parent_handle, node->handle))
-      list = g_slist_prepend(list, child);
-  }
+  for (i = children->len; i > 0; i--)
+    list = g_slist_prepend(list, children->pdata[i - 1]);
 
-  return g_slist_reverse(list);
+  return list;
 }
 
 // }}}
@@ -2611,7 +4205,8 @@ mega_node* mega_session_mkdir(mega_session* s, const gchar* path, GError** err)
     }
 
     // parse response
-    n = mega_node_parse_user(s, ur_node);
+    gc_s_json_tape_free SJsonTape* tape = s_json_tape_new(ur_node);
+    n = tape ? mega_node_parse_user(s, tape, 0) : NULL;
     if (!n)
     {
       g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
@@ -2657,8 +4252,7 @@ mega_node* mega_session_mkdir(mega_session* s, const gchar* path, GError** err)
   }
 
   // add mkdired node to the filesystem
-  s->fs_nodes = g_slist_append(s->fs_nodes, n);
-  update_pathmap(s);
+  pathmap_add_node(s, n, p);
 
   return n;
 }
@@ -2666,27 +4260,42 @@ mega_node* mega_session_mkdir(mega_session* s, const gchar* path, GError** err)
 // }}}
 // {{{ mega_session_rm
 
-gboolean mega_session_rm(mega_session* s, const gchar* path, GError** err)
+static mega_node* rm_lookup_node(mega_session* s, const gchar* path, GError** err)
 {
-  GError* local_err = NULL;
-
-  g_return_val_if_fail(s != NULL, FALSE);
-  g_return_val_if_fail(path != NULL, FALSE);
-  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
-
   mega_node* mn = mega_session_stat(s, path);
   if (!mn)
   {
     g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File not found: %s", path);
-    return FALSE;
+    return NULL;
   }
 
   if (!mega_node_is_writable(s, mn))
   {
     g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File is not removable: %s", path);
-    return FALSE;
+    return NULL;
+  }
+
+  if (mn->type != MEGA_NODE_FILE && mn->type != MEGA_NODE_FOLDER && mn->type != MEGA_NODE_CONTACT)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't remove system dir %s", path);
+    return NULL;
   }
 
+  return mn;
+}
+
+gboolean mega_session_rm(mega_session* s, const gchar* path, GError** err)
+{
+  GError* local_err = NULL;
+
+  g_return_val_if_fail(s != NULL, FALSE);
+  g_return_val_if_fail(path != NULL, FALSE);
+  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+  mega_node* mn = rm_lookup_node(s, path, err);
+  if (!mn)
+    return FALSE;
+
   if (mn->type == MEGA_NODE_FILE || mn->type == MEGA_NODE_FOLDER)
   {
     // prepare request
@@ -2697,7 +4306,7 @@ gboolean mega_session_rm(mega_session* s, const gchar* path, GError** err)
       return FALSE;
     }
   }
-  else if (mn->type == MEGA_NODE_CONTACT)
+  else
   {
     gc_free gchar* ur_node = api_call(s, 'i', NULL, &local_err, "[{a:ur, u:%s, l:0, i:%s}]", mn->handle, s->rid);
     if (!ur_node)
@@ -2706,45 +4315,202 @@ gboolean mega_session_rm(mega_session* s, const gchar* path, GError** err)
       return FALSE;
     }
   }
-  else
-  {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't remove system dir %s", path);
-    return FALSE;
-  }
 
   // remove node from the filesystem
-  s->fs_nodes = g_slist_remove(s->fs_nodes, mn);
-  mega_node_free(mn);
+  g_ptr_array_remove(s->fs_nodes, mn);
+  cache_log_remove(s, mn);
+  mega_node_free(s, mn);
   update_pathmap(s);
 
   return TRUE;
 }
 
 // }}}
-// {{{ mega_session_new_node_attribute
+// {{{ mega_session_rm_many
 
-gchar* mega_session_new_node_attribute(mega_session* s, const guchar* data, gsize len, const gchar* type, const guchar* key, GError** err)
+struct _rm_item
 {
-  GError* local_err = NULL;
-  AES_KEY k;
-  guchar iv[AES_BLOCK_SIZE] = {0};
-  gsize pad = len % 16 ? 16 - (len % 16) : 0;
+  const gchar* path;
+  mega_node* node;
+  GError* error;
+  // set if node is removed along with an ancestor given in another item
+  struct _rm_item* ancestor;
+};
 
-  g_return_val_if_fail(s != NULL, NULL);
-  g_return_val_if_fail(data != NULL, NULL);
-  g_return_val_if_fail(len > 0, NULL);
-  g_return_val_if_fail(type != NULL, NULL);
-  g_return_val_if_fail(key != NULL, NULL);
-  g_return_val_if_fail(err == NULL || *err == NULL, NULL);
+static void rm_many_done(mega_session* s, const gchar* result, GError* error, struct _rm_item* item)
+{
+  if (error)
+    item->error = g_error_copy(error);
+}
 
-  gc_free gchar* ufa_node = api_call(s, 'o', NULL, &local_err, "[{a:ufa, s:%i, ssl:0}]", (gint64)len + pad);
-  if (!ufa_node)
+static struct _rm_item* rm_find_removed_ancestor(mega_node* n, GHashTable* removed)
+{
+  for (n = n->parent; n; n = n->parent)
   {
-    g_propagate_error(err, local_err);
-    return NULL;
+    struct _rm_item* item = g_hash_table_lookup(removed, n);
+    if (item)
+      return item;
   }
 
-  gc_free gchar* p_url = s_json_get_member_string(ufa_node, "p");
+  return NULL;
+}
+
+// Remove several paths at once, removal commands are sent in batches. Paths
+// that can't be removed are reported in a single error, one line per path.
+gboolean mega_session_rm_many(mega_session* s, GSList* paths, GError** err)
+{
+  GError* local_err = NULL;
+  GSList* i;
+  guint j;
+  gc_api_batch_free api_batch* batch = NULL;
+  gc_hash_table_unref GHashTable* removed = NULL;
+  gc_string_free GString* errors = NULL;
+  struct _rm_item* items;
+  guint n_items = 0;
+
+  g_return_val_if_fail(s != NULL, FALSE);
+  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+  batch = api_batch_new(s);
+  removed = g_hash_table_new(g_direct_hash, g_direct_equal);
+  errors = g_string_new(NULL);
+  items = g_new0(struct _rm_item, g_slist_length(paths));
+
+  for (i = paths; i; i = i->next)
+  {
+    struct _rm_item* item = items + n_items++;
+
+    item->path = i->data;
+    item->node = rm_lookup_node(s, item->path, &item->error);
+
+    // same node given twice
+    if (item->node && g_hash_table_contains(removed, item->node))
+      item->node = NULL;
+
+    if (item->node)
+      g_hash_table_insert(removed, item->node, item);
+  }
+
+  for (j = 0; j < n_items; j++)
+  {
+    struct _rm_item* item = items + j;
+
+    if (!item->node)
+      continue;
+
+    // removing the parent takes care of the node too
+    item->ancestor = rm_find_removed_ancestor(item->node, removed);
+    if (item->ancestor)
+    {
+      g_hash_table_remove(removed, item->node);
+      item->node = NULL;
+      continue;
+    }
+
+    if (item->node->type == MEGA_NODE_CONTACT)
+      api_batch_add(batch, 'i', (api_batch_fn)rm_many_done, item, "{a:ur, u:%s, l:0, i:%s}", item->node->handle, s->rid);
+    else
+      api_batch_add(batch, 'i', (api_batch_fn)rm_many_done, item, "{a:d, i:%s, n:%s}", s->rid, item->node->handle);
+  }
+
+  api_batch_flush(batch, &local_err);
+  g_clear_error(&local_err);
+
+  // nodes skipped for an ancestor stay in place if the ancestor's removal
+  // failed
+  for (j = 0; j < n_items; j++)
+  {
+    struct _rm_item* item = items + j;
+    struct _rm_item* ancestor = item->ancestor;
+
+    while (ancestor && ancestor->ancestor)
+      ancestor = ancestor->ancestor;
+
+    if (ancestor && ancestor->error)
+      g_set_error(&item->error, MEGA_ERROR, MEGA_ERROR_OTHER, "Removal of %s failed: %s", ancestor->path, ancestor->error->message);
+  }
+
+  // remove nodes from the filesystem
+  g_hash_table_remove_all(removed);
+
+  for (j = 0; j < n_items; j++)
+  {
+    struct _rm_item* item = items + j;
+
+    if (item->error)
+    {
+      g_string_append_printf(errors, "%sCan't remove %s: %s", errors->len > 0 ? "\n" : "", item->path, item->error->message);
+      g_clear_error(&item->error);
+    }
+    else if (item->node)
+    {
+      g_hash_table_add(removed, item->node);
+    }
+  }
+
+  if (g_hash_table_size(removed) > 0)
+  {
+    guint k = 0;
+
+    for (j = 0; j < s->fs_nodes->len; j++)
+    {
+      mega_node* n = s->fs_nodes->pdata[j];
+
+      if (!g_hash_table_contains(removed, n))
+        s->fs_nodes->pdata[k++] = n;
+    }
+
+    g_ptr_array_set_size(s->fs_nodes, k);
+
+    for (j = 0; j < n_items; j++)
+    {
+      struct _rm_item* item = items + j;
+
+      if (item->node && g_hash_table_contains(removed, item->node))
+      {
+        cache_log_remove(s, item->node);
+        mega_node_free(s, item->node);
+      }
+    }
+  }
+
+  g_free(items);
+  update_pathmap(s);
+
+  if (errors->len > 0)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "%s", errors->str);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// }}}
+// {{{ mega_session_new_node_attribute
+
+gchar* mega_session_new_node_attribute(mega_session* s, const guchar* data, gsize len, const gchar* type, const guchar* key, GError** err)
+{
+  GError* local_err = NULL;
+  AES_KEY k;
+  guchar iv[AES_BLOCK_SIZE] = {0};
+  gsize pad = len % 16 ? 16 - (len % 16) : 0;
+
+  g_return_val_if_fail(s != NULL, NULL);
+  g_return_val_if_fail(data != NULL, NULL);
+  g_return_val_if_fail(len > 0, NULL);
+  g_return_val_if_fail(type != NULL, NULL);
+  g_return_val_if_fail(key != NULL, NULL);
+  g_return_val_if_fail(err == NULL || *err == NULL, NULL);
+
+  gc_free gchar* ufa_node = api_call(s, 'o', NULL, &local_err, "[{a:ufa, s:%i, ssl:0}]", (gint64)len + pad);
+  if (!ufa_node)
+  {
+    g_propagate_error(err, local_err);
+    return NULL;
+  }
+
+  gc_free gchar* p_url = s_json_get_member_string(ufa_node, "p");
 
   // encrypt
   AES_set_encrypt_key(key, 128, &k);
@@ -2916,12 +4682,8 @@ static gboolean progress_generic(goffset total, goffset now, mega_session* s)
 struct _put_data
 {
   GFileInputStream* stream;
-  AES_KEY k;
-  guchar iv[AES_BLOCK_SIZE];
-  gint num;
-  guchar ecount[AES_BLOCK_SIZE];
+  EVP_CIPHER_CTX* ctr;
   chunked_cbc_mac mac;
-  GByteArray* buffer;
 };
 
 static gsize put_process_data(gpointer buffer, gsize size, struct _put_data* data)
@@ -2929,10 +4691,8 @@ static gsize put_process_data(gpointer buffer, gsize size, struct _put_data* dat
   gc_error_free GError* local_err = NULL;
   gsize bytes_read = 0;
 
-  if (size > data->buffer->len)
-    g_byte_array_set_size(data->buffer, size);
-
-  if (!g_input_stream_read_all(G_INPUT_STREAM(data->stream), data->buffer->data, size, &bytes_read, NULL, &local_err))
+  // read plaintext directly to the curl's buffer and encrypt it in place
+  if (!g_input_stream_read_all(G_INPUT_STREAM(data->stream), buffer, size, &bytes_read, NULL, &local_err))
   {
     g_printerr("ERROR: Failed reading from stream: %s\n", local_err->message);
     return 0;
@@ -2940,805 +4700,3047 @@ static gsize put_process_data(gpointer buffer, gsize size, struct _put_data* dat
 
   if (bytes_read > 0)
   {
-    AES_ctr128_encrypt(data->buffer->data, buffer, bytes_read, &data->k, data->iv, data->ecount, &data->num);
-    chunked_cbc_mac_update(&data->mac, data->buffer->data, bytes_read);
+    chunked_cbc_mac_update(&data->mac, buffer, bytes_read);
+    aes_ctr_crypt(data->ctr, buffer, buffer, bytes_read);
   }
 
   return bytes_read;
 }
 
-mega_node* mega_session_put(mega_session* s, const gchar* remote_path, const gchar* local_path, GError** err)
+struct _pput_range
 {
-  struct _put_data data;
-  GError* local_err = NULL;
-  mega_node *node, *parent_node;
-  gc_free gchar* file_name = NULL;
-  gc_object_unref GFileInputStream* stream = NULL;
-  gc_byte_array_unref GByteArray* buffer = NULL;
+  guint64 offset;
+  guint64 size;
+  gsize first_chunk;
+  gsize n_chunks;
+};
 
-  g_return_val_if_fail(s != NULL, NULL);
-  g_return_val_if_fail(remote_path != NULL, NULL);
-  g_return_val_if_fail(local_path != NULL, NULL);
-  g_return_val_if_fail(err == NULL || *err == NULL, NULL);
+struct _pput_worker
+{
+  struct _pput_data* data;
+  guint64 sent;
+};
 
-  memset(&data, 0, sizeof(data));
+struct _pput_data
+{
+  GFile* file;
+  const gchar* url;
+  guchar* aes_key;
+  guchar* nonce;
+
+  struct _pput_range* ranges;
+  guint n_ranges;
+  guint next_range;
+  guchar* chunk_macs;
+  guchar* chunk_done;
+  gsize n_chunks;
+  struct _pput_worker* workers;
+
+  // upload journal (NULL if resume is disabled)
+  GKeyFile* journal;
+  const gchar* journal_path;
+
+  GMutex lock;
+  GCond cond;
+  gint running;
+  gint failed;
+  gboolean rejected;
+  GError* error;
+  guint64 done;
+  GString* up_handle;
+};
 
-  // check remote filesystem, and get parent node
+static void pput_fail(struct _pput_data* data, GError* error)
+{
+  g_mutex_lock(&data->lock);
+  if (!data->error)
+    data->error = error;
+  else
+    g_clear_error(&error);
+  g_atomic_int_set(&data->failed, 1);
+  g_mutex_unlock(&data->lock);
+}
 
-  node = mega_session_stat(s, remote_path);
-  if (node)
-  {
-    if (node->type == MEGA_NODE_FILE)
-    {
-      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File already exists: %s", remote_path);
-      return NULL;
-    }
-    else
-    {
-      // put into a dir
-      parent_node = node;
+static gboolean pput_progress(goffset total, goffset now, struct _pput_worker* w)
+{
+  g_mutex_lock(&w->data->lock);
+  w->sent = now;
+  g_mutex_unlock(&w->data->lock);
 
-      gc_free gchar* basename = g_path_get_basename(local_path);
-      gc_free gchar* tmp = g_strconcat(remote_path, "/", basename, NULL);
-      node = mega_session_stat(s, tmp);
-      if (node)
-      {
-        g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File already exists: %s", tmp);
-        return NULL;
-      }
+  return !g_atomic_int_get(&w->data->failed);
+}
 
-      if (!mega_node_is_writable(s, parent_node) || parent_node->type == MEGA_NODE_NETWORK || parent_node->type == MEGA_NODE_CONTACT)
-      {
-        g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Directory is not writable: %s", remote_path);
-        return NULL;
-      }
+// Upload journal is a key file in the user's cache directory that allows to
+// continue an interrupted upload from another process. It holds the upload
+// URL, the file key (encrypted with the master key), completed chunks with
+// their MACs and the upload handle once the server returns it. The URL is
+// enough to upload into the file, so the journal is private to the user.
 
-      file_name = g_path_get_basename(local_path);
-    }
-  }
+static gchar* get_upload_journal_path(mega_session* s, const gchar* local_path, GFileInfo* info, const gchar* parent_handle, const gchar* file_name)
+{
+  gc_free gchar* abs_path = NULL;
+  gc_checksum_free GChecksum* cs = g_checksum_new(G_CHECKSUM_SHA1);
+  guint64 mtime = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+
+  if (g_path_is_absolute(local_path))
+    abs_path = g_strdup(local_path);
   else
   {
-    gc_free gchar* tmp = path_simplify(remote_path);
-    gc_free gchar* parent_path = g_path_get_dirname(tmp);
+    gc_free gchar* cwd = g_get_current_dir();
+    abs_path = g_build_filename(cwd, local_path, NULL);
+  }
 
-    if (!strcmp(parent_path, "/"))
-    {
-      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't upload to toplevel dir: %s", remote_path);
-      return NULL;
-    }
+  gc_free gchar* id = g_strdup_printf("%s\n%s\n%s\n%s\n%" G_GINT64_FORMAT "\n%" G_GUINT64_FORMAT,
+    s->user_handle ? s->user_handle : "", abs_path, parent_handle, file_name, (gint64)g_file_info_get_size(info), mtime);
+  g_checksum_update(cs, id, -1);
 
-    parent_node = mega_session_stat(s, parent_path);
-    if (!parent_node || parent_node->type == MEGA_NODE_FILE)
-    {
-      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Parent directory doesn't exist: %s", parent_path);
-      return NULL;
-    }
+  gc_free gchar* dir = g_build_filename(g_get_user_cache_dir(), "megatools", NULL);
+  gc_free gchar* filename = g_strconcat(g_checksum_get_string(cs), ".megatools.upload", NULL);
 
-    if (!mega_node_is_writable(s, parent_node) || parent_node->type == MEGA_NODE_NETWORK || parent_node->type == MEGA_NODE_CONTACT)
-    {
-      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Directory is not writable: %s", parent_path);
-      return NULL;
-    }
+  g_mkdir_with_parents(dir, 0700);
 
-    file_name = g_path_get_basename(tmp);
-  }
+  return g_build_filename(dir, filename, NULL);
+}
 
-  // open local file for reading, and get file size
+// load upload url and key from the journal, returns NULL if there's no usable journal
+static GKeyFile* load_upload_journal(mega_session* s, const gchar* path, guint64 file_size, gchar** url, guchar** aes_key, guchar** nonce)
+{
+  GKeyFile* kf = g_key_file_new();
+  gc_free gchar* key_enc = NULL;
+  gc_free guchar* key = NULL;
+  gsize key_len = 0;
 
-  gc_object_unref GFile* file = g_file_new_for_path(local_path);
-  data.stream = stream = g_file_read(file, NULL, &local_err);
-  if (!stream)
-  {
-    g_propagate_prefixed_error(err, local_err, "Can't read local file %s: ", local_path);
-    return NULL;
-  }   
+  if (!g_key_file_load_from_file(kf, path, 0, NULL))
+    goto err;
 
-  gc_object_unref GFileInfo* info = g_file_input_stream_query_info(stream, G_FILE_ATTRIBUTE_STANDARD_SIZE, NULL, &local_err);
-  if (!info)
-  {
-    g_propagate_prefixed_error(err, local_err, "Can't read local file %s: ", local_path);
-    return NULL;
-  }
+  if (g_key_file_get_uint64(kf, "Upload", "Size", NULL) != file_size)
+    goto err;
 
-  goffset file_size = g_file_info_get_size(info);
+  key_enc = g_key_file_get_string(kf, "Upload", "Key", NULL);
+  *url = g_key_file_get_string(kf, "Upload", "Url", NULL);
+  if (!key_enc || !*url)
+    goto err;
 
-  // ask for upload url - [{"a":"u","ssl":0,"ms":0,"s":<SIZE>,"r":0,"e":0}]
-  gc_free gchar* up_node = api_call(s, 'o', NULL, &local_err, "[{a:u, ssl:0, ms:0, s:%i, r:0, e:0}]", (gint64)file_size);
-  if (!up_node)
-  {
-    g_propagate_error(err, local_err);
-    return NULL;
-  }
+  key = b64_aes128_decrypt(key_enc, s->master_key, &key_len);
+  if (!key || key_len != 32)
+    goto err;
 
-  gc_free gchar* p_url = s_json_get_member_string(up_node, "p");
+  *aes_key = g_memdup(key, 16);
+  *nonce = g_memdup(key + 16, 16);
+  return kf;
 
-  // setup encryption
-  gc_free guchar* aes_key = make_random_key();
-  gc_free guchar* nonce = make_random_key();
-  AES_set_encrypt_key(aes_key, 128, &data.k);
-  memcpy(data.iv, nonce, 8);
-  chunked_cbc_mac_init8(&data.mac, aes_key, nonce);
+err:
+  g_clear_pointer(url, g_free);
+  g_key_file_unref(kf);
+  return NULL;
+}
 
-  // setup buffer
-  data.buffer = buffer = g_byte_array_new();
+static GKeyFile* new_upload_journal(mega_session* s, guint64 file_size, const gchar* url, const guchar* aes_key, const guchar* nonce)
+{
+  GKeyFile* kf = g_key_file_new();
+  guchar key[32];
 
-  // perform upload
-  gc_http_free http* h = http_new();
-  http_set_content_type(h, "application/octet-stream");
-  http_set_progress_callback(h, (http_progress_fn)progress_generic, s);
-  gc_string_free GString* up_handle = http_post_stream_upload(h, p_url, file_size, (http_data_fn)put_process_data, &data, &local_err);
+  memcpy(key, aes_key, 16);
+  memcpy(key + 16, nonce, 16);
+  gc_free gchar* key_enc = b64_aes128_encrypt(key, 32, s->master_key);
 
-  if (!up_handle)
-  {
-    g_propagate_prefixed_error(err, local_err, "Data upload failed: ");
-    return NULL;
-  }
+  g_key_file_set_string(kf, "Upload", "Url", url);
+  g_key_file_set_string(kf, "Upload", "Key", key_enc);
+  g_key_file_set_uint64(kf, "Upload", "Size", file_size);
 
-  // check for numeric error code
-  if (up_handle->len < 10 && g_regex_match_simple("^-(\\d+)$", up_handle->str, 0, 0))
-  {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Server returned error code %s", srv_error_to_string(atoi(up_handle->str)));
-    return NULL;
-  }
+  return kf;
+}
 
-  if (up_handle->len > 100 || !g_regex_match_simple("^[a-zA-Z0-9_+/-]{20,50}$", up_handle->str, 0, 0))
-  {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid upload handle");
-    return NULL;
-  }
+static void pput_load_journal(struct _pput_data* data)
+{
+  gc_free gchar *done = g_key_file_get_string(data->journal, "Upload", "Done", NULL);
+  gc_free gchar *macs = g_key_file_get_string(data->journal, "Upload", "MACs", NULL);
+  gc_free gchar *handle = g_key_file_get_string(data->journal, "Upload", "Handle", NULL);
+  gc_free guchar *done_raw = NULL, *macs_raw = NULL;
+  gsize done_len = 0, macs_len = 0;
 
-  // create preview
-  gc_free gchar* fa = NULL;
-  if (s->create_preview)
-    fa = create_preview(s, local_path, aes_key, NULL);
+  if (!done || !macs)
+    return;
 
-  gc_free gchar* attrs = encode_node_attrs(file_name);
-  gc_free gchar* attrs_enc = b64_aes128_cbc_encrypt_str(attrs, aes_key);
-  guchar meta_mac[16];
-  guchar node_key[32];
+  done_raw = base64urldecode(done, &done_len);
+  macs_raw = base64urldecode(macs, &macs_len);
+  if (!done_raw || !macs_raw || done_len != data->n_chunks || macs_len != data->n_chunks * 16)
+    return;
 
-  chunked_cbc_mac_finish(&data.mac, meta_mac);
-  pack_node_key(node_key, aes_key, nonce, meta_mac);
-  gc_free gchar* node_key_enc = b64_aes128_encrypt(node_key, 32, s->master_key);
+  memcpy(data->chunk_done, done_raw, data->n_chunks);
+  memcpy(data->chunk_macs, macs_raw, data->n_chunks * 16);
 
-  // prepare request
-  gc_free gchar* put_node = api_call(s, 'o', NULL, &local_err, "[{a:p, t:%s, n:[{h:%s, t:0, k:%s, a:%s, fa:%s}]}]", parent_node->handle, up_handle->str, node_key_enc, attrs_enc, fa);
-  if (!put_node)
-  {
-    g_propagate_error(err, local_err);
-    return NULL;
-  }
+  if (handle)
+    data->up_handle = g_string_new(handle);
+}
 
-  const gchar* f_arr = s_json_get_member(put_node, "f");
-  if (s_json_get_type(f_arr) != S_JSON_TYPE_ARRAY)
+// must be called with data->lock held
+static gboolean pput_save_journal(struct _pput_data* data, GError** err)
+{
+  gc_free gchar* done = base64urlencode(data->chunk_done, data->n_chunks);
+  gc_free gchar* macs = base64urlencode(data->chunk_macs, data->n_chunks * 16);
+  gc_free gchar* contents = NULL;
+  gsize len = 0;
+
+  g_key_file_set_string(data->journal, "Upload", "Done", done);
+  g_key_file_set_string(data->journal, "Upload", "MACs", macs);
+  if (data->up_handle)
+    g_key_file_set_string(data->journal, "Upload", "Handle", data->up_handle->str);
+
+  contents = g_key_file_to_data(data->journal, &len, NULL);
+
+  return file_set_contents_private(data->journal_path, contents, len, err);
+}
+
+// read, encrypt and MAC one range of the file, returns encrypted data
+static GByteArray* pput_encrypt_range(struct _pput_data* data, GFileInputStream* stream, struct _pput_range* r, GError** err)
+{
+  GByteArray* buf;
+  chunked_cbc_mac mac;
+  gsize bytes_read = 0;
+  gc_free guchar* chunk_macs = g_malloc(r->n_chunks * 16);
+
+  buf = g_byte_array_sized_new(r->size);
+  g_byte_array_set_size(buf, r->size);
+
+  if (!g_seekable_seek(G_SEEKABLE(stream), r->offset, G_SEEK_SET, NULL, err) 
+      || !g_input_stream_read_all(G_INPUT_STREAM(stream), buf->data, r->size, &bytes_read, NULL, err))
   {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
+    g_byte_array_unref(buf);
     return NULL;
   }
 
-  const gchar* f_el = s_json_get_element(f_arr, 0);
-  if (!f_el || s_json_get_type(f_el) != S_JSON_TYPE_OBJECT)
+  if (bytes_read != r->size)
   {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File was truncated during upload");
+    g_byte_array_unref(buf);
     return NULL;
   }
 
-  mega_node* nn = mega_node_parse(s, f_el);
-  if (!nn)
-  {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
-    return NULL;
-  }
-
-  // add uploaded node to the filesystem
-  s->fs_nodes = g_slist_append(s->fs_nodes, nn);
-  nn->parent = parent_node;
+  chunked_cbc_mac_init_at(&mac, data->aes_key, data->nonce, r->offset, chunk_macs);
+  chunked_cbc_mac_update(&mac, buf->data, r->size);
+  chunked_cbc_mac_finish(&mac, NULL);
 
-  return nn;
-}
+  // journal may be saved by other workers meanwhile
+  g_mutex_lock(&data->lock);
+  memcpy(data->chunk_macs + r->first_chunk * 16, chunk_macs, r->n_chunks * 16);
+  g_mutex_unlock(&data->lock);
 
-// }}}
-// {{{ mega_session_get
+  gc_evp_cipher_ctx_free EVP_CIPHER_CTX* ctr = aes_ctr_new(data->aes_key);
+  aes_ctr_seek(ctr, data->nonce, r->offset);
+  aes_ctr_crypt(ctr, buf->data, buf->data, r->size);
 
-struct _get_data
-{
-  mega_session* s;
-  GFileOutputStream* stream;
-  AES_KEY k;
-  guchar iv[AES_BLOCK_SIZE];
-  gint num;
-  guchar ecount[AES_BLOCK_SIZE];
-  chunked_cbc_mac mac;
-  GByteArray* buffer;
-};
+  return buf;
+}
 
-static gsize get_process_data(gpointer buffer, gsize size, struct _get_data* data)
+static gpointer pput_worker_thread(struct _pput_worker* w)
 {
-  gc_error_free GError* local_err = NULL;
-
-  if (size > data->buffer->len)
-    g_byte_array_set_size(data->buffer, size);
-
-  AES_ctr128_encrypt(buffer, data->buffer->data, size, &data->k, data->iv, data->ecount, &data->num);
-
-  chunked_cbc_mac_update(&data->mac, data->buffer->data, size);
+  struct _pput_data* data = w->data;
+  GError* local_err = NULL;
+  GFileInputStream* stream;
+  http* h;
 
-  init_status(data->s, MEGA_STATUS_DATA);
-  data->s->status_data.data.size = size;
-  data->s->status_data.data.buf = data->buffer->data;
-  if (send_status(data->s)) 
-    return 0;
+  stream = g_file_read(data->file, NULL, &local_err);
+  if (!stream)
+  {
+    g_prefix_error(&local_err, "Can't read local file: ");
+    pput_fail(data, local_err);
+    goto out;
+  }
 
-  if (!data->stream)
-    return size;
+  h = http_new();
+  http_set_content_type(h, "application/octet-stream");
+  http_set_progress_callback(h, (http_progress_fn)pput_progress, w);
 
-  if (!g_output_stream_write_all(G_OUTPUT_STREAM(data->stream), data->buffer->data, size, NULL, NULL, &local_err))
+  while (TRUE)
   {
-    g_printerr("ERROR: Failed writing to stream: %s\n", local_err->message);
-    return 0;
-  }
+    struct _pput_range* r = NULL;
 
-  return size;
-}
+    g_mutex_lock(&data->lock);
+    if (!data->failed && data->next_range < data->n_ranges)
+      r = data->ranges + data->next_range++;
+    g_mutex_unlock(&data->lock);
 
-gboolean mega_session_get(mega_session* s, const gchar* local_path, const gchar* remote_path, GError** err)
-{
-  struct _get_data data;
-  GError* local_err = NULL;
-  gc_object_unref GFile* file = NULL;
-  gc_object_unref GFileOutputStream* stream = NULL;
-  gboolean remove_file = FALSE;
-  gc_free gchar* get_node = NULL, *url = NULL;
-  gc_http_free http* h = NULL;
-  gc_byte_array_unref GByteArray* buffer = NULL;
+    if (!r)
+      break;
 
-  g_return_val_if_fail(s != NULL, FALSE);
-  g_return_val_if_fail(remote_path != NULL, FALSE);
-  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+    gc_byte_array_unref GByteArray* buf = pput_encrypt_range(data, stream, r, &local_err);
+    if (!buf)
+    {
+      pput_fail(data, local_err);
+      local_err = NULL;
+      break;
+    }
 
-  memset(&data, 0, sizeof(data));
-  data.s = s;
+    gc_free gchar* url = g_strdup_printf("%s/%" G_GUINT64_FORMAT, data->url, r->offset);
+    gc_string_free GString* response = http_post(h, url, (const gchar*)buf->data, buf->len, &local_err);
+    if (!response)
+    {
+      pput_fail(data, local_err);
+      local_err = NULL;
+      break;
+    }
 
-  mega_node* n = mega_session_stat(s, remote_path);
-  if (!n)
-  {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Remote file not found: %s", remote_path);
-    return FALSE;
-  }
+    // check for numeric error code
+    if (response->len > 0 && response->len < 10 && g_regex_match_simple("^-(\\d+)$", response->str, 0, 0))
+    {
+      g_atomic_int_set(&data->rejected, TRUE);
+      pput_fail(data, g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Server returned error code %s", srv_error_to_string(atoi(response->str))));
+      break;
+    }
 
-  init_status(s, MEGA_STATUS_FILEINFO);
-  s->status_data.fileinfo.name = n->name;
-  s->status_data.fileinfo.size = n->size;
-  if (send_status(s)) 
-  {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Operation cancelled from status callback");
-    return FALSE;
-  }
+    g_mutex_lock(&data->lock);
+    data->done += r->size;
+    w->sent = 0;
+    memset(data->chunk_done + r->first_chunk, 1, r->n_chunks);
 
-  if (local_path)
-  {
-    file = g_file_new_for_path(local_path);
-    if (g_file_query_exists(file, NULL))
+    // upload handle is returned by the request that completes the upload
+    if (response->len > 0 && !data->up_handle)
     {
-      if (g_file_query_file_type(file, 0, NULL) == G_FILE_TYPE_DIRECTORY)
-      {
-        gc_object_unref GFile* child = g_file_get_child(file, n->name);
-        if (g_file_query_exists(child, NULL))
-        {
-          g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Local file already exists: %s/%s", local_path, n->name);
-          return FALSE;
-        }
-        else
-        {
-          file = child;
-          child = NULL;
-        }
-      }
-      else
-      {
-        g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Local file already exists: %s", local_path);
-        return FALSE;
-      }
+      data->up_handle = response;
+      response = NULL;
     }
 
-    data.stream = stream = g_file_create(file, 0, NULL, &local_err);
-    if (!data.stream)
+    if (data->journal && !pput_save_journal(data, &local_err))
     {
-      g_propagate_prefixed_error(err, local_err, "Can't open local file %s for writing: ", local_path);
-      return FALSE;
+      g_mutex_unlock(&data->lock);
+      g_prefix_error(&local_err, "Can't save upload journal: ");
+      pput_fail(data, local_err);
+      local_err = NULL;
+      break;
     }
+    g_mutex_unlock(&data->lock);
   }
 
-  remove_file = TRUE;
+  http_free(h);
+  g_object_unref(stream);
 
-  // initialize decrytpion key/state
-  guchar aes_key[16], meta_mac_xor[8];
-  unpack_node_key(n->key, aes_key, data.iv, meta_mac_xor);
-  AES_set_encrypt_key(aes_key, 128, &data.k);
-  chunked_cbc_mac_init8(&data.mac, aes_key, data.iv);
+out:
+  g_mutex_lock(&data->lock);
+  data->running--;
+  g_cond_signal(&data->cond);
+  g_mutex_unlock(&data->lock);
 
-  // prepare request
-  get_node = api_call(s, 'o', NULL, &local_err, "[{a:g, g:1, ssl:0, n:%s}]", n->handle);
-  if (!get_node)
-  {
-    g_propagate_error(err, local_err);
-    goto err;
-  }
+  return NULL;
+}
 
-  gint64 file_size = s_json_get_member_int(get_node, "s", -1);
-  if (file_size < 0)
-  {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't determine file size");
-    goto err;
-  }
+// Upload file data over several connections at once. File is split into
+// ranges on chunk boundaries, each range is encrypted on its own CTR offset
+// and POSTed to <url>/<offset>. Meta-MAC is assembled from the chunk MACs.
+//
+// If journal is given, chunks acknowledged by the server in a previous
+// attempt are skipped and the journal is updated after each range.
+static GString* upload_parallel(mega_session* s, const gchar* url, GFile* file, guint64 file_size, guchar aes_key[16], guchar nonce[8], GKeyFile* journal, const gchar* journal_path, guchar meta_mac[16], GError** err)
+{
+  struct _pput_data data;
+  GPtrArray* threads;
+  guint64 off = 0;
+  gsize idx = 0;
+  guint i, n_workers;
+  gboolean cancelled = FALSE;
 
-  url = s_json_get_member_string(get_node, "g");
-  if (!url)
-  {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't determine download url");
-    goto err;
-  }
+  memset(&data, 0, sizeof(data));
+  data.file = file;
+  data.url = url;
+  data.aes_key = aes_key;
+  data.nonce = nonce;
+  data.journal = journal;
+  data.journal_path = journal_path;
 
-  // setup buffer
-  data.buffer = buffer = g_byte_array_new();
+  data.n_chunks = get_chunk_count(file_size);
+  data.chunk_macs = g_malloc0(data.n_chunks * 16);
+  data.chunk_done = g_malloc0(data.n_chunks);
+  data.ranges = g_new0(struct _pput_range, data.n_chunks);
 
-  // perform download
-  h = http_new();
-  http_set_progress_callback(h, (http_progress_fn)progress_generic, s);
-  if (!http_post_stream_download(h, url, (http_data_fn)get_process_data, &data, &local_err))
+  if (journal)
   {
-    g_propagate_prefixed_error(err, local_err, "Data download failed: ");
-    goto err;
+    pput_load_journal(&data);
+
+    if (!pput_save_journal(&data, &data.error))
+      g_prefix_error(&data.error, "Can't save upload journal: ");
   }
 
-  if (file)
+  // split parts of the file not yet acknowledged by the server into ranges
+  // on chunk boundaries
+  for (idx = 0, off = 0; idx < data.n_chunks; )
   {
-    if (!g_output_stream_close(G_OUTPUT_STREAM(data.stream), NULL, &local_err))
+    if (data.chunk_done[idx])
     {
-      g_propagate_prefixed_error(err, local_err, "Can't close downloaded file: ");
-      goto err;
+      data.done += MIN(off + get_chunk_size(idx), file_size) - off;
+      off += get_chunk_size(idx++);
+      continue;
     }
-  }
 
-  // check mac of the downloaded file
-  guchar meta_mac_xor_calc[8];
-  chunked_cbc_mac_finish8(&data.mac, meta_mac_xor_calc);
-  if (memcmp(meta_mac_xor, meta_mac_xor_calc, 8) != 0) 
-  {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "MAC mismatch");
-    goto err;
+    struct _pput_range* r = data.ranges + data.n_ranges++;
+
+    r->offset = off;
+    r->first_chunk = idx;
+    while (idx < data.n_chunks && !data.chunk_done[idx] && off - r->offset < TRANSFER_RANGE_SIZE)
+      off += get_chunk_size(idx++);
+
+    r->size = MIN(off, file_size) - r->offset;
+    r->n_chunks = idx - r->first_chunk;
   }
 
-  return TRUE;
+  if (data.error)
+    data.n_ranges = 0;
 
-err:
-  if (file && remove_file)
-    g_file_delete(file, NULL, NULL);
+  g_mutex_init(&data.lock);
+  g_cond_init(&data.cond);
 
-  return FALSE;
-}
+  n_workers = MIN((guint)s->transfer_connections, data.n_ranges);
+  data.workers = g_new0(struct _pput_worker, n_workers);
+  threads = g_ptr_array_new();
 
-// }}}
-// {{{ mega_session_dl
+  g_mutex_lock(&data.lock);
+  for (i = 0; i < n_workers; i++)
+  {
+    data.workers[i].data = &data;
+    g_ptr_array_add(threads, g_thread_new("upload", (GThreadFunc)pput_worker_thread, data.workers + i));
+    data.running++;
+  }
 
-struct _dl_data
-{
-  mega_session* s;
-  GFileOutputStream* stream;
-  AES_KEY k;
-  guchar iv[AES_BLOCK_SIZE];
-  gint num;
-  guchar ecount[AES_BLOCK_SIZE];
-  chunked_cbc_mac mac;
-  GByteArray* buffer;
-};
+  // report progress from the calling thread, so that status callbacks don't
+  // need to be thread safe
+  while (data.running > 0)
+  {
+    guint64 done;
 
-static gsize dl_process_data(gpointer buffer, gsize size, struct _dl_data* data)
-{
-  gc_error_free GError* local_err = NULL;
+    g_cond_wait_until(&data.cond, &data.lock, g_get_monotonic_time() + G_USEC_PER_SEC / 4);
+    done = data.done;
+    for (i = 0; i < n_workers; i++)
+      done += data.workers[i].sent;
 
-  if (size > data->buffer->len)
-    g_byte_array_set_size(data->buffer, size);
+    g_mutex_unlock(&data.lock);
+    if (!cancelled && !progress_generic(file_size, done, s))
+    {
+      cancelled = TRUE;
+      pput_fail(&data, g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Operation cancelled from status callback"));
+    }
+    g_mutex_lock(&data.lock);
+  }
+  g_mutex_unlock(&data.lock);
 
-  AES_ctr128_encrypt(buffer, data->buffer->data, size, &data->k, data->iv, data->ecount, &data->num);
+  for (i = 0; i < threads->len; i++)
+    g_thread_join(threads->pdata[i]);
+  g_ptr_array_free(threads, TRUE);
 
-  chunked_cbc_mac_update(&data->mac, data->buffer->data, size);
+  g_mutex_clear(&data.lock);
+  g_cond_clear(&data.cond);
+  g_free(data.ranges);
+  g_free(data.workers);
+  g_free(data.chunk_done);
 
-  init_status(data->s, MEGA_STATUS_DATA);
-  data->s->status_data.data.size = size;
-  data->s->status_data.data.buf = data->buffer->data;
-  if (send_status(data->s)) 
-    return 0;
+  // upload url is no longer usable
+  if (data.rejected && journal_path)
+    g_unlink(journal_path);
 
-  if (!data->stream)
-    return size;
+  if (!data.error && !data.up_handle)
+    g_set_error(&data.error, MEGA_ERROR, MEGA_ERROR_OTHER, "Server didn't return upload handle");
 
-  if (!g_output_stream_write_all(G_OUTPUT_STREAM(data->stream), data->buffer->data, size, NULL, NULL, &local_err))
+  if (data.error)
   {
-    g_printerr("ERROR: Failed writing to stream: %s\n", local_err->message);
-    return 0;
+    g_free(data.chunk_macs);
+    if (data.up_handle)
+      g_string_free(data.up_handle, TRUE);
+    g_propagate_error(err, data.error);
+    return NULL;
   }
 
-  return size;
+  chunked_cbc_mac_fold(aes_key, data.chunk_macs, data.n_chunks, meta_mac);
+  g_free(data.chunk_macs);
+
+  return data.up_handle;
 }
 
-gboolean mega_session_dl(mega_session* s, const gchar* handle, const gchar* key, const gchar* local_path, GError** err)
+// find parent node and name of the uploaded file
+static mega_node* put_get_target(mega_session* s, const gchar* remote_path, const gchar* local_path, gchar** file_name, GError** err)
 {
-  struct _dl_data data;
-  GError* local_err = NULL;
-  gc_object_unref GFile *parent_dir = NULL, *file = NULL;
-  gboolean remove_file = FALSE;
-  gc_free gchar *node_name = NULL, *dl_node = NULL, *url = NULL, *at = NULL;
-  gc_free guchar* node_key = NULL;
-  gc_http_free http* h = NULL;
-  gc_object_unref GFileOutputStream* stream = NULL;
-  gc_byte_array_unref GByteArray* buffer = NULL;
-
-  g_return_val_if_fail(s != NULL, FALSE);
-  g_return_val_if_fail(handle != NULL, FALSE);
-  g_return_val_if_fail(key != NULL, FALSE);
-  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
-
-  memset(&data, 0, sizeof(data));
-  data.s = s;
+  mega_node *node, *parent_node;
 
-  if (local_path)
+  node = mega_session_stat(s, remote_path);
+  if (node)
   {
-    // get dir and filename to download to
-    file = g_file_new_for_path(local_path);
-    if (g_file_query_exists(file, NULL))
+    if (node->type == MEGA_NODE_FILE)
+    {
+      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File already exists: %s", remote_path);
+      return NULL;
+    }
+    else
     {
-      if (g_file_query_file_type(file, 0, NULL) != G_FILE_TYPE_DIRECTORY)
+      // put into a dir
+      parent_node = node;
+
+      gc_free gchar* basename = g_path_get_basename(local_path);
+      gc_free gchar* tmp = g_strconcat(remote_path, "/", basename, NULL);
+      node = mega_session_stat(s, tmp);
+      if (node)
       {
-        g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File already exists: %s", local_path);
-        return FALSE;
+        g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "File already exists: %s", tmp);
+        return NULL;
       }
-      else
+
+      if (!mega_node_is_writable(s, parent_node) || parent_node->type == MEGA_NODE_NETWORK || parent_node->type == MEGA_NODE_CONTACT)
       {
-        parent_dir = file;
-        file = NULL;
+        g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Directory is not writable: %s", remote_path);
+        return NULL;
       }
+
+      *file_name = g_path_get_basename(local_path);
     }
-    else
+  }
+  else
+  {
+    gc_free gchar* tmp = path_simplify(remote_path);
+    gc_free gchar* parent_path = g_path_get_dirname(tmp);
+
+    if (!strcmp(parent_path, "/"))
     {
-      parent_dir = g_file_get_parent(file);
+      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't upload to toplevel dir: %s", remote_path);
+      return NULL;
+    }
 
-      if (g_file_query_file_type(parent_dir, 0, NULL) != G_FILE_TYPE_DIRECTORY)
-      {
-        g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't download file into: %s", g_file_get_path(parent_dir));
-        return FALSE;
-      }
+    parent_node = mega_session_stat(s, parent_path);
+    if (!parent_node || parent_node->type == MEGA_NODE_FILE)
+    {
+      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Parent directory doesn't exist: %s", parent_path);
+      return NULL;
     }
+
+    if (!mega_node_is_writable(s, parent_node) || parent_node->type == MEGA_NODE_NETWORK || parent_node->type == MEGA_NODE_CONTACT)
+    {
+      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Directory is not writable: %s", parent_path);
+      return NULL;
+    }
+
+    *file_name = g_path_get_basename(tmp);
   }
 
-  // prepare request
-  dl_node = api_call(s, 'o', NULL, &local_err, "[{a:g, g:1, ssl:0, p:%s}]", handle);
-  if (!dl_node)
+  return parent_node;
+}
+
+// check the upload handle returned by the storage server
+static gboolean put_check_handle(GString* up_handle, GError** err)
+{
+  // check for numeric error code
+  if (up_handle->len < 10 && g_regex_match_simple("^-(\\d+)$", up_handle->str, 0, 0))
   {
-    g_propagate_error(err, local_err);
-    goto err;
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Server returned error code %s", srv_error_to_string(atoi(up_handle->str)));
+    return FALSE;
   }
 
-  // get file size
-  gint64 file_size = s_json_get_member_int(dl_node, "s", -1);
-  if (file_size < 0)
+  if (up_handle->len > 100 || !g_regex_match_simple("^[a-zA-Z0-9_+/-]{20,50}$", up_handle->str, 0, 0))
   {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't determine file size");
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid upload handle");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// build the command that creates node for the uploaded data
+static gchar* put_node_cmd(mega_session* s, mega_node* parent_node, const gchar* file_name, const gchar* local_path, GString* up_handle, guchar* aes_key, guchar* nonce, guchar meta_mac[16])
+{
+  // create preview
+  gc_free gchar* fa = NULL;
+  if (s->create_preview)
+    fa = create_preview(s, local_path, aes_key, NULL);
+
+  gc_free gchar* attrs = encode_node_attrs(file_name);
+  gc_free gchar* attrs_enc = b64_aes128_cbc_encrypt_str(attrs, aes_key);
+  guchar node_key[32];
+
+  pack_node_key(node_key, aes_key, nonce, meta_mac);
+  gc_free gchar* node_key_enc = b64_aes128_encrypt(node_key, 32, s->master_key);
+
+  return s_json_build("{a:p, t:%s, n:[{h:%s, t:0, k:%s, a:%s, fa:%s}]}", parent_node->handle, up_handle->str, node_key_enc, attrs_enc, fa);
+}
+
+// add node from the response to the put node command to the filesystem
+static mega_node* put_add_node(mega_session* s, mega_node* parent_node, const gchar* put_node, GError** err)
+{
+  const gchar* f_arr = s_json_get_member(put_node, "f");
+  if (s_json_get_type(f_arr) != S_JSON_TYPE_ARRAY)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
+    return NULL;
+  }
+
+  const gchar* f_el = s_json_get_element(f_arr, 0);
+  if (!f_el || s_json_get_type(f_el) != S_JSON_TYPE_OBJECT)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
+    return NULL;
+  }
+
+  mega_node* nn = mega_node_parse(s, f_el);
+  if (!nn)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response");
+    return NULL;
+  }
+
+  // add uploaded node to the filesystem
+  pathmap_add_node(s, nn, parent_node);
+
+  return nn;
+}
+
+// create node for the uploaded data
+static mega_node* put_finish(mega_session* s, mega_node* parent_node, const gchar* file_name, const gchar* local_path, GString* up_handle, guchar* aes_key, guchar* nonce, guchar meta_mac[16], GError** err)
+{
+  GError* local_err = NULL;
+
+  if (!put_check_handle(up_handle, err))
+    return NULL;
+
+  gc_free gchar* cmd = put_node_cmd(s, parent_node, file_name, local_path, up_handle, aes_key, nonce, meta_mac);
+
+  gc_free gchar* put_node = api_call(s, 'o', NULL, &local_err, "[%j]", cmd);
+  if (!put_node)
+  {
+    g_propagate_error(err, local_err);
+    return NULL;
+  }
+
+  return put_add_node(s, parent_node, put_node, err);
+}
+
+mega_node* mega_session_put(mega_session* s, const gchar* remote_path, const gchar* local_path, GError** err)
+{
+  struct _put_data data;
+  GError* local_err = NULL;
+  mega_node* parent_node;
+  gc_free gchar* file_name = NULL;
+  gc_object_unref GFileInputStream* stream = NULL;
+  gc_evp_cipher_ctx_free EVP_CIPHER_CTX* ctr = NULL;
+
+  g_return_val_if_fail(s != NULL, NULL);
+  g_return_val_if_fail(remote_path != NULL, NULL);
+  g_return_val_if_fail(local_path != NULL, NULL);
+  g_return_val_if_fail(err == NULL || *err == NULL, NULL);
+
+  memset(&data, 0, sizeof(data));
+
+  // check remote filesystem, and get parent node
+  parent_node = put_get_target(s, remote_path, local_path, &file_name, err);
+  if (!parent_node)
+    return NULL;
+
+  // open local file for reading, and get file size
+
+  gc_object_unref GFile* file = g_file_new_for_path(local_path);
+  data.stream = stream = g_file_read(file, NULL, &local_err);
+  if (!stream)
+  {
+    g_propagate_prefixed_error(err, local_err, "Can't read local file %s: ", local_path);
+    return NULL;
+  }   
+
+  gc_object_unref GFileInfo* info = g_file_input_stream_query_info(stream, G_FILE_ATTRIBUTE_STANDARD_SIZE "," G_FILE_ATTRIBUTE_TIME_MODIFIED, NULL, &local_err);
+  if (!info)
+  {
+    g_propagate_prefixed_error(err, local_err, "Can't read local file %s: ", local_path);
+    return NULL;
+  }
+
+  goffset file_size = g_file_info_get_size(info);
+
+  // continue interrupted upload if there's a journal for it
+  gc_free gchar* p_url = NULL;
+  gc_free guchar* aes_key = NULL;
+  gc_free guchar* nonce = NULL;
+  gc_free gchar* journal_path = NULL;
+  gc_key_file_unref GKeyFile* journal = NULL;
+
+  if (s->resume_transfers && file_size > 0)
+  {
+    journal_path = get_upload_journal_path(s, local_path, info, parent_node->handle, file_name);
+    journal = load_upload_journal(s, journal_path, file_size, &p_url, &aes_key, &nonce);
+  }
+
+  if (!p_url)
+  {
+    // ask for upload url - [{"a":"u","ssl":0,"ms":0,"s":<SIZE>,"r":0,"e":0}]
+    gc_free gchar* up_node = api_call(s, 'o', NULL, &local_err, "[{a:u, ssl:0, ms:0, s:%i, r:0, e:0}]", (gint64)file_size);
+    if (!up_node)
+    {
+      g_propagate_error(err, local_err);
+      return NULL;
+    }
+
+    p_url = s_json_get_member_string(up_node, "p");
+    if (!p_url)
+    {
+      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't determine upload url");
+      return NULL;
+    }
+
+    aes_key = make_random_key();
+    nonce = make_random_key();
+
+    if (journal_path)
+      journal = new_upload_journal(s, file_size, p_url, aes_key, nonce);
+  }
+
+  // setup encryption
+  data.ctr = ctr = aes_ctr_new(aes_key);
+  aes_ctr_seek(ctr, nonce, 0);
+  chunked_cbc_mac_init8(&data.mac, aes_key, nonce);
+
+  // perform upload
+  guchar meta_mac[16];
+  gc_http_free http* h = NULL;
+  gc_string_free GString* up_handle = NULL;
+
+  // resumable uploads are always done in ranges
+  if (journal || (s->transfer_connections > 1 && file_size > TRANSFER_RANGE_SIZE))
+  {
+    up_handle = upload_parallel(s, p_url, file, file_size, aes_key, nonce, journal, journal_path, meta_mac, &local_err);
+  }
+  else
+  {
+    // pool is not worth starting for a few chunks
+    if (file_size > get_chunk_size(0) * 2)
+      chunked_cbc_mac_enable_threads(&data.mac, get_worker_threads());
+
+    h = http_new();
+    http_set_content_type(h, "application/octet-stream");
+    http_set_progress_callback(h, (http_progress_fn)progress_generic, s);
+    up_handle = http_post_stream_upload(h, p_url, file_size, (http_data_fn)put_process_data, &data, &local_err);
+    chunked_cbc_mac_finish(&data.mac, meta_mac);
+  }
+
+  if (!up_handle)
+  {
+    g_propagate_prefixed_error(err, local_err, "Data upload failed: ");
+    return NULL;
+  }
+
+  mega_node* nn = put_finish(s, parent_node, file_name, local_path, up_handle, aes_key, nonce, meta_mac, err);
+  if (!nn)
+    return NULL;
+
+  if (journal_path)
+    g_unlink(journal_path);
+
+  return nn;
+}
+
+// }}}
+// {{{ parallel chunked download
+
+struct _pget_range
+{
+  guint64 offset;
+  guint64 size;
+  gsize first_chunk;
+  gsize n_chunks;
+};
+
+struct _pget_data
+{
+  mega_session* s;
+  GOutputStream* stream;
+  gchar* local_path;
+  const gchar* url;
+  guchar* aes_key;
+  guchar* nonce;
+
+  struct _pget_range* ranges;
+  guint n_ranges;
+  guint next_range;
+  guchar* chunk_macs;
+  guchar* chunk_done;
+  gsize n_chunks;
+
+  // resume state file (NULL if resume is disabled)
+  const gchar* state_path;
+  gchar* state_id;
+
+  GMutex lock;
+  GCond cond;
+  gint running;
+  gint failed;
+  GError* error;
+  guint64 done;
+};
+
+struct _pget_worker
+{
+  struct _pget_data* data;
+  EVP_CIPHER_CTX* ctr;
+  chunked_cbc_mac mac;
+  guint64 position;
+  guint64 end;
+};
+
+static void pget_fail(struct _pget_data* data, GError* error)
+{
+  g_mutex_lock(&data->lock);
+  if (!data->error)
+    data->error = error;
+  else
+    g_clear_error(&error);
+  g_atomic_int_set(&data->failed, 1);
+  g_mutex_unlock(&data->lock);
+}
+
+static gsize pget_process_data(gpointer buffer, gsize size, struct _pget_worker* w)
+{
+  struct _pget_data* data = w->data;
+  GError* local_err = NULL;
+
+  if (g_atomic_int_get(&data->failed))
+    return 0;
+
+  if (w->position + size > w->end)
+  {
+    pget_fail(data, g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Server returned more data than requested"));
+    return 0;
+  }
+
+  aes_ctr_decrypt_mac(w->ctr, &w->mac, buffer, size);
+
+  g_mutex_lock(&data->lock);
+  if (!g_seekable_seek(G_SEEKABLE(data->stream), w->position, G_SEEK_SET, NULL, &local_err)
+      || !g_output_stream_write_all(data->stream, buffer, size, NULL, NULL, &local_err))
+  {
+    g_mutex_unlock(&data->lock);
+    g_prefix_error(&local_err, "Failed writing to stream: ");
+    pget_fail(data, local_err);
+    return 0;
+  }
+
+  data->done += size;
+  g_mutex_unlock(&data->lock);
+
+  w->position += size;
+  return size;
+}
+
+// Resume state is stored in a key file next to the downloaded file. It lists
+// chunks that were already written to disk along with their MACs. Data file
+// is synced to the disk before the state is saved, and the listed chunks are
+// checked against their MACs before the download is resumed.
+
+// flush written data of the file to the disk
+static gboolean file_sync(const gchar* path, GError** err)
+{
+  gint fd, rv;
+
+  fd = g_open(path, O_WRONLY, 0);
+  if (fd < 0)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't open %s: %s", path, g_strerror(errno));
+    return FALSE;
+  }
+
+#ifdef G_OS_WIN32
+  rv = _commit(fd);
+#else
+  rv = fsync(fd);
+#endif
+
+  if (rv < 0)
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't sync %s: %s", path, g_strerror(errno));
+
+  close(fd);
+  return rv == 0;
+}
+
+static gchar* get_resume_state_id(const guchar aes_key[16], const guchar nonce[8], guint64 file_size)
+{
+  gc_checksum_free GChecksum* checksum = g_checksum_new(G_CHECKSUM_SHA256);
+  guint64 size_be = GUINT64_TO_BE(file_size);
+
+  g_checksum_update(checksum, aes_key, 16);
+  g_checksum_update(checksum, nonce, 8);
+  g_checksum_update(checksum, (guchar*)&size_be, 8);
+
+  return g_strdup(g_checksum_get_string(checksum));
+}
+
+static void pget_load_state(struct _pget_data* data)
+{
+  gc_key_file_unref GKeyFile* kf = g_key_file_new();
+  gc_free gchar *id = NULL, *done = NULL, *macs = NULL;
+  gc_free guchar *done_raw = NULL, *macs_raw = NULL;
+  gsize done_len = 0, macs_len = 0;
+
+  if (!g_key_file_load_from_file(kf, data->state_path, 0, NULL))
+    return;
+
+  id = g_key_file_get_string(kf, "Download", "Id", NULL);
+  done = g_key_file_get_string(kf, "Download", "Done", NULL);
+  macs = g_key_file_get_string(kf, "Download", "MACs", NULL);
+
+  // state of a different file
+  if (!id || !done || !macs || strcmp(id, data->state_id))
+    return;
+
+  done_raw = base64urldecode(done, &done_len);
+  macs_raw = base64urldecode(macs, &macs_len);
+  if (!done_raw || !macs_raw || done_len != data->n_chunks || macs_len != data->n_chunks * 16)
+    return;
+
+  memcpy(data->chunk_done, done_raw, data->n_chunks);
+  memcpy(data->chunk_macs, macs_raw, data->n_chunks * 16);
+}
+
+// recompute MACs of the chunks completed by a previous attempt from the data
+// on disk, chunks that don't match (eg. not written before a crash) are
+// downloaded again
+static void pget_verify_state(struct _pget_data* data, GFile* file, guint64 file_size)
+{
+  gc_object_unref GFileInputStream* in = g_file_read(file, NULL, NULL);
+  gc_evp_cipher_ctx_free EVP_CIPHER_CTX* ctr = aes_ctr_new(data->aes_key);
+  gc_evp_cipher_ctx_free EVP_CIPHER_CTX* cbc = cbc_mac_ctx_new(data->aes_key);
+  // big enough for the largest chunk
+  gc_free guchar* buf = g_malloc(get_chunk_size(G_MAXSIZE));
+  guchar iv[16], mac[16];
+  AES_KEY k;
+  guint64 off;
+  gsize idx;
+
+  AES_set_encrypt_key(data->aes_key, 128, &k);
+  memcpy(iv, data->nonce, 8);
+  memcpy(iv + 8, data->nonce, 8);
+
+  for (idx = 0, off = 0; idx < data->n_chunks; off += get_chunk_size(idx++))
+  {
+    gsize len = MIN(off + get_chunk_size(idx), file_size) - off, read = 0;
+
+    if (!data->chunk_done[idx])
+      continue;
+
+    if (!in || !g_seekable_seek(G_SEEKABLE(in), off, G_SEEK_SET, NULL, NULL)
+        || !g_input_stream_read_all(G_INPUT_STREAM(in), buf, len, &read, NULL, NULL) || read != len)
+    {
+      data->chunk_done[idx] = 0;
+      continue;
+    }
+
+    aes_ctr_seek(ctr, data->nonce, off);
+    aes_ctr_crypt(ctr, buf, buf, len);
+    chunk_mac_calc(&k, cbc, iv, buf, len, mac);
+
+    if (memcmp(mac, data->chunk_macs + idx * 16, 16))
+      data->chunk_done[idx] = 0;
+  }
+}
+
+// must be called with data->lock held
+static gboolean pget_save_state(struct _pget_data* data, GError** err)
+{
+  gc_key_file_unref GKeyFile* kf = g_key_file_new();
+  gc_free gchar* done = base64urlencode(data->chunk_done, data->n_chunks);
+  gc_free gchar* macs = base64urlencode(data->chunk_macs, data->n_chunks * 16);
+  gc_free gchar* contents = NULL;
+  gsize len = 0;
+
+  g_key_file_set_string(kf, "Download", "Id", data->state_id);
+  g_key_file_set_string(kf, "Download", "Done", done);
+  g_key_file_set_string(kf, "Download", "MACs", macs);
+
+  contents = g_key_file_to_data(kf, &len, NULL);
+
+  return g_file_set_contents(data->state_path, contents, len, err);
+}
+
+static gpointer pget_worker_thread(struct _pget_data* data)
+{
+  struct _pget_worker w;
+  GError* local_err = NULL;
+  http* h;
+
+  memset(&w, 0, sizeof(w));
+  w.data = data;
+
+  w.ctr = aes_ctr_new(data->aes_key);
+  h = http_new();
+
+  while (TRUE)
+  {
+    struct _pget_range* r = NULL;
+
+    g_mutex_lock(&data->lock);
+    if (!data->failed && data->next_range < data->n_ranges)
+      r = data->ranges + data->next_range++;
+    g_mutex_unlock(&data->lock);
+
+    if (!r)
+      break;
+
+    // state may be saved by other workers meanwhile, MACs are copied to
+    // data->chunk_macs under the lock
+    gc_free guchar* chunk_macs = g_malloc(r->n_chunks * 16);
+
+    aes_ctr_seek(w.ctr, data->nonce, r->offset);
+    w.position = r->offset;
+    w.end = r->offset + r->size;
+    chunked_cbc_mac_init_at(&w.mac, data->aes_key, data->nonce, r->offset, chunk_macs);
+
+    gc_free gchar* url = g_strdup_printf("%s/%" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT, data->url, r->offset, w.end - 1);
+    if (!http_post_stream_download(h, url, (http_data_fn)pget_process_data, &w, &local_err))
+    {
+      pget_fail(data, local_err);
+      local_err = NULL;
+      break;
+    }
+
+    if (w.position != w.end)
+    {
+      pget_fail(data, g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Server returned incomplete range"));
+      break;
+    }
+
+    // stores MAC of the last partial chunk of the file
+    chunked_cbc_mac_finish(&w.mac, NULL);
+
+    // make sure data of the completed chunks reach the disk before the state
+    if (data->state_path)
+    {
+      gboolean flushed;
+
+      g_mutex_lock(&data->lock);
+      flushed = g_output_stream_flush(data->stream, NULL, &local_err);
+      g_mutex_unlock(&data->lock);
+
+      if (!flushed || !file_sync(data->local_path, &local_err))
+      {
+        g_prefix_error(&local_err, "Can't save resume state: ");
+        pget_fail(data, local_err);
+        local_err = NULL;
+        break;
+      }
+    }
+
+    g_mutex_lock(&data->lock);
+    memcpy(data->chunk_macs + r->first_chunk * 16, chunk_macs, r->n_chunks * 16);
+    memset(data->chunk_done + r->first_chunk, 1, r->n_chunks);
+    if (data->state_path && !pget_save_state(data, &local_err))
+    {
+      g_mutex_unlock(&data->lock);
+      g_prefix_error(&local_err, "Can't save resume state: ");
+      pget_fail(data, local_err);
+      local_err = NULL;
+      break;
+    }
+    g_mutex_unlock(&data->lock);
+  }
+
+  http_free(h);
+  EVP_CIPHER_CTX_free(w.ctr);
+
+  g_mutex_lock(&data->lock);
+  data->running--;
+  g_cond_signal(&data->cond);
+  g_mutex_unlock(&data->lock);
+
+  return NULL;
+}
+
+// Download file data from url using several connections at once. File is split
+// into ranges on chunk boundaries, each range is decrypted on its own CTR
+// offset and chunk MACs are folded into the meta-MAC once all ranges are done.
+//
+// If state_path is given, chunks completed by a previous attempt are skipped
+// and the state is updated after each completed range.
+static gboolean download_parallel(mega_session* s, const gchar* url, guint64 file_size, guchar aes_key[16], guchar nonce[8], GFile* file, GOutputStream* stream, const gchar* state_path, guchar meta_mac_xor[8], GError** err)
+{
+  struct _pget_data data;
+  GError* local_err = NULL;
+  GPtrArray* threads;
+  guint64 off = 0;
+  gsize idx = 0;
+  guint i;
+  gboolean cancelled = FALSE;
+
+  memset(&data, 0, sizeof(data));
+  data.s = s;
+  data.stream = stream;
+  data.local_path = g_file_get_path(file);
+  data.url = url;
+  data.aes_key = aes_key;
+  data.nonce = nonce;
+  data.state_path = state_path;
+
+  data.n_chunks = get_chunk_count(file_size);
+  data.chunk_macs = g_malloc0(data.n_chunks * 16);
+  data.chunk_done = g_malloc0(data.n_chunks);
+  data.ranges = g_new0(struct _pget_range, data.n_chunks);
+
+  if (state_path)
+  {
+    data.state_id = get_resume_state_id(aes_key, nonce, file_size);
+    pget_load_state(&data);
+    pget_verify_state(&data, file, file_size);
+
+    if (!pget_save_state(&data, &local_err))
+    {
+      g_propagate_prefixed_error(err, local_err, "Can't save resume state: ");
+      goto out;
+    }
+  }
+
+  // split missing parts of the file into ranges on chunk boundaries
+  for (idx = 0, off = 0; idx < data.n_chunks; )
+  {
+    if (data.chunk_done[idx])
+    {
+      data.done += MIN(off + get_chunk_size(idx), file_size) - off;
+      off += get_chunk_size(idx++);
+      continue;
+    }
+
+    struct _pget_range* r = data.ranges + data.n_ranges++;
+
+    r->offset = off;
+    r->first_chunk = idx;
+    while (idx < data.n_chunks && !data.chunk_done[idx] && off - r->offset < TRANSFER_RANGE_SIZE)
+      off += get_chunk_size(idx++);
+
+    r->size = MIN(off, file_size) - r->offset;
+    r->n_chunks = idx - r->first_chunk;
+  }
+
+  g_mutex_init(&data.lock);
+  g_cond_init(&data.cond);
+
+  threads = g_ptr_array_new();
+  g_mutex_lock(&data.lock);
+  for (i = 0; i < MIN((guint)s->transfer_connections, data.n_ranges); i++)
+  {
+    g_ptr_array_add(threads, g_thread_new("download", (GThreadFunc)pget_worker_thread, &data));
+    data.running++;
+  }
+
+  // report progress from the calling thread, so that status callbacks don't
+  // need to be thread safe
+  while (data.running > 0)
+  {
+    guint64 done;
+
+    g_cond_wait_until(&data.cond, &data.lock, g_get_monotonic_time() + G_USEC_PER_SEC / 4);
+    done = data.done;
+
+    g_mutex_unlock(&data.lock);
+    if (!cancelled && !progress_generic(file_size, done, s))
+    {
+      cancelled = TRUE;
+      pget_fail(&data, g_error_new(MEGA_ERROR, MEGA_ERROR_OTHER, "Operation cancelled from status callback"));
+    }
+    g_mutex_lock(&data.lock);
+  }
+  g_mutex_unlock(&data.lock);
+
+  for (i = 0; i < threads->len; i++)
+    g_thread_join(threads->pdata[i]);
+  g_ptr_array_free(threads, TRUE);
+
+  g_mutex_clear(&data.lock);
+  g_cond_clear(&data.cond);
+
+  if (data.error)
+  {
+    g_propagate_prefixed_error(err, data.error, "Data download failed: ");
+    goto out;
+  }
+
+  guchar meta_mac[16];
+  chunked_cbc_mac_fold(aes_key, data.chunk_macs, data.n_chunks, meta_mac);
+  condense_meta_mac(meta_mac, meta_mac_xor);
+
+out:
+  g_free(data.ranges);
+  g_free(data.chunk_macs);
+  g_free(data.chunk_done);
+  g_free(data.state_id);
+  g_free(data.local_path);
+  return !data.error && !local_err;
+}
+
+static gboolean can_download_parallel(mega_session* s, GOutputStream* stream, guint64 file_size, gboolean resume)
+{
+  // streaming to a status callback requires in-order delivery of the data
+  if (!stream || !G_IS_SEEKABLE(stream) || !g_seekable_can_seek(G_SEEKABLE(stream)))
+    return FALSE;
+
+  // resumable downloads are always done in ranges
+  if (resume)
+    return file_size > 0;
+
+  return s->transfer_connections > 1 && file_size > TRANSFER_RANGE_SIZE;
+}
+
+static gchar* get_resume_state_path(GFile* file)
+{
+  gc_free gchar* path = g_file_get_path(file);
+
+  return g_strconcat(path, ".megatools-resume", NULL);
+}
+
+// Open local file for writing the download to. If the file exists and resume
+// is enabled, it's reopened for writing if there's a resume state for it. In
+// that case io_stream is set and must be kept alive while writing.
+static GOutputStream* open_download_file(mega_session* s, GFile* file, GFileIOStream** io_stream, gchar** state_path, GError** err)
+{
+  GError* local_err = NULL;
+  gc_free gchar* path = g_file_get_path(file);
+
+  if (s->resume_transfers)
+    *state_path = get_resume_state_path(file);
+
+  if (g_file_query_exists(file, NULL))
+  {
+    if (!*state_path || !g_file_test(*state_path, G_FILE_TEST_IS_REGULAR))
+    {
+      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Local file already exists: %s", path);
+      return NULL;
+    }
+
+    *io_stream = g_file_open_readwrite(file, NULL, &local_err);
+    if (!*io_stream)
+    {
+      g_propagate_prefixed_error(err, local_err, "Can't open local file %s for writing: ", path);
+      return NULL;
+    }
+
+    return g_object_ref(g_io_stream_get_output_stream(G_IO_STREAM(*io_stream)));
+  }
+
+  GFileOutputStream* stream = g_file_create(file, 0, NULL, &local_err);
+  if (!stream)
+  {
+    g_propagate_prefixed_error(err, local_err, "Can't open local file %s for writing: ", path);
+    return NULL;
+  }
+
+  return G_OUTPUT_STREAM(stream);
+}
+
+// }}}
+// {{{ mega_session_get
+
+struct _get_data
+{
+  mega_session* s;
+  GOutputStream* stream;
+  EVP_CIPHER_CTX* ctr;
+  chunked_cbc_mac mac;
+};
+
+static gsize get_process_data(gpointer buffer, gsize size, struct _get_data* data)
+{
+  gc_error_free GError* local_err = NULL;
+
+  aes_ctr_decrypt_mac(data->ctr, &data->mac, buffer, size);
+
+  init_status(data->s, MEGA_STATUS_DATA);
+  data->s->status_data.data.size = size;
+  data->s->status_data.data.buf = buffer;
+  if (send_status(data->s)) 
+    return 0;
+
+  if (!data->stream)
+    return size;
+
+  if (!g_output_stream_write_all(data->stream, buffer, size, NULL, NULL, &local_err))
+  {
+    g_printerr("ERROR: Failed writing to stream: %s\n", local_err->message);
+    return 0;
+  }
+
+  return size;
+}
+
+gboolean mega_session_get(mega_session* s, const gchar* local_path, const gchar* remote_path, GError** err)
+{
+  struct _get_data data;
+  GError* local_err = NULL;
+  gc_object_unref GFile* file = NULL;
+  gc_object_unref GFileIOStream* io_stream = NULL;
+  gc_object_unref GOutputStream* stream = NULL;
+  gboolean remove_file = FALSE;
+  gc_free gchar* get_node = NULL, *url = NULL, *state_path = NULL;
+  gc_http_free http* h = NULL;
+  gc_evp_cipher_ctx_free EVP_CIPHER_CTX* ctr = NULL;
+
+  g_return_val_if_fail(s != NULL, FALSE);
+  g_return_val_if_fail(remote_path != NULL, FALSE);
+  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+  memset(&data, 0, sizeof(data));
+  data.s = s;
+
+  mega_node* n = mega_session_stat(s, remote_path);
+  if (!n)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Remote file not found: %s", remote_path);
+    return FALSE;
+  }
+
+  init_status(s, MEGA_STATUS_FILEINFO);
+  s->status_data.fileinfo.name = n->name;
+  s->status_data.fileinfo.size = n->size;
+  if (send_status(s)) 
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Operation cancelled from status callback");
+    return FALSE;
+  }
+
+  if (local_path)
+  {
+    file = g_file_new_for_path(local_path);
+    if (g_file_query_file_type(file, 0, NULL) == G_FILE_TYPE_DIRECTORY)
+    {
+      GFile* child = g_file_get_child(file, n->name);
+
+      g_object_unref(file);
+      file = child;
+    }
+
+    data.stream = stream = open_download_file(s, file, &io_stream, &state_path, err);
+    if (!data.stream)
+      return FALSE;
+  }
+
+  remove_file = TRUE;
+
+  // initialize decrytpion key/state
+  guchar aes_key[16], nonce[8], meta_mac_xor[8];
+  unpack_node_key(n->key, aes_key, nonce, meta_mac_xor);
+  data.ctr = ctr = aes_ctr_new(aes_key);
+  aes_ctr_seek(ctr, nonce, 0);
+  chunked_cbc_mac_init8(&data.mac, aes_key, nonce);
+
+  // prepare request
+  get_node = api_call(s, 'o', NULL, &local_err, "[{a:g, g:1, ssl:0, n:%s}]", n->handle);
+  if (!get_node)
+  {
+    g_propagate_error(err, local_err);
+    goto err;
+  }
+
+  gint64 file_size = s_json_get_member_int(get_node, "s", -1);
+  if (file_size < 0)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't determine file size");
+    goto err;
+  }
+
+  url = s_json_get_member_string(get_node, "g");
+  if (!url)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't determine download url");
+    goto err;
+  }
+
+  guchar meta_mac_xor_calc[8];
+  if (can_download_parallel(s, data.stream, file_size, state_path != NULL))
+  {
+    if (!download_parallel(s, url, file_size, aes_key, nonce, file, data.stream, state_path, meta_mac_xor_calc, err))
+      goto err;
+  }
+  else
+  {
+    // perform download, MAC is calculated inline by aes_ctr_decrypt_mac
+    h = http_new();
+    http_set_progress_callback(h, (http_progress_fn)progress_generic, s);
+    gboolean downloaded = http_post_stream_download(h, url, (http_data_fn)get_process_data, &data, &local_err);
+    chunked_cbc_mac_finish8(&data.mac, meta_mac_xor_calc);
+    if (!downloaded)
+    {
+      g_propagate_prefixed_error(err, local_err, "Data download failed: ");
+      goto err;
+    }
+  }
+
+  if (file)
+  {
+    if (!g_output_stream_close(data.stream, NULL, &local_err))
+    {
+      g_propagate_prefixed_error(err, local_err, "Can't close downloaded file: ");
+      goto err;
+    }
+  }
+
+  // check mac of the downloaded file, data can't be reused on mismatch
+  if (state_path)
+    g_unlink(state_path);
+
+  if (memcmp(meta_mac_xor, meta_mac_xor_calc, 8) != 0) 
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "MAC mismatch");
+    goto err;
+  }
+
+  return TRUE;
+
+err:
+  // keep partial file if it can be resumed later
+  if (file && remove_file && !(state_path && g_file_test(state_path, G_FILE_TEST_EXISTS)))
+    g_file_delete(file, NULL, NULL);
+
+  return FALSE;
+}
+
+// }}}
+// {{{ mega_transfer_queue
+
+// Transfers of many files at once. Data of up to max_transfers files is
+// transferred concurrently on a single thread using http_multi. API calls
+// are never made while http_multi is driven: upload/download urls of the
+// next max_transfers queued files are fetched in a single batch when there
+// are no fetched ones left to start, and nodes for finished uploads are
+// created in the same batch (or when nothing is running). Big and
+// resumable transfers that would be split into ranges by
+// mega_session_put/get are done by them one by one when no other transfer
+// is running.
+
+struct _mega_transfer_queue
+{
+  mega_session* s;
+  gint max_transfers;
+  // queued transfers
+  GQueue* pending;
+  // transfers with url, ready to be started
+  GQueue* ready;
+  // uploaded data waiting for node creation
+  GQueue* finished;
+  GQueue* exclusive;
+  http_multi* multi;
+
+  mega_transfer_done_fn done_cb;
+  gpointer done_data;
+};
+
+typedef struct
+{
+  mega_transfer_queue* q;
+  gboolean upload;
+  gchar* local_path;
+  gchar* remote_path;
+
+  http* h;
+  gchar* url;
+  guchar aes_key[16];
+  guchar nonce[8];
+
+  // upload
+  struct _put_data put;
+  mega_node* parent_node;
+  gchar* file_name;
+  goffset file_size;
+  GString* up_handle;
+  guchar meta_mac[16];
+
+  // download
+  struct _get_data get;
+  GFile* file;
+  guchar meta_mac_xor[8];
+} mega_transfer;
+
+static mega_transfer* mega_transfer_new(mega_transfer_queue* q, gboolean upload, const gchar* local_path, const gchar* remote_path)
+{
+  mega_transfer* t = g_new0(mega_transfer, 1);
+
+  t->q = q;
+  t->upload = upload;
+  t->local_path = g_strdup(local_path);
+  t->remote_path = g_strdup(remote_path);
+
+  return t;
+}
+
+static void mega_transfer_free(mega_transfer* t)
+{
+  if (!t)
+    return;
+
+  http_free(t->h);
+
+  if (t->put.ctr)
+    EVP_CIPHER_CTX_free(t->put.ctr);
+  if (t->put.stream)
+    g_object_unref(t->put.stream);
+  if (t->up_handle)
+    g_string_free(t->up_handle, TRUE);
+
+  if (t->get.ctr)
+    EVP_CIPHER_CTX_free(t->get.ctr);
+  if (t->get.stream)
+    g_object_unref(t->get.stream);
+  if (t->file)
+    g_object_unref(t->file);
+
+  g_free(t->url);
+  g_free(t->file_name);
+  g_free(t->local_path);
+  g_free(t->remote_path);
+  memset(t, 0, sizeof(mega_transfer));
+  g_free(t);
+}
+
+static void mega_transfer_done(mega_transfer* t, GError* error)
+{
+  mega_transfer_queue* q = t->q;
+
+  if (q->done_cb)
+    q->done_cb(t->local_path, t->remote_path, error, q->done_data);
+
+  mega_transfer_free(t);
+}
+
+// partially written download file is removed
+static void mega_transfer_fail(mega_transfer* t, GError* error)
+{
+  if (t->get.stream)
+  {
+    g_output_stream_close(t->get.stream, NULL, NULL);
+    g_file_delete(t->file, NULL, NULL);
+  }
+
+  mega_transfer_done(t, error);
+}
+
+static gboolean mega_transfer_send_progress(mega_transfer_queue* q, const gchar* path, goffset total, goffset now)
+{
+  init_status(q->s, MEGA_STATUS_TRANSFER);
+  q->s->status_data.transfer.path = path;
+  q->s->status_data.transfer.total = total;
+  q->s->status_data.transfer.done = now;
+  q->s->status_data.transfer.running = http_multi_get_running(q->multi);
+  q->s->status_data.transfer.queued = g_queue_get_length(q->pending) + g_queue_get_length(q->ready) + g_queue_get_length(q->exclusive);
+
+  return !send_status(q->s);
+}
+
+static gboolean mega_transfer_progress(goffset total, goffset now, mega_transfer* t)
+{
+  return mega_transfer_send_progress(t->q, t->local_path, total, now);
+}
+
+static gboolean mega_transfer_queue_progress(goffset total, goffset now, mega_transfer_queue* q)
+{
+  return mega_transfer_send_progress(q, NULL, total, now);
+}
+
+// node is created later, from mega_transfer_queue_sync
+static void mega_transfer_put_done(http* h, GString* response, GError* error, mega_transfer* t)
+{
+  GError* local_err = NULL;
+
+  chunked_cbc_mac_finish(&t->put.mac, t->meta_mac);
+
+  if (!response)
+  {
+    local_err = g_error_copy(error);
+    g_prefix_error(&local_err, "Data upload failed: ");
+  }
+  else if (put_check_handle(response, &local_err))
+  {
+    t->up_handle = g_string_new_len(response->str, response->len);
+    g_queue_push_tail(t->q->finished, t);
+    return;
+  }
+
+  mega_transfer_done(t, local_err);
+  g_clear_error(&local_err);
+}
+
+static void mega_transfer_get_done(http* h, GString* response, GError* error, mega_transfer* t)
+{
+  GError* local_err = NULL;
+  guchar meta_mac_xor_calc[8];
+
+  chunked_cbc_mac_finish8(&t->get.mac, meta_mac_xor_calc);
+
+  if (error)
+  {
+    local_err = g_error_copy(error);
+    g_prefix_error(&local_err, "Data download failed: ");
+  }
+  else if (!g_output_stream_close(t->get.stream, NULL, &local_err))
+    g_prefix_error(&local_err, "Can't close downloaded file: ");
+  else if (memcmp(t->meta_mac_xor, meta_mac_xor_calc, 8) != 0)
+    g_set_error(&local_err, MEGA_ERROR, MEGA_ERROR_OTHER, "MAC mismatch");
+
+  if (local_err)
+    mega_transfer_fail(t, local_err);
+  else
+    mega_transfer_done(t, NULL);
+
+  g_clear_error(&local_err);
+}
+
+static void mega_transfer_url_done(mega_session* s, const gchar* result, GError* error, mega_transfer* t)
+{
+  GError* local_err = NULL;
+
+  if (error)
+  {
+    mega_transfer_fail(t, error);
+    return;
+  }
+
+  t->url = s_json_get_member_string(result, t->upload ? "p" : "g");
+  if (!t->url)
+  {
+    g_set_error(&local_err, MEGA_ERROR, MEGA_ERROR_OTHER, t->upload ? "Can't determine upload url" : "Can't determine download url");
+    mega_transfer_fail(t, local_err);
+    g_clear_error(&local_err);
+    return;
+  }
+
+  g_queue_push_tail(t->q->ready, t);
+}
+
+static void mega_transfer_node_done(mega_session* s, const gchar* result, GError* error, mega_transfer* t)
+{
+  GError* local_err = NULL;
+
+  if (error)
+    local_err = g_error_copy(error);
+  else
+    put_add_node(s, t->parent_node, result, &local_err);
+
+  mega_transfer_done(t, local_err);
+  g_clear_error(&local_err);
+}
+
+// open the local file and queue the url request, returns FALSE if the
+// transfer has to be done exclusively
+static gboolean mega_transfer_prepare_put(mega_transfer* t, api_batch* batch, GError** err)
+{
+  mega_session* s = t->q->s;
+  GError* local_err = NULL;
+
+  t->parent_node = put_get_target(s, t->remote_path, t->local_path, &t->file_name, err);
+  if (!t->parent_node)
+    return TRUE;
+
+  gc_object_unref GFile* file = g_file_new_for_path(t->local_path);
+  t->put.stream = g_file_read(file, NULL, &local_err);
+  if (!t->put.stream)
+  {
+    g_propagate_prefixed_error(err, local_err, "Can't read local file %s: ", t->local_path);
+    return TRUE;
+  }
+
+  gc_object_unref GFileInfo* info = g_file_input_stream_query_info(t->put.stream, G_FILE_ATTRIBUTE_STANDARD_SIZE, NULL, &local_err);
+  if (!info)
+  {
+    g_propagate_prefixed_error(err, local_err, "Can't read local file %s: ", t->local_path);
+    return TRUE;
+  }
+
+  t->file_size = g_file_info_get_size(info);
+
+  if ((s->resume_transfers && t->file_size > 0) || (s->transfer_connections > 1 && t->file_size > TRANSFER_RANGE_SIZE))
+    return FALSE;
+
+  gc_free guchar* aes_key = make_random_key();
+  gc_free guchar* nonce = make_random_key();
+  memcpy(t->aes_key, aes_key, 16);
+  memcpy(t->nonce, nonce, 8);
+
+  api_batch_add(batch, 'o', (api_batch_fn)mega_transfer_url_done, t, "{a:u, ssl:0, ms:0, s:%i, r:0, e:0}", (gint64)t->file_size);
+
+  return TRUE;
+}
+
+static gboolean mega_transfer_prepare_get(mega_transfer* t, api_batch* batch, GError** err)
+{
+  mega_session* s = t->q->s;
+  GFileIOStream* io_stream = NULL;
+  gc_free gchar* state_path = NULL;
+
+  mega_node* n = mega_session_stat(s, t->remote_path);
+  if (!n)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Remote file not found: %s", t->remote_path);
+    return TRUE;
+  }
+
+  if (s->resume_transfers || (s->transfer_connections > 1 && n->size > TRANSFER_RANGE_SIZE))
+    return FALSE;
+
+  t->file = g_file_new_for_path(t->local_path);
+  if (g_file_query_file_type(t->file, 0, NULL) == G_FILE_TYPE_DIRECTORY)
+  {
+    GFile* child = g_file_get_child(t->file, n->name);
+
+    g_object_unref(t->file);
+    t->file = child;
+  }
+
+  t->get.s = s;
+  t->get.stream = open_download_file(s, t->file, &io_stream, &state_path, err);
+  if (!t->get.stream)
+    return TRUE;
+
+  unpack_node_key(n->key, t->aes_key, t->nonce, t->meta_mac_xor);
+
+  api_batch_add(batch, 'o', (api_batch_fn)mega_transfer_url_done, t, "{a:g, g:1, ssl:0, n:%s}", n->handle);
+
+  return TRUE;
+}
+
+static void mega_transfer_prepare(mega_transfer* t, api_batch* batch)
+{
+  GError* local_err = NULL;
+  gboolean concurrent;
+
+  if (t->upload)
+    concurrent = mega_transfer_prepare_put(t, batch, &local_err);
+  else
+    concurrent = mega_transfer_prepare_get(t, batch, &local_err);
+
+  if (!concurrent)
+  {
+    // start over when nothing else is running
+    mega_transfer* nt = mega_transfer_new(t->q, t->upload, t->local_path, t->remote_path);
+
+    g_queue_push_tail(t->q->exclusive, nt);
+    mega_transfer_free(t);
+  }
+  else if (local_err)
+  {
+    mega_transfer_fail(t, local_err);
+    g_clear_error(&local_err);
+  }
+}
+
+// start transferring data, no API calls are made here
+static void mega_transfer_start(mega_transfer* t)
+{
+  GError* local_err = NULL;
+
+  t->h = http_new();
+  http_set_progress_callback(t->h, (http_progress_fn)mega_transfer_progress, t);
+
+  if (t->upload)
+  {
+    t->put.ctr = aes_ctr_new(t->aes_key);
+    aes_ctr_seek(t->put.ctr, t->nonce, 0);
+    chunked_cbc_mac_init8(&t->put.mac, t->aes_key, t->nonce);
+
+    http_set_content_type(t->h, "application/octet-stream");
+    if (!http_multi_add_upload(t->q->multi, t->h, t->url, t->file_size, (http_data_fn)put_process_data, &t->put, (http_done_fn)mega_transfer_put_done, t))
+      g_set_error(&local_err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't start upload");
+  }
+  else
+  {
+    t->get.ctr = aes_ctr_new(t->aes_key);
+    aes_ctr_seek(t->get.ctr, t->nonce, 0);
+    chunked_cbc_mac_init8(&t->get.mac, t->aes_key, t->nonce);
+
+    if (!http_multi_add_download(t->q->multi, t->h, t->url, (http_data_fn)get_process_data, &t->get, (http_done_fn)mega_transfer_get_done, t))
+      g_set_error(&local_err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't start download");
+  }
+
+  if (local_err)
+  {
+    mega_transfer_fail(t, local_err);
+    g_clear_error(&local_err);
+  }
+}
+
+// create nodes for finished uploads and fetch urls for up to max_transfers
+// queued transfers in a single batch
+static void mega_transfer_queue_sync(mega_transfer_queue* q, gboolean prefetch)
+{
+  GError* local_err = NULL;
+  gc_api_batch_free api_batch* batch = api_batch_new(q->s);
+  gint i;
+
+  while (!g_queue_is_empty(q->finished))
+  {
+    mega_transfer* t = g_queue_pop_head(q->finished);
+    gc_free gchar* cmd = put_node_cmd(q->s, t->parent_node, t->file_name, t->local_path, t->up_handle, t->aes_key, t->nonce, t->meta_mac);
+
+    api_batch_add(batch, 'o', (api_batch_fn)mega_transfer_node_done, t, "%j", cmd);
+  }
+
+  for (i = 0; prefetch && i < q->max_transfers && !g_queue_is_empty(q->pending); i++)
+    mega_transfer_prepare(g_queue_pop_head(q->pending), batch);
+
+  // errors are passed to the callbacks
+  api_batch_flush(batch, &local_err);
+  g_clear_error(&local_err);
+}
+
+static void mega_transfer_run_exclusive(mega_transfer* t)
+{
+  GError* local_err = NULL;
+
+  if (t->upload)
+    mega_session_put(t->q->s, t->remote_path, t->local_path, &local_err);
+  else
+    mega_session_get(t->q->s, t->local_path, t->remote_path, &local_err);
+
+  mega_transfer_done(t, local_err);
+  g_clear_error(&local_err);
+}
+
+mega_transfer_queue* mega_transfer_queue_new(mega_session* s, gint max_transfers)
+{
+  g_return_val_if_fail(s != NULL, NULL);
+
+  mega_transfer_queue* q = g_new0(mega_transfer_queue, 1);
+
+  q->s = s;
+  q->max_transfers = MAX(max_transfers, 1);
+  q->pending = g_queue_new();
+  q->ready = g_queue_new();
+  q->finished = g_queue_new();
+  q->exclusive = g_queue_new();
+  q->multi = http_multi_new();
+  http_multi_set_progress_callback(q->multi, (http_progress_fn)mega_transfer_queue_progress, q);
+
+  return q;
+}
+
+void mega_transfer_queue_set_done_callback(mega_transfer_queue* q, mega_transfer_done_fn cb, gpointer userdata)
+{
+  g_return_if_fail(q != NULL);
+
+  q->done_cb = cb;
+  q->done_data = userdata;
+}
+
+void mega_transfer_queue_put(mega_transfer_queue* q, const gchar* remote_path, const gchar* local_path)
+{
+  g_return_if_fail(q != NULL);
+  g_return_if_fail(remote_path != NULL);
+  g_return_if_fail(local_path != NULL);
+
+  g_queue_push_tail(q->pending, mega_transfer_new(q, TRUE, local_path, remote_path));
+}
+
+void mega_transfer_queue_get(mega_transfer_queue* q, const gchar* local_path, const gchar* remote_path)
+{
+  g_return_if_fail(q != NULL);
+  g_return_if_fail(local_path != NULL);
+  g_return_if_fail(remote_path != NULL);
+
+  g_queue_push_tail(q->pending, mega_transfer_new(q, FALSE, local_path, remote_path));
+}
+
+// run until all queued transfers are finished, errors of individual
+// transfers are passed to the done callback
+gboolean mega_transfer_queue_run(mega_transfer_queue* q, GError** err)
+{
+  GError* local_err = NULL;
+
+  g_return_val_if_fail(q != NULL, FALSE);
+  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+  if (!q->multi)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't initialize transfers");
+    return FALSE;
+  }
+
+  while (!g_queue_is_empty(q->pending) || !g_queue_is_empty(q->ready) || !g_queue_is_empty(q->finished) || !g_queue_is_empty(q->exclusive) || http_multi_get_running(q->multi) > 0)
+  {
+    gint running = http_multi_get_running(q->multi);
+    gboolean prefetch = g_queue_is_empty(q->ready) && !g_queue_is_empty(q->pending) && running < q->max_transfers;
+
+    if (prefetch || (running == 0 && !g_queue_is_empty(q->finished)))
+      mega_transfer_queue_sync(q, prefetch);
+
+    while (!g_queue_is_empty(q->ready) && http_multi_get_running(q->multi) < q->max_transfers)
+      mega_transfer_start(g_queue_pop_head(q->ready));
+
+    if (http_multi_get_running(q->multi) == 0)
+    {
+      if (g_queue_is_empty(q->pending) && g_queue_is_empty(q->finished) && !g_queue_is_empty(q->exclusive))
+        mega_transfer_run_exclusive(g_queue_pop_head(q->exclusive));
+
+      continue;
+    }
+
+    if (!http_multi_perform(q->multi, 1000, &local_err))
+    {
+      g_propagate_error(err, local_err);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+void mega_transfer_queue_free(mega_transfer_queue* q)
+{
+  if (!q)
+    return;
+
+  // running transfers are aborted, their done callbacks free them
+  http_multi_free(q->multi);
+  g_queue_free_full(q->pending, (GDestroyNotify)mega_transfer_free);
+  g_queue_free_full(q->ready, (GDestroyNotify)mega_transfer_free);
+  g_queue_free_full(q->finished, (GDestroyNotify)mega_transfer_free);
+  g_queue_free_full(q->exclusive, (GDestroyNotify)mega_transfer_free);
+  memset(q, 0, sizeof(mega_transfer_queue));
+  g_free(q);
+}
+
+// }}}
+// {{{ mega_session_dl
+
+struct _dl_data
+{
+  mega_session* s;
+  GOutputStream* stream;
+  EVP_CIPHER_CTX* ctr;
+  chunked_cbc_mac mac;
+};
+
+static gsize dl_process_data(gpointer buffer, gsize size, struct _dl_data* data)
+{
+  gc_error_free GError* local_err = NULL;
+
+  aes_ctr_decrypt_mac(data->ctr, &data->mac, buffer, size);
+
+  init_status(data->s, MEGA_STATUS_DATA);
+  data->s->status_data.data.size = size;
+  data->s->status_data.data.buf = buffer;
+  if (send_status(data->s)) 
+    return 0;
+
+  if (!data->stream)
+    return size;
+
+  if (!g_output_stream_write_all(data->stream, buffer, size, NULL, NULL, &local_err))
+  {
+    g_printerr("ERROR: Failed writing to stream: %s\n", local_err->message);
+    return 0;
+  }
+
+  return size;
+}
+
+gboolean mega_session_dl(mega_session* s, const gchar* handle, const gchar* key, const gchar* local_path, GError** err)
+{
+  struct _dl_data data;
+  GError* local_err = NULL;
+  gc_object_unref GFile *parent_dir = NULL, *file = NULL;
+  gboolean remove_file = FALSE;
+  gc_free gchar *node_name = NULL, *dl_node = NULL, *url = NULL, *at = NULL, *state_path = NULL;
+  gc_free guchar* node_key = NULL;
+  gc_http_free http* h = NULL;
+  gc_object_unref GFileIOStream* io_stream = NULL;
+  gc_object_unref GOutputStream* stream = NULL;
+  gc_evp_cipher_ctx_free EVP_CIPHER_CTX* ctr = NULL;
+
+  g_return_val_if_fail(s != NULL, FALSE);
+  g_return_val_if_fail(handle != NULL, FALSE);
+  g_return_val_if_fail(key != NULL, FALSE);
+  g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
+
+  memset(&data, 0, sizeof(data));
+  data.s = s;
+
+  if (local_path)
+  {
+    // get dir and filename to download to
+    file = g_file_new_for_path(local_path);
+    if (g_file_query_exists(file, NULL))
+    {
+      // existing files are only reused if the download can be resumed
+      if (g_file_query_file_type(file, 0, NULL) == G_FILE_TYPE_DIRECTORY)
+      {
+        parent_dir = file;
+        file = NULL;
+      }
+    }
+    else
+    {
+      parent_dir = g_file_get_parent(file);
+
+      if (g_file_query_file_type(parent_dir, 0, NULL) != G_FILE_TYPE_DIRECTORY)
+      {
+        g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't download file into: %s", g_file_get_path(parent_dir));
+        return FALSE;
+      }
+    }
+  }
+
+  // prepare request
+  dl_node = api_call(s, 'o', NULL, &local_err, "[{a:g, g:1, ssl:0, p:%s}]", handle);
+  if (!dl_node)
+  {
+    g_propagate_error(err, local_err);
+    goto err;
+  }
+
+  // get file size
+  gint64 file_size = s_json_get_member_int(dl_node, "s", -1);
+  if (file_size < 0)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't determine file size");
+    goto err;
+  }
+
+  url = s_json_get_member_string(dl_node, "g");
+  if (!url)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't determine download url");
+    goto err;
+  }
+
+  at = s_json_get_member_string(dl_node, "at");
+  if (!at)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't get file attributes");
+    goto err;
+  }
+
+  // decode node_key
+  gsize node_key_len = 0;
+  node_key = base64urldecode(key, &node_key_len);
+  if (!node_key || node_key_len != 32)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't retrieve file key");
+    goto err;
+  }
+
+  // initialize decrytpion key
+  guchar aes_key[16], nonce[8], meta_mac_xor[8];
+  unpack_node_key(node_key, aes_key, nonce, meta_mac_xor);
+
+  // decrypt attributes with aes_key
+  if (!decrypt_node_attrs(at, aes_key, &node_name))
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid key");
+    goto err;
+  }
+
+  if (!node_name)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't retrieve remote file name");
+    goto err;
+  }
+
+  init_status(s, MEGA_STATUS_FILEINFO);
+  s->status_data.fileinfo.name = node_name;
+  s->status_data.fileinfo.size = file_size;
+  if (send_status(s)) 
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Operation cancelled from status callback");
+    goto err;
+  }
+
+  // check for invalid characters in filename
+#ifdef G_OS_WIN32
+  if (strpbrk(node_name, "/\\<>:\"|?*") || !strcmp(node_name, ".") || !strcmp(node_name, ".."))
+#else
+  if (strpbrk(node_name, "/") || !strcmp(node_name, ".") || !strcmp(node_name, "..")) 
+#endif
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Remote file name is invalid: '%s'", node_name);
+    goto err;
+  }
+
+  if (local_path)
+  {
+    if (!file)
+      file = g_file_get_child(parent_dir, node_name);
+  }
+
+  if (local_path)
+  {
+    // open local file for writing
+    data.stream = stream = open_download_file(s, file, &io_stream, &state_path, err);
+    if (!data.stream)
+      goto err;
+  }
+
+  remove_file = TRUE;
+
+  // initialize decryption and mac calculation
+  data.ctr = ctr = aes_ctr_new(aes_key);
+  aes_ctr_seek(ctr, nonce, 0);
+  chunked_cbc_mac_init8(&data.mac, aes_key, nonce);
+
+  guchar meta_mac_xor_calc[8];
+  if (can_download_parallel(s, data.stream, file_size, state_path != NULL))
+  {
+    if (!download_parallel(s, url, file_size, aes_key, nonce, file, data.stream, state_path, meta_mac_xor_calc, err))
+      goto err;
+  }
+  else
+  {
+    // perform download, MAC is calculated inline by aes_ctr_decrypt_mac
+    h = http_new();
+    http_set_progress_callback(h, (http_progress_fn)progress_generic, s);
+    gboolean downloaded = http_post_stream_download(h, url, (http_data_fn)dl_process_data, &data, &local_err);
+    chunked_cbc_mac_finish8(&data.mac, meta_mac_xor_calc);
+    if (!downloaded)
+    {
+      g_propagate_prefixed_error(err, local_err, "Data download failed: ");
+      goto err;
+    }
+  }
+
+  if (data.stream)
+  {
+    if (!g_output_stream_close(data.stream, NULL, &local_err))
+    {
+      g_propagate_prefixed_error(err, local_err, "Can't close downloaded file: ");
+      goto err;
+    }
+  }
+
+  // check mac of the downloaded file, data can't be reused on mismatch
+  if (state_path)
+    g_unlink(state_path);
+
+  if (memcmp(meta_mac_xor, meta_mac_xor_calc, 8) != 0) 
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "MAC mismatch");
     goto err;
   }
 
-  url = s_json_get_member_string(dl_node, "g");
-  if (!url)
+  return TRUE;
+
+err:
+  // keep partial file if it can be resumed later
+  if (file && remove_file && !(state_path && g_file_test(state_path, G_FILE_TEST_EXISTS)))
+      g_file_delete(file, NULL, NULL);
+
+  return FALSE;
+}
+
+// }}}
+
+// {{{ mega_node_get_link
+
+gchar* mega_node_get_link(mega_node* n, gboolean include_key)
+{
+  g_return_val_if_fail(n != NULL, NULL);
+
+  if (n->link)
+  {
+    if (include_key && n->key)
+    {
+      gc_free gchar* key = mega_node_get_key(n);
+
+      return g_strdup_printf("https://mega.co.nz/#!%s!%s", n->link, key);
+    }
+
+    return g_strdup_printf("https://mega.co.nz/#!%s", n->link);
+  }
+
+  return NULL;
+}
+
+// }}}
+// {{{ mega_node_get_key
+
+gchar* mega_node_get_key(mega_node* n)
+{
+  g_return_val_if_fail(n != NULL, NULL);
+
+  if (n->key)
+    return base64urlencode(n->key, n->key_len);
+
+  return NULL;
+}
+
+// }}}
+// {{{ mega_node_get_path
+
+gchar* mega_node_get_path_dup(mega_node* n)
+{
+  gchar path[4096];
+
+  if (mega_node_get_path(n, path, sizeof(path)))
+    return g_strndup(path, sizeof(path));
+
+  return NULL;
+}
+
+gboolean mega_node_get_path(mega_node* n, gchar* buf, gsize len)
+{
+  g_return_val_if_fail(n != NULL, FALSE);
+
+  // count parents
+  gint n_parents = 0;
+  mega_node* it = n;
+  while (it)
+  {
+    n_parents++;
+    it = it->parent;
+  }
+
+  // allocate pointer list on stack
+  mega_node** parents = g_alloca(sizeof(mega_node*) * n_parents);
+
+  // get parents into the pointer list
+  it = n;
+  n_parents = 0;
+  while (it)
+  {
+    parents[n_parents++] = it;
+    it = it->parent;
+  }
+
+  // reverse iteration
+  gint i;
+  gchar* p = buf;
+  for (i = n_parents - 1; i >= 0; i--) 
   {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't determine download url");
-    goto err;
+    it = parents[i];
+    gint name_len = strlen(it->name);
+    gint remaining_buf_len = len - (p - buf);
+
+    if (remaining_buf_len < name_len + 2)
+      return FALSE;
+
+    *p = '/';
+    p += 1;
+
+    memcpy(p, it->name, name_len);
+    p += name_len;
   }
 
-  at = s_json_get_member_string(dl_node, "at");
-  if (!at)
+  *p = '\0';
+
+  return TRUE;
+}
+
+// }}}
+// {{{
+
+gboolean mega_node_is_container(mega_node* n)
+{
+	return n && n->type != MEGA_NODE_FILE;
+}
+
+// }}}
+
+// {{{ session cache format
+
+// The cache is a binary file that is mapped into memory and read
+// sequentially:
+//
+//   header: magic[8] version:u32 block_size:u32 data_len:u64 nonce[8] mac[32]
+//   blocks: ciphertext[block_size] mac[32], the last block may be shorter
+//
+// Data are encrypted with AES-128-CTR using the password key. Each block is
+// authenticated with HMAC-SHA256 over its index and ciphertext, so that it
+// can be verified and decrypted only when the reader gets to it. The header
+// MAC also serves as a password check.
+//
+// All integers are little endian, strings and byte arrays are prefixed with
+// u32 length, G_MAXUINT32 stands for NULL.
+
+#define CACHE_MAGIC "MEGACACH"
+#define CACHE_BLOCK_SIZE (64 * 1024)
+#define CACHE_MAC_SIZE 32
+#define CACHE_HEADER_SIZE (8 + 4 + 4 + 8 + 8 + CACHE_MAC_SIZE)
+#define CACHE_NULL G_MAXUINT32
+
+static gchar* get_cache_path(const gchar* email)
+{
+  gc_free gchar* un = g_ascii_strdown(email, -1);
+  gc_checksum_free GChecksum* cs = g_checksum_new(G_CHECKSUM_SHA1);
+  g_checksum_update(cs, un, -1);
+  gc_free gchar* filename = g_strconcat(g_checksum_get_string(cs), ".megatools.cache", NULL);
+
+  return g_build_filename(g_get_tmp_dir(), filename, NULL);
+}
+
+static void cache_mac_key(const guchar* password_key, guchar mac_key[CACHE_MAC_SIZE])
+{
+  GHmac* hmac = g_hmac_new(G_CHECKSUM_SHA256, password_key, 16);
+  gsize len = CACHE_MAC_SIZE;
+
+  g_hmac_update(hmac, "megatools cache", -1);
+  g_hmac_get_digest(hmac, mac_key, &len);
+  g_hmac_unref(hmac);
+}
+
+static void cache_mac(const guchar mac_key[CACHE_MAC_SIZE], guint64 index, const guchar* data, gsize len, guchar mac[CACHE_MAC_SIZE])
+{
+  GHmac* hmac = g_hmac_new(G_CHECKSUM_SHA256, mac_key, CACHE_MAC_SIZE);
+  guint64 index_le = GUINT64_TO_LE(index);
+  gsize mac_len = CACHE_MAC_SIZE;
+
+  g_hmac_update(hmac, (guchar*)&index_le, sizeof(index_le));
+  g_hmac_update(hmac, data, len);
+  g_hmac_get_digest(hmac, mac, &mac_len);
+  g_hmac_unref(hmac);
+}
+
+// }}}
+// {{{ cache writer
+
+static void cache_put_u32(GByteArray* b, guint32 v)
+{
+  v = GUINT32_TO_LE(v);
+  g_byte_array_append(b, (guchar*)&v, sizeof(v));
+}
+
+static void cache_put_u64(GByteArray* b, guint64 v)
+{
+  v = GUINT64_TO_LE(v);
+  g_byte_array_append(b, (guchar*)&v, sizeof(v));
+}
+
+static void cache_put_bytes(GByteArray* b, const guchar* data, gsize len)
+{
+  if (!data)
   {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't get file attributes");
-    goto err;
+    cache_put_u32(b, CACHE_NULL);
+    return;
   }
 
-  // decode node_key
-  gsize node_key_len = 0;
-  node_key = base64urldecode(key, &node_key_len);
-  if (!node_key || node_key_len != 32)
+  cache_put_u32(b, len);
+  g_byte_array_append(b, data, len);
+}
+
+static void cache_put_str(GByteArray* b, const gchar* str)
+{
+  cache_put_bytes(b, (const guchar*)str, str ? strlen(str) : 0);
+}
+
+static void cache_put_bn(GByteArray* b, BIGNUM* n)
+{
+  if (!n)
   {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't retrieve file key");
-    goto err;
+    cache_put_u32(b, CACHE_NULL);
+    return;
   }
 
-  // initialize decrytpion key
-  guchar aes_key[16], meta_mac_xor[8];
-  unpack_node_key(node_key, aes_key, data.iv, meta_mac_xor);
+  gsize len = BN_num_bytes(n);
+  gc_free guchar* data = g_malloc0(len + 1);
 
-  // decrypt attributes with aes_key
-  if (!decrypt_node_attrs(at, aes_key, &node_name))
+  BN_bn2bin(n, data);
+  cache_put_bytes(b, data, len);
+}
+
+static void cache_put_node(GByteArray* b, mega_node* n)
+{
+  cache_put_str(b, n->name);
+  cache_put_str(b, n->handle);
+  cache_put_str(b, n->parent_handle);
+  cache_put_str(b, n->user_handle);
+  cache_put_str(b, n->su_handle);
+  cache_put_bytes(b, n->key, n->key_len);
+  cache_put_u32(b, n->type);
+  cache_put_u64(b, n->size);
+  cache_put_u64(b, n->timestamp);
+  cache_put_str(b, n->link);
+}
+
+// encrypt and authenticate data, returns the whole cache file
+static GByteArray* cache_seal(GByteArray* data, const guchar* password_key, guchar nonce[8])
+{
+  guchar mac_key[CACHE_MAC_SIZE];
+  guchar mac[CACHE_MAC_SIZE];
+  guint64 off, index;
+
+  cache_mac_key(password_key, mac_key);
+  RAND_bytes(nonce, 8);
+
+  GByteArray* b = g_byte_array_sized_new(CACHE_HEADER_SIZE + data->len + (data->len / CACHE_BLOCK_SIZE + 1) * CACHE_MAC_SIZE);
+
+  g_byte_array_append(b, (guchar*)CACHE_MAGIC, 8);
+  cache_put_u32(b, CACHE_FORMAT_VERSION);
+  cache_put_u32(b, CACHE_BLOCK_SIZE);
+  cache_put_u64(b, data->len);
+  g_byte_array_append(b, nonce, 8);
+  cache_mac(mac_key, G_MAXUINT64, b->data, b->len, mac);
+  g_byte_array_append(b, mac, sizeof(mac));
+
+  gc_evp_cipher_ctx_free EVP_CIPHER_CTX* ctr = aes_ctr_new(password_key);
+  aes_ctr_seek(ctr, nonce, 0);
+
+  for (off = 0, index = 0; off < data->len; off += CACHE_BLOCK_SIZE, index++)
   {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid key");
-    goto err;
+    gsize len = MIN(CACHE_BLOCK_SIZE, data->len - off);
+    gsize pos = b->len;
+
+    g_byte_array_set_size(b, pos + len);
+    aes_ctr_crypt(ctr, data->data + off, b->data + pos, len);
+    cache_mac(mac_key, index, b->data + pos, len, mac);
+    g_byte_array_append(b, mac, sizeof(mac));
   }
 
-  if (!node_name)
+  return b;
+}
+
+// }}}
+// {{{ cache reader
+
+// reader without a file (blocks == NULL) reads just the current block
+typedef struct
+{
+  GMappedFile* file;
+  const guchar* blocks;
+  guint64 data_len;
+  guint64 block_size;
+  guchar nonce[8];
+  guchar mac_key[CACHE_MAC_SIZE];
+  EVP_CIPHER_CTX* ctr;
+
+  // currently decrypted block
+  guchar* block;
+  guint64 block_index;
+  gsize block_len;
+  gsize block_pos;
+
+  gboolean failed;
+} cache_reader;
+
+static void cache_reader_free(cache_reader* r)
+{
+  if (r)
   {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't retrieve remote file name");
-    goto err;
+    if (r->file)
+      g_mapped_file_unref(r->file);
+    if (r->ctr)
+      EVP_CIPHER_CTX_free(r->ctr);
+    g_free(r->block);
+    memset(r->mac_key, 0, sizeof(r->mac_key));
+    g_free(r);
   }
+}
 
-  init_status(s, MEGA_STATUS_FILEINFO);
-  s->status_data.fileinfo.name = node_name;
-  s->status_data.fileinfo.size = file_size;
-  if (send_status(s)) 
+DEFINE_CLEANUP_FUNCTION_NULL(cache_reader*, cache_reader_free)
+#define gc_cache_reader_free CLEANUP(cache_reader_free)
+
+static guint64 cache_header_u64(const guchar* p, gsize size)
+{
+  guint32 v32;
+  guint64 v64;
+
+  if (size == 4)
   {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Operation cancelled from status callback");
-    goto err;
+    memcpy(&v32, p, 4);
+    return GUINT32_FROM_LE(v32);
+  }
+
+  memcpy(&v64, p, 8);
+  return GUINT64_FROM_LE(v64);
+}
+
+// only the header is verified here, blocks are checked as they are read
+static cache_reader* cache_reader_open(const gchar* path, const guchar* password_key, GError** err)
+{
+  GError* local_err = NULL;
+  gc_cache_reader_free cache_reader* r = g_new0(cache_reader, 1);
+  guchar mac[CACHE_MAC_SIZE];
+
+  r->file = g_mapped_file_new(path, FALSE, &local_err);
+  if (!r->file)
+  {
+    g_propagate_error(err, local_err);
+    return NULL;
+  }
+
+  const guchar* data = (const guchar*)g_mapped_file_get_contents(r->file);
+  gsize len = g_mapped_file_get_length(r->file);
+
+  if (len < CACHE_HEADER_SIZE || memcmp(data, CACHE_MAGIC, 8))
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Corrupted cache file");
+    return NULL;
+  }
+
+  if (cache_header_u64(data + 8, 4) != CACHE_FORMAT_VERSION)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Cache version mismatch");
+    return NULL;
+  }
+
+  cache_mac_key(password_key, r->mac_key);
+  cache_mac(r->mac_key, G_MAXUINT64, data, CACHE_HEADER_SIZE - CACHE_MAC_SIZE, mac);
+  if (memcmp(mac, data + CACHE_HEADER_SIZE - CACHE_MAC_SIZE, CACHE_MAC_SIZE))
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Incorrect password");
+    return NULL;
+  }
+
+  r->block_size = cache_header_u64(data + 12, 4);
+  r->data_len = cache_header_u64(data + 16, 8);
+  memcpy(r->nonce, data + 24, 8);
+  r->blocks = data + CACHE_HEADER_SIZE;
+
+  guint64 n_blocks = r->block_size > 0 ? (r->data_len + r->block_size - 1) / r->block_size : 0;
+  if (r->block_size == 0 || r->block_size > 16 * 1024 * 1024 || len - CACHE_HEADER_SIZE != r->data_len + n_blocks * CACHE_MAC_SIZE)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Corrupted cache file");
+    return NULL;
+  }
+
+  r->ctr = aes_ctr_new(password_key);
+  r->block = g_malloc(r->block_size);
+
+  cache_reader* ret = r;
+  r = NULL;
+  return ret;
+}
+
+static gboolean cache_reader_next_block(cache_reader* r)
+{
+  guchar mac[CACHE_MAC_SIZE];
+  guint64 off = r->block_index * r->block_size;
+
+  if (!r->blocks || off >= r->data_len)
+    return FALSE;
+
+  const guchar* cipher = r->blocks + r->block_index * (r->block_size + CACHE_MAC_SIZE);
+  gsize len = MIN(r->block_size, r->data_len - off);
+
+  cache_mac(r->mac_key, r->block_index, cipher, len, mac);
+  if (memcmp(mac, cipher + len, CACHE_MAC_SIZE))
+    return FALSE;
+
+  aes_ctr_seek(r->ctr, r->nonce, off);
+  aes_ctr_crypt(r->ctr, cipher, r->block, len);
+
+  r->block_index++;
+  r->block_len = len;
+  r->block_pos = 0;
+
+  return TRUE;
+}
+
+static gboolean cache_get(cache_reader* r, gpointer out, gsize len)
+{
+  guchar* p = out;
+
+  while (len > 0 && !r->failed)
+  {
+    if (r->block_pos == r->block_len && !cache_reader_next_block(r))
+    {
+      r->failed = TRUE;
+      break;
+    }
+
+    gsize chunk = MIN(len, r->block_len - r->block_pos);
+
+    memcpy(p, r->block + r->block_pos, chunk);
+    r->block_pos += chunk;
+    p += chunk;
+    len -= chunk;
+  }
+
+  return !r->failed;
+}
+
+static guint32 cache_get_u32(cache_reader* r)
+{
+  guint32 v = 0;
+
+  cache_get(r, &v, sizeof(v));
+  return GUINT32_FROM_LE(v);
+}
+
+static guint64 cache_get_u64(cache_reader* r)
+{
+  guint64 v = 0;
+
+  cache_get(r, &v, sizeof(v));
+  return GUINT64_FROM_LE(v);
+}
+
+// read into a reusable buffer, returns NULL for NULL values
+static const guchar* cache_get_bytes_tmp(cache_reader* r, GByteArray* buf, gsize* len)
+{
+  guint32 l = cache_get_u32(r);
+
+  *len = 0;
+
+  if (r->failed || l == CACHE_NULL)
+    return NULL;
+
+  if (l > r->data_len)
+  {
+    r->failed = TRUE;
+    return NULL;
+  }
+
+  g_byte_array_set_size(buf, l + 1);
+  if (!cache_get(r, buf->data, l))
+    return NULL;
+
+  buf->data[l] = '\0';
+  *len = l;
+  return buf->data;
+}
+
+static const gchar* cache_get_str_tmp(cache_reader* r, GByteArray* buf)
+{
+  gsize len;
+
+  return (const gchar*)cache_get_bytes_tmp(r, buf, &len);
+}
+
+static gchar* cache_get_str(cache_reader* r, GByteArray* buf)
+{
+  return g_strdup(cache_get_str_tmp(r, buf));
+}
+
+static guchar* cache_get_bytes(cache_reader* r, GByteArray* buf, gsize* len)
+{
+  const guchar* data = cache_get_bytes_tmp(r, buf, len);
+
+  return data ? g_memdup(data, *len) : NULL;
+}
+
+static BIGNUM* cache_get_bn(cache_reader* r, GByteArray* buf)
+{
+  gsize len;
+  const guchar* data = cache_get_bytes_tmp(r, buf, &len);
+
+  return data ? BN_bin2bn(data, len, NULL) : NULL;
+}
+
+static mega_node* cache_get_node(cache_reader* r, GByteArray* buf, mega_session* s)
+{
+  mega_node* n = mega_node_new(s);
+  gsize len;
+
+  n->name = node_store_strdup(s->nodes, cache_get_str_tmp(r, buf));
+  n->handle = node_store_intern(s->nodes, cache_get_str_tmp(r, buf));
+  n->parent_handle = node_store_intern(s->nodes, cache_get_str_tmp(r, buf));
+  n->user_handle = node_store_intern(s->nodes, cache_get_str_tmp(r, buf));
+  n->su_handle = node_store_intern(s->nodes, cache_get_str_tmp(r, buf));
+  n->key = node_store_memdup(s->nodes, cache_get_bytes_tmp(r, buf, &len), len);
+  n->key_len = len;
+  n->type = (gint32)cache_get_u32(r);
+  n->size = cache_get_u64(r);
+  n->timestamp = cache_get_u64(r);
+  n->link = node_store_strdup(s->nodes, cache_get_str_tmp(r, buf));
+
+  if (r->failed || !n->handle)
+  {
+    mega_node_free(s, n);
+    return NULL;
+  }
+
+  return n;
+}
+
+// }}}
+// {{{ session cache log
+
+// Changes made after the cache was written are appended to a log file next
+// to it, instead of rewriting the whole cache:
+//
+//   header:  magic[8] snapshot_nonce[8] log_nonce[8] mac[32]
+//   records: len:u32 ciphertext[len] mac[32]
+//
+// Each record holds a single change, it is encrypted with AES-128-CTR at its
+// file offset and authenticated like the cache blocks. The log belongs to
+// the cache with the matching nonce and is merged into a new cache once it
+// gets too big.
+
+#define CACHE_LOG_MAGIC "MEGACLOG"
+#define CACHE_LOG_HEADER_SIZE (8 + 8 + 8 + CACHE_MAC_SIZE)
+#define CACHE_LOG_MIN_COMPACT (256 * 1024)
+
+enum
+{
+  CACHE_LOG_NODE = 'N',
+  CACHE_LOG_REMOVE = 'D',
+  CACHE_LOG_SHARE_KEY = 'K',
+  CACHE_LOG_STATE = 'S'
+};
+
+// whole cache will be rewritten on the next save
+static void cache_invalidate(mega_session* s)
+{
+  s->cache_dirty = TRUE;
+  g_byte_array_set_size(s->cache_log, 0);
+}
+
+static GByteArray* cache_log_new(mega_session* s, guchar op)
+{
+  if (s->cache_dirty)
+    return NULL;
+
+  GByteArray* rec = g_byte_array_new();
+  g_byte_array_append(rec, &op, 1);
+
+  return rec;
+}
+
+static void cache_log_add(mega_session* s, GByteArray* rec)
+{
+  cache_put_bytes(s->cache_log, rec->data, rec->len);
+  g_byte_array_unref(rec);
+}
+
+static void cache_log_node(mega_session* s, mega_node* n)
+{
+  GByteArray* rec = cache_log_new(s, CACHE_LOG_NODE);
+
+  if (rec)
+  {
+    cache_put_node(rec, n);
+    cache_log_add(s, rec);
+  }
+}
+
+static void cache_log_remove(mega_session* s, mega_node* n)
+{
+  GByteArray* rec = cache_log_new(s, CACHE_LOG_REMOVE);
+
+  if (rec)
+  {
+    cache_put_str(rec, n->handle);
+    cache_log_add(s, rec);
   }
+}
 
-  // check for invalid characters in filename
-#ifdef G_OS_WIN32
-  if (strpbrk(node_name, "/\\<>:\"|?*") || !strcmp(node_name, ".") || !strcmp(node_name, ".."))
-#else
-  if (strpbrk(node_name, "/") || !strcmp(node_name, ".") || !strcmp(node_name, "..")) 
-#endif
+static void cache_log_share_key(mega_session* s, const gchar* handle, const guchar* key)
+{
+  GByteArray* rec = cache_log_new(s, CACHE_LOG_SHARE_KEY);
+
+  if (rec)
   {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Remote file name is invalid: '%s'", node_name);
-    goto err;
+    cache_put_str(rec, handle);
+    cache_put_bytes(rec, key, 16);
+    cache_log_add(s, rec);
   }
+}
 
-  if (local_path)
+static void cache_log_state(mega_session* s)
+{
+  GByteArray* rec = cache_log_new(s, CACHE_LOG_STATE);
+
+  if (rec)
   {
-    if (!file)
-      file = g_file_get_child(parent_dir, node_name);
+    cache_put_u64(rec, s->last_refresh);
+    cache_put_str(rec, s->sn);
+    cache_log_add(s, rec);
   }
+}
 
-  if (local_path)
+static gboolean cache_log_should_compact(mega_session* s)
+{
+  gsize len = s->cache_log_len + s->cache_log->len;
+
+  return len > MAX(CACHE_LOG_MIN_COMPACT, s->cache_snapshot_len / 4);
+}
+
+// encrypt pending records and append them to the log file
+static gboolean cache_log_append(mega_session* s, const gchar* log_path, GError** err)
+{
+  guchar mac_key[CACHE_MAC_SIZE];
+  guchar mac[CACHE_MAC_SIZE];
+  gsize base = s->cache_log_len;
+  guint32 len;
+
+  cache_mac_key(s->password_key, mac_key);
+
+  gc_byte_array_unref GByteArray* b = g_byte_array_new();
+
+  if (base == 0)
   {
-    // open local file for writing
-    data.stream = stream = g_file_create(file, 0, NULL, &local_err);
-    if (!data.stream)
-    {
-      gc_free gchar* tmp = g_file_get_path(file);
+    RAND_bytes(s->cache_log_nonce, 8);
 
-      g_propagate_prefixed_error(err, local_err, "Can't open local file %s for writing: ", tmp);
-      goto err;
-    }
+    g_byte_array_append(b, (guchar*)CACHE_LOG_MAGIC, 8);
+    g_byte_array_append(b, s->cache_nonce, 8);
+    g_byte_array_append(b, s->cache_log_nonce, 8);
+    cache_mac(mac_key, G_MAXUINT64, b->data, b->len, mac);
+    g_byte_array_append(b, mac, sizeof(mac));
   }
 
-  remove_file = TRUE;
+  gc_evp_cipher_ctx_free EVP_CIPHER_CTX* ctr = aes_ctr_new(s->password_key);
+  const guchar* p = s->cache_log->data;
+  const guchar* end = p + s->cache_log->len;
 
-  // initialize decryption and mac calculation
-  AES_set_encrypt_key(aes_key, 128, &data.k);
-  chunked_cbc_mac_init8(&data.mac, aes_key, data.iv);
+  while (p < end)
+  {
+    memcpy(&len, p, 4);
+    len = GUINT32_FROM_LE(len);
+    p += 4;
 
-  // setup buffer
-  data.buffer = buffer = g_byte_array_new();
+    cache_put_u32(b, len);
 
-  // perform download
-  h = http_new();
-  http_set_progress_callback(h, (http_progress_fn)progress_generic, s);
-  if (!http_post_stream_download(h, url, (http_data_fn)dl_process_data, &data, &local_err))
-  {
-    g_propagate_prefixed_error(err, local_err, "Data download failed: ");
-    goto err;
+    guint64 off = base + b->len;
+    gsize pos = b->len;
+
+    g_byte_array_set_size(b, pos + len);
+    aes_ctr_seek(ctr, s->cache_log_nonce, off);
+    aes_ctr_crypt(ctr, p, b->data + pos, len);
+    cache_mac(mac_key, off, b->data + pos, len, mac);
+    g_byte_array_append(b, mac, sizeof(mac));
+
+    p += len;
   }
 
-  if (data.stream)
+  FILE* f = g_fopen(log_path, base == 0 ? "wb" : "ab");
+  if (!f)
   {
-    if (!g_output_stream_close(G_OUTPUT_STREAM(data.stream), NULL, &local_err))
-    {
-      g_propagate_prefixed_error(err, local_err, "Can't close downloaded file: ");
-      goto err;
-    }
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't open cache log %s", log_path);
+    return FALSE;
   }
 
-  // check mac of the downloaded file
-  guchar meta_mac_xor_calc[8];
-  chunked_cbc_mac_finish8(&data.mac, meta_mac_xor_calc);
-  if (memcmp(meta_mac_xor, meta_mac_xor_calc, 8) != 0) 
+  gboolean ok = fwrite(b->data, b->len, 1, f) == 1;
+  if (fclose(f) != 0 || !ok)
   {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "MAC mismatch");
-    goto err;
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Can't write cache log %s", log_path);
+    return FALSE;
   }
 
+  s->cache_log_len += b->len;
+  g_byte_array_set_size(s->cache_log, 0);
+
   return TRUE;
+}
 
-err:
-  if (file && remove_file)
-      g_file_delete(file, NULL, NULL);
+// apply logged changes on top of the loaded cache, returns FALSE if the log
+// doesn't belong to the cache or is damaged
+static gboolean cache_log_replay(mega_session* s, const gchar* log_path, const guchar* password_key)
+{
+  gc_free gchar* data = NULL;
+  gsize data_len = 0, off;
+  guchar mac_key[CACHE_MAC_SIZE];
+  guchar mac[CACHE_MAC_SIZE];
+  gboolean ok = TRUE;
+  guint i, j;
 
-  return FALSE;
-}
+  s->cache_log_len = 0;
 
-// }}}
+  if (!g_file_get_contents(log_path, &data, &data_len, NULL))
+    return !g_file_test(log_path, G_FILE_TEST_EXISTS);
 
-// {{{ mega_node_get_link
+  cache_mac_key(password_key, mac_key);
 
-gchar* mega_node_get_link(mega_node* n, gboolean include_key)
-{
-  g_return_val_if_fail(n != NULL, NULL);
+  if (data_len < CACHE_LOG_HEADER_SIZE || memcmp(data, CACHE_LOG_MAGIC, 8) || memcmp(data + 8, s->cache_nonce, 8))
+    return FALSE;
 
-  if (n->link)
-  {
-    if (include_key && n->key)
-    {
-      gc_free gchar* key = mega_node_get_key(n);
+  cache_mac(mac_key, G_MAXUINT64, (guchar*)data, CACHE_LOG_HEADER_SIZE - CACHE_MAC_SIZE, mac);
+  if (memcmp(mac, data + CACHE_LOG_HEADER_SIZE - CACHE_MAC_SIZE, CACHE_MAC_SIZE))
+    return FALSE;
 
-      return g_strdup_printf("https://mega.co.nz/#!%s!%s", n->link, key);
-    }
+  memcpy(s->cache_log_nonce, data + 16, 8);
+  s->cache_log_len = CACHE_LOG_HEADER_SIZE;
 
-    return g_strdup_printf("https://mega.co.nz/#!%s", n->link);
-  }
+  gc_evp_cipher_ctx_free EVP_CIPHER_CTX* ctr = aes_ctr_new(password_key);
+  gc_byte_array_unref GByteArray* buf = g_byte_array_new();
+  gc_byte_array_unref GByteArray* plain = g_byte_array_new();
+  gc_hash_table_unref GHashTable* handles = g_hash_table_new(g_str_hash, g_str_equal);
+  gc_hash_table_unref GHashTable* removed = g_hash_table_new(g_direct_hash, g_direct_equal);
 
-  return NULL;
-}
+  for (i = 0; i < s->fs_nodes->len; i++)
+  {
+    mega_node* n = s->fs_nodes->pdata[i];
 
-// }}}
-// {{{ mega_node_get_key
+    g_hash_table_insert(handles, n->handle, n);
+  }
 
-gchar* mega_node_get_key(mega_node* n)
-{
-  g_return_val_if_fail(n != NULL, NULL);
+  for (off = CACHE_LOG_HEADER_SIZE; off < data_len;)
+  {
+    guint32 len;
+    guchar op;
 
-  if (n->key)
-    return base64urlencode(n->key, n->key_len);
+    if (data_len - off < 4)
+    {
+      ok = FALSE;
+      break;
+    }
 
-  return NULL;
-}
+    memcpy(&len, data + off, 4);
+    len = GUINT32_FROM_LE(len);
+    off += 4;
 
-// }}}
-// {{{ mega_node_get_path
+    if (data_len - off < (gsize)len + CACHE_MAC_SIZE || len == 0)
+    {
+      ok = FALSE;
+      break;
+    }
 
-gchar* mega_node_get_path_dup(mega_node* n)
-{
-  gchar path[4096];
+    cache_mac(mac_key, off, (guchar*)data + off, len, mac);
+    if (memcmp(mac, data + off + len, CACHE_MAC_SIZE))
+    {
+      ok = FALSE;
+      break;
+    }
 
-  if (mega_node_get_path(n, path, sizeof(path)))
-    return g_strndup(path, sizeof(path));
+    g_byte_array_set_size(plain, len);
+    aes_ctr_seek(ctr, s->cache_log_nonce, off);
+    aes_ctr_crypt(ctr, (guchar*)data + off, plain->data, len);
+    off += len + CACHE_MAC_SIZE;
 
-  return NULL;
-}
+    cache_reader r = { 0 };
+    r.block = plain->data;
+    r.block_len = r.data_len = len;
 
-gboolean mega_node_get_path(mega_node* n, gchar* buf, gsize len)
-{
-  g_return_val_if_fail(n != NULL, FALSE);
+    cache_get(&r, &op, 1);
 
-  // count parents
-  gint n_parents = 0;
-  mega_node* it = n;
-  while (it)
-  {
-    n_parents++;
-    it = it->parent;
-  }
+    if (op == CACHE_LOG_NODE)
+    {
+      mega_node* n = cache_get_node(&r, buf, s);
+      if (!n)
+      {
+        r.failed = TRUE;
+      }
+      else
+      {
+        mega_node* existing = g_hash_table_lookup(handles, n->handle);
 
-  // allocate pointer list on stack
-  mega_node** parents = g_alloca(sizeof(mega_node*) * n_parents);
+        if (existing)
+        {
+          mega_node tmp = *existing;
 
-  // get parents into the pointer list
-  it = n;
-  n_parents = 0;
-  while (it)
-  {
-    parents[n_parents++] = it;
-    it = it->parent;
-  }
+          *existing = *n;
+          *n = tmp;
+          mega_node_free(s, n);
+          g_hash_table_remove(removed, existing);
+        }
+        else
+        {
+          g_ptr_array_add(s->fs_nodes, n);
+          g_hash_table_insert(handles, n->handle, n);
+        }
+      }
+    }
+    else if (op == CACHE_LOG_REMOVE)
+    {
+      const gchar* handle = cache_get_str_tmp(&r, buf);
+      mega_node* n = handle ? g_hash_table_lookup(handles, handle) : NULL;
 
-  // reverse iteration
-  gint i;
-  gchar* p = buf;
-  for (i = n_parents - 1; i >= 0; i--) 
-  {
-    it = parents[i];
-    gint name_len = strlen(it->name);
-    gint remaining_buf_len = len - (p - buf);
+      if (n)
+        g_hash_table_add(removed, n);
+    }
+    else if (op == CACHE_LOG_SHARE_KEY)
+    {
+      gc_free gchar* handle = cache_get_str(&r, buf);
+      gsize key_len;
+      const guchar* key = cache_get_bytes_tmp(&r, buf, &key_len);
 
-    if (remaining_buf_len < name_len + 2)
-      return FALSE;
+      if (handle && key && key_len == 16)
+        add_share_key(s, handle, key);
+    }
+    else if (op == CACHE_LOG_STATE)
+    {
+      s->last_refresh = cache_get_u64(&r);
+      g_free(s->sn);
+      s->sn = cache_get_str(&r, buf);
+    }
 
-    *p = '/';
-    p += 1;
+    if (r.failed)
+    {
+      ok = FALSE;
+      break;
+    }
 
-    memcpy(p, it->name, name_len);
-    p += name_len;
+    s->cache_log_len = off;
   }
 
-  *p = '\0';
+  if (g_hash_table_size(removed) > 0)
+  {
+    for (i = 0, j = 0; i < s->fs_nodes->len; i++)
+    {
+      mega_node* n = s->fs_nodes->pdata[i];
 
-  return TRUE;
-}
+      if (g_hash_table_contains(removed, n))
+        mega_node_free(s, n);
+      else
+        s->fs_nodes->pdata[j++] = n;
+    }
 
-// }}}
-// {{{
+    g_ptr_array_set_size(s->fs_nodes, j);
+  }
 
-gboolean mega_node_is_container(mega_node* n)
-{
-	return n && n->type != MEGA_NODE_FILE;
+  return ok;
 }
 
 // }}}
-
 // {{{ mega_session_save
 
-static void save_share_keys(gchar* handle, gchar* key, SJsonGen* gen)
+static void save_share_keys(gchar* handle, guchar* key, GByteArray* b)
 {
-  s_json_gen_start_object(gen);
-  s_json_gen_member_string(gen, "handle", handle);
-  s_json_gen_member_bytes(gen, "key", key, 16);
-  s_json_gen_end_object(gen);
+  cache_put_str(b, handle);
+  cache_put_bytes(b, key, 16);
 }
 
 gboolean mega_session_save(mega_session* s, GError** err)
 {
   GError* local_err = NULL;
-  GSList* i;
+  guint i;
 
   g_return_val_if_fail(s != NULL, FALSE);
   g_return_val_if_fail(s->user_email != NULL, FALSE);
   g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
 
-  // calculate cache file path
-  gc_free gchar* un = g_ascii_strdown(s->user_email, -1);
-  gc_checksum_free GChecksum* cs = g_checksum_new(G_CHECKSUM_SHA1);
-  g_checksum_update(cs, un, -1);
-  gc_free gchar* filename = g_strconcat(g_checksum_get_string(cs), ".megatools.cache", NULL);
-  gc_free gchar* path = g_build_filename(g_get_tmp_dir(), filename, NULL);
+  gc_free gchar* path = get_cache_path(s->user_email);
+  gc_free gchar* log_path = g_strconcat(path, ".log", NULL);
 
-  SJsonGen *gen = s_json_gen_new();
-  s_json_gen_start_object(gen);
+  // nothing changed since the last save
+  if (!s->cache_dirty && s->cache_log->len == 0)
+    return TRUE;
 
-  // serialize session object
-  s_json_gen_member_int(gen, "version", CACHE_FORMAT_VERSION);
-  s_json_gen_member_int(gen, "last_refresh", s->last_refresh);
+  // append small changes to the log, rewrite the cache when that fails
+  if (!s->cache_dirty && !cache_log_should_compact(s))
+  {
+    if (cache_log_append(s, log_path, &local_err))
+      return TRUE;
 
-  s_json_gen_member_string(gen, "sid", s->sid);
-  s_json_gen_member_bytes(gen, "password_key", s->password_key, 16);
-  s_json_gen_member_bytes(gen, "master_key", s->master_key, 16);
-  s_json_gen_member_rsa_key(gen, "rsa_key", &s->rsa_key);
-  s_json_gen_member_string(gen, "user_handle", s->user_handle);
-  s_json_gen_member_string(gen, "user_name", s->user_name);
-  s_json_gen_member_string(gen, "user_email", s->user_email);
+    if (mega_debug & MEGA_DEBUG_CACHE)
+      g_printerr("SAVE CACHE: %s\n", local_err->message);
 
-  s_json_gen_member_array(gen, "share_keys");
-  g_hash_table_foreach(s->share_keys, (GHFunc)save_share_keys, gen);
-  s_json_gen_end_array(gen);
+    g_clear_error(&local_err);
+  }
 
-  s_json_gen_member_array(gen, "fs_nodes");
-  for (i = s->fs_nodes; i; i = i->next)
-  {
-    mega_node* n = i->data;
+  gc_byte_array_unref GByteArray* b = g_byte_array_new();
 
-    s_json_gen_start_object(gen);
-    s_json_gen_member_string(gen, "name", n->name);
-    s_json_gen_member_string(gen, "handle", n->handle);
-    s_json_gen_member_string(gen, "parent_handle", n->parent_handle);
-    s_json_gen_member_string(gen, "user_handle", n->user_handle);
-    s_json_gen_member_string(gen, "su_handle", n->su_handle);
-    s_json_gen_member_bytes(gen, "key", n->key, n->key_len);
-    s_json_gen_member_int(gen, "type", n->type);
-    s_json_gen_member_int(gen, "size", n->size);
-    s_json_gen_member_int(gen, "timestamp", n->timestamp);
-    s_json_gen_member_string(gen, "link", n->link);
-    s_json_gen_end_object(gen);
-  }
-  s_json_gen_end_array(gen);
+  // session data go first, so that they can be read without decrypting
+  // the rest of the file
+  cache_put_u64(b, s->last_refresh);
+  cache_put_str(b, s->sid);
+  cache_put_str(b, s->sn);
+  cache_put_bytes(b, s->password_key, 16);
+  cache_put_bytes(b, s->master_key, 16);
+  cache_put_bn(b, s->rsa_key.p);
+  cache_put_bn(b, s->rsa_key.q);
+  cache_put_bn(b, s->rsa_key.d);
+  cache_put_bn(b, s->rsa_key.u);
+  cache_put_bn(b, s->rsa_key.m);
+  cache_put_bn(b, s->rsa_key.e);
+  cache_put_str(b, s->user_handle);
+  cache_put_str(b, s->user_name);
+  cache_put_str(b, s->user_email);
 
-  s_json_gen_end_object(gen);
-  gc_free gchar *cache_data = s_json_gen_done(gen);
+  cache_put_u32(b, g_hash_table_size(s->share_keys));
+  g_hash_table_foreach(s->share_keys, (GHFunc)save_share_keys, b);
+
+  cache_put_u32(b, s->fs_nodes->len);
+  for (i = 0; i < s->fs_nodes->len; i++)
+    cache_put_node(b, s->fs_nodes->pdata[i]);
 
   if (mega_debug & MEGA_DEBUG_CACHE)
-    print_node(cache_data, "SAVE CACHE: ");
+    g_printerr("SAVE CACHE: %u nodes, %u bytes\n", s->fs_nodes->len, b->len);
 
-  gc_free gchar* tmp = g_strconcat("MEGA", cache_data, NULL);
-  gc_free gchar* cipher = b64_aes128_cbc_encrypt_str(tmp, s->password_key);
+  guchar nonce[8];
+  gc_byte_array_unref GByteArray* cipher = cache_seal(b, s->password_key, nonce);
 
-  if (!g_file_set_contents(path, cipher, -1, &local_err))
+  if (!g_file_set_contents(path, (gchar*)cipher->data, cipher->len, &local_err))
   {
     g_propagate_error(err, local_err);
     return FALSE;
   }
 
+  // the old log belongs to the previous cache
+  g_unlink(log_path);
+
+  memcpy(s->cache_nonce, nonce, 8);
+  s->cache_snapshot_len = cipher->len;
+  s->cache_log_len = 0;
+  s->cache_dirty = FALSE;
+  g_byte_array_set_size(s->cache_log, 0);
+
   return TRUE;
 }
 
@@ -3748,154 +7750,149 @@ gboolean mega_session_save(mega_session* s, GError** err)
 gboolean mega_session_load(mega_session* s, const gchar* un, const gchar* pw, gint max_age, gchar** last_sid, GError** err)
 {
   GError* local_err = NULL;
-  gc_free gchar* cipher = NULL;
+  guint32 i, count;
+  gsize len;
 
   g_return_val_if_fail(s != NULL, FALSE);
   g_return_val_if_fail(un != NULL, FALSE);
-  g_return_val_if_fail(pw != NULL, FALSE);
   g_return_val_if_fail(err == NULL || *err == NULL, FALSE);
 
   mega_session_close(s);
 
-  // calculate cache file path
-  gc_free gchar* un_lower = g_ascii_strdown(un, -1);
-  gc_checksum_free GChecksum* cs = g_checksum_new(G_CHECKSUM_SHA1);
-  g_checksum_update(cs, un_lower, -1);
-  gc_free gchar* filename = g_strconcat(g_checksum_get_string(cs), ".megatools.cache", NULL);
-  gc_free gchar* path = g_build_filename(g_get_tmp_dir(), filename, NULL);
+  gc_free gchar* path = get_cache_path(un);
+  gc_free gchar* log_path = g_strconcat(path, ".log", NULL);
+  gc_cache_reader_free cache_reader* r = NULL;
+  gc_free guchar* password_key = key_cache_lookup(s, un);
 
-  // load cipher data
-  if (!g_file_get_contents(path, &cipher, NULL, &local_err))
+  // remembered password key may be outdated
+  if (password_key)
   {
-    g_propagate_error(err, local_err);
-    return FALSE;
+    r = cache_reader_open(path, password_key, NULL);
+    if (!r)
+    {
+      // missing cache says nothing about the key
+      if (g_file_test(path, G_FILE_TEST_EXISTS))
+        key_cache_remove(s, un);
+
+      g_clear_pointer(&password_key, g_free);
+    }
   }
 
-  // calculate password key
-  gc_free guchar* password_key = make_password_key(pw);
-  gsize len = 0;
-  gc_free gchar* data = b64_aes128_cbc_decrypt(cipher, password_key, &len);
+  if (!r)
+  {
+    if (!key_cache_need_password(pw, err))
+      return FALSE;
+
+    password_key = make_password_key(pw);
+
+    r = cache_reader_open(path, password_key, &local_err);
+    if (!r)
+    {
+      g_propagate_error(err, local_err);
+      return FALSE;
+    }
+
+    // header MAC verified the password key
+    key_cache_store(s, un, password_key);
+  }
+
+  gc_byte_array_unref GByteArray* buf = g_byte_array_new();
 
-  if (!data || len < 4)
+  gint64 last_refresh = cache_get_u64(r);
+  gc_free gchar* sid = cache_get_str(r, buf);
+  if (r->failed)
   {
     g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Corrupted cache file");
     return FALSE;
   }
 
-  if (memcmp(data, "MEGA", 4) != 0)
+  // return sid value if available
+  if (last_sid && sid)
+    *last_sid = g_strdup(sid);
+
+  // check max_age, the log may contain a more recent refresh
+  gboolean has_log = g_file_test(log_path, G_FILE_TEST_EXISTS);
+  if (max_age > 0 && !has_log)
   {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Incorrect password");
-    return FALSE;
+    if (!last_refresh || ((last_refresh + max_age) < time(NULL)))
+    {
+      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Cache timed out");
+      return FALSE;
+    }
   }
 
-  if (!s_json_is_valid(data + 4))
+  // cache is valid, load it
+  s->last_refresh = last_refresh;
+  s->sid = sid; sid = NULL;
+  s->sn = cache_get_str(r, buf);
+  s->password_key = cache_get_bytes(r, buf, &len);
+  s->master_key = cache_get_bytes(r, buf, &len);
+  s->rsa_key.p = cache_get_bn(r, buf);
+  s->rsa_key.q = cache_get_bn(r, buf);
+  s->rsa_key.d = cache_get_bn(r, buf);
+  s->rsa_key.u = cache_get_bn(r, buf);
+  s->rsa_key.m = cache_get_bn(r, buf);
+  s->rsa_key.e = cache_get_bn(r, buf);
+  s->user_handle = cache_get_str(r, buf);
+  s->user_name = cache_get_str(r, buf);
+  s->user_email = cache_get_str(r, buf);
+
+  if (r->failed)
   {
     g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Corrupted cache file");
     return FALSE;
   }
 
-  gc_free gchar* cache_obj = s_json_get(data + 4);
-
-  if (mega_debug & MEGA_DEBUG_CACHE)
-    print_node(cache_obj, "LOAD CACHE: ");
-
-  if (s_json_get_type(cache_obj) == S_JSON_TYPE_OBJECT)
+  if (!s->sid || !s->password_key || !s->master_key || !s->user_handle || !s->user_email || !s->rsa_key.p || !s->rsa_key.q || !s->rsa_key.d || !s->rsa_key.u)
   {
-    gint64 version = s_json_get_member_int(cache_obj, "version", 0);
-    gint64 last_refresh = s_json_get_member_int(cache_obj, "last_refresh", 0);
-
-    if (version != CACHE_FORMAT_VERSION)
-    {
-      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Cache version mismatch");
-      return FALSE;
-    }
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Incomplete cache data");
+    return FALSE;
+  }
 
-    // return sid value if available
-    gc_free gchar* sid = s_json_get_member_string(cache_obj, "sid");
-    if (last_sid && sid)
-      *last_sid = g_strdup(sid);
+  count = cache_get_u32(r);
+  for (i = 0; i < count && !r->failed; i++)
+  {
+    gc_free gchar* handle = cache_get_str(r, buf);
+    const guchar* key = cache_get_bytes_tmp(r, buf, &len);
 
-    // check max_age
-    if (max_age > 0)
-    {
-      if (!last_refresh || ((last_refresh + max_age) < time(NULL)))
-      {
-        g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Cache timed out");
-        return FALSE;
-      }
-    }
+    if (handle && key && len == 16)
+      add_share_key(s, handle, key);
+  }
 
-    // cache is valid, load it
-    gsize len;
+  count = cache_get_u32(r);
+  for (i = 0; i < count && !r->failed; i++)
+  {
+    mega_node* n = cache_get_node(r, buf, s);
 
-    s->last_refresh = last_refresh;
-    s->sid = sid; sid = NULL;
-    s->password_key = s_json_get_member_bytes(cache_obj, "password_key", &len);
-    s->master_key = s_json_get_member_bytes(cache_obj, "master_key", &len);
-    s_json_get_member_rsa_key(cache_obj, "rsa_key", &s->rsa_key);
-    s->user_handle = s_json_get_member_string(cache_obj, "user_handle");
-    s->user_name = s_json_get_member_string(cache_obj, "user_name");
-    s->user_email = s_json_get_member_string(cache_obj, "user_email");
+    if (n)
+      g_ptr_array_add(s->fs_nodes, n);
+  }
 
-    if (!s->sid || !s->password_key || !s->master_key || !s->user_handle || !s->user_email || !s->rsa_key.p || !s->rsa_key.q || !s->rsa_key.d || !s->rsa_key.u)
-    {
-      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Incomplete cache data");
-      return FALSE;
-    }
+  if (r->failed)
+  {
+    mega_session_close(s);
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Corrupted cache file");
+    return FALSE;
+  }
 
-    const gchar* sk_nodes = s_json_get_member(cache_obj, "share_keys");
-    if (s_json_get_type(sk_nodes) == S_JSON_TYPE_ARRAY)
-    {
-      S_JSON_FOREACH_ELEMENT(sk_nodes, sk_node)
-        gc_free gchar* handle = s_json_get_member_string(sk_node, "handle");
-        gc_free guchar* key = s_json_get_member_bytes(sk_node, "key", &len);
+  memcpy(s->cache_nonce, r->nonce, 8);
+  s->cache_snapshot_len = g_mapped_file_get_length(r->file);
 
-        add_share_key(s, handle, key);
-      S_JSON_FOREACH_END()
-    }
+  // a damaged or stale log is dropped with the next save
+  s->cache_dirty = has_log && !cache_log_replay(s, log_path, password_key);
 
-    const gchar* fs_nodes = s_json_get_member(cache_obj, "fs_nodes");
-    if (s_json_get_type(fs_nodes) == S_JSON_TYPE_ARRAY)
+  if (max_age > 0 && has_log)
+  {
+    if (!s->last_refresh || ((s->last_refresh + max_age) < time(NULL)))
     {
-      S_JSON_FOREACH_ELEMENT(fs_nodes, fs_node)
-        mega_node* n = g_new0(mega_node, 1);
-
-	n->type = -1;
-
-	S_JSON_FOREACH_MEMBER(fs_node, k, v)
-		if (s_json_string_match(k, "name"))
-			n->name = s_json_get_string(v);
-		else if (s_json_string_match(k, "handle"))
-			n->handle = s_json_get_string(v);
-		else if (s_json_string_match(k, "parent_handle"))
-			n->parent_handle = s_json_get_string(v);
-		else if (s_json_string_match(k, "user_handle"))
-			n->user_handle = s_json_get_string(v);
-		else if (s_json_string_match(k, "su_handle"))
-			n->su_handle = s_json_get_string(v);
-		else if (s_json_string_match(k, "key"))
-			n->key = s_json_get_bytes(v, &n->key_len);
-		else if (s_json_string_match(k, "type"))
-			n->type = s_json_get_int(v, -1);
-		else if (s_json_string_match(k, "size"))
-			n->size = s_json_get_int(v, 0);
-		else if (s_json_string_match(k, "timestamp"))
-			n->timestamp = s_json_get_int(v, 0);
-		else if (s_json_string_match(k, "link"))
-			n->link = s_json_get_string(v);
-	S_JSON_FOREACH_END()
-
-        s->fs_nodes = g_slist_prepend(s->fs_nodes, n);
-      S_JSON_FOREACH_END()
-
-      s->fs_nodes = g_slist_reverse(s->fs_nodes);
+      mega_session_close(s);
+      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Cache timed out");
+      return FALSE;
     }
   }
-  else
-  {
-    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Corrupt cache");
-    return FALSE;
-  }
+
+  if (mega_debug & MEGA_DEBUG_CACHE)
+    g_printerr("LOAD CACHE: %u nodes, %" G_GSIZE_FORMAT " bytes of log\n", count, s->cache_log_len);
 
   update_pathmap(s);
 
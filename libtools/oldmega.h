@@ -39,6 +39,7 @@ typedef struct _mega_share_key mega_share_key;
 typedef struct _mega_user_quota mega_user_quota;
 typedef struct _mega_status_data mega_status_data;
 typedef struct _mega_reg_state mega_reg_state;
+typedef struct _mega_transfer_queue mega_transfer_queue;
 
 // status callback
 
@@ -46,7 +47,9 @@ enum
 {
   MEGA_STATUS_PROGRESS = 1,
   MEGA_STATUS_FILEINFO,
-  MEGA_STATUS_DATA
+  MEGA_STATUS_DATA,
+  MEGA_STATUS_RATELIMIT,
+  MEGA_STATUS_TRANSFER
 };
 
 struct _mega_status_data
@@ -72,11 +75,35 @@ struct _mega_status_data
       guchar* buf;
       guint64 size;
     } data;
+
+    // sent when the server asks us to slow down (interval grows) and when
+    // the interval decays back to zero, not for each decay step
+    struct
+    {
+      gint64 interval;
+      gdouble throttle_rate;
+      guint64 requests;
+      guint64 throttled;
+    } ratelimit;
+
+    // sent by mega_transfer_queue for each running transfer (path is its
+    // local path) and for the whole queue (path is NULL)
+    struct
+    {
+      const gchar* path;
+      guint64 total;
+      guint64 done;
+      guint running;
+      guint queued;
+    } transfer;
   };
 };
 
 typedef gboolean (*mega_status_callback)(mega_status_data* data, gpointer userdata);
 
+// called when a queued transfer finishes, error is NULL on success
+typedef void (*mega_transfer_done_fn)(const gchar* local_path, const gchar* remote_path, GError* error, gpointer userdata);
+
 // session data types
 
 enum
@@ -96,6 +123,7 @@ struct _mega_share_key
   guchar* key;
 };
 
+// node strings and keys are owned by the session, don't free them
 struct _mega_node 
 {
   gchar* name;
@@ -112,6 +140,10 @@ struct _mega_node
   // call addlinks after refresh to get links populated
   gchar* link;
 
+  // binary forms of handle and parent_handle
+  guint64 handle_id;
+  guint64 parent_id;
+
   mega_session* s;
   mega_node* parent;
 };
@@ -143,8 +175,13 @@ void                mega_session_free               (mega_session* s);
 
 void                mega_session_watch_status       (mega_session* s, mega_status_callback cb, gpointer userdata);
 void                mega_session_enable_previews    (mega_session* s, gboolean enable);
+void                mega_session_set_connections    (mega_session* s, gint connections);
+void                mega_session_enable_resume      (mega_session* s, gboolean enable);
+void                mega_session_enable_key_cache   (mega_session* s, gboolean enable);
+gboolean            mega_session_has_remembered_key (mega_session* s, const gchar* un);
 
-// this has side effect of the current session being closed
+// this has side effect of the current session being closed, pw may be NULL
+// if there's a remembered key
 gboolean            mega_session_open               (mega_session* s, const gchar* un, const gchar* pw, const gchar* sid, GError** err);
 void                mega_session_close              (mega_session* s);
 const gchar*        mega_session_get_sid            (mega_session* s);
@@ -155,6 +192,9 @@ gboolean            mega_session_load               (mega_session* s, const gcha
 
 gboolean            mega_session_get_user           (mega_session* s, GError** err);
 gboolean            mega_session_refresh            (mega_session* s, GError** err);
+// apply filesystem changes since the last refresh/sync, falls back to refresh
+gboolean            mega_session_sync               (mega_session* s, GError** err);
+gboolean            mega_session_is_stale           (mega_session* s, gint max_age);
 gboolean            mega_session_addlinks           (mega_session* s, GSList* nodes, GError** err);
 mega_user_quota*    mega_session_user_quota         (mega_session* s, GError** err);
 
@@ -164,10 +204,19 @@ GSList*             mega_session_get_node_chilren   (mega_session* s, mega_node*
 mega_node*          mega_session_stat               (mega_session* s, const gchar* path);
 mega_node*          mega_session_mkdir              (mega_session* s, const gchar* path, GError** err);
 gboolean            mega_session_rm                 (mega_session* s, const gchar* path, GError** err);
+gboolean            mega_session_rm_many            (mega_session* s, GSList* paths, GError** err);
 mega_node*          mega_session_put                (mega_session* s, const gchar* remote_path, const gchar* local_path, GError** err);
 gchar*              mega_session_new_node_attribute (mega_session* s, const guchar* data, gsize len, const gchar* type, const guchar* key, GError** err);
 gboolean            mega_session_get                (mega_session* s, const gchar* local_path, const gchar* remote_path, GError** err);
 
+// transfers of many files at once, they run concurrently when the queue runs
+mega_transfer_queue* mega_transfer_queue_new        (mega_session* s, gint max_transfers);
+void                mega_transfer_queue_set_done_callback (mega_transfer_queue* q, mega_transfer_done_fn cb, gpointer userdata);
+void                mega_transfer_queue_put         (mega_transfer_queue* q, const gchar* remote_path, const gchar* local_path);
+void                mega_transfer_queue_get         (mega_transfer_queue* q, const gchar* local_path, const gchar* remote_path);
+gboolean            mega_transfer_queue_run         (mega_transfer_queue* q, GError** err);
+void                mega_transfer_queue_free        (mega_transfer_queue* q);
+
 gboolean            mega_session_open_exp_folder    (mega_session* s, const gchar* n, const gchar* key, GError** err);
 gboolean            mega_session_dl                 (mega_session* s, const gchar* handle, const gchar* key, const gchar* local_path, GError** err);
 
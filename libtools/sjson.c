@@ -65,6 +65,119 @@ enum
   IDENT = [A-Za-z_-][a-zA-Z0-9_-]*;
 */
 
+// fast string scanning
+//
+// Strings (handles, keys, encrypted attributes) make up most of the API
+// responses. Strings without escapes are matched by looking for the closing
+// quote 16 or 32 bytes at a time, anything else goes through the re2c
+// scanner below. Vector loads never cross a page boundary, so they can't
+// fault past the end of the string.
+
+typedef const guchar* (*ScanStringFunc)(const guchar* c);
+
+// return pointer to the first '"', '\\' or '\0'
+static const guchar* scan_string_scalar(const guchar* c)
+{
+  while (*c != '"' && *c != '\\' && *c != '\0')
+    c++;
+
+  return c;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <immintrin.h>
+
+#define HAVE_SCAN_STRING_SIMD 1
+
+__attribute__((target("sse2")))
+static const guchar* scan_string_sse2(const guchar* c)
+{
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i bslash = _mm_set1_epi8('\\');
+  const __m128i zero = _mm_setzero_si128();
+
+  while (TRUE)
+  {
+    // go byte by byte near the end of a page
+    if (((guintptr)c & 4095) > 4096 - 16)
+    {
+      if (*c == '"' || *c == '\\' || *c == '\0')
+        return c;
+
+      c++;
+      continue;
+    }
+
+    __m128i v = _mm_loadu_si128((const __m128i*)c);
+    __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)), _mm_cmpeq_epi8(v, zero));
+    guint mask = _mm_movemask_epi8(hits);
+
+    if (mask)
+      return c + __builtin_ctz(mask);
+
+    c += 16;
+  }
+}
+
+__attribute__((target("avx2")))
+static const guchar* scan_string_avx2(const guchar* c)
+{
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i bslash = _mm256_set1_epi8('\\');
+  const __m256i zero = _mm256_setzero_si256();
+
+  while (TRUE)
+  {
+    // go byte by byte near the end of a page
+    if (((guintptr)c & 4095) > 4096 - 32)
+    {
+      if (*c == '"' || *c == '\\' || *c == '\0')
+        return c;
+
+      c++;
+      continue;
+    }
+
+    __m256i v = _mm256_loadu_si256((const __m256i*)c);
+    __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bslash)), _mm256_cmpeq_epi8(v, zero));
+    guint mask = _mm256_movemask_epi8(hits);
+
+    if (mask)
+      return c + __builtin_ctz(mask);
+
+    c += 32;
+  }
+}
+
+#endif
+
+static ScanStringFunc get_scan_string(void)
+{
+  static gsize impl = 0;
+
+  if (g_once_init_enter(&impl))
+  {
+    ScanStringFunc func = scan_string_scalar;
+    const gchar* force = g_getenv("SJSON_SCAN");
+
+#ifdef HAVE_SCAN_STRING_SIMD
+    __builtin_cpu_init();
+
+    if (!g_strcmp0(force, "scalar"))
+      func = scan_string_scalar;
+    else if (__builtin_cpu_supports("avx2") && g_strcmp0(force, "sse2"))
+      func = scan_string_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+      func = scan_string_sse2;
+#endif
+
+    g_once_init_leave(&impl, (gsize)func);
+  }
+
+  return (ScanStringFunc)impl;
+}
+
 static gint s_json_get_token(const gchar* json, const gchar** start, const gchar** end)
 {
   g_return_val_if_fail(json != NULL, FALSE);
@@ -74,6 +187,24 @@ static gint s_json_get_token(const gchar* json, const gchar** start, const gchar
   const guchar* s;
   gint token;
 
+  // fast path for strings without escapes
+  while (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r')
+    c++;
+
+  if (*c == '"')
+  {
+    const guchar* q = get_scan_string()(c + 1);
+
+    if (*q == '"')
+    {
+      if (start)
+        *start = (const gchar*)c;
+      if (end)
+        *end = (const gchar*)q + 1;
+      return TOK_NOESC_STRING;
+    }
+  }
+
   while (TRUE)
   {
     s = c;
@@ -1281,3 +1412,551 @@ err:
   g_string_free(str, TRUE);
   return NULL;
 }
+
+// structural index
+
+typedef struct
+{
+  const gchar* json;
+  gint next;   // index of the first entry after this value
+  gint parent; // index of the enclosing array/object, -1 for the root value
+  SJsonType type;
+} SJsonTapeEntry;
+
+struct _SJsonTape
+{
+  GArray* entries;
+};
+
+#define TAPE_ENTRY(tape, i) (&g_array_index((tape)->entries, SJsonTapeEntry, (i)))
+
+enum
+{
+  TAPE_VALUE,
+  TAPE_VALUE_OR_END,
+  TAPE_KEY,
+  TAPE_KEY_OR_END,
+  TAPE_COLON,
+  TAPE_COMMA_OR_END,
+  TAPE_DONE
+};
+
+static gint tape_push(GArray* entries, const gchar* json, gint parent, SJsonType type)
+{
+  SJsonTapeEntry e = { json, entries->len + 1, parent, type };
+
+  g_array_append_val(entries, e);
+  return entries->len - 1;
+}
+
+SJsonTape* s_json_tape_new(const gchar* json)
+{
+  GArray* entries;
+  GArray* stack;
+  const gchar* p = json;
+  const gchar* start;
+  gint state = TAPE_VALUE;
+  gint token, parent = -1, idx;
+
+  g_return_val_if_fail(json != NULL, NULL);
+
+  entries = g_array_sized_new(FALSE, FALSE, sizeof(SJsonTapeEntry), 64);
+  stack = g_array_sized_new(FALSE, FALSE, sizeof(gint), 16);
+
+  while (state != TAPE_DONE)
+  {
+    token = s_json_get_token(p, &start, &p);
+
+    switch (state)
+    {
+      case TAPE_VALUE_OR_END:
+        if (token == TOK_ARRAY_END)
+          goto close;
+        // fall through
+      case TAPE_VALUE:
+        idx = tape_push(entries, start, parent, token_to_type(token));
+
+        if (token == TOK_OBJ_START || token == TOK_ARRAY_START)
+        {
+          g_array_append_val(stack, idx);
+          parent = idx;
+          state = token == TOK_OBJ_START ? TAPE_KEY_OR_END : TAPE_VALUE_OR_END;
+          continue;
+        }
+
+        if (token != TOK_STRING && token != TOK_NOESC_STRING && token != TOK_NUMBER && token != TOK_FALSE && token != TOK_TRUE && token != TOK_NULL)
+          goto err;
+
+        goto value_done;
+
+      case TAPE_KEY_OR_END:
+        if (token == TOK_OBJ_END)
+          goto close;
+        // fall through
+      case TAPE_KEY:
+        if (token != TOK_STRING && token != TOK_NOESC_STRING)
+          goto err;
+
+        tape_push(entries, start, parent, S_JSON_TYPE_STRING);
+        state = TAPE_COLON;
+        continue;
+
+      case TAPE_COLON:
+        if (token != TOK_COLON)
+          goto err;
+
+        state = TAPE_VALUE;
+        continue;
+
+      case TAPE_COMMA_OR_END:
+        if (token == TOK_COMMA)
+        {
+          state = g_array_index(entries, SJsonTapeEntry, parent).type == S_JSON_TYPE_OBJECT ? TAPE_KEY : TAPE_VALUE;
+          continue;
+        }
+
+        if (token == (g_array_index(entries, SJsonTapeEntry, parent).type == S_JSON_TYPE_OBJECT ? TOK_OBJ_END : TOK_ARRAY_END))
+          goto close;
+
+        goto err;
+    }
+
+close:
+    // container is complete, its subtree ends here
+    g_array_index(entries, SJsonTapeEntry, parent).next = entries->len;
+    g_array_set_size(stack, stack->len - 1);
+    parent = stack->len > 0 ? g_array_index(stack, gint, stack->len - 1) : -1;
+
+value_done:
+    state = parent < 0 ? TAPE_DONE : TAPE_COMMA_OR_END;
+  }
+
+  // nothing but whitespace may follow the root value
+  if (s_json_get_token(p, NULL, NULL) != TOK_NONE)
+    goto err;
+
+  g_array_free(stack, TRUE);
+
+  SJsonTape* tape = g_slice_new(SJsonTape);
+  tape->entries = entries;
+  return tape;
+
+err:
+  g_array_free(stack, TRUE);
+  g_array_free(entries, TRUE);
+  return NULL;
+}
+
+void s_json_tape_free(SJsonTape* tape)
+{
+  if (!tape)
+    return;
+
+  g_array_free(tape->entries, TRUE);
+  g_slice_free(SJsonTape, tape);
+}
+
+SJsonType s_json_tape_get_type(SJsonTape* tape, gint node)
+{
+  g_return_val_if_fail(tape != NULL, S_JSON_TYPE_INVALID);
+
+  if (node < 0 || node >= tape->entries->len)
+    return S_JSON_TYPE_NONE;
+
+  return TAPE_ENTRY(tape, node)->type;
+}
+
+const gchar* s_json_tape_get_json(SJsonTape* tape, gint node)
+{
+  g_return_val_if_fail(tape != NULL, NULL);
+
+  if (node < 0 || node >= tape->entries->len)
+    return NULL;
+
+  return TAPE_ENTRY(tape, node)->json;
+}
+
+const gchar* s_json_tape_get_key(SJsonTape* tape, gint node)
+{
+  g_return_val_if_fail(tape != NULL, NULL);
+
+  if (node <= 0 || node >= tape->entries->len)
+    return NULL;
+
+  gint parent = TAPE_ENTRY(tape, node)->parent;
+  if (parent < 0 || TAPE_ENTRY(tape, parent)->type != S_JSON_TYPE_OBJECT)
+    return NULL;
+
+  return TAPE_ENTRY(tape, node - 1)->json;
+}
+
+gint s_json_tape_get_first(SJsonTape* tape, gint node)
+{
+  SJsonTapeEntry* e;
+
+  g_return_val_if_fail(tape != NULL, -1);
+
+  if (node < 0 || node >= tape->entries->len)
+    return -1;
+
+  e = TAPE_ENTRY(tape, node);
+  if (e->next == node + 1)
+    return -1;
+
+  // skip member name
+  if (e->type == S_JSON_TYPE_OBJECT)
+    return node + 2;
+  else if (e->type == S_JSON_TYPE_ARRAY)
+    return node + 1;
+
+  return -1;
+}
+
+gint s_json_tape_get_next(SJsonTape* tape, gint node)
+{
+  SJsonTapeEntry *e, *p;
+
+  g_return_val_if_fail(tape != NULL, -1);
+
+  if (node <= 0 || node >= tape->entries->len)
+    return -1;
+
+  e = TAPE_ENTRY(tape, node);
+  if (e->parent < 0)
+    return -1;
+
+  p = TAPE_ENTRY(tape, e->parent);
+  if (e->next >= p->next)
+    return -1;
+
+  // skip member name
+  return p->type == S_JSON_TYPE_OBJECT ? e->next + 1 : e->next;
+}
+
+gint s_json_tape_get_member(SJsonTape* tape, gint node, const gchar* name)
+{
+  gint value;
+
+  g_return_val_if_fail(tape != NULL, -1);
+  g_return_val_if_fail(name != NULL, -1);
+
+  if (s_json_tape_get_type(tape, node) != S_JSON_TYPE_OBJECT)
+    return -1;
+
+  for (value = s_json_tape_get_first(tape, node); value >= 0; value = s_json_tape_get_next(tape, value))
+    if (s_json_string_match(TAPE_ENTRY(tape, value - 1)->json, name))
+      return value;
+
+  return -1;
+}
+
+gchar* s_json_tape_get_member_string(SJsonTape* tape, gint node, const gchar* name)
+{
+  const gchar* json = s_json_tape_get_json(tape, s_json_tape_get_member(tape, node, name));
+
+  return json ? s_json_get_string(json) : NULL;
+}
+
+gint64 s_json_tape_get_member_int(SJsonTape* tape, gint node, const gchar* name, gint64 fallback)
+{
+  const gchar* json = s_json_tape_get_json(tape, s_json_tape_get_member(tape, node, name));
+
+  return json ? s_json_get_int(json, fallback) : fallback;
+}
+
+// streaming parser
+
+typedef struct
+{
+  gchar* name; // member name, or NULL for array index
+  gint index;
+} SJsonStreamSegment;
+
+typedef struct
+{
+  gchar type;         // '{' or '['
+  gboolean matched;   // container is on the streamed path
+  gboolean target;    // this is the streamed array
+  gboolean expect_key;
+  gboolean expect_value;
+  gint index;
+  GString* key;
+} SJsonStreamFrame;
+
+struct _SJsonStream
+{
+  SJsonStreamSegment* segments;
+  guint n_segments;
+  SJsonStreamFunc callback;
+  gpointer user_data;
+
+  GArray* frames;
+  gboolean in_string;
+  gboolean in_key;
+  gboolean escape;
+  gboolean in_element;
+  gboolean failed;
+
+  GString* skeleton;
+  GString* element;
+};
+
+#define STREAM_TOP(st) ((st)->frames->len > 0 ? &g_array_index((st)->frames, SJsonStreamFrame, (st)->frames->len - 1) : NULL)
+
+static gboolean stream_parse_path(const gchar* path, GArray* segments)
+{
+  const gchar* c = path;
+
+  if (*c++ != '$')
+    return FALSE;
+
+  while (*c)
+  {
+    SJsonStreamSegment seg = { NULL, 0 };
+
+    if (*c == '.')
+    {
+      const gchar* start = ++c;
+
+      while (*c && *c != '.' && *c != '[')
+        c++;
+
+      if (c == start)
+        return FALSE;
+
+      seg.name = g_strndup(start, c - start);
+    }
+    else if (*c == '[')
+    {
+      gchar* end;
+
+      seg.index = strtol(c + 1, &end, 10);
+      if (end == c + 1 || *end != ']' || seg.index < 0)
+        return FALSE;
+
+      c = end + 1;
+    }
+    else
+      return FALSE;
+
+    g_array_append_val(segments, seg);
+  }
+
+  return TRUE;
+}
+
+SJsonStream* s_json_stream_new(const gchar* path, SJsonStreamFunc callback, gpointer user_data)
+{
+  GArray* segments;
+  guint i;
+
+  g_return_val_if_fail(path != NULL, NULL);
+  g_return_val_if_fail(callback != NULL, NULL);
+
+  segments = g_array_new(FALSE, FALSE, sizeof(SJsonStreamSegment));
+  if (!stream_parse_path(path, segments))
+  {
+    for (i = 0; i < segments->len; i++)
+      g_free(g_array_index(segments, SJsonStreamSegment, i).name);
+    g_array_free(segments, TRUE);
+    return NULL;
+  }
+
+  SJsonStream* st = g_slice_new0(SJsonStream);
+  st->n_segments = segments->len;
+  st->segments = (SJsonStreamSegment*)g_array_free(segments, FALSE);
+  st->callback = callback;
+  st->user_data = user_data;
+  st->frames = g_array_new(FALSE, FALSE, sizeof(SJsonStreamFrame));
+  st->skeleton = g_string_sized_new(1024);
+  st->element = g_string_sized_new(1024);
+
+  return st;
+}
+
+void s_json_stream_free(SJsonStream* st)
+{
+  guint i;
+
+  if (!st)
+    return;
+
+  for (i = 0; i < st->n_segments; i++)
+    g_free(st->segments[i].name);
+  g_free(st->segments);
+
+  for (i = 0; i < st->frames->len; i++)
+    g_string_free(g_array_index(st->frames, SJsonStreamFrame, i).key, TRUE);
+  g_array_free(st->frames, TRUE);
+
+  g_string_free(st->skeleton, TRUE);
+  g_string_free(st->element, TRUE);
+  g_slice_free(SJsonStream, st);
+}
+
+// check that a value at the current position in the parent container
+// continues the streamed path
+static gboolean stream_segment_match(SJsonStream* st, SJsonStreamFrame* parent, guint depth)
+{
+  SJsonStreamSegment* seg;
+
+  if (!parent->matched || depth >= st->n_segments)
+    return FALSE;
+
+  seg = st->segments + depth;
+  if (parent->type == '{')
+    return seg->name && !strcmp(seg->name, parent->key->str);
+
+  return !seg->name && seg->index == parent->index;
+}
+
+static gboolean stream_emit_element(SJsonStream* st)
+{
+  gboolean cont = st->callback(st->element->str, st->user_data);
+
+  g_string_truncate(st->element, 0);
+  st->in_element = FALSE;
+
+  return cont;
+}
+
+gboolean s_json_stream_feed(SJsonStream* st, const gchar* buf, gsize len)
+{
+  const gchar* run = buf;
+  const gchar* c;
+  const gchar* end = buf + len;
+
+  g_return_val_if_fail(st != NULL, FALSE);
+  g_return_val_if_fail(buf != NULL || len == 0, FALSE);
+
+  if (st->failed)
+    return FALSE;
+
+#define FLUSH_RUN(upto) \
+  G_STMT_START { \
+    g_string_append_len(st->in_element ? st->element : st->skeleton, run, (upto) - run); \
+    run = (upto); \
+  } G_STMT_END
+
+  for (c = buf; c < end; c++)
+  {
+    SJsonStreamFrame* top = STREAM_TOP(st);
+
+    if (st->in_string)
+    {
+      if (st->escape)
+        st->escape = FALSE;
+      else if (*c == '\\')
+        st->escape = TRUE;
+      else if (*c == '"')
+      {
+        st->in_string = FALSE;
+        st->in_key = FALSE;
+        continue;
+      }
+
+      if (st->in_key)
+        g_string_append_c(top->key, *c);
+
+      continue;
+    }
+
+    if (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r')
+      continue;
+
+    // start of the next element of the streamed array
+    if (top && top->target && top->expect_value && *c != ']')
+    {
+      FLUSH_RUN(c);
+      st->in_element = TRUE;
+      top->expect_value = FALSE;
+    }
+
+    switch (*c)
+    {
+      case '"':
+        st->in_string = TRUE;
+        if (top && top->matched && top->type == '{' && top->expect_key)
+        {
+          st->in_key = TRUE;
+          g_string_truncate(top->key, 0);
+        }
+        break;
+
+      case '{':
+      case '[':
+      {
+        SJsonStreamFrame f = { *c, FALSE, FALSE, *c == '{', *c == '[', 0, g_string_new(NULL) };
+
+        f.matched = top ? stream_segment_match(st, top, st->frames->len - 1) : TRUE;
+        f.target = f.matched && *c == '[' && st->frames->len == st->n_segments;
+
+        g_array_append_val(st->frames, f);
+        break;
+      }
+
+      case '}':
+      case ']':
+        if (!top || top->type != (*c == '}' ? '{' : '['))
+          goto err;
+
+        if (top->target && st->in_element)
+        {
+          FLUSH_RUN(c);
+          if (!stream_emit_element(st))
+            goto err;
+        }
+
+        g_string_free(top->key, TRUE);
+        g_array_set_size(st->frames, st->frames->len - 1);
+        break;
+
+      case ',':
+        if (!top)
+          goto err;
+
+        if (top->type == '[')
+        {
+          top->index++;
+          top->expect_value = TRUE;
+        }
+        else
+          top->expect_key = TRUE;
+
+        // separators between streamed elements are dropped
+        if (top->target && st->in_element)
+        {
+          FLUSH_RUN(c);
+          run = c + 1;
+          if (!stream_emit_element(st))
+            goto err;
+        }
+        break;
+
+      case ':':
+        if (top && top->type == '{')
+          top->expect_key = FALSE;
+        break;
+    }
+  }
+
+  FLUSH_RUN(end);
+
+#undef FLUSH_RUN
+
+  return TRUE;
+
+err:
+  st->failed = TRUE;
+  return FALSE;
+}
+
+gchar* s_json_stream_finish(SJsonStream* st)
+{
+  g_return_val_if_fail(st != NULL, NULL);
+
+  if (st->failed || st->in_string || st->in_element || st->frames->len > 0)
+    return NULL;
+
+  return g_strdup(st->skeleton->str);
+}
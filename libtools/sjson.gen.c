@@ -45,6 +45,119 @@ enum
 #line 66 "sjson.c"
 
 
+// fast string scanning
+//
+// Strings (handles, keys, encrypted attributes) make up most of the API
+// responses. Strings without escapes are matched by looking for the closing
+// quote 16 or 32 bytes at a time, anything else goes through the re2c
+// scanner below. Vector loads never cross a page boundary, so they can't
+// fault past the end of the string.
+
+typedef const guchar* (*ScanStringFunc)(const guchar* c);
+
+// return pointer to the first '"', '\\' or '\0'
+static const guchar* scan_string_scalar(const guchar* c)
+{
+  while (*c != '"' && *c != '\\' && *c != '\0')
+    c++;
+
+  return c;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <immintrin.h>
+
+#define HAVE_SCAN_STRING_SIMD 1
+
+__attribute__((target("sse2")))
+static const guchar* scan_string_sse2(const guchar* c)
+{
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i bslash = _mm_set1_epi8('\\');
+  const __m128i zero = _mm_setzero_si128();
+
+  while (TRUE)
+  {
+    // go byte by byte near the end of a page
+    if (((guintptr)c & 4095) > 4096 - 16)
+    {
+      if (*c == '"' || *c == '\\' || *c == '\0')
+        return c;
+
+      c++;
+      continue;
+    }
+
+    __m128i v = _mm_loadu_si128((const __m128i*)c);
+    __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)), _mm_cmpeq_epi8(v, zero));
+    guint mask = _mm_movemask_epi8(hits);
+
+    if (mask)
+      return c + __builtin_ctz(mask);
+
+    c += 16;
+  }
+}
+
+__attribute__((target("avx2")))
+static const guchar* scan_string_avx2(const guchar* c)
+{
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i bslash = _mm256_set1_epi8('\\');
+  const __m256i zero = _mm256_setzero_si256();
+
+  while (TRUE)
+  {
+    // go byte by byte near the end of a page
+    if (((guintptr)c & 4095) > 4096 - 32)
+    {
+      if (*c == '"' || *c == '\\' || *c == '\0')
+        return c;
+
+      c++;
+      continue;
+    }
+
+    __m256i v = _mm256_loadu_si256((const __m256i*)c);
+    __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bslash)), _mm256_cmpeq_epi8(v, zero));
+    guint mask = _mm256_movemask_epi8(hits);
+
+    if (mask)
+      return c + __builtin_ctz(mask);
+
+    c += 32;
+  }
+}
+
+#endif
+
+static ScanStringFunc get_scan_string(void)
+{
+  static gsize impl = 0;
+
+  if (g_once_init_enter(&impl))
+  {
+    ScanStringFunc func = scan_string_scalar;
+    const gchar* force = g_getenv("SJSON_SCAN");
+
+#ifdef HAVE_SCAN_STRING_SIMD
+    __builtin_cpu_init();
+
+    if (!g_strcmp0(force, "scalar"))
+      func = scan_string_scalar;
+    else if (__builtin_cpu_supports("avx2") && g_strcmp0(force, "sse2"))
+      func = scan_string_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+      func = scan_string_sse2;
+#endif
+
+    g_once_init_leave(&impl, (gsize)func);
+  }
+
+  return (ScanStringFunc)impl;
+}
+
 static gint s_json_get_token(const gchar* json, const gchar** start, const gchar** end)
 {
   g_return_val_if_fail(json != NULL, FALSE);
@@ -54,12 +167,30 @@ static gint s_json_get_token(const gchar* json, const gchar** start, const gchar
   const guchar* s;
   gint token;
 
+  // fast path for strings without escapes
+  while (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r')
+    c++;
+
+  if (*c == '"')
+  {
+    const guchar* q = get_scan_string()(c + 1);
+
+    if (*q == '"')
+    {
+      if (start)
+        *start = (const gchar*)c;
+      if (end)
+        *end = (const gchar*)q + 1;
+      return TOK_NOESC_STRING;
+    }
+  }
+
   while (TRUE)
   {
     s = c;
 
 
-#line 63 "sjson.gen.c"
+#line 194 "sjson.gen.c"
 	{
 		guchar yych;
 		unsigned int yyaccept = 0;
@@ -114,69 +245,69 @@ yy2:
 		yych = (guchar)*c;
 		goto yy66;
 yy3:
-#line 82 "sjson.c"
+#line 213 "sjson.c"
 		{ 
       continue; 
     }
-#line 122 "sjson.gen.c"
+#line 253 "sjson.gen.c"
 yy4:
 		++c;
-#line 86 "sjson.c"
+#line 217 "sjson.c"
 		{
       token = TOK_OBJ_START;
       goto done;
     }
-#line 130 "sjson.gen.c"
+#line 261 "sjson.gen.c"
 yy6:
 		++c;
-#line 91 "sjson.c"
+#line 222 "sjson.c"
 		{
       token = TOK_OBJ_END;
       goto done;
     }
-#line 138 "sjson.gen.c"
+#line 269 "sjson.gen.c"
 yy8:
 		++c;
-#line 96 "sjson.c"
+#line 227 "sjson.c"
 		{
       token = TOK_ARRAY_START;
       goto done;
     }
-#line 146 "sjson.gen.c"
+#line 277 "sjson.gen.c"
 yy10:
 		++c;
-#line 101 "sjson.c"
+#line 232 "sjson.c"
 		{
       token = TOK_ARRAY_END;
       goto done;
     }
-#line 154 "sjson.gen.c"
+#line 285 "sjson.gen.c"
 yy12:
 		yyaccept = 0;
 		yych = (guchar)*(m = ++c);
 		if (yych >= 0x01) goto yy53;
 yy13:
-#line 150 "sjson.c"
+#line 281 "sjson.c"
 		{
       return TOK_INVALID;
     }
-#line 164 "sjson.gen.c"
+#line 295 "sjson.gen.c"
 yy14:
 		++c;
-#line 116 "sjson.c"
+#line 247 "sjson.c"
 		{
       token = TOK_COLON;
       goto done;
     }
-#line 172 "sjson.gen.c"
+#line 303 "sjson.gen.c"
 yy16:
 		++c;
-#line 121 "sjson.c"
+#line 252 "sjson.c"
 		{
       token = TOK_COMMA;
       goto done;
     }
-#line 180 "sjson.gen.c"
+#line 311 "sjson.gen.c"
 yy18:
 		yych = (guchar)*++c;
 		if (yych <= '/') goto yy13;
@@ -193,12 +324,12 @@ yy19:
 			if (yych == 'e') goto yy45;
 		}
 yy20:
-#line 126 "sjson.c"
+#line 257 "sjson.c"
 		{
       token = TOK_NUMBER;
       goto done;
     }
-#line 202 "sjson.gen.c"
+#line 333 "sjson.gen.c"
 yy21:
 		yyaccept = 1;
 		yych = (guchar)*(m = ++c);
@@ -220,11 +351,11 @@ yy24:
 		goto yy13;
 yy25:
 		++c;
-#line 146 "sjson.c"
+#line 277 "sjson.c"
 		{ 
       return TOK_NONE;
     }
-#line 228 "sjson.gen.c"
+#line 359 "sjson.gen.c"
 yy27:
 		yych = (guchar)*++c;
 		goto yy13;
@@ -242,12 +373,12 @@ yy30:
 		yych = (guchar)*++c;
 		if (yych != 'l') goto yy29;
 		++c;
-#line 141 "sjson.c"
+#line 272 "sjson.c"
 		{
       token = TOK_NULL;
       goto done;
     }
-#line 251 "sjson.gen.c"
+#line 382 "sjson.gen.c"
 yy33:
 		yych = (guchar)*++c;
 		if (yych != 'l') goto yy29;
@@ -256,24 +387,24 @@ yy33:
 		yych = (guchar)*++c;
 		if (yych != 'e') goto yy29;
 		++c;
-#line 136 "sjson.c"
+#line 267 "sjson.c"
 		{
       token = TOK_FALSE;
       goto done;
     }
-#line 265 "sjson.gen.c"
+#line 396 "sjson.gen.c"
 yy38:
 		yych = (guchar)*++c;
 		if (yych != 'u') goto yy29;
 		yych = (guchar)*++c;
 		if (yych != 'e') goto yy29;
 		++c;
-#line 131 "sjson.c"
+#line 262 "sjson.c"
 		{
       token = TOK_TRUE;
       goto done;
     }
-#line 277 "sjson.gen.c"
+#line 408 "sjson.gen.c"
 yy42:
 		yyaccept = 1;
 		m = ++c;
@@ -387,12 +518,12 @@ yy54:
 		}
 yy55:
 		++c;
-#line 106 "sjson.c"
+#line 237 "sjson.c"
 		{
       token = TOK_NOESC_STRING;
       goto done;
     }
-#line 396 "sjson.gen.c"
+#line 527 "sjson.gen.c"
 yy57:
 		++c;
 		yych = (guchar)*c;
@@ -417,12 +548,12 @@ yy58:
 			goto yy58;
 		}
 		++c;
-#line 111 "sjson.c"
+#line 242 "sjson.c"
 		{
       token = TOK_STRING;
       goto done;
     }
-#line 426 "sjson.gen.c"
+#line 557 "sjson.gen.c"
 yy62:
 		++c;
 		yych = (guchar)*c;
@@ -472,7 +603,7 @@ yy66:
 			goto yy3;
 		}
 	}
-#line 153 "sjson.c"
+#line 284 "sjson.c"
 
   }
 
@@ -787,7 +918,7 @@ gchar* s_json_get_string(const gchar* json)
     s = c;
 
 
-#line 791 "sjson.gen.c"
+#line 922 "sjson.gen.c"
 	{
 		guchar yych;
 		yych = (guchar)*c;
@@ -801,12 +932,12 @@ gchar* s_json_get_string(const gchar* json)
 		yych = (guchar)*c;
 		goto yy86;
 yy70:
-#line 467 "sjson.c"
+#line 598 "sjson.c"
 		{
       g_string_append_len(str, s, c - s);
       continue;
     }
-#line 810 "sjson.gen.c"
+#line 941 "sjson.gen.c"
 yy71:
 		yych = (guchar)*(m = ++c);
 		if (yych <= 'e') {
@@ -834,18 +965,18 @@ yy71:
 			}
 		}
 yy72:
-#line 502 "sjson.c"
+#line 633 "sjson.c"
 		{ 
       g_assert_not_reached();
     }
-#line 842 "sjson.gen.c"
+#line 973 "sjson.gen.c"
 yy73:
 		++c;
-#line 498 "sjson.c"
+#line 629 "sjson.c"
 		{
       return g_string_free(str, FALSE);
     }
-#line 849 "sjson.gen.c"
+#line 980 "sjson.gen.c"
 yy75:
 		yych = (guchar)*++c;
 		goto yy72;
@@ -864,7 +995,7 @@ yy77:
 		goto yy72;
 yy78:
 		++c;
-#line 472 "sjson.c"
+#line 603 "sjson.c"
 		{
       gchar ch = (gchar)s[1];
 
@@ -883,7 +1014,7 @@ yy78:
 
       continue;
     }
-#line 887 "sjson.gen.c"
+#line 1018 "sjson.gen.c"
 yy80:
 		yych = (guchar)*++c;
 		if (yych <= '@') {
@@ -916,14 +1047,14 @@ yy82:
 		}
 yy83:
 		++c;
-#line 491 "sjson.c"
+#line 622 "sjson.c"
 		{
       guint ch = 0;
       sscanf(s + 2, "%4x", &ch);
       g_string_append_unichar(str, ch);
       continue;
     }
-#line 927 "sjson.gen.c"
+#line 1058 "sjson.gen.c"
 yy85:
 		++c;
 		yych = (guchar)*c;
@@ -937,7 +1068,7 @@ yy86:
 			goto yy85;
 		}
 	}
-#line 505 "sjson.c"
+#line 636 "sjson.c"
 
   }
 
@@ -1169,7 +1300,7 @@ static void escape_string(GString* str, const gchar* v)
     s = c;
 
 
-#line 1173 "sjson.gen.c"
+#line 1304 "sjson.gen.c"
 	{
 		guchar yych;
 		yych = (guchar)*c;
@@ -1194,24 +1325,24 @@ static void escape_string(GString* str, const gchar* v)
 			}
 		}
 		++c;
-#line 736 "sjson.c"
+#line 867 "sjson.c"
 		{ g_string_append(str, "\\n"); continue; }
-#line 1200 "sjson.gen.c"
+#line 1331 "sjson.gen.c"
 yy91:
 		++c;
-#line 737 "sjson.c"
+#line 868 "sjson.c"
 		{ g_string_append(str, "\\r"); continue; }
-#line 1205 "sjson.gen.c"
+#line 1336 "sjson.gen.c"
 yy93:
 		++c;
-#line 738 "sjson.c"
+#line 869 "sjson.c"
 		{ g_string_append(str, "\\b"); continue; }
-#line 1210 "sjson.gen.c"
+#line 1341 "sjson.gen.c"
 yy95:
 		++c;
-#line 739 "sjson.c"
+#line 870 "sjson.c"
 		{ g_string_append(str, "\\t"); continue; }
-#line 1215 "sjson.gen.c"
+#line 1346 "sjson.gen.c"
 yy97:
 		++c;
 		if ((yych = (guchar)*c) <= '\r') {
@@ -1229,26 +1360,26 @@ yy97:
 			}
 		}
 yy98:
-#line 740 "sjson.c"
+#line 871 "sjson.c"
 		{ g_string_append(str, "\\f"); continue; }
-#line 1235 "sjson.gen.c"
+#line 1366 "sjson.gen.c"
 yy99:
 		++c;
-#line 741 "sjson.c"
+#line 872 "sjson.c"
 		{ g_string_append(str, "\\\""); continue; }
-#line 1240 "sjson.gen.c"
+#line 1371 "sjson.gen.c"
 yy101:
 		++c;
-#line 742 "sjson.c"
+#line 873 "sjson.c"
 		{ g_string_append(str, "\\\\"); continue; }
-#line 1245 "sjson.gen.c"
+#line 1376 "sjson.gen.c"
 yy103:
 		++c;
-#line 744 "sjson.c"
+#line 875 "sjson.c"
 		{ 
     break;
   }
-#line 1252 "sjson.gen.c"
+#line 1383 "sjson.gen.c"
 yy105:
 		++c;
 		yych = (guchar)*c;
@@ -1267,14 +1398,14 @@ yy105:
 			}
 		}
 yy107:
-#line 748 "sjson.c"
+#line 879 "sjson.c"
 		{
     g_string_append_len(str, (gchar*)s, c - s);
     continue;
   }
-#line 1276 "sjson.gen.c"
+#line 1407 "sjson.gen.c"
 	}
-#line 752 "sjson.c"
+#line 883 "sjson.c"
 
   }
 
@@ -1510,7 +1641,7 @@ gchar* s_json_buildv(const gchar* format, va_list args)
     s = c;
 
 
-#line 1514 "sjson.gen.c"
+#line 1645 "sjson.gen.c"
 	{
 		guchar yych;
 		unsigned int yyaccept = 0;
@@ -1582,22 +1713,22 @@ yy110:
 		yych = (guchar)*(m = ++c);
 		goto yy144;
 yy111:
-#line 987 "sjson.c"
+#line 1118 "sjson.c"
 		{
       g_string_append_len(str, s, c - s);
       continue;
     }
-#line 1591 "sjson.gen.c"
+#line 1722 "sjson.gen.c"
 yy112:
 		yyaccept = 1;
 		yych = (guchar)*(m = ++c);
 		if (yych >= 0x01) goto yy146;
 yy113:
-#line 1034 "sjson.c"
+#line 1165 "sjson.c"
 		{
       goto err;
     }
-#line 1601 "sjson.gen.c"
+#line 1732 "sjson.gen.c"
 yy114:
 		++c;
 		if ((yych = (guchar)*c) <= '/') goto yy139;
@@ -1605,14 +1736,14 @@ yy114:
 		if (yych <= '9') goto yy150;
 		goto yy139;
 yy115:
-#line 992 "sjson.c"
+#line 1123 "sjson.c"
 		{
       g_string_append_c(str, '"');
       g_string_append_len(str, s, c - s);
       g_string_append_c(str, '"');
       continue;
     }
-#line 1616 "sjson.gen.c"
+#line 1747 "sjson.gen.c"
 yy116:
 		yyaccept = 0;
 		yych = (guchar)*(m = ++c);
@@ -1681,11 +1812,11 @@ yy122:
 		}
 yy123:
 		++c;
-#line 1030 "sjson.c"
+#line 1161 "sjson.c"
 		{ 
       break;   
     }
-#line 1689 "sjson.gen.c"
+#line 1820 "sjson.gen.c"
 yy125:
 		yych = (guchar)*++c;
 		goto yy113;
@@ -1720,28 +1851,28 @@ yy127:
 		}
 yy128:
 		++c;
-#line 1026 "sjson.c"
+#line 1157 "sjson.c"
 		{
       FMT(gboolean, g_string_append(str, arg ? "true" : "false");)
     }
-#line 1728 "sjson.gen.c"
+#line 1859 "sjson.gen.c"
 yy130:
 		++c;
-#line 1022 "sjson.c"
+#line 1153 "sjson.c"
 		{
       FMT(gdouble, g_string_append_printf(str, "%lg" , arg);)
     }
-#line 1735 "sjson.gen.c"
+#line 1866 "sjson.gen.c"
 yy132:
 		++c;
-#line 1018 "sjson.c"
+#line 1149 "sjson.c"
 		{
       FMT(gint64, g_string_append_printf(str, "%" G_GINT64_FORMAT, arg);)
     }
-#line 1742 "sjson.gen.c"
+#line 1873 "sjson.gen.c"
 yy134:
 		++c;
-#line 1005 "sjson.c"
+#line 1136 "sjson.c"
 		{
       FMT_FULL(gchar*, 
         if (arg) {
@@ -1754,14 +1885,14 @@ yy134:
           g_string_append(str, "null");
         }, if (fmt == 'J') g_free(arg);)
     }
-#line 1758 "sjson.gen.c"
+#line 1889 "sjson.gen.c"
 yy136:
 		++c;
-#line 1001 "sjson.c"
+#line 1132 "sjson.c"
 		{
       FMT_FULL(gchar*, if (arg) escape_string(str, arg); else g_string_append(str, "null");, if (fmt == 'S') g_free(arg);)
     }
-#line 1765 "sjson.gen.c"
+#line 1896 "sjson.gen.c"
 yy138:
 		++c;
 		yych = (guchar)*c;
@@ -3172,7 +3303,7 @@ yy201:
 			goto yy127;
 		}
 	}
-#line 1037 "sjson.c"
+#line 1168 "sjson.c"
 
   }
 
@@ -3294,7 +3425,7 @@ const gchar* s_json_path(const gchar* json, const gchar* path)
     s = c;
 
 
-#line 3298 "sjson.gen.c"
+#line 3429 "sjson.gen.c"
 	{
 		guchar yych;
 		unsigned int yyaccept = 0;
@@ -3329,21 +3460,21 @@ yy204:
 		yych = (guchar)*c;
 		goto yy268;
 yy205:
-#line 1158 "sjson.c"
+#line 1289 "sjson.c"
 		{
       // skip whitespace
       continue;
     }
-#line 3338 "sjson.gen.c"
+#line 3469 "sjson.gen.c"
 yy206:
 		++c;
-#line 1163 "sjson.c"
+#line 1294 "sjson.c"
 		{
       // root
       cur_node = json;
       continue;
     }
-#line 3347 "sjson.gen.c"
+#line 3478 "sjson.gen.c"
 yy208:
 		++c;
 		if ((yych = (guchar)*c) <= 'Z') {
@@ -3358,11 +3489,11 @@ yy208:
 			}
 		}
 yy209:
-#line 1236 "sjson.c"
+#line 1367 "sjson.c"
 		{
       return NULL;
     }
-#line 3366 "sjson.gen.c"
+#line 3497 "sjson.gen.c"
 yy210:
 		yyaccept = 0;
 		yych = (guchar)*(m = ++c);
@@ -3383,11 +3514,11 @@ yy211:
 		}
 yy212:
 		++c;
-#line 1232 "sjson.c"
+#line 1363 "sjson.c"
 		{ 
       break;
     }
-#line 3391 "sjson.gen.c"
+#line 3522 "sjson.gen.c"
 yy214:
 		yych = (guchar)*++c;
 		goto yy209;
@@ -3396,37 +3527,37 @@ yy215:
 		yych = (guchar)*(m = ++c);
 		if (yych == 'r') goto yy255;
 yy216:
-#line 1228 "sjson.c"
+#line 1359 "sjson.c"
 		{
       CHECK_TYPE(S_JSON_TYPE_ARRAY)
     }
-#line 3404 "sjson.gen.c"
+#line 3535 "sjson.gen.c"
 yy217:
 		yyaccept = 2;
 		yych = (guchar)*(m = ++c);
 		if (yych == 'b') goto yy250;
 yy218:
-#line 1224 "sjson.c"
+#line 1355 "sjson.c"
 		{
       CHECK_TYPE(S_JSON_TYPE_OBJECT)
     }
-#line 3414 "sjson.gen.c"
+#line 3545 "sjson.gen.c"
 yy219:
 		yyaccept = 3;
 		yych = (guchar)*(m = ++c);
 		if (yych == 'o') goto yy244;
 yy220:
-#line 1220 "sjson.c"
+#line 1351 "sjson.c"
 		{
       CHECK_TYPE(S_JSON_TYPE_BOOL)
     }
-#line 3424 "sjson.gen.c"
+#line 3555 "sjson.gen.c"
 yy221:
 		yyaccept = 4;
 		yych = (guchar)*(m = ++c);
 		if (yych == 'n') goto yy238;
 yy222:
-#line 1203 "sjson.c"
+#line 1334 "sjson.c"
 		{
       if (cur_node && s_json_get_type(cur_node) == S_JSON_TYPE_NUMBER)
       {
@@ -3443,27 +3574,27 @@ yy222:
 
       return NULL;
     }
-#line 3447 "sjson.gen.c"
+#line 3578 "sjson.gen.c"
 yy223:
 		yyaccept = 5;
 		yych = (guchar)*(m = ++c);
 		if (yych == 't') goto yy233;
 yy224:
-#line 1199 "sjson.c"
+#line 1330 "sjson.c"
 		{
       CHECK_TYPE(S_JSON_TYPE_STRING)
     }
-#line 3457 "sjson.gen.c"
+#line 3588 "sjson.gen.c"
 yy225:
 		yyaccept = 6;
 		yych = (guchar)*(m = ++c);
 		if (yych == 'u') goto yy227;
 yy226:
-#line 1195 "sjson.c"
+#line 1326 "sjson.c"
 		{
       CHECK_TYPE(S_JSON_TYPE_NUMBER)
     }
-#line 3467 "sjson.gen.c"
+#line 3598 "sjson.gen.c"
 yy227:
 		yych = (guchar)*++c;
 		if (yych == 'm') goto yy229;
@@ -3572,7 +3703,7 @@ yy260:
 		if (yych != ']') goto yy228;
 yy262:
 		++c;
-#line 1182 "sjson.c"
+#line 1313 "sjson.c"
 		{
       if (!cur_node || s_json_get_type(cur_node) != S_JSON_TYPE_ARRAY)
         return NULL;
@@ -3583,7 +3714,7 @@ yy262:
       cur_node = s_json_get_element(cur_node, index);
       continue;
     }
-#line 3587 "sjson.gen.c"
+#line 3718 "sjson.gen.c"
 yy264:
 		++c;
 		yych = (guchar)*c;
@@ -3604,7 +3735,7 @@ yy264:
 			}
 		}
 yy266:
-#line 1169 "sjson.c"
+#line 1300 "sjson.c"
 		{
       if (!cur_node || s_json_get_type(cur_node) != S_JSON_TYPE_OBJECT)
         return NULL;
@@ -3617,7 +3748,7 @@ yy266:
       cur_node = s_json_get_member(cur_node, name);
       continue;
     }
-#line 3621 "sjson.gen.c"
+#line 3752 "sjson.gen.c"
 yy267:
 		++c;
 		yych = (guchar)*c;
@@ -3632,7 +3763,7 @@ yy268:
 			goto yy205;
 		}
 	}
-#line 1239 "sjson.c"
+#line 1370 "sjson.c"
 
   }
 
@@ -3653,7 +3784,7 @@ gchar* s_json_compact(const gchar* json)
     s = c;
 
 
-#line 3657 "sjson.gen.c"
+#line 3788 "sjson.gen.c"
 	{
 		guchar yych;
 		unsigned int yyaccept = 0;
@@ -3739,22 +3870,22 @@ yy271:
 			}
 		}
 yy272:
-#line 1259 "sjson.c"
+#line 1390 "sjson.c"
 		{
       g_string_append_len(str, s, c - s);
       continue;
     }
-#line 3748 "sjson.gen.c"
+#line 3879 "sjson.gen.c"
 yy273:
 		yyaccept = 1;
 		yych = (guchar)*(m = ++c);
 		if (yych >= 0x01) goto yy294;
 yy274:
-#line 1272 "sjson.c"
+#line 1403 "sjson.c"
 		{
       goto err;
     }
-#line 3758 "sjson.gen.c"
+#line 3889 "sjson.gen.c"
 yy275:
 		yych = (guchar)*++c;
 		if (yych <= '/') goto yy274;
@@ -3873,18 +4004,18 @@ yy281:
 		yych = (guchar)*c;
 		goto yy287;
 yy282:
-#line 1264 "sjson.c"
+#line 1395 "sjson.c"
 		{
       continue;
     }
-#line 3881 "sjson.gen.c"
+#line 4012 "sjson.gen.c"
 yy283:
 		++c;
-#line 1268 "sjson.c"
+#line 1399 "sjson.c"
 		{ 
       break;   
     }
-#line 3888 "sjson.gen.c"
+#line 4019 "sjson.gen.c"
 yy285:
 		yych = (guchar)*++c;
 		goto yy274;
@@ -4500,7 +4631,7 @@ yy327:
 			goto yy289;
 		}
 	}
-#line 1275 "sjson.c"
+#line 1406 "sjson.c"
 
   }
 
@@ -4510,3 +4641,551 @@ err:
   g_string_free(str, TRUE);
   return NULL;
 }
+
+// structural index
+
+typedef struct
+{
+  const gchar* json;
+  gint next;   // index of the first entry after this value
+  gint parent; // index of the enclosing array/object, -1 for the root value
+  SJsonType type;
+} SJsonTapeEntry;
+
+struct _SJsonTape
+{
+  GArray* entries;
+};
+
+#define TAPE_ENTRY(tape, i) (&g_array_index((tape)->entries, SJsonTapeEntry, (i)))
+
+enum
+{
+  TAPE_VALUE,
+  TAPE_VALUE_OR_END,
+  TAPE_KEY,
+  TAPE_KEY_OR_END,
+  TAPE_COLON,
+  TAPE_COMMA_OR_END,
+  TAPE_DONE
+};
+
+static gint tape_push(GArray* entries, const gchar* json, gint parent, SJsonType type)
+{
+  SJsonTapeEntry e = { json, entries->len + 1, parent, type };
+
+  g_array_append_val(entries, e);
+  return entries->len - 1;
+}
+
+SJsonTape* s_json_tape_new(const gchar* json)
+{
+  GArray* entries;
+  GArray* stack;
+  const gchar* p = json;
+  const gchar* start;
+  gint state = TAPE_VALUE;
+  gint token, parent = -1, idx;
+
+  g_return_val_if_fail(json != NULL, NULL);
+
+  entries = g_array_sized_new(FALSE, FALSE, sizeof(SJsonTapeEntry), 64);
+  stack = g_array_sized_new(FALSE, FALSE, sizeof(gint), 16);
+
+  while (state != TAPE_DONE)
+  {
+    token = s_json_get_token(p, &start, &p);
+
+    switch (state)
+    {
+      case TAPE_VALUE_OR_END:
+        if (token == TOK_ARRAY_END)
+          goto close;
+        // fall through
+      case TAPE_VALUE:
+        idx = tape_push(entries, start, parent, token_to_type(token));
+
+        if (token == TOK_OBJ_START || token == TOK_ARRAY_START)
+        {
+          g_array_append_val(stack, idx);
+          parent = idx;
+          state = token == TOK_OBJ_START ? TAPE_KEY_OR_END : TAPE_VALUE_OR_END;
+          continue;
+        }
+
+        if (token != TOK_STRING && token != TOK_NOESC_STRING && token != TOK_NUMBER && token != TOK_FALSE && token != TOK_TRUE && token != TOK_NULL)
+          goto err;
+
+        goto value_done;
+
+      case TAPE_KEY_OR_END:
+        if (token == TOK_OBJ_END)
+          goto close;
+        // fall through
+      case TAPE_KEY:
+        if (token != TOK_STRING && token != TOK_NOESC_STRING)
+          goto err;
+
+        tape_push(entries, start, parent, S_JSON_TYPE_STRING);
+        state = TAPE_COLON;
+        continue;
+
+      case TAPE_COLON:
+        if (token != TOK_COLON)
+          goto err;
+
+        state = TAPE_VALUE;
+        continue;
+
+      case TAPE_COMMA_OR_END:
+        if (token == TOK_COMMA)
+        {
+          state = g_array_index(entries, SJsonTapeEntry, parent).type == S_JSON_TYPE_OBJECT ? TAPE_KEY : TAPE_VALUE;
+          continue;
+        }
+
+        if (token == (g_array_index(entries, SJsonTapeEntry, parent).type == S_JSON_TYPE_OBJECT ? TOK_OBJ_END : TOK_ARRAY_END))
+          goto close;
+
+        goto err;
+    }
+
+close:
+    // container is complete, its subtree ends here
+    g_array_index(entries, SJsonTapeEntry, parent).next = entries->len;
+    g_array_set_size(stack, stack->len - 1);
+    parent = stack->len > 0 ? g_array_index(stack, gint, stack->len - 1) : -1;
+
+value_done:
+    state = parent < 0 ? TAPE_DONE : TAPE_COMMA_OR_END;
+  }
+
+  // nothing but whitespace may follow the root value
+  if (s_json_get_token(p, NULL, NULL) != TOK_NONE)
+    goto err;
+
+  g_array_free(stack, TRUE);
+
+  SJsonTape* tape = g_slice_new(SJsonTape);
+  tape->entries = entries;
+  return tape;
+
+err:
+  g_array_free(stack, TRUE);
+  g_array_free(entries, TRUE);
+  return NULL;
+}
+
+void s_json_tape_free(SJsonTape* tape)
+{
+  if (!tape)
+    return;
+
+  g_array_free(tape->entries, TRUE);
+  g_slice_free(SJsonTape, tape);
+}
+
+SJsonType s_json_tape_get_type(SJsonTape* tape, gint node)
+{
+  g_return_val_if_fail(tape != NULL, S_JSON_TYPE_INVALID);
+
+  if (node < 0 || node >= tape->entries->len)
+    return S_JSON_TYPE_NONE;
+
+  return TAPE_ENTRY(tape, node)->type;
+}
+
+const gchar* s_json_tape_get_json(SJsonTape* tape, gint node)
+{
+  g_return_val_if_fail(tape != NULL, NULL);
+
+  if (node < 0 || node >= tape->entries->len)
+    return NULL;
+
+  return TAPE_ENTRY(tape, node)->json;
+}
+
+const gchar* s_json_tape_get_key(SJsonTape* tape, gint node)
+{
+  g_return_val_if_fail(tape != NULL, NULL);
+
+  if (node <= 0 || node >= tape->entries->len)
+    return NULL;
+
+  gint parent = TAPE_ENTRY(tape, node)->parent;
+  if (parent < 0 || TAPE_ENTRY(tape, parent)->type != S_JSON_TYPE_OBJECT)
+    return NULL;
+
+  return TAPE_ENTRY(tape, node - 1)->json;
+}
+
+gint s_json_tape_get_first(SJsonTape* tape, gint node)
+{
+  SJsonTapeEntry* e;
+
+  g_return_val_if_fail(tape != NULL, -1);
+
+  if (node < 0 || node >= tape->entries->len)
+    return -1;
+
+  e = TAPE_ENTRY(tape, node);
+  if (e->next == node + 1)
+    return -1;
+
+  // skip member name
+  if (e->type == S_JSON_TYPE_OBJECT)
+    return node + 2;
+  else if (e->type == S_JSON_TYPE_ARRAY)
+    return node + 1;
+
+  return -1;
+}
+
+gint s_json_tape_get_next(SJsonTape* tape, gint node)
+{
+  SJsonTapeEntry *e, *p;
+
+  g_return_val_if_fail(tape != NULL, -1);
+
+  if (node <= 0 || node >= tape->entries->len)
+    return -1;
+
+  e = TAPE_ENTRY(tape, node);
+  if (e->parent < 0)
+    return -1;
+
+  p = TAPE_ENTRY(tape, e->parent);
+  if (e->next >= p->next)
+    return -1;
+
+  // skip member name
+  return p->type == S_JSON_TYPE_OBJECT ? e->next + 1 : e->next;
+}
+
+gint s_json_tape_get_member(SJsonTape* tape, gint node, const gchar* name)
+{
+  gint value;
+
+  g_return_val_if_fail(tape != NULL, -1);
+  g_return_val_if_fail(name != NULL, -1);
+
+  if (s_json_tape_get_type(tape, node) != S_JSON_TYPE_OBJECT)
+    return -1;
+
+  for (value = s_json_tape_get_first(tape, node); value >= 0; value = s_json_tape_get_next(tape, value))
+    if (s_json_string_match(TAPE_ENTRY(tape, value - 1)->json, name))
+      return value;
+
+  return -1;
+}
+
+gchar* s_json_tape_get_member_string(SJsonTape* tape, gint node, const gchar* name)
+{
+  const gchar* json = s_json_tape_get_json(tape, s_json_tape_get_member(tape, node, name));
+
+  return json ? s_json_get_string(json) : NULL;
+}
+
+gint64 s_json_tape_get_member_int(SJsonTape* tape, gint node, const gchar* name, gint64 fallback)
+{
+  const gchar* json = s_json_tape_get_json(tape, s_json_tape_get_member(tape, node, name));
+
+  return json ? s_json_get_int(json, fallback) : fallback;
+}
+
+// streaming parser
+
+typedef struct
+{
+  gchar* name; // member name, or NULL for array index
+  gint index;
+} SJsonStreamSegment;
+
+typedef struct
+{
+  gchar type;         // '{' or '['
+  gboolean matched;   // container is on the streamed path
+  gboolean target;    // this is the streamed array
+  gboolean expect_key;
+  gboolean expect_value;
+  gint index;
+  GString* key;
+} SJsonStreamFrame;
+
+struct _SJsonStream
+{
+  SJsonStreamSegment* segments;
+  guint n_segments;
+  SJsonStreamFunc callback;
+  gpointer user_data;
+
+  GArray* frames;
+  gboolean in_string;
+  gboolean in_key;
+  gboolean escape;
+  gboolean in_element;
+  gboolean failed;
+
+  GString* skeleton;
+  GString* element;
+};
+
+#define STREAM_TOP(st) ((st)->frames->len > 0 ? &g_array_index((st)->frames, SJsonStreamFrame, (st)->frames->len - 1) : NULL)
+
+static gboolean stream_parse_path(const gchar* path, GArray* segments)
+{
+  const gchar* c = path;
+
+  if (*c++ != '$')
+    return FALSE;
+
+  while (*c)
+  {
+    SJsonStreamSegment seg = { NULL, 0 };
+
+    if (*c == '.')
+    {
+      const gchar* start = ++c;
+
+      while (*c && *c != '.' && *c != '[')
+        c++;
+
+      if (c == start)
+        return FALSE;
+
+      seg.name = g_strndup(start, c - start);
+    }
+    else if (*c == '[')
+    {
+      gchar* end;
+
+      seg.index = strtol(c + 1, &end, 10);
+      if (end == c + 1 || *end != ']' || seg.index < 0)
+        return FALSE;
+
+      c = end + 1;
+    }
+    else
+      return FALSE;
+
+    g_array_append_val(segments, seg);
+  }
+
+  return TRUE;
+}
+
+SJsonStream* s_json_stream_new(const gchar* path, SJsonStreamFunc callback, gpointer user_data)
+{
+  GArray* segments;
+  guint i;
+
+  g_return_val_if_fail(path != NULL, NULL);
+  g_return_val_if_fail(callback != NULL, NULL);
+
+  segments = g_array_new(FALSE, FALSE, sizeof(SJsonStreamSegment));
+  if (!stream_parse_path(path, segments))
+  {
+    for (i = 0; i < segments->len; i++)
+      g_free(g_array_index(segments, SJsonStreamSegment, i).name);
+    g_array_free(segments, TRUE);
+    return NULL;
+  }
+
+  SJsonStream* st = g_slice_new0(SJsonStream);
+  st->n_segments = segments->len;
+  st->segments = (SJsonStreamSegment*)g_array_free(segments, FALSE);
+  st->callback = callback;
+  st->user_data = user_data;
+  st->frames = g_array_new(FALSE, FALSE, sizeof(SJsonStreamFrame));
+  st->skeleton = g_string_sized_new(1024);
+  st->element = g_string_sized_new(1024);
+
+  return st;
+}
+
+void s_json_stream_free(SJsonStream* st)
+{
+  guint i;
+
+  if (!st)
+    return;
+
+  for (i = 0; i < st->n_segments; i++)
+    g_free(st->segments[i].name);
+  g_free(st->segments);
+
+  for (i = 0; i < st->frames->len; i++)
+    g_string_free(g_array_index(st->frames, SJsonStreamFrame, i).key, TRUE);
+  g_array_free(st->frames, TRUE);
+
+  g_string_free(st->skeleton, TRUE);
+  g_string_free(st->element, TRUE);
+  g_slice_free(SJsonStream, st);
+}
+
+// check that a value at the current position in the parent container
+// continues the streamed path
+static gboolean stream_segment_match(SJsonStream* st, SJsonStreamFrame* parent, guint depth)
+{
+  SJsonStreamSegment* seg;
+
+  if (!parent->matched || depth >= st->n_segments)
+    return FALSE;
+
+  seg = st->segments + depth;
+  if (parent->type == '{')
+    return seg->name && !strcmp(seg->name, parent->key->str);
+
+  return !seg->name && seg->index == parent->index;
+}
+
+static gboolean stream_emit_element(SJsonStream* st)
+{
+  gboolean cont = st->callback(st->element->str, st->user_data);
+
+  g_string_truncate(st->element, 0);
+  st->in_element = FALSE;
+
+  return cont;
+}
+
+gboolean s_json_stream_feed(SJsonStream* st, const gchar* buf, gsize len)
+{
+  const gchar* run = buf;
+  const gchar* c;
+  const gchar* end = buf + len;
+
+  g_return_val_if_fail(st != NULL, FALSE);
+  g_return_val_if_fail(buf != NULL || len == 0, FALSE);
+
+  if (st->failed)
+    return FALSE;
+
+#define FLUSH_RUN(upto) \
+  G_STMT_START { \
+    g_string_append_len(st->in_element ? st->element : st->skeleton, run, (upto) - run); \
+    run = (upto); \
+  } G_STMT_END
+
+  for (c = buf; c < end; c++)
+  {
+    SJsonStreamFrame* top = STREAM_TOP(st);
+
+    if (st->in_string)
+    {
+      if (st->escape)
+        st->escape = FALSE;
+      else if (*c == '\\')
+        st->escape = TRUE;
+      else if (*c == '"')
+      {
+        st->in_string = FALSE;
+        st->in_key = FALSE;
+        continue;
+      }
+
+      if (st->in_key)
+        g_string_append_c(top->key, *c);
+
+      continue;
+    }
+
+    if (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r')
+      continue;
+
+    // start of the next element of the streamed array
+    if (top && top->target && top->expect_value && *c != ']')
+    {
+      FLUSH_RUN(c);
+      st->in_element = TRUE;
+      top->expect_value = FALSE;
+    }
+
+    switch (*c)
+    {
+      case '"':
+        st->in_string = TRUE;
+        if (top && top->matched && top->type == '{' && top->expect_key)
+        {
+          st->in_key = TRUE;
+          g_string_truncate(top->key, 0);
+        }
+        break;
+
+      case '{':
+      case '[':
+      {
+        SJsonStreamFrame f = { *c, FALSE, FALSE, *c == '{', *c == '[', 0, g_string_new(NULL) };
+
+        f.matched = top ? stream_segment_match(st, top, st->frames->len - 1) : TRUE;
+        f.target = f.matched && *c == '[' && st->frames->len == st->n_segments;
+
+        g_array_append_val(st->frames, f);
+        break;
+      }
+
+      case '}':
+      case ']':
+        if (!top || top->type != (*c == '}' ? '{' : '['))
+          goto err;
+
+        if (top->target && st->in_element)
+        {
+          FLUSH_RUN(c);
+          if (!stream_emit_element(st))
+            goto err;
+        }
+
+        g_string_free(top->key, TRUE);
+        g_array_set_size(st->frames, st->frames->len - 1);
+        break;
+
+      case ',':
+        if (!top)
+          goto err;
+
+        if (top->type == '[')
+        {
+          top->index++;
+          top->expect_value = TRUE;
+        }
+        else
+          top->expect_key = TRUE;
+
+        // separators between streamed elements are dropped
+        if (top->target && st->in_element)
+        {
+          FLUSH_RUN(c);
+          run = c + 1;
+          if (!stream_emit_element(st))
+            goto err;
+        }
+        break;
+
+      case ':':
+        if (top && top->type == '{')
+          top->expect_key = FALSE;
+        break;
+    }
+  }
+
+  FLUSH_RUN(end);
+
+#undef FLUSH_RUN
+
+  return TRUE;
+
+err:
+  st->failed = TRUE;
+  return FALSE;
+}
+
+gchar* s_json_stream_finish(SJsonStream* st)
+{
+  g_return_val_if_fail(st != NULL, NULL);
+
+  if (st->failed || st->in_string || st->in_element || st->frames->len > 0)
+    return NULL;
+
+  return g_strdup(st->skeleton->str);
+}
@@ -110,6 +110,45 @@ gchar*         s_json_build                 (const gchar* format, ...);
 gchar*         s_json_pretty                (const gchar* json);
 gchar*         s_json_compact               (const gchar* json);
 
+// structural index
+//
+// Tape is built in a single pass over the JSON string, it records where each
+// value starts and where its subtree ends. Values are referred to by their
+// index on the tape, root value has index 0, -1 means no value. Strings
+// returned by s_json_tape_get_json point into the original JSON string,
+// which must outlive the tape.
+
+typedef struct _SJsonTape SJsonTape;
+
+SJsonTape*     s_json_tape_new              (const gchar* json);
+void           s_json_tape_free             (SJsonTape* tape);
+
+SJsonType      s_json_tape_get_type         (SJsonTape* tape, gint node);
+const gchar*   s_json_tape_get_json         (SJsonTape* tape, gint node);
+const gchar*   s_json_tape_get_key          (SJsonTape* tape, gint node);
+gint           s_json_tape_get_first        (SJsonTape* tape, gint node);
+gint           s_json_tape_get_next         (SJsonTape* tape, gint node);
+gint           s_json_tape_get_member       (SJsonTape* tape, gint node, const gchar* name);
+gchar*         s_json_tape_get_member_string(SJsonTape* tape, gint node, const gchar* name);
+gint64         s_json_tape_get_member_int   (SJsonTape* tape, gint node, const gchar* name, gint64 fallback);
+
+// streaming parser
+//
+// Data is pushed in arbitrary pieces as it arrives. Elements of the array at
+// path (eg. "$[0].f") are passed to the callback one by one as soon as they
+// are complete, and are left out of the rest of the document. What remains
+// is returned by s_json_stream_finish. Elements and the remaining document
+// are not validated, use s_json_is_valid or s_json_tape_new on them.
+
+typedef struct _SJsonStream SJsonStream;
+
+typedef gboolean (*SJsonStreamFunc)(const gchar* element, gpointer user_data);
+
+SJsonStream*   s_json_stream_new            (const gchar* path, SJsonStreamFunc callback, gpointer user_data);
+gboolean       s_json_stream_feed           (SJsonStream* stream, const gchar* buf, gsize len);
+gchar*         s_json_stream_finish         (SJsonStream* stream);
+void           s_json_stream_free           (SJsonStream* stream);
+
 // iterator macros
 
 #define S_JSON_FOREACH_ELEMENT(json, iter) \
@@ -24,6 +24,9 @@
 
 #include "config.h"
 #include "tools.h"
+#include "sjson.h"
+#include "http.h"
+#include "mega/mega.h"
 
 #ifdef G_OS_WIN32
 #include <windows.h>
@@ -49,7 +52,12 @@ static gboolean opt_version;
 static gboolean opt_no_config;
 static gboolean opt_no_ask_password;
 static gboolean opt_disable_previews;
+static gboolean opt_remember_key;
+static gboolean opt_no_daemon;
+static gint opt_connections;
 gboolean tool_allow_unknown_options = FALSE;
+gboolean tool_allow_daemon = FALSE;
+gboolean tool_allow_transfer_options = FALSE;
 
 static gboolean opt_debug_callback(const gchar *option_name, const gchar *value, gpointer data, GError **error)
 {
@@ -94,6 +102,14 @@ static GOptionEntry auth_options[] =
   { "no-ask-password",    '\0',  0, G_OPTION_ARG_NONE,      &opt_no_ask_password,  "Never ask interactively for a password",      NULL       },
   { "disable-previews",   '\0',  0, G_OPTION_ARG_NONE,      &opt_disable_previews, "Never generate previews when uploading file", NULL       },
   { "reload",             '\0',  0, G_OPTION_ARG_NONE,      &opt_reload_files,     "Reload filesystem cache",                     NULL       },
+  { "remember-key",       '\0',  0, G_OPTION_ARG_NONE,      &opt_remember_key,     "Remember password key until logout",          NULL       },
+  { "no-daemon",          '\0',  0, G_OPTION_ARG_NONE,      &opt_no_daemon,        "Don't use running megad, even if available",  NULL       },
+  { NULL }
+};
+
+static GOptionEntry transfer_options[] =
+{
+  { "connections",        '\0',  0, G_OPTION_ARG_INT,       &opt_connections,      "Number of connections used per file (1-16)",  "N"        },
   { NULL }
 };
 
@@ -313,6 +329,45 @@ gchar* tool_convert_filename(const gchar* path, gboolean local)
   return locale_path;
 }
 
+static GKeyFile* load_config(void)
+{
+  gboolean status;
+  GKeyFile* kf;
+
+  if (opt_no_config && !opt_config)
+    return NULL;
+
+  kf = g_key_file_new();
+
+  if (opt_config)
+    status = g_key_file_load_from_file(kf, opt_config, 0, NULL);
+  else
+  {
+    status = g_key_file_load_from_file(kf, MEGA_RC_FILENAME, 0, NULL);
+    if (!status)
+    {
+      gc_free gchar* tmp = g_build_filename(g_get_home_dir(), MEGA_RC_FILENAME, NULL);
+      status = g_key_file_load_from_file(kf, tmp, 0, NULL);
+    }
+  }
+
+  if (!status)
+  {
+    g_key_file_unref(kf);
+    return NULL;
+  }
+
+  return kf;
+}
+
+static void load_transfer_config(GKeyFile* kf)
+{
+  if (!tool_allow_transfer_options || opt_connections > 0)
+    return;
+
+  opt_connections = g_key_file_get_integer(kf, "Network", "Connections", NULL);
+}
+
 void tool_init_bare(gint* ac, gchar*** av, const gchar* tool_name, GOptionEntry* tool_entries)
 {
   GError *local_err = NULL;
@@ -324,6 +379,8 @@ void tool_init_bare(gint* ac, gchar*** av, const gchar* tool_name, GOptionEntry*
     g_option_context_set_ignore_unknown_options(opt_context, TRUE);
   if (tool_entries)
     g_option_context_add_main_entries(opt_context, tool_entries, NULL);
+  if (tool_allow_transfer_options)
+    g_option_context_add_main_entries(opt_context, transfer_options, NULL);
   g_option_context_add_main_entries(opt_context, basic_options, NULL);
 
   if (!g_option_context_parse(opt_context, ac, av, &local_err))
@@ -334,6 +391,12 @@ void tool_init_bare(gint* ac, gchar*** av, const gchar* tool_name, GOptionEntry*
   }
 
   print_version();
+
+  // tools without login only read transfer settings from the default
+  // config file
+  gc_key_file_unref GKeyFile* kf = load_config();
+  if (kf)
+    load_transfer_config(kf);
 }
 
 void tool_init(gint* ac, gchar*** av, const gchar* tool_name, GOptionEntry* tool_entries)
@@ -347,6 +410,8 @@ void tool_init(gint* ac, gchar*** av, const gchar* tool_name, GOptionEntry* tool
     g_option_context_set_ignore_unknown_options(opt_context, TRUE);
   if (tool_entries)
     g_option_context_add_main_entries(opt_context, tool_entries, NULL);
+  if (tool_allow_transfer_options)
+    g_option_context_add_main_entries(opt_context, transfer_options, NULL);
   g_option_context_add_main_entries(opt_context, auth_options, NULL);
   g_option_context_add_main_entries(opt_context, basic_options, NULL);
 
@@ -360,24 +425,10 @@ void tool_init(gint* ac, gchar*** av, const gchar* tool_name, GOptionEntry* tool
   print_version();
 
   // load username/password from ini file
-  if (!opt_no_config || opt_config)
   {
-    gboolean status;
-    gc_key_file_unref GKeyFile* kf = g_key_file_new();
+    gc_key_file_unref GKeyFile* kf = load_config();
 
-    if (opt_config)
-      status = g_key_file_load_from_file(kf, opt_config, 0, NULL);
-    else
-    {
-      status = g_key_file_load_from_file(kf, MEGA_RC_FILENAME, 0, NULL);
-      if (!status)
-      {
-        gc_free gchar* tmp = g_build_filename(g_get_home_dir(), MEGA_RC_FILENAME, NULL);
-        status = g_key_file_load_from_file(kf, tmp, 0, NULL);
-      }
-    }
-
-    if (status)
+    if (kf)
     {
       if (!opt_username)
         opt_username = g_key_file_get_string(kf, "Login", "Username", NULL);
@@ -389,6 +440,11 @@ void tool_init(gint* ac, gchar*** av, const gchar* tool_name, GOptionEntry* tool
         opt_cache_timout = to;
       else
         g_clear_error(&local_err);
+
+      if (!opt_remember_key)
+        opt_remember_key = g_key_file_get_boolean(kf, "Cache", "RememberKey", NULL);
+
+      load_transfer_config(kf);
     }
   }
 
@@ -398,6 +454,11 @@ void tool_init(gint* ac, gchar*** av, const gchar* tool_name, GOptionEntry* tool
     exit(1);
   }
 
+  // password is not needed when talking to megad or when the key is
+  // remembered, ask for it later if it turns out to be needed
+  if (tool_daemon_available() || opt_remember_key)
+    return;
+
   if (!opt_password && opt_no_ask_password)
   {
     g_printerr("ERROR: You must specify your mega.co.nz password\n");
@@ -408,6 +469,28 @@ void tool_init(gint* ac, gchar*** av, const gchar* tool_name, GOptionEntry* tool
     opt_password = input_password();
 }
 
+void tool_setup_transfers(mega_session* s)
+{
+  if (opt_connections > 0)
+    mega_session_set_connections(s, opt_connections);
+}
+
+// ask for the password, unless remembered key can be used instead
+static gboolean get_password(mega_session* s)
+{
+  if (opt_password || mega_session_has_remembered_key(s, opt_username))
+    return TRUE;
+
+  if (opt_no_ask_password)
+  {
+    g_printerr("ERROR: You must specify your mega.co.nz password\n");
+    return FALSE;
+  }
+
+  opt_password = input_password();
+  return TRUE;
+}
+
 mega_session* tool_start_session(void)
 {
   GError *local_err = NULL;
@@ -416,13 +499,47 @@ mega_session* tool_start_session(void)
 
   mega_session* s = mega_session_new();
 
-  // try to load cached session data (they are valid for 10 minutes since last
-  // user_get or refresh)
-  if (!mega_session_load(s, opt_username, opt_password, opt_cache_timout, &sid, &local_err))
+  mega_session_enable_key_cache(s, opt_remember_key);
+
+  if (!get_password(s))
+    goto err;
+
+  // try to load cached session data, filesystem data older than 10 minutes
+  // are brought up to date incrementally using server-client action packets
+  // (timeout of 0 means the cache never expires)
+  if (mega_session_load(s, opt_username, opt_password, 0, &sid, &local_err))
+  {
+    if (!opt_reload_files && opt_cache_timout > 0 && mega_session_is_stale(s, opt_cache_timout))
+    {
+      // on failure, fall back to login and full refresh
+      if (mega_session_sync(s, &local_err))
+      {
+        loaded = TRUE;
+        mega_session_save(s, NULL);
+      }
+    }
+    else
+      loaded = TRUE;
+  }
+
+  if (!loaded)
   {
     g_clear_error(&local_err);
 
-    if (!mega_session_open(s, opt_username, opt_password, sid, &local_err))
+    gboolean opened = mega_session_open(s, opt_username, opt_password, sid, &local_err);
+
+    // remembered key was outdated and is dropped, password is needed now
+    if (!opened && !opt_password)
+    {
+      g_clear_error(&local_err);
+
+      if (!get_password(s))
+        goto err;
+
+      opened = mega_session_open(s, opt_username, opt_password, sid, &local_err);
+    }
+
+    if (!opened)
     {
       g_printerr("ERROR: Can't login to mega.co.nz: %s\n", local_err->message);
       goto err;
@@ -434,11 +551,9 @@ mega_session* tool_start_session(void)
       goto err;
     }
 
-    loaded = TRUE;
     mega_session_save(s, NULL);
   }
-
-  if (opt_reload_files && !loaded)
+  else if (opt_reload_files)
   {
     if (!mega_session_refresh(s, &local_err))
     {
@@ -450,6 +565,7 @@ mega_session* tool_start_session(void)
   }
 
   mega_session_enable_previews(s, !opt_disable_previews);
+  tool_setup_transfers(s);
 
   g_free(sid);
   return s;
@@ -461,12 +577,147 @@ err:
   return NULL;
 }
 
+// {{{ megad client
+
+gchar* tool_daemon_socket_path(void)
+{
+  g_return_val_if_fail(opt_username != NULL, NULL);
+
+  gc_free gchar* un_lower = g_ascii_strdown(opt_username, -1);
+  gc_checksum_free GChecksum* cs = g_checksum_new(G_CHECKSUM_SHA1);
+  g_checksum_update(cs, un_lower, -1);
+  gc_free gchar* filename = g_strconcat("megad-", g_checksum_get_string(cs), ".sock", NULL);
+
+  return g_build_filename(g_get_user_runtime_dir(), filename, NULL);
+}
+
+gboolean tool_daemon_available(void)
+{
+#ifdef G_OS_UNIX
+  if (!tool_allow_daemon || opt_no_daemon || opt_reload_files || !opt_username)
+    return FALSE;
+
+  gc_free gchar* path = tool_daemon_socket_path();
+
+  return g_file_test(path, G_FILE_TEST_EXISTS);
+#else
+  return FALSE;
+#endif
+}
+
+gchar* tool_daemon_call(const gchar* request, GError** err)
+{
+  GError* local_err = NULL;
+
+  g_return_val_if_fail(request != NULL, NULL);
+  g_return_val_if_fail(err == NULL || *err == NULL, NULL);
+
+#ifdef G_OS_UNIX
+  gc_free gchar* path = tool_daemon_socket_path();
+  gc_object_unref GSocketAddress* address = g_unix_socket_address_new(path);
+  gc_object_unref GSocketClient* client = g_socket_client_new();
+
+  gc_object_unref GSocketConnection* conn = g_socket_client_connect(client, G_SOCKET_CONNECTABLE(address), NULL, &local_err);
+  if (!conn)
+  {
+    g_propagate_error(err, local_err);
+    return NULL;
+  }
+
+  GOutputStream* out = g_io_stream_get_output_stream(G_IO_STREAM(conn));
+  if (!g_output_stream_write_all(out, request, strlen(request), NULL, NULL, &local_err) || !g_output_stream_write_all(out, "\n", 1, NULL, NULL, &local_err))
+  {
+    g_propagate_error(err, local_err);
+    return NULL;
+  }
+
+  gc_object_unref GDataInputStream* in = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(conn)));
+  gchar* response = g_data_input_stream_read_line(in, NULL, NULL, &local_err);
+  if (!response)
+  {
+    if (local_err)
+      g_propagate_error(err, local_err);
+    else
+      g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Connection closed by megad");
+    return NULL;
+  }
+
+  if (s_json_get_type(response) != S_JSON_TYPE_OBJECT)
+  {
+    g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "Invalid response from megad");
+    g_free(response);
+    return NULL;
+  }
+
+  return response;
+#else
+  g_set_error(err, MEGA_ERROR, MEGA_ERROR_OTHER, "megad is not supported on this platform");
+  return NULL;
+#endif
+}
+
+static void daemon_node_free(mega_node* n)
+{
+  g_free(n->name);
+  g_free(n->handle);
+  g_free(n->parent_handle);
+  g_free(n->user_handle);
+  g_free(n->key);
+  g_free(n->link);
+  g_free(n);
+}
+
+GHashTable* tool_daemon_load_nodes(const gchar* nodes)
+{
+  GHashTable* map = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)daemon_node_free);
+  GHashTableIter it;
+  mega_node* n;
+
+  S_JSON_FOREACH_ELEMENT(nodes, node)
+    if (s_json_get_type(node) != S_JSON_TYPE_OBJECT)
+      continue;
+
+    n = g_new0(mega_node, 1);
+    n->handle = s_json_get_member_string(node, "h");
+    n->parent_handle = s_json_get_member_string(node, "p");
+    n->user_handle = s_json_get_member_string(node, "u");
+    n->name = s_json_get_member_string(node, "n");
+    n->link = s_json_get_member_string(node, "l");
+    n->type = s_json_get_member_int(node, "t", -1);
+    n->size = s_json_get_member_int(node, "s", 0);
+    n->timestamp = s_json_get_member_int(node, "ts", 0);
+
+    gc_free gchar* key = s_json_get_member_string(node, "k");
+    if (key)
+      n->key = mega_base64urldecode(key, &n->key_len);
+
+    if (!n->handle || !n->name)
+    {
+      daemon_node_free(n);
+      continue;
+    }
+
+    g_hash_table_replace(map, n->handle, n);
+  S_JSON_FOREACH_END()
+
+  // link parents, so that mega_node_get_path works
+  g_hash_table_iter_init(&it, map);
+  while (g_hash_table_iter_next(&it, NULL, (gpointer*)&n))
+    if (n->parent_handle)
+      n->parent = g_hash_table_lookup(map, n->parent_handle);
+
+  return map;
+}
+
+// }}}
+
 void tool_fini(mega_session* s)
 {
   if (s)
     mega_session_free(s);
 
   g_option_context_free(opt_context);
+  http_cleanup();
   curl_global_cleanup();
   CRYPTO_cleanup_all_ex_data();
   ERR_free_strings();
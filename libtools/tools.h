@@ -31,11 +31,21 @@
 void            tool_init_bare        (gint* ac, gchar*** av, const gchar* tool_name, GOptionEntry* tool_entries);
 void            tool_init             (gint* ac, gchar*** av, const gchar* tool_name, GOptionEntry* tool_entries);
 mega_session*   tool_start_session    (void);
+void            tool_setup_transfers  (mega_session* s);
 void            tool_fini             (mega_session* s);
 
 gchar*          tool_convert_filename (const gchar* path, gboolean local);
 
+// megad client, tools must set tool_allow_daemon before tool_init
+gchar*          tool_daemon_socket_path (void);
+gboolean        tool_daemon_available   (void);
+gchar*          tool_daemon_call        (const gchar* request, GError** err);
+GHashTable*     tool_daemon_load_nodes  (const gchar* nodes);
+
 extern gboolean tool_allow_unknown_options;
+extern gboolean tool_allow_daemon;
+// --connections option and [Network] Connections setting
+extern gboolean tool_allow_transfer_options;
 
 #ifdef G_OS_WIN32
 #define ESC_CLREOL ""
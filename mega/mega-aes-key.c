@@ -66,6 +66,7 @@
 
 #include <string.h>
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <openssl/err.h>
 
@@ -79,17 +80,10 @@ struct _MegaAesKeyPrivate
   AES_KEY dec_key;
 
   // for ctr
-  union 
-  {
-    guchar ctr_iv[16];
-    struct 
-    {
-      guchar ctr_nonce[8];
-      guint64 ctr_position;
-    };
-  };
-  gint ctr_num;
-  guchar ctr_ecount[AES_BLOCK_SIZE];
+  EVP_CIPHER_CTX* ctr_ctx;
+
+  // for cbc_mac, key is expanded once, only IV is reset per call
+  EVP_CIPHER_CTX* cbc_mac_ctx;
 };
 
 // {{{ GObject property and signal enums
@@ -243,6 +237,12 @@ void mega_aes_key_load_binary(MegaAesKey* aes_key, const guchar* data)
 
   memcpy(aes_key->priv->key, data, 16);
 
+  if (aes_key->priv->cbc_mac_ctx)
+  {
+    EVP_CIPHER_CTX_free(aes_key->priv->cbc_mac_ctx);
+    aes_key->priv->cbc_mac_ctx = NULL;
+  }
+
   AES_set_encrypt_key(data, 128, &aes_key->priv->enc_key);
   AES_set_decrypt_key(data, 128, &aes_key->priv->dec_key);
 
@@ -404,25 +404,36 @@ void mega_aes_key_generate_from_password(MegaAesKey* aes_key, const gchar* passw
   g_return_if_fail(password != NULL);
 
   guchar pkey[16] = {0x93, 0xC4, 0x67, 0xE3, 0x7D, 0xB0, 0xC7, 0xA4, 0xD1, 0xBE, 0x3F, 0x81, 0x01, 0x52, 0xCB, 0x56};
-  gint off, r;
+  gint i, r, n_keys;
   gint len;
 
   len = strlen(password);
+  n_keys = (len + 15) / 16;
+
+  // key schedules don't change between rounds, expand them just once
+  AES_KEY* keys = g_new0(AES_KEY, MAX(n_keys, 1));
+  for (i = 0; i < n_keys; i++)
+  {
+    guchar key[16] = {0};
+    strncpy(key, password + i * 16, 16);
+
+    AES_set_encrypt_key(key, 128, keys + i);
+  }
 
   for (r = 65536; r--; )
   {
-    for (off = 0; off < len; off += 16)
+    for (i = 0; i < n_keys; i++)
     {
-      AES_KEY k;
-      guchar key[16] = {0}, pkey_tmp[16];
-      strncpy(key, password + off, 16);
+      guchar pkey_tmp[16];
 
-      AES_set_encrypt_key(key, 128, &k);
-      AES_encrypt(pkey, pkey_tmp, &k);  
+      AES_encrypt(pkey, pkey_tmp, keys + i);
       memcpy(pkey, pkey_tmp, 16);
     }
   }
 
+  memset(keys, 0, sizeof(AES_KEY) * MAX(n_keys, 1));
+  g_free(keys);
+
   mega_aes_key_load_binary(aes_key, pkey);
 }
 
@@ -554,6 +565,55 @@ void mega_aes_key_encrypt_cbc_raw (MegaAesKey* aes_key, const guchar* plain, guc
   AES_cbc_encrypt(plain, cipher, len, &aes_key->priv->enc_key, iv, 1);
 }
 
+/**
+ * mega_aes_key_cbc_mac_raw:
+ * @aes_key: a #MegaAesKey
+ * @mac: (inout) (element-type guint8) (array fixed-size=16): MAC state, used as IV and updated in place
+ * @data: (in) (element-type guint8) (array length=len): Input data
+ * @len: (in): 16 byte aligned length of input data.
+ *
+ * Update CBC-MAC with whole blocks of data. Uses EVP's CBC implementation,
+ * which is hardware accelerated where available. The expanded key is kept
+ * with @aes_key, so this is not safe to call from multiple threads on the
+ * same key.
+ */
+void mega_aes_key_cbc_mac_raw(MegaAesKey* aes_key, guchar* mac, const guchar* data, gsize len)
+{
+  guchar out[16 * 1024];
+  EVP_CIPHER_CTX* ctx;
+  gint out_len = 0;
+
+  g_return_if_fail(MEGA_IS_AES_KEY(aes_key));
+  g_return_if_fail(aes_key->priv->loaded);
+  g_return_if_fail(mac != NULL);
+  g_return_if_fail(data != NULL);
+  g_return_if_fail((len % 16) == 0);
+
+  if (len == 0)
+    return;
+
+  ctx = aes_key->priv->cbc_mac_ctx;
+  if (ctx == NULL)
+  {
+    ctx = aes_key->priv->cbc_mac_ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, aes_key->priv->key, NULL);
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+  }
+
+  EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, mac);
+
+  while (len > 0)
+  {
+    gsize n = MIN(len, sizeof(out));
+
+    EVP_EncryptUpdate(ctx, out, &out_len, data, n);
+    data += n;
+    len -= n;
+  }
+
+  memcpy(mac, out + out_len - 16, 16);
+}
+
 /**
  * mega_aes_key_decrypt_cbc_raw:
  * @aes_key: a #MegaAesKey
@@ -684,14 +744,19 @@ gchar* mega_aes_key_encrypt_string_cbc(MegaAesKey* aes_key, const gchar* str)
  */
 void mega_aes_key_setup_ctr(MegaAesKey* aes_key, guchar* nonce, guint64 position)
 {
+  guchar iv[16];
+
   g_return_if_fail(MEGA_IS_AES_KEY(aes_key));
   g_return_if_fail(nonce != NULL);
 
-  memcpy(aes_key->priv->ctr_nonce, nonce, 8);
-  aes_key->priv->ctr_position = GUINT64_TO_BE(position);
+  position = GUINT64_TO_BE(position);
+  memcpy(iv, nonce, 8);
+  memcpy(iv + 8, &position, 8);
+
+  if (aes_key->priv->ctr_ctx == NULL)
+    aes_key->priv->ctr_ctx = EVP_CIPHER_CTX_new();
 
-  memset(aes_key->priv->ctr_ecount, 0, 16);
-  aes_key->priv->ctr_num = 0;
+  EVP_EncryptInit_ex(aes_key->priv->ctr_ctx, EVP_aes_128_ctr(), NULL, aes_key->priv->key, iv);
 }
 
 /**
@@ -699,18 +764,33 @@ void mega_aes_key_setup_ctr(MegaAesKey* aes_key, guchar* nonce, guint64 position
  * @aes_key: a #MegaAesKey
  * @from: (in) (element-type guint8) (array length=len): Plaintext input data
  * @to: (out caller-allocates) (element-type guint8) (array length=len): Ciphertext
- * @len: (in): 16 byte aligned length of plaintext data.
+ * @len: (in): Length of plaintext data.
+ *
+ * Encrypt plaintext using AES key in CTR mode. Keystream position is advanced
+ * by @len bytes, so data can be processed in pieces of any size. @from and @to
+ * may point to the same buffer.
  *
- * Encrypt plaintext blocks using AES key in CTR mode.
+ * #mega_aes_key_setup_ctr must be called first.
  */
 void mega_aes_key_encrypt_ctr(MegaAesKey* aes_key, guchar* from, guchar* to, gsize len)
 {
+  gint out_len;
+
   g_return_if_fail(MEGA_IS_AES_KEY(aes_key));
+  g_return_if_fail(aes_key->priv->ctr_ctx != NULL);
   g_return_if_fail(from != NULL);
   g_return_if_fail(to != NULL);
   g_return_if_fail(len > 0);
 
-  AES_ctr128_encrypt(from, to, len, &aes_key->priv->enc_key, aes_key->priv->ctr_iv, aes_key->priv->ctr_ecount, &aes_key->priv->ctr_num);
+  while (len > 0)
+  {
+    gsize n = MIN(len, 1 << 30);
+
+    EVP_EncryptUpdate(aes_key->priv->ctr_ctx, to, &out_len, from, n);
+    from += n;
+    to += n;
+    len -= n;
+  }
 }
 
 /**
@@ -846,8 +926,13 @@ static void mega_aes_key_dispose(GObject *object)
 
 static void mega_aes_key_finalize(GObject *object)
 {
-  //MegaAesKey *aes_key = MEGA_AES_KEY(object);
-  //
+  MegaAesKey *aes_key = MEGA_AES_KEY(object);
+
+  if (aes_key->priv->ctr_ctx)
+    EVP_CIPHER_CTX_free(aes_key->priv->ctr_ctx);
+  if (aes_key->priv->cbc_mac_ctx)
+    EVP_CIPHER_CTX_free(aes_key->priv->cbc_mac_ctx);
+
   G_OBJECT_CLASS(mega_aes_key_parent_class)->finalize(object);
 }
 
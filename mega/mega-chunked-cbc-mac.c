@@ -41,8 +41,25 @@ struct _MegaChunkedCbcMacPrivate
   guchar chunk_mac[16];
   guchar meta_mac[16];
   gboolean finished;
+
+  // worker pool mode, each worker takes its own copy of the key from
+  // worker_keys, so that the expanded key isn't shared between threads
+  gint threads;
+  GThreadPool* pool;
+  GAsyncQueue* worker_keys;
+  GPtrArray* jobs;
+  GByteArray* chunk_buf;
+  GMutex lock;
+  GCond cond;
+  guint pending;
 };
 
+typedef struct
+{
+  GByteArray* data;
+  guchar mac[16];
+} ChunkJob;
+
 // {{{ GObject property and signal enums
 //
 enum MegaChunkedCbcMacProp
@@ -76,21 +93,127 @@ G_GNUC_UNUSED static gsize get_chunk_off(gint idx)
   return p;
 }
 
-static void close_chunk(MegaChunkedCbcMacPrivate* priv)
+static void fold_chunk_mac(MegaChunkedCbcMacPrivate* priv, const guchar* chunk_mac)
 {
   gint i;
   guchar tmp[16];
 
   for (i = 0; i < 16; i++)
-    priv->meta_mac[i] ^= priv->chunk_mac[i];
+    priv->meta_mac[i] ^= chunk_mac[i];
 
   mega_aes_key_encrypt_raw(priv->key, priv->meta_mac, tmp, 16);
   memcpy(priv->meta_mac, tmp, 16);
+}
+
+static void close_chunk(MegaChunkedCbcMacPrivate* priv)
+{
+  fold_chunk_mac(priv, priv->chunk_mac);
 
   memcpy(priv->chunk_mac, priv->chunk_mac_iv, 16);
   priv->next_boundary += get_chunk_size(++priv->chunk_idx);
 }
 
+// {{{ worker pool
+
+static void chunk_job_run(ChunkJob* job, MegaChunkedCbcMacPrivate* priv)
+{
+  guchar tmp[16];
+  guchar* data = job->data->data;
+  gsize len = job->data->len;
+  gsize blocks_len = len & ~(gsize)15, i;
+
+  MegaAesKey* key = g_async_queue_pop(priv->worker_keys);
+
+  memcpy(job->mac, priv->chunk_mac_iv, 16);
+
+  mega_aes_key_cbc_mac_raw(key, job->mac, data, blocks_len);
+
+  // zero padded last block
+  if (len > blocks_len)
+  {
+    for (i = 0; i < len - blocks_len; i++)
+      job->mac[i] ^= data[blocks_len + i];
+
+    mega_aes_key_encrypt_raw(key, job->mac, tmp, 16);
+    memcpy(job->mac, tmp, 16);
+  }
+
+  g_async_queue_push(priv->worker_keys, key);
+
+  g_byte_array_unref(job->data);
+  job->data = NULL;
+
+  g_mutex_lock(&priv->lock);
+  priv->pending--;
+  g_cond_signal(&priv->cond);
+  g_mutex_unlock(&priv->lock);
+}
+
+static void submit_chunk(MegaChunkedCbcMacPrivate* priv)
+{
+  ChunkJob* job = g_new0(ChunkJob, 1);
+
+  job->data = priv->chunk_buf;
+  priv->chunk_buf = g_byte_array_new();
+  g_ptr_array_add(priv->jobs, job);
+
+  // limit memory used by chunks that wait for processing
+  g_mutex_lock(&priv->lock);
+  while (priv->pending >= priv->threads * 2)
+    g_cond_wait(&priv->cond, &priv->lock);
+  priv->pending++;
+  g_mutex_unlock(&priv->lock);
+
+  g_thread_pool_push(priv->pool, job, NULL);
+  priv->next_boundary += get_chunk_size(++priv->chunk_idx);
+}
+
+static void pool_start(MegaChunkedCbcMacPrivate* priv)
+{
+  gint i;
+
+  priv->worker_keys = g_async_queue_new_full(g_object_unref);
+  for (i = 0; i < priv->threads; i++)
+  {
+    guchar* key = mega_aes_key_get_binary(priv->key);
+
+    g_async_queue_push(priv->worker_keys, mega_aes_key_new_from_binary(key));
+    g_free(key);
+  }
+
+  priv->pool = g_thread_pool_new((GFunc)chunk_job_run, priv, priv->threads, FALSE, NULL);
+  priv->jobs = g_ptr_array_new_with_free_func(g_free);
+  priv->chunk_buf = g_byte_array_new();
+  priv->pending = 0;
+}
+
+// waits for all jobs and folds their MACs into meta_mac in chunk order
+static void pool_stop(MegaChunkedCbcMacPrivate* priv, gboolean fold)
+{
+  guint i;
+
+  if (!priv->pool)
+    return;
+
+  g_thread_pool_free(priv->pool, FALSE, TRUE);
+  priv->pool = NULL;
+
+  if (fold)
+  {
+    for (i = 0; i < priv->jobs->len; i++)
+      fold_chunk_mac(priv, ((ChunkJob*)priv->jobs->pdata[i])->mac);
+  }
+
+  g_ptr_array_unref(priv->jobs);
+  priv->jobs = NULL;
+  g_byte_array_unref(priv->chunk_buf);
+  priv->chunk_buf = NULL;
+  g_async_queue_unref(priv->worker_keys);
+  priv->worker_keys = NULL;
+}
+
+// }}}
+
 /**
  * mega_chunked_cbc_mac_new:
  *
@@ -123,6 +246,8 @@ void mega_chunked_cbc_mac_setup(MegaChunkedCbcMac* mac, MegaAesKey* key, guchar*
 
   priv = mac->priv;
 
+  pool_stop(priv, FALSE);
+
   if (priv->key)
     g_object_unref(priv->key);
 
@@ -131,9 +256,30 @@ void mega_chunked_cbc_mac_setup(MegaChunkedCbcMac* mac, MegaAesKey* key, guchar*
   priv->chunk_idx = 0;
   priv->next_boundary = get_chunk_size(priv->chunk_idx);
   priv->position = 0;
+  priv->finished = FALSE;
   memcpy(priv->chunk_mac_iv, iv, 16);
   memcpy(priv->chunk_mac, iv, 16);
   memset(priv->meta_mac, 0, 16);
+
+  if (priv->threads > 1)
+    pool_start(priv);
+}
+
+/**
+ * mega_chunked_cbc_mac_set_threads:
+ * @mac: a #MegaChunkedCbcMac
+ * @threads: Number of worker threads, 0 or 1 to calculate MAC in the caller's
+ * thread.
+ *
+ * Calculate MACs of individual chunks on a pool of worker threads. Chunk MACs
+ * are still folded into the meta-MAC in order. Takes effect on the next call
+ * to mega_chunked_cbc_mac_setup().
+ */
+void mega_chunked_cbc_mac_set_threads(MegaChunkedCbcMac* mac, gint threads)
+{
+  g_return_if_fail(MEGA_IS_CHUNKED_CBC_MAC(mac));
+
+  mac->priv->threads = MAX(threads, 0);
 }
 
 /**
@@ -155,16 +301,49 @@ void mega_chunked_cbc_mac_update(MegaChunkedCbcMac* mac, const guchar* data, gsi
 
   priv = mac->priv;
 
-  for (i = 0; i < len; i++)
+  if (priv->pool)
   {
-    priv->chunk_mac[priv->position % 16] ^= data[i];
-    priv->position++;
+    while (len > 0)
+    {
+      gsize n = MIN(len, priv->next_boundary - priv->position);
+
+      g_byte_array_append(priv->chunk_buf, data, n);
+      priv->position += n;
+      data += n;
+      len -= n;
+
+      if (priv->position == priv->next_boundary)
+        submit_chunk(priv);
+    }
+
+    return;
+  }
+
+  i = 0;
+  while (i < len)
+  {
+    // whole blocks up to the chunk boundary are processed in bulk, byte loop
+    // is only used for unaligned head and tail
+    if ((priv->position % 16) == 0 && len - i >= 16)
+    {
+      gsize n = MIN(len - i, priv->next_boundary - priv->position) & ~(gsize)15;
 
-    if (G_UNLIKELY((priv->position % 16) == 0))
+      mega_aes_key_cbc_mac_raw(priv->key, priv->chunk_mac, data + i, n);
+      priv->position += n;
+      i += n;
+    }
+    else
     {
-      guchar tmp[16];
-      mega_aes_key_encrypt_raw(priv->key, priv->chunk_mac, tmp, 16);
-      memcpy(priv->chunk_mac, tmp, 16);
+      priv->chunk_mac[priv->position % 16] ^= data[i];
+      priv->position++;
+      i++;
+
+      if (G_UNLIKELY((priv->position % 16) == 0))
+      {
+        guchar tmp[16];
+        mega_aes_key_encrypt_raw(priv->key, priv->chunk_mac, tmp, 16);
+        memcpy(priv->chunk_mac, tmp, 16);
+      }
     }
 
     // add chunk mac to the chunk macs list if we are at the chunk boundary
@@ -197,6 +376,16 @@ void mega_chunked_cbc_mac_finish(MegaChunkedCbcMac* mac, guchar* meta_mac)
 
   priv->finished = TRUE;
 
+  if (priv->pool)
+  {
+    if (priv->chunk_buf->len > 0)
+      submit_chunk(priv);
+
+    pool_stop(priv, TRUE);
+    memcpy(meta_mac, priv->meta_mac, 16);
+    return;
+  }
+
   // finish buffer if necessary
   if (priv->position % 16)
   {
@@ -247,6 +436,9 @@ G_DEFINE_TYPE(MegaChunkedCbcMac, mega_chunked_cbc_mac, G_TYPE_OBJECT);
 static void mega_chunked_cbc_mac_init(MegaChunkedCbcMac *mac)
 {
   mac->priv = G_TYPE_INSTANCE_GET_PRIVATE(mac, MEGA_TYPE_CHUNKED_CBC_MAC, MegaChunkedCbcMacPrivate);
+
+  g_mutex_init(&mac->priv->lock);
+  g_cond_init(&mac->priv->cond);
 }
 
 static void mega_chunked_cbc_mac_dispose(GObject *object)
@@ -263,6 +455,10 @@ static void mega_chunked_cbc_mac_dispose(GObject *object)
 static void mega_chunked_cbc_mac_finalize(GObject *object)
 {
   MegaChunkedCbcMac *mac = MEGA_CHUNKED_CBC_MAC(object);
+
+  pool_stop(mac->priv, FALSE);
+  g_mutex_clear(&mac->priv->lock);
+  g_cond_clear(&mac->priv->cond);
   
   if (mac->priv->key)
     g_object_unref(mac->priv->key);
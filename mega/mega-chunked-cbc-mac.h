@@ -50,6 +50,7 @@ GType                   mega_chunked_cbc_mac_get_type   (void) G_GNUC_CONST;
 
 MegaChunkedCbcMac*      mega_chunked_cbc_mac_new        (void);
 
+void                    mega_chunked_cbc_mac_set_threads(MegaChunkedCbcMac* mac, gint threads);
 void                    mega_chunked_cbc_mac_setup      (MegaChunkedCbcMac* mac, MegaAesKey* key, guchar* iv);
 void                    mega_chunked_cbc_mac_update     (MegaChunkedCbcMac* mac, const guchar* data, gsize len);
 void                    mega_chunked_cbc_mac_finish     (MegaChunkedCbcMac* mac, guchar* meta_mac);
@@ -180,6 +180,20 @@ void test_aes_encrypt(void)
 
 void test_aes_cbc(void)
 {
+  MegaAesKey* k = mega_aes_key_new_from_binary(KEY_BINARY);
+  guchar plain[4096], cipher[4096], mac[16] = {0};
+  gint i;
+
+  for (i = 0; i < sizeof(plain); i++)
+    plain[i] = i * 13;
+
+  // CBC-MAC is the last block of CBC ciphertext
+  mega_aes_key_encrypt_cbc_raw(k, plain, cipher, sizeof(plain));
+  mega_aes_key_cbc_mac_raw(k, mac, plain, sizeof(plain));
+  g_assert(memcmp(mac, cipher + sizeof(plain) - 16, 16) == 0);
+
+  g_object_unref(k);
+
   /*
 gchar*                  mega_aes_key_encrypt_cbc        (MegaAesKey* aes_key, const guchar* plain, gsize len);
 gchar*                  mega_aes_key_encrypt_string_cbc (MegaAesKey* aes_key, const gchar* str);
@@ -187,12 +201,110 @@ GBytes*                 mega_aes_key_decrypt_cbc        (MegaAesKey* aes_key, co
 */
 }
 
+const guchar* CTR_KAT_KEY = (const guchar*)"\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c";
+const guchar* CTR_KAT_NONCE = (const guchar*)"\xf0\xf1\xf2\xf3\xf4\xf5\xf6\xf7";
+const guint64 CTR_KAT_POSITION = G_GUINT64_CONSTANT(0xf8f9fafbfcfdfeff);
+const guchar* CTR_KAT_PLAIN = (const guchar*)
+  "\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a"
+  "\xae\x2d\x8a\x57\x1e\x03\xac\x9c\x9e\xb7\x6f\xac\x45\xaf\x8e\x51"
+  "\x30\xc8\x1c\x46\xa3\x5c\xe4\x11\xe5\xfb\xc1\x19\x1a\x0a\x52\xef"
+  "\xf6\x9f\x24\x45\xdf\x4f\x9b\x17\xad\x2b\x41\x7b\xe6\x6c\x37\x10";
+const guchar* CTR_KAT_CIPHER = (const guchar*)
+  "\x87\x4d\x61\x91\xb6\x20\xe3\x26\x1b\xef\x68\x64\x99\x0d\xb6\xce"
+  "\x98\x06\xf6\x6b\x79\x70\xfd\xff\x86\x17\x18\x7b\xb9\xff\xfd\xff"
+  "\x5a\xe4\xdf\x3e\xdb\xd5\xd3\x5e\x5b\x4f\x09\x02\x0d\xb0\x3e\xab"
+  "\x1e\x03\x1d\xda\x2f\xbe\x03\xd1\x79\x21\x70\xa0\xf3\x00\x9c\xee";
+
 void test_aes_ctr(void)
 {
-  /*
-void                    mega_aes_key_setup_ctr          (MegaAesKey* aes_key, guchar* nonce, guint64 position);
-void                    mega_aes_key_encrypt_ctr        (MegaAesKey* aes_key, guchar* from, guchar* to, gsize len);
-*/
+  MegaAesKey* k = mega_aes_key_new_from_binary(KEY_BINARY);
+  guchar nonce[8] = "12345678";
+  guchar plain[100], cipher[100], cipher2[100], buf[100];
+  gint i;
+
+  for (i = 0; i < sizeof(plain); i++)
+    plain[i] = i * 13;
+
+  mega_aes_key_setup_ctr(k, nonce, 0);
+  mega_aes_key_encrypt_ctr(k, plain, cipher, sizeof(plain));
+  g_assert(memcmp(plain, cipher, sizeof(plain)) != 0);
+
+  // unaligned pieces continue the keystream
+  mega_aes_key_setup_ctr(k, nonce, 0);
+  mega_aes_key_encrypt_ctr(k, plain, cipher2, 7);
+  mega_aes_key_encrypt_ctr(k, plain + 7, cipher2 + 7, sizeof(plain) - 7);
+  g_assert(memcmp(cipher, cipher2, sizeof(plain)) == 0);
+
+  // setup at block position
+  mega_aes_key_setup_ctr(k, nonce, 2);
+  mega_aes_key_encrypt_ctr(k, plain + 32, cipher2, sizeof(plain) - 32);
+  g_assert(memcmp(cipher + 32, cipher2, sizeof(plain) - 32) == 0);
+
+  // in place decryption
+  memcpy(buf, cipher, sizeof(buf));
+  mega_aes_key_setup_ctr(k, nonce, 0);
+  mega_aes_key_encrypt_ctr(k, buf, buf, sizeof(buf));
+  g_assert(memcmp(buf, plain, sizeof(plain)) == 0);
+
+  g_object_unref(k);
+
+  // known answer (NIST SP 800-38A F.5.1), nonce is the upper half of the
+  // initial counter block, position the lower half
+  k = mega_aes_key_new_from_binary(CTR_KAT_KEY);
+  mega_aes_key_setup_ctr(k, (guchar*)CTR_KAT_NONCE, CTR_KAT_POSITION);
+  mega_aes_key_encrypt_ctr(k, (guchar*)CTR_KAT_PLAIN, buf, 64);
+  g_assert(memcmp(buf, CTR_KAT_CIPHER, 64) == 0);
+
+  // same from the second block on, in unaligned pieces
+  mega_aes_key_setup_ctr(k, (guchar*)CTR_KAT_NONCE, CTR_KAT_POSITION + 1);
+  mega_aes_key_encrypt_ctr(k, (guchar*)CTR_KAT_PLAIN + 16, buf, 5);
+  mega_aes_key_encrypt_ctr(k, (guchar*)CTR_KAT_PLAIN + 21, buf + 5, 43);
+  g_assert(memcmp(buf, CTR_KAT_CIPHER + 16, 48) == 0);
+
+  g_object_unref(k);
+}
+
+void test_aes_chunked_cbc_mac(void)
+{
+  MegaAesKey* k = mega_aes_key_new_from_binary(KEY_BINARY);
+  MegaChunkedCbcMac* serial = mega_chunked_cbc_mac_new();
+  MegaChunkedCbcMac* threaded = mega_chunked_cbc_mac_new();
+  gsize sizes[] = { 0, 1, 16, 128 * 1024, 128 * 1024 + 7, 3 * 1024 * 1024 + 12345 };
+  guchar iv[16] = "12345678";
+  guchar mac1[16], mac2[16];
+  gint i;
+
+  mega_chunked_cbc_mac_set_threads(threaded, 4);
+
+  for (i = 0; i < G_N_ELEMENTS(sizes); i++)
+  {
+    guchar* data = g_malloc(sizes[i] + 1);
+    gsize off, n;
+
+    for (off = 0; off < sizes[i]; off++)
+      data[off] = off * 7 + i;
+
+    mega_chunked_cbc_mac_setup(serial, k, iv);
+    mega_chunked_cbc_mac_setup(threaded, k, iv);
+
+    // feed data in odd sized pieces to cross chunk boundaries
+    for (off = 0; off < sizes[i]; off += n)
+    {
+      n = MIN(sizes[i] - off, 100003);
+      mega_chunked_cbc_mac_update(serial, data + off, n);
+      mega_chunked_cbc_mac_update(threaded, data + off, n);
+    }
+
+    mega_chunked_cbc_mac_finish(serial, mac1);
+    mega_chunked_cbc_mac_finish(threaded, mac2);
+    g_assert(memcmp(mac1, mac2, 16) == 0);
+
+    g_free(data);
+  }
+
+  g_object_unref(serial);
+  g_object_unref(threaded);
+  g_object_unref(k);
 }
 
 void test_aes_un_hash(void)
@@ -204,6 +316,23 @@ void test_aes_un_hash(void)
   g_assert_cmpstr(mega_aes_key_make_username_hash(pk, USERNAME_UC), ==, UNHASH);
 }
 
+void test_aes_password_kdf_perf(void)
+{
+  const gchar* passwords[] = { PASSWORD, "a much longer password made of several AES blocks" };
+  gint i;
+
+  for (i = 0; i < G_N_ELEMENTS(passwords); i++)
+  {
+    g_test_timer_start();
+    MegaAesKey* pk = mega_aes_key_new_from_password(passwords[i]);
+    gdouble elapsed = g_test_timer_elapsed();
+
+    g_assert(mega_aes_key_is_loaded(pk));
+    g_test_minimized_result(elapsed, "password key derivation (%d bytes): %.3fs", (gint)strlen(passwords[i]), elapsed);
+    g_object_unref(pk);
+  }
+}
+
 int main(int argc, char **argv)
 {
 #if !GLIB_CHECK_VERSION(2, 32, 0)
@@ -222,7 +351,11 @@ int main(int argc, char **argv)
   g_test_add_func("/aes/encrypt", test_aes_encrypt);
   g_test_add_func("/aes/cbc", test_aes_cbc);
   g_test_add_func("/aes/ctr", test_aes_ctr);
+  g_test_add_func("/aes/chunked-cbc-mac", test_aes_chunked_cbc_mac);
   g_test_add_func("/aes/un-hash", test_aes_un_hash);
 
+  if (g_test_perf())
+    g_test_add_func("/aes/password-kdf", test_aes_password_kdf_perf);
+
   return g_test_run();
 }
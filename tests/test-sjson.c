@@ -0,0 +1,237 @@
+/*
+ *  megatools - Mega.co.nz client library and tools
+ *  Copyright (C) 2013  Ondřej Jirman <megous@megous.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "sjson.h"
+#include <string.h>
+
+#ifdef G_OS_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// elements contain escapes, keys, and brackets and commas inside strings, so
+// that feeding the document byte by byte puts each of them on a boundary
+const gchar* STREAM_DOC =
+  "[{\"a\":\"[f]\",\"f\":[{\"h\":\"a\\\"b\",\"k\":\"x\\\\y\",\"a\":{\"n\":\"]\"}},"
+  "{\"h\":\"c,d\",\"t\":1} , [1,2,\"]\"],\n \"\\u0041\\/\",-1.5e3,true,null,[]],"
+  "\"ok\":{\"f\":[3]}},-2]";
+
+const gchar* STREAM_ELEMENTS[] =
+{
+  "{\"h\":\"a\\\"b\",\"k\":\"x\\\\y\",\"a\":{\"n\":\"]\"}}",
+  "{\"h\":\"c,d\",\"t\":1}",
+  "[1,2,\"]\"]",
+  "\"\\u0041\\/\"",
+  "-1.5e3",
+  "true",
+  "null",
+  "[]",
+};
+
+static gboolean collect_element(const gchar* element, GPtrArray* elements)
+{
+  g_ptr_array_add(elements, g_strstrip(g_strdup(element)));
+  return TRUE;
+}
+
+// feed the document in pieces of chunk_size bytes, return the remaining
+// document
+static gchar* stream_doc(gsize chunk_size, GPtrArray* elements)
+{
+  SJsonStream* stream = s_json_stream_new("$[0].f", (SJsonStreamFunc)collect_element, elements);
+  gsize len = strlen(STREAM_DOC), off;
+  gchar* rest;
+
+  for (off = 0; off < len; off += chunk_size)
+    g_assert(s_json_stream_feed(stream, STREAM_DOC + off, MIN(chunk_size, len - off)));
+
+  rest = s_json_stream_finish(stream);
+  s_json_stream_free(stream);
+
+  return rest;
+}
+
+void test_sjson_stream(void)
+{
+  GPtrArray* expected = g_ptr_array_new_with_free_func(g_free);
+  gsize chunk_size;
+  guint i;
+
+  gchar* expected_rest = stream_doc(strlen(STREAM_DOC), expected);
+
+  g_assert_cmpuint(expected->len, ==, G_N_ELEMENTS(STREAM_ELEMENTS));
+  for (i = 0; i < expected->len; i++)
+    g_assert_cmpstr(expected->pdata[i], ==, STREAM_ELEMENTS[i]);
+
+  // streamed array is emptied, everything else is kept
+  g_assert(s_json_is_valid(expected_rest));
+  const gchar* f = s_json_path(expected_rest, "$[0].f");
+  g_assert_cmpint(s_json_get_type(f), ==, S_JSON_TYPE_ARRAY);
+  g_assert(s_json_get_element_first(f) == NULL);
+  gchar* a = s_json_get_string(s_json_path(expected_rest, "$[0].a"));
+  g_assert_cmpstr(a, ==, "[f]");
+  g_free(a);
+  g_assert_cmpint(s_json_get_int(s_json_path(expected_rest, "$[0].ok.f[0]"), 0), ==, 3);
+  g_assert_cmpint(s_json_get_int(s_json_path(expected_rest, "$[1]"), 0), ==, -2);
+
+  for (chunk_size = 1; chunk_size <= 32; chunk_size++)
+  {
+    GPtrArray* elements = g_ptr_array_new_with_free_func(g_free);
+    gchar* rest = stream_doc(chunk_size, elements);
+
+    g_assert_cmpuint(elements->len, ==, expected->len);
+    for (i = 0; i < elements->len; i++)
+      g_assert_cmpstr(elements->pdata[i], ==, expected->pdata[i]);
+
+    g_assert_cmpstr(rest, ==, expected_rest);
+
+    g_free(rest);
+    g_ptr_array_free(elements, TRUE);
+  }
+
+  g_free(expected_rest);
+  g_ptr_array_free(expected, TRUE);
+}
+
+// String scanning variants are picked once per process, so each one is
+// forced with SJSON_SCAN in a subprocess. Strings are placed so that they end
+// right before a page boundary. On unix the next page is inaccessible, so
+// vector loads that cross it crash the test.
+
+#define SCAN_STRINGS 200000
+
+static void gen_scan_string(GString* json, GString* plain)
+{
+  const gchar* chars = "abcXYZ019 _-=+/{}[]:,";
+  gint len = g_test_rand_int_range(0, 100), i;
+
+  g_string_assign(json, "\"");
+  g_string_truncate(plain, 0);
+
+  for (i = 0; i < len; i++)
+  {
+    // escapes are rare, so that most strings take the fast path
+    switch (g_test_rand_int_range(0, 64))
+    {
+      case 0:
+        g_string_append(json, "\\\"");
+        g_string_append_c(plain, '"');
+        break;
+      case 1:
+        g_string_append(json, "\\\\");
+        g_string_append_c(plain, '\\');
+        break;
+      case 2:
+        g_string_append(json, "\\n");
+        g_string_append_c(plain, '\n');
+        break;
+      case 3:
+        g_string_append(json, "\\u0041");
+        g_string_append_c(plain, 'A');
+        break;
+      default:
+        g_string_append_c(json, chars[g_test_rand_int_range(0, strlen(chars))]);
+        g_string_append_c(plain, json->str[json->len - 1]);
+    }
+  }
+}
+
+void test_sjson_scan_string_subprocess(void)
+{
+  gchar* pages;
+  GString* json = g_string_new(NULL);
+  GString* plain = g_string_new(NULL);
+  gint i;
+
+#ifdef G_OS_UNIX
+  gsize page_size = sysconf(_SC_PAGESIZE);
+
+  pages = mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  g_assert(pages != MAP_FAILED);
+  g_assert(mprotect(pages + page_size, page_size, PROT_NONE) == 0);
+#else
+  gsize page_size = 4096;
+  gchar* buf = g_malloc(3 * page_size);
+
+  pages = (gchar*)(((guintptr)buf + page_size - 1) & ~(guintptr)(page_size - 1));
+#endif
+
+  for (i = 0; i < SCAN_STRINGS; i++)
+  {
+    gboolean terminated = g_test_rand_int_range(0, 8) > 0;
+    gint pad = g_test_rand_int_range(0, 40);
+
+    gen_scan_string(json, plain);
+    if (terminated)
+      g_string_append_c(json, '"');
+
+    // put the string so that its NUL terminator is pad bytes before the end
+    // of the first page
+    gchar* str = pages + page_size - json->len - 1 - pad;
+    memcpy(str, json->str, json->len + 1);
+
+    if (terminated)
+    {
+      g_assert_cmpint(s_json_get_type(str), ==, S_JSON_TYPE_STRING);
+
+      gchar* value = s_json_get_string(str);
+      g_assert_cmpstr(value, ==, plain->str);
+      g_free(value);
+    }
+    else
+    {
+      g_assert(!s_json_is_valid(str));
+    }
+  }
+
+#ifdef G_OS_UNIX
+  munmap(pages, 2 * page_size);
+#else
+  g_free(buf);
+#endif
+
+  g_string_free(json, TRUE);
+  g_string_free(plain, TRUE);
+}
+
+void test_sjson_scan_string(void)
+{
+  const gchar* variants[] = { "scalar", "sse2", "avx2" };
+  gint i;
+
+  for (i = 0; i < G_N_ELEMENTS(variants); i++)
+  {
+    g_setenv("SJSON_SCAN", variants[i], TRUE);
+    g_test_trap_subprocess("/sjson/scan-string/subprocess", 0, 0);
+    g_test_trap_assert_passed();
+  }
+
+  g_unsetenv("SJSON_SCAN");
+}
+
+int main(int argc, char **argv)
+{
+  g_test_init(&argc, &argv, NULL);
+
+  g_test_add_func("/sjson/stream", test_sjson_stream);
+  g_test_add_func("/sjson/scan-string", test_sjson_scan_string);
+  g_test_add_func("/sjson/scan-string/subprocess", test_sjson_scan_string_subprocess);
+
+  return g_test_run();
+}
@@ -24,7 +24,9 @@ static gchar* opt_local_path;
 static gboolean opt_download;
 static gboolean opt_noprogress;
 static gboolean opt_dryrun;
+static gint opt_parallel = 1;
 static mega_session* s;
+static mega_transfer_queue* queue;
 
 static GOptionEntry entries[] =
 {
@@ -33,6 +35,7 @@ static GOptionEntry entries[] =
   { "download",      'd',   0, G_OPTION_ARG_NONE,    &opt_download,     "Download files from mega",         NULL    },
   { "no-progress",   '\0',  0, G_OPTION_ARG_NONE,    &opt_noprogress,   "Disable progress bar",             NULL    },
   { "dryrun",        'n',   0, G_OPTION_ARG_NONE,    &opt_dryrun,       "Don't perform any actual changes", NULL    },
+  { "parallel",      '\0',  0, G_OPTION_ARG_INT,     &opt_parallel,     "Number of files to transfer at once", "N" },
   { NULL }
 };
 
@@ -50,9 +53,35 @@ static gboolean status_callback(mega_status_data* data, gpointer userdata)
     g_free(total_str);
   }
 
+  // combined progress of the transfer queue
+  if (!opt_noprogress && data->type == MEGA_STATUS_TRANSFER && !data->transfer.path)
+  {
+    gchar* done_str = g_format_size_full(data->transfer.done, G_FORMAT_SIZE_IEC_UNITS);
+    gchar* total_str = g_format_size_full(data->transfer.total, G_FORMAT_SIZE_IEC_UNITS);
+
+    g_print("  " ESC_GREEN "%s" ESC_NORMAL " of %s - %u running, %u queued" ESC_CLREOL "\r", done_str, total_str, data->transfer.running, data->transfer.queued);
+
+    g_free(done_str);
+    g_free(total_str);
+  }
+
   return FALSE;
 }
 
+static void transfer_done(const gchar* local_path, const gchar* remote_path, GError* error, gpointer userdata)
+{
+  if (!opt_noprogress)
+    g_print("\r" ESC_CLREOL);
+
+  if (error)
+  {
+    if (opt_download)
+      g_printerr("ERROR: Download failed for %s: %s\n", remote_path, error->message);
+    else
+      g_printerr("ERROR: Upload failed for %s: %s\n", remote_path, error->message);
+  }
+}
+
 // upload operation
 
 static gboolean up_sync_file(GFile* root, GFile* file, const gchar* remote_path)
@@ -68,7 +97,13 @@ static gboolean up_sync_file(GFile* root, GFile* file, const gchar* remote_path)
 
   g_print("F %s\n", remote_path);
 
-  if (!opt_dryrun)
+  if (!opt_dryrun && queue)
+  {
+    gc_free gchar* local_path = g_file_get_path(file);
+
+    mega_transfer_queue_put(queue, remote_path, local_path);
+  }
+  else if (!opt_dryrun)
   {
     if (!mega_session_put(s, remote_path, g_file_get_path(file), &local_err))
     {
@@ -170,7 +205,11 @@ static gboolean dl_sync_file(mega_node* node, GFile* file, const gchar* remote_p
 
   g_print("F %s\n", local_path);
 
-  if (!opt_dryrun)
+  if (!opt_dryrun && queue)
+  {
+    mega_transfer_queue_get(queue, local_path, remote_path);
+  }
+  else if (!opt_dryrun)
   {
     if (!mega_session_get(s, g_file_get_path(file), remote_path, &local_err))
     {
@@ -263,6 +302,13 @@ int main(int ac, char* av[])
 
   mega_session_watch_status(s, status_callback, NULL);
 
+  // directory walk only queues the files, they are transferred at the end
+  if (opt_parallel > 1)
+  {
+    queue = mega_transfer_queue_new(s, opt_parallel);
+    mega_transfer_queue_set_done_callback(queue, transfer_done, NULL);
+  }
+
   // check remote dir existence
   mega_node* remote_dir = mega_session_stat(s, opt_remote_path);
   if (!remote_dir)
@@ -292,9 +338,26 @@ int main(int ac, char* av[])
     }
 
     up_sync_dir(local_file, local_file, opt_remote_path);
-    mega_session_save(s, NULL);
   }
 
+  if (queue)
+  {
+    GError *local_err = NULL;
+
+    if (!mega_transfer_queue_run(queue, &local_err))
+    {
+      if (!opt_noprogress)
+        g_print("\r" ESC_CLREOL);
+
+      g_printerr("ERROR: Transfers failed: %s\n", local_err->message);
+      g_clear_error(&local_err);
+    }
+  }
+
+  if (!opt_download)
+    mega_session_save(s, NULL);
+
+  mega_transfer_queue_free(queue);
   g_object_unref(local_file);
   tool_fini(s);
   return 0;
@@ -302,6 +365,7 @@ int main(int ac, char* av[])
 err1:
   g_object_unref(local_file);
 err0:
+  mega_transfer_queue_free(queue);
   tool_fini(s);
   return 1;
 }
@@ -0,0 +1,410 @@
+/*
+ *  megatools - Mega.co.nz client library and tools
+ *  Copyright (C) 2013  Ondřej Jirman <megous@megous.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "tools.h"
+#include "sjson.h"
+
+#ifdef G_OS_UNIX
+#include <glib-unix.h>
+#include <signal.h>
+#endif
+
+static gint opt_sync_interval = 30;
+
+static GOptionEntry entries[] =
+{
+  { "sync-interval", '\0',   0, G_OPTION_ARG_INT,     &opt_sync_interval, "Bring filesystem up to date before a request, if it's older than this (in seconds)", "SECONDS" },
+  { NULL }
+};
+
+static mega_session* s;
+static GMainLoop* loop;
+
+#ifdef G_OS_UNIX
+
+// {{{ node serialization
+
+static void gen_node(SJsonGen* gen, mega_node* n)
+{
+  s_json_gen_start_object(gen);
+  s_json_gen_member_string(gen, "h", n->handle);
+  if (n->parent_handle)
+    s_json_gen_member_string(gen, "p", n->parent_handle);
+  if (n->user_handle)
+    s_json_gen_member_string(gen, "u", n->user_handle);
+  s_json_gen_member_string(gen, "n", n->name);
+  s_json_gen_member_int(gen, "t", n->type);
+  s_json_gen_member_int(gen, "s", n->size);
+  s_json_gen_member_int(gen, "ts", n->timestamp);
+
+  if (n->key)
+  {
+    gc_free gchar* key = mega_node_get_key(n);
+    s_json_gen_member_string(gen, "k", key);
+  }
+
+  if (n->link)
+    s_json_gen_member_string(gen, "l", n->link);
+
+  s_json_gen_end_object(gen);
+}
+
+// collect node along with its parents, clients need them to build paths
+static void collect_node(GHashTable* nodes, mega_node* n)
+{
+  while (n && !g_hash_table_contains(nodes, n))
+  {
+    g_hash_table_add(nodes, n);
+    n = n->parent;
+  }
+}
+
+static void gen_handles(SJsonGen* gen, const gchar* name, GSList* list)
+{
+  GSList* i;
+
+  s_json_gen_member_array(gen, name);
+  for (i = list; i; i = i->next)
+    s_json_gen_string(gen, ((mega_node*)i->data)->handle);
+  s_json_gen_end_array(gen);
+}
+
+// }}}
+// {{{ request handlers
+
+static void handle_ls(const gchar* req, SJsonGen* gen)
+{
+  gc_hash_table_unref GHashTable* nodes = g_hash_table_new(NULL, NULL);
+  gboolean recursive = s_json_get_member_bool(req, "recursive");
+  gboolean export = s_json_get_member_bool(req, "export");
+  const gchar* paths = s_json_get_member(req, "paths");
+  GSList* all = NULL, *i;
+  GError* local_err = NULL;
+
+  s_json_gen_member_array(gen, "results");
+
+  if (paths && s_json_get_type(paths) == S_JSON_TYPE_ARRAY)
+  {
+    S_JSON_FOREACH_ELEMENT(paths, path_json)
+      gc_free gchar* path = s_json_get_string(path_json);
+      if (!path)
+        continue;
+
+      mega_node* n = mega_session_stat(s, path);
+      GSList* children = mega_session_ls(s, path, recursive);
+
+      s_json_gen_start_object(gen);
+      if (n)
+      {
+        s_json_gen_member_string(gen, "node", n->handle);
+        all = g_slist_prepend(all, n);
+      }
+      gen_handles(gen, "children", children);
+      s_json_gen_end_object(gen);
+
+      all = g_slist_concat(children, all);
+    S_JSON_FOREACH_END()
+  }
+  else
+  {
+    GSList* children = mega_session_ls_all(s);
+
+    s_json_gen_start_object(gen);
+    gen_handles(gen, "children", children);
+    s_json_gen_end_object(gen);
+
+    all = g_slist_concat(children, all);
+  }
+
+  s_json_gen_end_array(gen);
+
+  if (export && !mega_session_addlinks(s, all, &local_err))
+  {
+    s_json_gen_member_string(gen, "error", local_err->message);
+    g_clear_error(&local_err);
+  }
+
+  for (i = all; i; i = i->next)
+    collect_node(nodes, i->data);
+
+  s_json_gen_member_array(gen, "nodes");
+  GHashTableIter it;
+  mega_node* n;
+  g_hash_table_iter_init(&it, nodes);
+  while (g_hash_table_iter_next(&it, (gpointer*)&n, NULL))
+    gen_node(gen, n);
+  s_json_gen_end_array(gen);
+
+  g_slist_free(all);
+}
+
+static void handle_df(const gchar* req, SJsonGen* gen)
+{
+  GError* local_err = NULL;
+
+  mega_user_quota* q = mega_session_user_quota(s, &local_err);
+  if (!q)
+  {
+    s_json_gen_member_string(gen, "error", local_err->message);
+    g_clear_error(&local_err);
+    return;
+  }
+
+  s_json_gen_member_int(gen, "total", q->total);
+  s_json_gen_member_int(gen, "used", q->used);
+  g_free(q);
+}
+
+static void handle_mkdir(const gchar* req, SJsonGen* gen)
+{
+  const gchar* paths = s_json_get_member(req, "paths");
+  GError* local_err = NULL;
+
+  // one error message per path, null on success
+  s_json_gen_member_array(gen, "errors");
+
+  if (paths && s_json_get_type(paths) == S_JSON_TYPE_ARRAY)
+  {
+    S_JSON_FOREACH_ELEMENT(paths, path_json)
+      gc_free gchar* path = s_json_get_string(path_json);
+
+      if (path && mega_session_mkdir(s, path, &local_err))
+        s_json_gen_null(gen);
+      else
+      {
+        s_json_gen_string(gen, local_err ? local_err->message : "Invalid path");
+        g_clear_error(&local_err);
+      }
+    S_JSON_FOREACH_END()
+  }
+
+  s_json_gen_end_array(gen);
+
+  mega_session_save(s, NULL);
+}
+
+static void handle_rm(const gchar* req, SJsonGen* gen)
+{
+  const gchar* paths = s_json_get_member(req, "paths");
+  GSList* list = NULL;
+  GError* local_err = NULL;
+
+  if (paths && s_json_get_type(paths) == S_JSON_TYPE_ARRAY)
+  {
+    S_JSON_FOREACH_ELEMENT(paths, path_json)
+      gchar* path = s_json_get_string(path_json);
+      if (path)
+        list = g_slist_prepend(list, path);
+    S_JSON_FOREACH_END()
+  }
+
+  list = g_slist_reverse(list);
+
+  if (!mega_session_rm_many(s, list, &local_err))
+  {
+    s_json_gen_member_string(gen, "error", local_err->message);
+    g_clear_error(&local_err);
+  }
+
+  g_slist_free_full(list, g_free);
+
+  mega_session_save(s, NULL);
+}
+
+static void handle_ping(const gchar* req, SJsonGen* gen)
+{
+}
+
+static struct
+{
+  const gchar* name;
+  void (*handler)(const gchar* req, SJsonGen* gen);
+} handlers[] =
+{
+  { "ping",  handle_ping  },
+  { "ls",    handle_ls    },
+  { "df",    handle_df    },
+  { "mkdir", handle_mkdir },
+  { "rm",    handle_rm    },
+};
+
+static gchar* handle_request(const gchar* req)
+{
+  GError* local_err = NULL;
+  SJsonGen* gen = s_json_gen_new();
+  gint i;
+
+  s_json_gen_start_object(gen);
+
+  gc_free gchar* cmd = s_json_get_type(req) == S_JSON_TYPE_OBJECT ? s_json_get_member_string(req, "cmd") : NULL;
+  if (!cmd)
+  {
+    s_json_gen_member_string(gen, "error", "Invalid request");
+    goto out;
+  }
+
+  // keep the filesystem view reasonably fresh, other clients may be
+  // changing it too
+  if (strcmp(cmd, "ping") && mega_session_is_stale(s, opt_sync_interval) && !mega_session_sync(s, &local_err))
+  {
+    g_printerr("WARNING: Can't bring filesystem up to date: %s\n", local_err->message);
+    g_clear_error(&local_err);
+  }
+
+  for (i = 0; i < G_N_ELEMENTS(handlers); i++)
+  {
+    if (!strcmp(handlers[i].name, cmd))
+    {
+      handlers[i].handler(req, gen);
+      goto out;
+    }
+  }
+
+  s_json_gen_member_string(gen, "error", "Unknown command");
+
+out:
+  s_json_gen_end_object(gen);
+  return s_json_gen_done(gen);
+}
+
+// }}}
+// {{{ socket service
+
+// clients that stall while sending a request or reading a response are
+// dropped after this many seconds
+#define CLIENT_TIMEOUT 30
+
+// requests are read asynchronously, so that a slow client doesn't hold up
+// the others, but served one by one from the main loop, the session is not
+// meant to be used concurrently
+static void on_request(GDataInputStream* in, GAsyncResult* result, GSocketConnection* conn)
+{
+  GError* local_err = NULL;
+  GOutputStream* out = g_io_stream_get_output_stream(G_IO_STREAM(conn));
+
+  gc_free gchar* req = g_data_input_stream_read_line_finish(in, result, NULL, &local_err);
+  if (req)
+  {
+    if (mega_debug & MEGA_DEBUG_API)
+      g_print("megad: %s\n", req);
+
+    gc_free gchar* res = handle_request(req);
+
+    if (!g_output_stream_write_all(out, res, strlen(res), NULL, NULL, &local_err) || !g_output_stream_write_all(out, "\n", 1, NULL, NULL, &local_err))
+      g_clear_error(&local_err);
+  }
+
+  g_clear_error(&local_err);
+  g_object_unref(in);
+  g_object_unref(conn);
+}
+
+static gboolean on_incoming(GSocketService* service, GSocketConnection* conn, GObject* source, gpointer user_data)
+{
+  GDataInputStream* in = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(conn)));
+
+  g_socket_set_timeout(g_socket_connection_get_socket(conn), CLIENT_TIMEOUT);
+  g_data_input_stream_read_line_async(in, G_PRIORITY_DEFAULT, NULL, (GAsyncReadyCallback)on_request, g_object_ref(conn));
+
+  return TRUE;
+}
+
+static gboolean on_quit(gpointer user_data)
+{
+  g_main_loop_quit(loop);
+  return FALSE;
+}
+
+// }}}
+
+#endif
+
+int main(int ac, char* av[])
+{
+#ifdef G_OS_UNIX
+  gc_error_free GError *local_err = NULL;
+
+  tool_init(&ac, &av, "- keep mega.co.nz session open for other tools", entries);
+
+  gc_free gchar* path = tool_daemon_socket_path();
+
+  // refuse to replace a daemon that is still alive
+  if (g_file_test(path, G_FILE_TEST_EXISTS))
+  {
+    gc_free gchar* res = tool_daemon_call("{\"cmd\":\"ping\"}", NULL);
+    if (res)
+    {
+      g_printerr("ERROR: megad is already running for this account\n");
+      tool_fini(NULL);
+      return 1;
+    }
+
+    g_unlink(path);
+  }
+
+  s = tool_start_session();
+  if (!s)
+  {
+    tool_fini(NULL);
+    return 1;
+  }
+
+  g_mkdir_with_parents(g_get_user_runtime_dir(), 0700);
+
+  GSocketService* service = g_socket_service_new();
+  gc_object_unref GSocketAddress* address = g_unix_socket_address_new(path);
+
+  if (!g_socket_listener_add_address(G_SOCKET_LISTENER(service), address, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, &local_err))
+  {
+    g_printerr("ERROR: Can't listen on %s: %s\n", path, local_err->message);
+    g_object_unref(service);
+    tool_fini(s);
+    return 1;
+  }
+
+  g_chmod(path, 0600);
+
+  g_signal_connect(service, "incoming", G_CALLBACK(on_incoming), NULL);
+  g_socket_service_start(service);
+
+  loop = g_main_loop_new(NULL, FALSE);
+  g_unix_signal_add(SIGINT, on_quit, NULL);
+  g_unix_signal_add(SIGTERM, on_quit, NULL);
+  g_unix_signal_add(SIGHUP, on_quit, NULL);
+
+  g_print("Listening on %s\n", path);
+  g_main_loop_run(loop);
+
+  g_socket_service_stop(service);
+  g_socket_listener_close(G_SOCKET_LISTENER(service));
+  g_object_unref(service);
+  g_main_loop_unref(loop);
+  g_unlink(path);
+
+  mega_session_save(s, NULL);
+
+  tool_fini(s);
+  return 0;
+#else
+  tool_init(&ac, &av, "- keep mega.co.nz session open for other tools", entries);
+  g_printerr("ERROR: megad is not supported on this platform\n");
+  tool_fini(NULL);
+  return 1;
+#endif
+}
@@ -18,6 +18,7 @@
  */
 
 #include "tools.h"
+#include "sjson.h"
 
 static gboolean opt_human;
 static gboolean opt_mb;
@@ -52,8 +53,10 @@ static gchar* format_size(guint64 size)
 int main(int ac, char* av[])
 {
   GError *local_err = NULL;
-  mega_session* s;
+  mega_session* s = NULL;
+  mega_user_quota* q = NULL;
 
+  tool_allow_daemon = TRUE;
   tool_init(&ac, &av, "- display mega.co.nz storage quotas/usage", entries);
 
   if (opt_total || opt_free || opt_used)
@@ -84,16 +87,39 @@ int main(int ac, char* av[])
     }
   }
 
-  s = tool_start_session();
-  if (!s)
-    return 1;
+  if (tool_daemon_available())
+  {
+    gc_free gchar* response = tool_daemon_call("{\"cmd\":\"df\"}", &local_err);
+    if (response)
+    {
+      gc_free gchar* error = s_json_get_member_string(response, "error");
+      if (error)
+      {
+        g_printerr("ERROR: Can't determine disk usage: %s\n", error);
+        goto err;
+      }
+
+      q = g_new0(mega_user_quota, 1);
+      q->total = s_json_get_member_int(response, "total", 0);
+      q->used = s_json_get_member_int(response, "used", 0);
+    }
+
+    g_clear_error(&local_err);
+  }
 
-  mega_user_quota* q = mega_session_user_quota(s, &local_err);
   if (!q)
   {
-    g_printerr("ERROR: Can't determine disk usage: %s\n", local_err->message);
-    g_clear_error(&local_err);
-    goto err;
+    s = tool_start_session();
+    if (!s)
+      return 1;
+
+    q = mega_session_user_quota(s, &local_err);
+    if (!q)
+    {
+      g_printerr("ERROR: Can't determine disk usage: %s\n", local_err->message);
+      g_clear_error(&local_err);
+      goto err;
+    }
   }
 
   guint64 free = q->total >= q->used ? q->total - q->used : 0;
@@ -27,12 +27,14 @@ static gchar* opt_path = ".";
 static gboolean opt_stream = FALSE;
 static gboolean opt_noprogress = FALSE;
 static gboolean opt_print_names = FALSE;
+static gboolean opt_resume = FALSE;
 
 static GOptionEntry entries[] =
 {
   { "path",          '\0',   0, G_OPTION_ARG_FILENAME,  &opt_path,  "Local directory or file name, to save data to",  "PATH" },
   { "no-progress",   '\0',   0, G_OPTION_ARG_NONE,    &opt_noprogress,  "Disable progress bar",   NULL},
   { "print-names",   '\0',   0, G_OPTION_ARG_NONE,    &opt_print_names,  "Print names of downloaded files",   NULL},
+  { "resume",        '\0',   0, G_OPTION_ARG_NONE,    &opt_resume,  "Resume interrupted downloads",   NULL},
   { NULL }
 };
 
@@ -71,7 +73,7 @@ static gboolean dl_sync_file(mega_node* node, GFile* file, const gchar* remote_p
   gc_error_free GError *local_err = NULL;
   gc_free gchar* local_path = g_file_get_path(file);
 
-  if (g_file_query_exists(file, NULL))
+  if (!opt_resume && g_file_query_exists(file, NULL))
   {
     g_printerr("ERROR: File already exists at %s\n", local_path);
     return FALSE;
@@ -151,6 +153,7 @@ int main(int ac, char* av[])
   gint i;
   int status = 0;
 
+  tool_allow_transfer_options = TRUE;
   tool_init_bare(&ac, &av, "- download exported files from mega.co.nz", entries);
 
   if (!strcmp(opt_path, "-"))
@@ -188,8 +191,10 @@ int main(int ac, char* av[])
   // create session
 
   s = mega_session_new();
+  tool_setup_transfers(s);
 
   mega_session_watch_status(s, status_callback, NULL);
+  mega_session_enable_resume(s, opt_resume);
 
   // process links
   for (i = 1; i < ac; i++)
@@ -22,11 +22,13 @@
 static gchar* opt_path = ".";
 static gboolean opt_stream = FALSE;
 static gboolean opt_noprogress = FALSE;
+static gboolean opt_resume = FALSE;
 
 static GOptionEntry entries[] =
 {
   { "path",          '\0',   0, G_OPTION_ARG_FILENAME,  &opt_path,  "Local directory or file name, to save data to",  "PATH" },
   { "no-progress",   '\0',   0, G_OPTION_ARG_NONE,    &opt_noprogress,  "Disable progress bar",   NULL},
+  { "resume",        '\0',   0, G_OPTION_ARG_NONE,    &opt_resume,  "Resume interrupted downloads",   NULL},
   { NULL }
 };
 
@@ -62,6 +64,7 @@ int main(int ac, char* av[])
   gc_error_free GError *local_err = NULL;
   mega_session* s;
 
+  tool_allow_transfer_options = TRUE;
   tool_init(&ac, &av, "- download individual files from mega.co.nz", entries);
 
   if (!strcmp(opt_path, "-"))
@@ -89,6 +92,7 @@ int main(int ac, char* av[])
   }
 
   mega_session_watch_status(s, status_callback, NULL);
+  mega_session_enable_resume(s, opt_resume);
 
   gint i;
   for (i = 1; i < ac; i++)
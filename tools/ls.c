@@ -18,6 +18,7 @@
  */
 
 #include "tools.h"
+#include "sjson.h"
 
 static gboolean opt_names;
 static gboolean opt_recursive;
@@ -49,15 +50,88 @@ static gint compare_node(mega_node* a, mega_node* b)
   return 0;
 }
 
+// gather nodes from a running megad, returns FALSE if it can't be reached
+static gboolean gather_from_daemon(gint ac, gchar* av[], GSList** list, GHashTable** nodes, gint* status)
+{
+  gc_error_free GError *local_err = NULL;
+  GSList* l = NULL;
+  gint j;
+
+  SJsonGen* gen = s_json_gen_new();
+  s_json_gen_start_object(gen);
+  s_json_gen_member_string(gen, "cmd", "ls");
+  s_json_gen_member_bool(gen, "recursive", opt_recursive);
+  s_json_gen_member_bool(gen, "export", opt_export);
+  if (ac > 1)
+  {
+    s_json_gen_member_array(gen, "paths");
+    for (j = 1; j < ac; j++)
+    {
+      gc_free gchar* path = tool_convert_filename(av[j], FALSE);
+      s_json_gen_string(gen, path);
+    }
+    s_json_gen_end_array(gen);
+  }
+  s_json_gen_end_object(gen);
+  gc_free gchar* request = s_json_gen_done(gen);
+
+  gc_free gchar* response = tool_daemon_call(request, &local_err);
+  if (!response)
+    return FALSE;
+
+  gc_free gchar* error = s_json_get_member_string(response, "error");
+  if (error)
+  {
+    g_printerr("ERROR: Can't read links info from mega.co.nz: %s\n", error);
+    *status = 1;
+    return TRUE;
+  }
+
+  *nodes = tool_daemon_load_nodes(s_json_get_member(response, "nodes"));
+
+  S_JSON_FOREACH_ELEMENT(s_json_get_member(response, "results"), result)
+    gc_free gchar* handle = s_json_get_member_string(result, "node");
+    mega_node* n = handle ? g_hash_table_lookup(*nodes, handle) : NULL;
+    if (n && (n->type == MEGA_NODE_FILE || !opt_names))
+      l = g_slist_append(l, n);
+
+    S_JSON_FOREACH_ELEMENT(s_json_get_member(result, "children"), child)
+      gc_free gchar* child_handle = s_json_get_string(child);
+      mega_node* c = child_handle ? g_hash_table_lookup(*nodes, child_handle) : NULL;
+      if (c)
+        l = g_slist_prepend(l, c);
+    S_JSON_FOREACH_END()
+  S_JSON_FOREACH_END()
+
+  *list = l;
+  return TRUE;
+}
+
 int main(int ac, char* av[])
 {
-  mega_session* s;
+  mega_session* s = NULL;
   gc_error_free GError *local_err = NULL;
+  gc_hash_table_unref GHashTable* daemon_nodes = NULL;
   GSList *l = NULL, *i;
-  gint j;
+  gint j, status = 0;
 
+  tool_allow_daemon = TRUE;
   tool_init(&ac, &av, "- list files stored at mega.co.nz", entries);
 
+  if (ac == 1 || ac > 2 || opt_recursive)
+    opt_names = FALSE;
+
+  if (tool_daemon_available() && gather_from_daemon(ac, av, &l, &daemon_nodes, &status))
+  {
+    if (status)
+    {
+      tool_fini(NULL);
+      return status;
+    }
+
+    goto print;
+  }
+
   s = tool_start_session();
   if (!s)
     return 1;
@@ -66,13 +140,9 @@ int main(int ac, char* av[])
   if (ac == 1)
   {
     l = mega_session_ls_all(s);
-    opt_names = FALSE;
   }
   else
   {
-    if (ac > 2 || opt_recursive)
-      opt_names = FALSE;
-
     for (j = 1; j < ac; j++)
     {
       gc_free gchar* path = tool_convert_filename(av[j], FALSE);
@@ -85,8 +155,6 @@ int main(int ac, char* av[])
     }
   }
 
-  l = g_slist_sort(l, (GCompareFunc)compare_node);
-
   // export if requested
   if (opt_export && !mega_session_addlinks(s, l, &local_err))
   {
@@ -96,6 +164,9 @@ int main(int ac, char* av[])
     return 1;
   }
 
+print:
+  l = g_slist_sort(l, (GCompareFunc)compare_node);
+
   if (l && opt_long && opt_header && !opt_export)
   {
     g_print("===================================================================================\n");
@@ -18,6 +18,7 @@
  */
 
 #include "tools.h"
+#include "sjson.h"
 
 static mega_session* s;
 
@@ -29,7 +30,9 @@ static GOptionEntry entries[] =
 int main(int ac, char* av[])
 {
   gc_error_free GError *local_err = NULL;
+  gint i;
 
+  tool_allow_daemon = TRUE;
   tool_init(&ac, &av, "- create directories at mega.co.nz", entries);
 
   if (ac < 2)
@@ -39,6 +42,40 @@ int main(int ac, char* av[])
     return 1;
   }
 
+  if (tool_daemon_available())
+  {
+    SJsonGen* gen = s_json_gen_new();
+    s_json_gen_start_object(gen);
+    s_json_gen_member_string(gen, "cmd", "mkdir");
+    s_json_gen_member_array(gen, "paths");
+    for (i = 1; i < ac; i++)
+    {
+      gc_free gchar* path = tool_convert_filename(av[i], FALSE);
+      s_json_gen_string(gen, path);
+    }
+    s_json_gen_end_array(gen);
+    s_json_gen_end_object(gen);
+    gc_free gchar* request = s_json_gen_done(gen);
+
+    gc_free gchar* response = tool_daemon_call(request, &local_err);
+    if (response)
+    {
+      const gchar* errors = s_json_get_member(response, "errors");
+
+      for (i = 1; i < ac; i++)
+      {
+        gc_free gchar* error = errors ? s_json_get_string(s_json_get_element(errors, i - 1)) : NULL;
+        if (error)
+          g_printerr("ERROR: Can't create directory %s: %s\n", av[i], error);
+      }
+
+      tool_fini(NULL);
+      return 0;
+    }
+
+    g_clear_error(&local_err);
+  }
+
   s = tool_start_session();
   if (!s)
   {
@@ -46,7 +83,6 @@ int main(int ac, char* av[])
     return 1;
   }
 
-  gint i;
   for (i = 1; i < ac; i++)
   {
     gc_free gchar* path = tool_convert_filename(av[i], FALSE);
@@ -21,11 +21,13 @@
 
 static gchar* opt_path = "/Root";
 static gboolean opt_noprogress = FALSE;
+static gboolean opt_resume = FALSE;
 
 static GOptionEntry entries[] =
 {
   { "path",          '\0',   0, G_OPTION_ARG_STRING,  &opt_path,  "Remote path to save files to",  "PATH" },
   { "no-progress",   '\0',   0, G_OPTION_ARG_NONE,    &opt_noprogress,  "Disable progress bar",   NULL},
+  { "resume",        '\0',   0, G_OPTION_ARG_NONE,    &opt_resume,  "Resume interrupted uploads",   NULL},
   { NULL }
 };
 
@@ -55,6 +57,7 @@ int main(int ac, char* av[])
   gc_error_free GError *local_err = NULL;
   mega_session* s;
 
+  tool_allow_transfer_options = TRUE;
   tool_init(&ac, &av, "- upload files to mega.co.nz", entries);
 
   if (ac < 2)
@@ -69,6 +72,7 @@ int main(int ac, char* av[])
     return 1;
 
   mega_session_watch_status(s, status_callback, NULL);
+  mega_session_enable_resume(s, opt_resume);
 
   gint i;
   for (i = 1; i < ac; i++)
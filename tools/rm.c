@@ -18,17 +18,30 @@
  */
 
 #include "tools.h"
+#include "sjson.h"
 
 static GOptionEntry entries[] =
 {
   { NULL }
 };
 
+// errors for several paths come in one message, one line per path
+static void print_errors(const gchar* message)
+{
+  gc_strfreev gchar** lines = g_strsplit(message, "\n", -1);
+  gchar** line;
+
+  for (line = lines; *line; line++)
+    g_printerr("ERROR: %s\n", *line);
+}
+
 int main(int ac, char* av[])
 {
   gc_error_free GError *local_err = NULL;
   static mega_session* s;
+  gint i;
 
+  tool_allow_daemon = TRUE;
   tool_init(&ac, &av, "- remove files from mega.co.nz", entries);
 
   if (ac < 2)
@@ -38,6 +51,35 @@ int main(int ac, char* av[])
     return 1;
   }
 
+  if (tool_daemon_available())
+  {
+    SJsonGen* gen = s_json_gen_new();
+    s_json_gen_start_object(gen);
+    s_json_gen_member_string(gen, "cmd", "rm");
+    s_json_gen_member_array(gen, "paths");
+    for (i = 1; i < ac; i++)
+    {
+      gc_free gchar* path = tool_convert_filename(av[i], FALSE);
+      s_json_gen_string(gen, path);
+    }
+    s_json_gen_end_array(gen);
+    s_json_gen_end_object(gen);
+    gc_free gchar* request = s_json_gen_done(gen);
+
+    gc_free gchar* response = tool_daemon_call(request, &local_err);
+    if (response)
+    {
+      gc_free gchar* error = s_json_get_member_string(response, "error");
+      if (error)
+        print_errors(error);
+
+      tool_fini(NULL);
+      return 0;
+    }
+
+    g_clear_error(&local_err);
+  }
+
   s = tool_start_session();
   if (!s)
   {
@@ -45,18 +87,19 @@ int main(int ac, char* av[])
     return 1;
   }
 
-  gint i;
+  // remove all paths at once, so that removal requests can be batched
+  GSList* paths = NULL;
   for (i = 1; i < ac; i++)
-  {
-    gc_free gchar* path = tool_convert_filename(av[i], FALSE);
+    paths = g_slist_append(paths, tool_convert_filename(av[i], FALSE));
 
-    if (!mega_session_rm(s, path, &local_err))
-    {
-      g_printerr("ERROR: Can't remove %s: %s\n", path, local_err->message);
-      g_clear_error(&local_err);
-    }
+  if (!mega_session_rm_many(s, paths, &local_err))
+  {
+    print_errors(local_err->message);
+    g_clear_error(&local_err);
   }
 
+  g_slist_free_full(paths, g_free);
+
   mega_session_save(s, NULL);
 
   tool_fini(s);